@@ -8,7 +8,7 @@ commands_recovery_local_path := $(LOCAL_PATH)
 
 LOCAL_MODULE := recovery
 
-LOCAL_C_INCLUDES += bionic external/stlport/stlport
+LOCAL_C_INCLUDES += bionic external/stlport/stlport external/zlib
 
 LOCAL_SRC_FILES := \
     recovery.c \
@@ -22,6 +22,12 @@ LOCAL_SRC_FILES := \
     ddftw.c \
     backstore.c \
     format.c \
+    md5.c \
+    pgzip.c \
+    winfile.c \
+    tarball.c \
+    chunkstore.c \
+    extmap.c \
     data.cpp
 
 ifeq ($(TARGET_RECOVERY_REBOOT_SRC),)
@@ -32,11 +38,24 @@ endif
 
 RECOVERY_API_VERSION := 2
 LOCAL_CFLAGS += -DRECOVERY_API_VERSION=$(RECOVERY_API_VERSION)
+LOCAL_CFLAGS += -DRECOVERY_BUILD_ID=\"$(BUILD_NUMBER)\"
 
 ifeq ($(BOARD_HAS_NO_REAL_SDCARD), true)
     LOCAL_CFLAGS += -DBOARD_HAS_NO_REAL_SDCARD
 endif
 
+ifneq ($(SYSTEM_BACKUP_METHOD),)
+	LOCAL_CFLAGS += -DSYSTEM_BACKUP_METHOD=$(SYSTEM_BACKUP_METHOD)
+endif
+ifneq ($(DATA_BACKUP_METHOD),)
+	LOCAL_CFLAGS += -DDATA_BACKUP_METHOD=$(DATA_BACKUP_METHOD)
+endif
+ifneq ($(CACHE_BACKUP_METHOD),)
+	LOCAL_CFLAGS += -DCACHE_BACKUP_METHOD=$(CACHE_BACKUP_METHOD)
+endif
+ifneq ($(SDEXT_BACKUP_METHOD),)
+	LOCAL_CFLAGS += -DSDEXT_BACKUP_METHOD=$(SDEXT_BACKUP_METHOD)
+endif
 ifneq ($(SP1_NAME),)
 	LOCAL_CFLAGS += -DSP1_NAME=$(SP1_NAME) -DSP1_BACKUP_METHOD=$(SP1_BACKUP_METHOD) -DSP1_MOUNTABLE=$(SP1_MOUNTABLE)
 endif
@@ -104,6 +123,82 @@ LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := winfile_test.c winfile.c pgzip.c md5.c
+
+LOCAL_MODULE := winfile_test
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_STATIC_LIBRARIES := libz libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := tarball_test.c tarball.c winfile.c pgzip.c md5.c
+
+LOCAL_MODULE := tarball_test
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_STATIC_LIBRARIES := libminzip libz libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := chunkstore_test.c chunkstore.c winfile.c pgzip.c md5.c
+
+LOCAL_MODULE := chunkstore_test
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_STATIC_LIBRARIES := libminzip libmincrypt libz libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := sparse_test.c mtdutils/sparse.c
+
+LOCAL_MODULE := sparse_test
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := rawcopy_test.c mtdutils/rawcopy.c mtdutils/sparse.c
+
+LOCAL_MODULE := rawcopy_test
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
 include $(commands_recovery_local_path)/minui/Android.mk
 include $(commands_recovery_local_path)/minelf/Android.mk
 ifeq ($(TARGET_RECOVERY_GUI),true)
@@ -25,6 +25,10 @@
 #include <time.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "phx_reboot.h"
 #include "backstore.h"
@@ -33,6 +37,13 @@
 #include "roots.h"
 #include "format.h"
 #include "data.h"
+#include "mtdutils/mtdutils.h"
+#include "mtdutils/rawcopy.h"
+#include "tarball.h"
+#include "winfile.h"
+#include "chunkstore.h"
+#include "mtdutils/sparse.h"
+#include "extmap.h"
 
 int getWordFromString(int word, const char* string, char* buffer, int bufferLen)
 {
@@ -149,7 +160,8 @@ set_restore_files()
             extn = ptr;
         }
 
-        if (extn == NULL || strcmp(extn, "win") != 0)   continue;
+        if (extn == NULL || (strcmp(extn, "win") != 0 && strcmp(extn, "chunks") != 0 &&
+            strcmp(extn, "sparse") != 0 && strcmp(extn, "blocks") != 0))  continue;
 
         dev = findDeviceByLabel(label);
         if (dev == NULL)
@@ -249,38 +261,299 @@ int phx_unmount(struct dInfo uMnt)
 	return ret;
 }
 
+// Partitions may be backed up from several threads at once. The ui and the
+// DataManager aren't thread safe, so everything in a backup runs holding
+// this lock except the archive/image copy itself.
+static pthread_mutex_t phx_backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t phx_backup_cond = PTHREAD_COND_INITIALIZER;
+
+// Echo archived names the same way the tar -v output used to be shown
+static void phx_backup_entry(const char* name, void* cookie)
+{
+    int spam = *((int*) cookie);
+
+    if (!spam)              return;
+
+    pthread_mutex_lock(&phx_backup_lock);
+    if (spam == 2)          ui_print_overwrite("%s\n", name);
+    else if (spam == 1)     ui_print_overwrite("%s", name);
+    pthread_mutex_unlock(&phx_backup_lock);
+}
+
+#define IMG_COPY_SIZE   (1024 * 1024)
+
+static int phx_win_out(void* cookie, const void* data, size_t len)
+{
+    return win_write((WinFile*) cookie, data, len);
+}
+
+static int phx_chunk_out(void* cookie, const void* data, size_t len)
+{
+    return chunk_write((ChunkWriter*) cookie, data, len);
+}
+
+static int phx_sparse_out(void* cookie, const void* data, size_t len)
+{
+    return sparse_write((SparseWriter*) cookie, data, len);
+}
+
+// Chunks are shared by every backup of the device, one level above the
+// timestamped backup folders, hidden so the restore list doesn't offer it
+static void phx_chunk_store(const char* dir, char* store)
+{
+    sprintf(store, "%s%s../.chunks", dir, dir[strlen(dir) - 1] == '/' ? "" : "/");
+}
+
+// Streams a raw partition into the backup file (or the chunk store). MTD
+// partitions (part, looked up by the caller) are read a whole erase block
+// at a time through mtdutils, which skips bad blocks the same way
+// dump_image does.
+static int phx_backup_image(struct dInfo* mnt, const MtdPartition* part, chunk_out_fn out, void* cookie)
+{
+    char* buf;
+    ssize_t len;
+    int ret = 0;
+
+    if (part)
+    {
+        MtdReadContext* in;
+        size_t erase_size;
+
+        if (mtd_partition_info(part, NULL, &erase_size, NULL) != 0 || (in = mtd_read_partition(part)) == NULL)
+        {
+            LOGE("Unable to open mtd partition %s\n", mnt->mnt);
+            return -1;
+        }
+
+        buf = malloc(erase_size);
+        if (buf == NULL)
+        {
+            mtd_read_close(in);
+            return -1;
+        }
+        // mtd_read_data fails once it runs off the end of the partition
+        while ((len = mtd_read_data(in, buf, erase_size)) > 0)
+        {
+            if (out(cookie, buf, len))
+            {
+                ret = -1;
+                break;
+            }
+        }
+        mtd_read_close(in);
+        free(buf);
+        return ret;
+    }
+
+    // The next buffer is read while the last one is compressed and written
+    int fd = raw_open(mnt->blk, O_RDONLY, RAW_DIRECT);
+    if (fd < 0)
+    {
+        LOGE("Unable to open %s (%s)\n", mnt->blk, strerror(errno));
+        return -1;
+    }
+    ret = raw_read_fd(fd, out, cookie, RAW_DIRECT);
+    close(fd);
+    return ret;
+}
+
+// Copies only the blocks an ext2/3/4 filesystem has in use, in disk order,
+// into a sparse image whose free space is left as don't care chunks. The
+// partition must not be mounted, or the bitmaps could change under us.
+static int phx_backup_blocks(struct dInfo* mnt, WinFile* wf, unsigned long long* size)
+{
+    struct ext_map* map;
+    SparseWriter* sw = NULL;
+    unsigned long long block, run, max_run;
+    uint32_t chunks = 0;
+    char* buf = NULL;
+    int fd, ret = -1;
+
+    fd = open(mnt->blk, O_RDONLY);
+    if (fd < 0)
+    {
+        LOGE("Unable to open %s (%s)\n", mnt->blk, strerror(errno));
+        return -1;
+    }
+    if ((map = ext_map_read(fd)) == NULL)
+        goto out;
+    if (map->blocks > 0xffffffffULL)
+    {
+        LOGE("%s has too many blocks for a sparse image\n", mnt->blk);
+        goto out;
+    }
+
+    // The chunk count goes in the header, so walk the map once up front
+    max_run = SPARSE_RAW_MAX / map->block_size;
+    for (block = 0; block < map->blocks; block += run, chunks++)
+        run = ext_map_run(map, block, ext_map_used(map, block) ? max_run : 0xffffffff);
+    LOGI("%s: %llu of %llu blocks in use, %u chunks\n", mnt->blk, map->used, map->blocks, chunks);
+
+    buf = (char*) malloc(IMG_COPY_SIZE);
+    sw = sparse_create_mapped(phx_win_out, wf, map->block_size, map->blocks, chunks);
+    if (buf == NULL || sw == NULL)
+        goto out;
+
+    ret = 0;
+    for (block = 0; ret == 0 && block < map->blocks; block += run)
+    {
+        unsigned long long left;
+        int used = ext_map_used(map, block);
+
+        run = ext_map_run(map, block, used ? max_run : 0xffffffff);
+        if (!used)
+        {
+            ret = sparse_skip(sw, run);
+            continue;
+        }
+
+        left = run * map->block_size;
+        if (sparse_raw(sw, run) || lseek64(fd, block * map->block_size, SEEK_SET) != (loff_t) (block * map->block_size))
+            ret = -1;
+        while (ret == 0 && left > 0)
+        {
+            ssize_t len = read(fd, buf, left < IMG_COPY_SIZE ? (size_t) left : IMG_COPY_SIZE);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len <= 0)
+            {
+                LOGE("Unable to read %s (%s)\n", mnt->blk, len < 0 ? strerror(errno) : "end of device");
+                ret = -1;
+                break;
+            }
+            ret = sparse_write(sw, buf, len);
+            left -= len;
+        }
+    }
+    *size = map->blocks * map->block_size;
+
+out:
+    if (sw && sparse_close(sw))
+        ret = -1;
+    free(buf);
+    ext_map_free(map);
+    close(fd);
+    return ret;
+}
+
+// Finds the latest earlier backup in the device folder that has a file list
+// for 'image', and names it the way a list's base line does
+static int phx_find_base(const char* dir, const char* image, char* base)
+{
+    char folder[PATH_MAX];
+    char current[PATH_MAX];
+    char best[256];
+    char path[PATH_MAX];
+    char* ptr;
+    DIR* d;
+    struct dirent* de;
+    struct stat st;
+
+    // dir is <folder>/<timestamp>/
+    strcpy(current, dir);
+    while ((ptr = strrchr(current, '/')) != NULL && ptr[1] == '\0')
+        *ptr = '\0';
+    if ((ptr = strrchr(current, '/')) == NULL)
+        return -1;
+    *ptr = '\0';
+    strcpy(folder, current);
+    strcpy(current, ptr + 1);
+
+    d = opendir(folder);
+    if (d == NULL)
+        return -1;
+
+    best[0] = '\0';
+    while ((de = readdir(d)) != NULL)
+    {
+        // Timestamps sort the same way as the names do
+        if (de->d_name[0] == '.' || strcmp(de->d_name, current) >= 0 || strcmp(de->d_name, best) <= 0)
+            continue;
+
+        sprintf(path, "%s/%s/%s.files", folder, de->d_name, image);
+        if (stat(path, &st) != 0)
+            continue;
+        sprintf(path, "%s/%s/%s", folder, de->d_name, image);
+        if (stat(path, &st) != 0)
+            continue;
+        strcpy(best, de->d_name);
+    }
+    closedir(d);
+
+    if (best[0] == '\0')
+        return -1;
+    sprintf(base, "%s/%s", best, image);
+    return 0;
+}
+
 /* New backup function
 ** Condensed all partitions into one function
+** Called with phx_backup_lock held
 */
-int phx_backup(struct dInfo bMnt, const char *bDir)
+// True if the block device is mounted anywhere. /proc/mounts may name it
+// by another path (or /data may be mounted a second time for the sdcard),
+// so devices are compared, not names.
+static int phx_blk_mounted(const char* blk)
 {
-    // set compression or not
-	char bTarArg[32];
-	if (DataManager_GetIntValue(VAR_USE_COMPRESSION_VAR)) {
-		strcpy(bTarArg,"-czv");
-	} else {
-		strcpy(bTarArg,"-cv");
-	}
-    FILE *bFp;
+    char device[PATH_MAX], rest[512];
+    struct stat st, mst;
+    FILE* fp;
+    int found = 0;
 
-#ifdef RECOVERY_SDCARD_ON_DATA
-    strcat(bTarArg, " -X /tmp/excludes.lst");
+    if (stat(blk, &st) != 0 || !S_ISBLK(st.st_mode))
+        return 0;
+    fp = fopen("/proc/mounts", "r");
+    if (fp == NULL)
+        return 1;   // can't tell, so don't risk it
+    while (!found && fscanf(fp, "%4095s", device) == 1)
+    {
+        if (fgets(rest, sizeof(rest), fp) == NULL)
+            break;
+        found = (stat(device, &mst) == 0 && S_ISBLK(mst.st_mode) && mst.st_rdev == st.st_rdev);
+    }
+    fclose(fp);
+    return found;
+}
 
-    bFp = fopen("/tmp/excludes.lst", "wt");
-    if (bFp)
+// The blocks method needs an unmounted ext2/3/4 filesystem; anything else
+// is backed up as files this time round.
+static void phx_check_blocks(struct dInfo* bMnt)
+{
+    if (strncmp(bMnt->fst, "ext", 3) != 0)
+    {
+        ui_print("%s is %s, not ext2/3/4, backing up its files.\n", bMnt->mnt, bMnt->fst);
+        bMnt->backup = files;
+        return;
+    }
+    phx_unmount(*bMnt);
+    if (phx_blk_mounted(bMnt->blk))
     {
-        fprintf(bFp, "/data/media\n");
-        fprintf(bFp, "./media\n");
-        fprintf(bFp, "media\n");
-        fclose(bFp);
+        ui_print("%s is still mounted, backing up its files.\n", bMnt->mnt);
+        bMnt->backup = files;
     }
+}
+
+static int phx_backup_locked(struct dInfo bMnt, const char *bDir)
+{
+#ifdef RECOVERY_SDCARD_ON_DATA
+    const char* bExcludes[] = { "./media", NULL };
+#else
+    const char** bExcludes = NULL;
 #endif
 
     char str[512];
 	unsigned long long bPartSize;
+
+    if (bMnt.backup == blocks)
+        phx_check_blocks(&bMnt);
+
 	char *bImage = malloc(sizeof(char)*50);
 	char *bMount = malloc(sizeof(char)*50);
 	char *bCommand = malloc(sizeof(char)*255);
+    int bDedup = (bMnt.backup == image && DataManager_GetIntValue(VAR_BACKUP_DEDUP) == 1);
+    // emmc images are mostly empty space; store them as sparse images
+    int bSparse = (bMnt.backup == image && !bDedup && strcmp(bMnt.fst, "mtd") != 0 &&
+                   bMnt.sze % SPARSE_BLOCK_SIZE == 0 && DataManager_GetIntValue(VAR_BACKUP_SPARSE) == 1);
 
     if (bMnt.backup == files)
     {
@@ -304,21 +577,31 @@ int phx_backup(struct dInfo bMnt, const char *bDir)
 			}
 		}
 		bPartSize = bMnt.used;
-		sprintf(bCommand,"cd %s && tar %s -f %s%s ./*",bMount,bTarArg,bDir,bImage); // form backup command
 	} else if (bMnt.backup == image) {
 		strcpy(bMount,bMnt.mnt);
 		bPartSize = bMnt.sze;
-		sprintf(bImage,"%s.%s.win",bMnt.mnt,bMnt.fst); // non-mountable partitions such as boot/sp1/recovery
-		if (strcmp(bMnt.fst,"mtd") == 0) {
-			sprintf(bCommand,"dump_image %s %s%s",bMnt.mnt,bDir,bImage); // if it's mtd, we use dump image
-		} else {
-			sprintf(bCommand,"dd bs=%s if=%s of=%s%s",bs_size,bMnt.blk,bDir,bImage); // if it's emmc, use dd
-		}
+		sprintf(bImage,"%s.%s.%s",bMnt.mnt,bMnt.fst,bDedup ? "chunks" : bSparse ? "sparse" : "win"); // non-mountable partitions such as boot/sp1/recovery
 		ui_print("\n");
+	} else if (bMnt.backup == blocks) {
+		strcpy(bMount,bMnt.mnt);
+		bPartSize = bMnt.used;
+		sprintf(bImage,"%s.%s.blocks",bMnt.mnt,bMnt.fst); // in use blocks of an ext2/3/4 partition
+        SetDataState("Unmounting", bMnt.mnt, 0, 0);
+		if (phx_unmount(bMnt))
+        {
+			ui_print("-- Could not unmount: %s\n-- Aborting.\n",bMount);
+			free(bCommand);
+			free(bMount);
+			free(bImage);
+			return 1;
+		}
 	}
     else
     {
         LOGE("Unknown backup method for mount %s\n", bMnt.mnt);
+        free(bCommand);
+        free(bMount);
+        free(bImage);
         return 1;
     }
 
@@ -333,29 +616,146 @@ int phx_backup(struct dInfo bMnt, const char *bDir)
 	ui_print("[%s (%lu MB)]\n", bUppr, (unsigned long) (bPartSize / (1024 * 1024))); // show size in MB
 
     SetDataState("Backup", bMnt.mnt, 0, 0);
-	int bProgTime;
 	time_t bStart, bStop;
-	char bOutput[1024];
 
     time(&bStart); // start timer
     ui_print("...Backing up %s partition.\n",bMount);
-    bFp = __popen(bCommand, "r"); // sending backup command formed earlier above
-    if(DataManager_GetIntValue(VAR_SHOW_SPAM_VAR) == 2) { // if spam is on, show all lines
-        while (fgets(bOutput,sizeof(bOutput),bFp) != NULL) {
-            ui_print_overwrite("%s",bOutput);
+
+    // Both archives and raw images are written in-process, so the md5 is
+    // taken from the bytes on their way to the sdcard instead of a second
+    // md5sum pass over the finished file.
+    int bFlags = 0;
+    if (bMnt.backup == files && DataManager_GetIntValue(VAR_USE_COMPRESSION_VAR))
+        bFlags |= WIN_COMPRESS;
+    if (DataManager_GetIntValue(VAR_BACKUP_BLOCK_GZIP) == 1)
+        bFlags |= WIN_INDEX;    // lets the restore inflate on every core
+    if (DataManager_GetIntValue(VAR_SKIP_MD5_GENERATE_VAR) != 1)
+        bFlags |= WIN_MD5;
+
+    // mtdutils' partition table is shared, so look the partition up before
+    // the lock is let go for the copy
+    const MtdPartition* bPart = NULL;
+    if (bMnt.backup == image && strcmp(bMnt.fst, "mtd") == 0 &&
+        (mtd_scan_partitions() <= 0 || (bPart = mtd_find_partition_by_name(bMnt.mnt)) == NULL))
+    {
+        ui_print("E: Unable to find mtd partition %s\n", bMnt.mnt);
+        free(bCommand);
+        free(bMount);
+        free(bImage);
+        return 1;
+    }
+
+    int bErr;
+    WinFile* wf = NULL;
+    ChunkWriter* cw = NULL;
+    unsigned long long bImageSize = 0;
+
+    sprintf(bCommand, "%s%s", bDir, bImage);
+    if (bDedup)
+    {
+        // Only chunks the store hasn't seen are written; the backup folder
+        // gets a manifest listing them
+        char bStore[PATH_MAX];
+        phx_chunk_store(bDir, bStore);
+        cw = chunk_create(bStore, bCommand, bFlags);
+    }
+    else
+        wf = win_create(bCommand, bFlags);
+    if (wf == NULL && cw == NULL)
+    {
+        ui_print("E: Unable to create %s\n", bCommand);
+        phx_unmount(bMnt);
+        free(bCommand);
+        free(bMount);
+        free(bImage);
+        return 1;
+    }
+
+    int spam = DataManager_GetIntValue(VAR_SHOW_SPAM_VAR);
+    struct tar_options bOpts;
+    char bList[PATH_MAX];
+    char bListTmp[PATH_MAX];
+
+    memset(&bOpts, 0, sizeof(bOpts));
+    bOpts.excludes = bExcludes;
+    bOpts.cb = phx_backup_entry;
+    bOpts.cookie = &spam;
+    if (bMnt.backup == files)
+    {
+        // Every archive gets a file list so the next backup can be made
+        // incremental against it
+        char bBase[PATH_MAX];
+
+        if (DataManager_GetIntValue(VAR_BACKUP_INCREMENTAL) == 1 && phx_find_base(bDir, bImage, bBase) == 0)
+        {
+            sprintf(bList, "%s../%s.files", bDir, bBase);
+            bOpts.base = tar_list_load(bList);
+            if (bOpts.base)
+                ui_print("...Storing changes since %s\n", bBase);
         }
-    } else { // else just show single line
-        while (fscanf(bFp,"%s",bOutput) == 1) {
-            if(DataManager_GetIntValue(VAR_SHOW_SPAM_VAR) == 1) ui_print_overwrite("%s",bOutput);
+
+        sprintf(bList, "%s.files", bCommand);
+        sprintf(bListTmp, "%s.tmp", bList);
+        bOpts.list = fopen(bListTmp, "w");
+        if (bOpts.list == NULL || tar_list_begin(bOpts.list, bOpts.base ? bBase : NULL))
+            LOGW("Unable to write %s, the next backup can't be incremental\n", bList);
+    }
+
+    pthread_mutex_unlock(&phx_backup_lock);
+    if (bMnt.backup == files)
+    {
+        // Archive in-process: tar records are streamed straight into the
+        // .win file and compression is spread over all cores.
+        bErr = tar_create(wf, bMount, &bOpts);
+
+        if (bOpts.list)
+        {
+            if (fclose(bOpts.list) == 0 && bErr == 0)
+                rename(bListTmp, bList);
+            else
+                unlink(bListTmp);
         }
+        tar_list_free(bOpts.base);
+    }
+    else if (bSparse)
+    {
+        // sparse_close only succeeds once exactly bMnt.sze bytes went in
+        SparseWriter* sw = sparse_create(phx_win_out, wf, bMnt.sze);
+        bErr = sw ? phx_backup_image(&bMnt, bPart, phx_sparse_out, sw) : 1;
+        if (sw && sparse_close(sw) != 0)
+            bErr = 1;
+        bImageSize = bMnt.sze;
+    }
+    else if (bMnt.backup == blocks)
+        bErr = phx_backup_blocks(&bMnt, wf, &bImageSize);
+    else if (cw)
+    {
+        bErr = phx_backup_image(&bMnt, bPart, phx_chunk_out, cw);
+        bImageSize = chunk_bytes_in(cw);
+    }
+    else
+        bErr = phx_backup_image(&bMnt, bPart, phx_win_out, wf);
+
+    if (cw && chunk_close(cw) != 0)
+        bErr = 1;
+    if (wf && win_close(wf) != 0)
+        bErr = 1;
+    pthread_mutex_lock(&phx_backup_lock);
+
+    if (bErr != 0)
+    {
+        ui_print("E: Error while backing up %s. Aborting.\n\n", bMount);
+        phx_unmount(bMnt);
+        free(bCommand);
+        free(bMount);
+        free(bImage);
+        return 1;
     }
     ui_print_overwrite(" * Done.\n");
-    __pclose(bFp);
 
     ui_print(" * Verifying backup size.\n");
     SetDataState("Verifying", bMnt.mnt, 0, 0);
 
-    sprintf(bCommand, "%s%s", bDir, bImage);
     struct stat st;
     if (stat(bCommand, &st) != 0 || st.st_size == 0)
     {
@@ -372,8 +772,9 @@ int phx_backup(struct dInfo bMnt, const char *bDir)
     // Only verify image sizes
     if (bMnt.backup == image)
     {
-        LOGI(" * Expected size: %llu Got: %lld\n", bMnt.sze, st.st_size);
-        if (bMnt.sze != (unsigned long long) st.st_size)
+        if (!bDedup && !bSparse)    bImageSize = st.st_size;
+        LOGI(" * Expected size: %llu Got: %llu\n", bMnt.sze, bImageSize);
+        if (bMnt.sze != bImageSize)
         {
             ui_print("E: File size is incorrect. Aborting.\n\n"); // they dont :(
             free(bCommand);
@@ -382,10 +783,17 @@ int phx_backup(struct dInfo bMnt, const char *bDir)
             return 1;
         }
     }
+    else if (bMnt.backup == blocks && bImageSize > bMnt.sze)
+    {
+        ui_print("E: Filesystem is larger than its partition. Aborting.\n\n");
+        free(bCommand);
+        free(bMount);
+        free(bImage);
+        return 1;
+    }
 
-    ui_print(" * Generating md5...\n");
-    SetDataState("Generating MD5", bMnt.mnt, 0, 0);
-    makeMD5(bDir, bImage); // make md5 file
+    if (bFlags & WIN_MD5)
+        ui_print("....MD5 Created.\n");
     time(&bStop); // stop timer
     ui_print("[%s DONE (%d SECONDS)]\n\n",bUppr,(int)difftime(bStop,bStart)); // done, finally. How long did it take?
     phx_unmount(bMnt); // unmount partition we just restored to (if it's not a mountable partition, it will just bypass)
@@ -396,6 +804,15 @@ int phx_backup(struct dInfo bMnt, const char *bDir)
 	return 0;
 }
 
+int phx_backup(struct dInfo bMnt, const char *bDir)
+{
+    pthread_mutex_lock(&phx_backup_lock);
+    invalidateUsedSizes();  // the backup itself takes up room
+    int ret = phx_backup_locked(bMnt, bDir);
+    pthread_mutex_unlock(&phx_backup_lock);
+    return ret;
+}
+
 unsigned long long get_backup_size(struct dInfo* mnt)
 {
     if (!mnt)
@@ -407,6 +824,7 @@ unsigned long long get_backup_size(struct dInfo* mnt)
     switch (mnt->backup)
     {
     case files:
+    case blocks:
         return mnt->used;
     case image:
         return (unsigned long long) mnt->sze;
@@ -428,62 +846,62 @@ int CalculateBackupDetails(int* total_partitions, unsigned long long* total_img_
     if (DataManager_GetIntValue(VAR_BACKUP_SYSTEM_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (sys.backup == image)    *total_img_bytes += get_backup_size(&sys);
+        if (sys.backup != files)    *total_img_bytes += get_backup_size(&sys);
         else                        *total_file_bytes += get_backup_size(&sys);
     }
 
     if (DataManager_GetIntValue(VAR_BACKUP_DATA_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (dat.backup == image)    *total_img_bytes += get_backup_size(&dat);
+        if (dat.backup != files)    *total_img_bytes += get_backup_size(&dat);
         else                        *total_file_bytes += get_backup_size(&dat);
     }
     if (DataManager_GetIntValue(VAR_BACKUP_CACHE_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (cac.backup == image)    *total_img_bytes += get_backup_size(&cac);
+        if (cac.backup != files)    *total_img_bytes += get_backup_size(&cac);
         else                        *total_file_bytes += get_backup_size(&cac);
     }
     if (DataManager_GetIntValue(VAR_BACKUP_RECOVERY_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (rec.backup == image)    *total_img_bytes += get_backup_size(&rec);
+        if (rec.backup != files)    *total_img_bytes += get_backup_size(&rec);
         else                        *total_file_bytes += get_backup_size(&rec);
     }
     if (DataManager_GetIntValue(VAR_BACKUP_SP1_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (sp1.backup == image)    *total_img_bytes += get_backup_size(&sp1);
+        if (sp1.backup != files)    *total_img_bytes += get_backup_size(&sp1);
         else                        *total_file_bytes += get_backup_size(&sp1);
     }
     if (DataManager_GetIntValue(VAR_BACKUP_SP2_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (sp2.backup == image)    *total_img_bytes += get_backup_size(&sp2);
+        if (sp2.backup != files)    *total_img_bytes += get_backup_size(&sp2);
         else                        *total_file_bytes += get_backup_size(&sp2);
     }
     if (DataManager_GetIntValue(VAR_BACKUP_SP3_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (sp3.backup == image)    *total_img_bytes += get_backup_size(&sp3);
+        if (sp3.backup != files)    *total_img_bytes += get_backup_size(&sp3);
         else                        *total_file_bytes += get_backup_size(&sp3);
     }
     if (DataManager_GetIntValue(VAR_BACKUP_BOOT_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (boo.backup == image)    *total_img_bytes += get_backup_size(&boo);
+        if (boo.backup != files)    *total_img_bytes += get_backup_size(&boo);
         else                        *total_file_bytes += get_backup_size(&boo);
     }
     if (DataManager_GetIntValue(VAR_BACKUP_ANDSEC_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (ase.backup == image)    *total_img_bytes += get_backup_size(&ase);
+        if (ase.backup != files)    *total_img_bytes += get_backup_size(&ase);
         else                        *total_file_bytes += get_backup_size(&ase);
     }
     if (DataManager_GetIntValue(VAR_BACKUP_SDEXT_VAR) == 1)
     {
         *total_partitions = *total_partitions + 1;
-        if (sde.backup == image)    *total_img_bytes += get_backup_size(&sde);
+        if (sde.backup != files)    *total_img_bytes += get_backup_size(&sde);
         else                        *total_file_bytes += get_backup_size(&sde);
     }
     return 0;
@@ -513,71 +931,195 @@ int recursive_mkdir(const char* path)
     return 0;
 }
 
-int phx_do_backup(const char* enableVar, struct dInfo* mnt, const char* image_dir, unsigned long long img_bytes, unsigned long long file_bytes, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long* img_byte_time, unsigned long* file_byte_time)
+struct backup_job
+{
+    struct dInfo* mnt;
+    const char* image_dir;
+    unsigned long long bytes;
+    unsigned long section_time;     // estimated seconds, for the progress bar
+    int compress;                   // needs one of the compression slots
+    int state;
+    int result;
+    time_t start;
+    pthread_t thread;
+};
+
+#define JOB_QUEUED      0
+#define JOB_RUNNING     1
+#define JOB_DONE        2
+#define JOB_REAPED      3
+
+struct backup_sched
+{
+    struct backup_job jobs[16];
+    int count;
+
+    int io_free;                    // partitions that may be copied at once
+    int cpu_free;                   // ... and how many of those may compress
+    int failed;
+
+    unsigned long img_bps, file_bps;
+    unsigned long total_time;
+    unsigned long long img_bytes_remaining, file_bytes_remaining;
+    unsigned long img_byte_time, file_byte_time;
+};
+
+static void phx_add_backup_job(struct backup_sched* sched, const char* enableVar, struct dInfo* mnt, const char* image_dir)
 {
     // Check if this partition is being backed up...
-	if (!DataManager_GetIntValue(enableVar))    return 0;
+    if (!DataManager_GetIntValue(enableVar))    return;
 
-    // Let's calculate the percentage of the bar this section is expected to take
-    unsigned long int img_bps = DataManager_GetIntValue(VAR_BACKUP_AVG_IMG_RATE);
-    unsigned long int file_bps;
+    struct backup_job* job = &sched->jobs[sched->count++];
+    memset(job, 0, sizeof(*job));
+    job->mnt = mnt;
+    job->image_dir = image_dir;
+    job->bytes = get_backup_size(mnt);
+    job->compress = (mnt->backup == files && DataManager_GetIntValue(VAR_USE_COMPRESSION_VAR));
+
+    if (mnt->backup != files)       job->section_time = job->bytes / sched->img_bps;
+    else                            job->section_time = job->bytes / sched->file_bps;
+}
 
-    if (DataManager_GetIntValue(VAR_USE_COMPRESSION_VAR))    file_bps = DataManager_GetIntValue(VAR_BACKUP_AVG_FILE_COMP_RATE);
-    else                                                    file_bps = DataManager_GetIntValue(VAR_BACKUP_AVG_FILE_RATE);
+// Called with phx_backup_lock held whenever a partition starts or finishes.
+// The bar is placed at the estimated time of everything finished so far and
+// then animated over the sections currently in flight.
+static void phx_backup_progress(struct backup_sched* sched)
+{
+    unsigned long remain_time = (sched->img_bytes_remaining / sched->img_bps) + (sched->file_bytes_remaining / sched->file_bps);
+    unsigned long running_time = 0, longest = 0;
+    int i;
 
-    if (DataManager_GetIntValue(VAR_SKIP_MD5_GENERATE_VAR) == 1)
+    for (i = 0; i < sched->count; i++)
     {
-        // If we're skipping MD5 generation, our BPS is faster by about 1.65
-        file_bps = (unsigned long) (file_bps * 1.65);
-        img_bps = (unsigned long) (img_bps * 1.65);
+        if (sched->jobs[i].state != JOB_RUNNING)    continue;
+        running_time += sched->jobs[i].section_time;
+        if (sched->jobs[i].section_time > longest)  longest = sched->jobs[i].section_time;
     }
 
-    // We know the speed for both, how far into the whole backup are we, based on time
-    unsigned long total_time = (img_bytes / img_bps) + (file_bytes / file_bps);
-    unsigned long remain_time = (*img_bytes_remaining / img_bps) + (*file_bytes_remaining / file_bps);
+    LOGI("Estimated Total time: %lu  Estimated remaining time: %lu\n", sched->total_time, remain_time);
+    ui_set_progress((sched->total_time - remain_time) / (float) sched->total_time);
+    if (running_time)
+        ui_show_progress(running_time / (float) sched->total_time, longest);
+}
 
-    float pos = (total_time - remain_time) / (float) total_time;
-    ui_set_progress(pos);
+static void* phx_backup_thread(void* cookie)
+{
+    struct backup_job* job = (struct backup_job*) cookie;
+    int ret = phx_backup(*job->mnt, job->image_dir);
+
+    pthread_mutex_lock(&phx_backup_lock);
+    job->result = ret;
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&phx_backup_cond);
+    pthread_mutex_unlock(&phx_backup_lock);
+    return NULL;
+}
 
-    LOGI("Estimated Total time: %lu  Estimated remaining time: %lu\n", total_time, remain_time);
+// Picks the next partition in the usual order that fits in the remaining
+// budget. An image can start while a compressed archive holds the only
+// compression slot, since it needs none.
+static struct backup_job* phx_next_backup_job(struct backup_sched* sched)
+{
+    int i;
 
-    // Determine how much we're about to process
-    unsigned long long blocksize = get_backup_size(mnt);
+    if (sched->failed || sched->io_free <= 0)   return NULL;
 
-    // And get the time
-    unsigned long section_time;
-    if (mnt->backup == image)       section_time = blocksize / img_bps;
-    else                            section_time = blocksize / file_bps;
+    for (i = 0; i < sched->count; i++)
+    {
+        struct backup_job* job = &sched->jobs[i];
+        if (job->state != JOB_QUEUED)           continue;
+        if (job->compress && sched->cpu_free <= 0)  continue;
+        return job;
+    }
+    return NULL;
+}
 
-    // Set the position
-    pos = section_time / (float) total_time;
-    ui_show_progress(pos, section_time);
+// Called with phx_backup_lock held; returns with it held
+static void phx_finish_backup_job(struct backup_sched* sched, struct backup_job* job)
+{
+    time_t stop;
 
-    time_t start, stop;
-    time(&start);
+    pthread_join(job->thread, NULL);
+    job->state = JOB_REAPED;
+    sched->io_free++;
+    if (job->compress)      sched->cpu_free++;
 
-    if (phx_backup(*mnt, image_dir) == 1) { // did the backup process return an error ? 0 = no error
-        SetDataState("Backup failed", mnt->mnt, 1, 1);
-        ui_print("-- Error occured, check recovery.log. Aborting.\n"); //oh noes! abort abort!
-        return 1;
+    if (job->result == 1)   // did the backup process return an error ? 0 = no error
+    {
+        // The first failure stops anything new from starting; partitions
+        // already in flight are allowed to finish before we report back
+        if (!sched->failed)
+        {
+            SetDataState("Backup failed", job->mnt->mnt, 1, 1);
+            ui_print("-- Error occured, check recovery.log. Aborting.\n"); //oh noes! abort abort!
+        }
+        sched->failed = 1;
+        return;
     }
-    time(&stop);
 
-    LOGI("Partition Backup time: %d\n", (int) difftime(stop, start));
+    time(&stop);
+    LOGI("Partition Backup time: %d\n", (int) difftime(stop, job->start));
 
     // Now, decrement out byte counts
-    if (mnt->backup == image)
+    if (job->mnt->backup != files)
     {
-        *img_bytes_remaining -= blocksize;
-        *img_byte_time += (int) difftime(stop, start);
+        sched->img_bytes_remaining -= job->bytes;
+        sched->img_byte_time += (int) difftime(stop, job->start);
     }
     else
     {
-        *file_bytes_remaining -= blocksize;
-        *file_byte_time += (int) difftime(stop, start);
+        sched->file_bytes_remaining -= job->bytes;
+        sched->file_byte_time += (int) difftime(stop, job->start);
     }
+}
 
-    return 0;
+static int phx_run_backup_jobs(struct backup_sched* sched)
+{
+    struct backup_job* job;
+    int running = 0;
+    int i;
+
+    pthread_mutex_lock(&phx_backup_lock);
+    for (;;)
+    {
+        int changed = 0;
+
+        for (i = 0; i < sched->count; i++)
+        {
+            if (sched->jobs[i].state != JOB_DONE)   continue;
+            phx_finish_backup_job(sched, &sched->jobs[i]);
+            running--;
+            changed = 1;
+        }
+
+        while ((job = phx_next_backup_job(sched)) != NULL)
+        {
+            job->state = JOB_RUNNING;
+            time(&job->start);
+            if (pthread_create(&job->thread, NULL, phx_backup_thread, job) != 0)
+            {
+                LOGE("Unable to start backup of %s\n", job->mnt->mnt);
+                job->state = JOB_REAPED;
+                SetDataState("Backup failed", job->mnt->mnt, 1, 1);
+                sched->failed = 1;
+                break;
+            }
+            sched->io_free--;
+            if (job->compress)      sched->cpu_free--;
+            running++;
+            changed = 1;
+        }
+
+        if (running == 0)
+            break;
+        if (changed)
+            phx_backup_progress(sched);
+
+        pthread_cond_wait(&phx_backup_cond, &phx_backup_lock);
+    }
+    pthread_mutex_unlock(&phx_backup_lock);
+
+    return sched->failed;
 }
 
 int
@@ -654,44 +1196,46 @@ nandroid_back_exe()
 #endif
 
     // Prepare progress bar...
-    unsigned long long img_bytes_remaining = total_img_bytes;
-    unsigned long long file_bytes_remaining = total_file_bytes;
-    unsigned long img_byte_time = 0, file_byte_time = 0;
+    static struct backup_sched sched;
 	struct stat st;
 
-    ui_set_progress(0.0);
-
-	// SYSTEM
-    if (phx_do_backup(VAR_BACKUP_SYSTEM_VAR, &sys, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))       return 1;
-
-	// DATA
-    if (phx_do_backup(VAR_BACKUP_DATA_VAR, &dat, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))         return 1;
-
-    // BOOT
-    if (phx_do_backup(VAR_BACKUP_BOOT_VAR, &boo, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))         return 1;
-
-    // RECOVERY
-    if (phx_do_backup(VAR_BACKUP_RECOVERY_VAR, &rec, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))     return 1;
-
-    // CACHE
-    if (phx_do_backup(VAR_BACKUP_CACHE_VAR, &cac, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))        return 1;
+    memset(&sched, 0, sizeof(sched));
+    sched.io_free = DataManager_GetIntValue(VAR_BACKUP_IO_JOBS);
+    sched.cpu_free = DataManager_GetIntValue(VAR_BACKUP_CPU_JOBS);
+    if (sched.io_free < 1)      sched.io_free = 1;
+    if (sched.cpu_free < 1)     sched.cpu_free = 1;
 
-    // SP1
-    if (phx_do_backup(VAR_BACKUP_SP1_VAR, &sp1, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))          return 1;
+    sched.img_bps = DataManager_GetIntValue(VAR_BACKUP_AVG_IMG_RATE);
+    if (DataManager_GetIntValue(VAR_USE_COMPRESSION_VAR))    sched.file_bps = DataManager_GetIntValue(VAR_BACKUP_AVG_FILE_COMP_RATE);
+    else                                                    sched.file_bps = DataManager_GetIntValue(VAR_BACKUP_AVG_FILE_RATE);
+    if (sched.img_bps == 0)     sched.img_bps = 1;
+    if (sched.file_bps == 0)    sched.file_bps = 1;
 
-    // SP2
-    if (phx_do_backup(VAR_BACKUP_SP2_VAR, &sp2, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))          return 1;
+    // We know the speed for both, how long should the whole backup take
+    sched.total_time = (total_img_bytes / sched.img_bps) + (total_file_bytes / sched.file_bps);
+    if (sched.total_time == 0)  sched.total_time = 1;
+    sched.img_bytes_remaining = total_img_bytes;
+    sched.file_bytes_remaining = total_file_bytes;
 
-    // SP3
-    if (phx_do_backup(VAR_BACKUP_SP3_VAR, &sp3, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))          return 1;
+    ui_set_progress(0.0);
 
-    // ANDROID-SECURE
+    phx_add_backup_job(&sched, VAR_BACKUP_SYSTEM_VAR, &sys, image_dir);
+    phx_add_backup_job(&sched, VAR_BACKUP_DATA_VAR, &dat, image_dir);
+    phx_add_backup_job(&sched, VAR_BACKUP_BOOT_VAR, &boo, image_dir);
+    phx_add_backup_job(&sched, VAR_BACKUP_RECOVERY_VAR, &rec, image_dir);
+    phx_add_backup_job(&sched, VAR_BACKUP_CACHE_VAR, &cac, image_dir);
+    phx_add_backup_job(&sched, VAR_BACKUP_SP1_VAR, &sp1, image_dir);
+    phx_add_backup_job(&sched, VAR_BACKUP_SP2_VAR, &sp2, image_dir);
+    phx_add_backup_job(&sched, VAR_BACKUP_SP3_VAR, &sp3, image_dir);
 	if (stat(ase.dev, &st) ==0)
-		if (phx_do_backup(VAR_BACKUP_ANDSEC_VAR, &ase, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))       return 1;
-
-    // SD-EXT
+        phx_add_backup_job(&sched, VAR_BACKUP_ANDSEC_VAR, &ase, image_dir);
 	if (stat(sde.dev, &st) ==0)
-		if (phx_do_backup(VAR_BACKUP_SDEXT_VAR, &sde, image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))        return 1;
+        phx_add_backup_job(&sched, VAR_BACKUP_SDEXT_VAR, &sde, image_dir);
+
+    // Raw images and archives of different partitions don't contend much,
+    // so run as many as the I/O and compression budgets allow
+    if (phx_run_backup_jobs(&sched))
+        return 1;
 
     ui_print(" * Verifying filesystems...\n");
     verifyFst();
@@ -701,7 +1245,10 @@ nandroid_back_exe()
 
     time(&stop);
 
-    // Average BPS
+    // Average BPS, per partition stream. Sections that finish inside a
+    // second are counted as taking one.
+    unsigned long img_byte_time = sched.img_byte_time ? sched.img_byte_time : 1;
+    unsigned long file_byte_time = sched.file_byte_time ? sched.file_byte_time : 1;
     unsigned long int img_bps = total_img_bytes / img_byte_time;
     unsigned long int file_bps = total_file_bytes / file_byte_time;
 
@@ -709,13 +1256,6 @@ nandroid_back_exe()
     ui_print("Average backup rate for file systems: %lu MB/sec\n", (file_bps / (1024 * 1024)));
     ui_print("Average backup rate for imaged drives: %lu MB/sec\n", (img_bps / (1024 * 1024)));
 
-    if (DataManager_GetIntValue(VAR_SKIP_MD5_GENERATE_VAR) == 1)
-    {
-        // If we're skipping MD5 generation, our BPS is faster by about 1.65
-        file_bps = (unsigned long) (file_bps / 1.65);
-        img_bps = (unsigned long) (img_bps / 1.65);
-    }
-
     img_bps += (DataManager_GetIntValue(VAR_BACKUP_AVG_IMG_RATE) * 4);
     img_bps /= 5;
 
@@ -737,121 +1277,699 @@ nandroid_back_exe()
 	return 0;
 }
 
-int phx_restore(struct dInfo rMnt, const char *rDir)
+static void phx_restore_entry(const char* name, void* cookie)
 {
-	int i;
-	FILE *reFp;
-	char rUppr[20];
-	char rMount[30];
-	char rFilesystem[10];
-	char rFilename[255];
-	char rCommand[255];
-	char rOutput[255];
-	time_t rStart, rStop;
-	strcpy(rUppr,rMnt.mnt);
-	for (i = 0; i < (int) strlen(rUppr); i++) {
-		rUppr[i] = toupper(rUppr[i]);
-	}
-	ui_print("[%s]\n",rUppr);
-	time(&rStart);
-    int md5_result;
-	if (DataManager_GetIntValue(VAR_SKIP_MD5_CHECK_VAR)) {
-		SetDataState("Verifying MD5", rMnt.mnt, 0, 0);
-		ui_print("...Verifying md5 hash for %s.\n",rMnt.mnt);
-		md5_result = checkMD5(rDir, rMnt.fnm); // verify md5, check if no error; 0 = no error.
-	} else {
-		md5_result = 0;
-		ui_print("Skipping MD5 check based on user setting.\n");
-	}
-	if(md5_result == 0)
-	{
-		strcpy(rFilename,rDir);
-        if (rFilename[strlen(rFilename)-1] != '/')
-        {
-            strcat(rFilename, "/");
-        }
-		strcat(rFilename,rMnt.fnm);
-		sprintf(rCommand,"ls -l %s | awk -F'.' '{ print $2 }'",rFilename); // let's get the filesystem type from filename
-        reFp = __popen(rCommand, "r");
-		LOGI("=> Filename is: %s\n",rMnt.fnm);
-		while (fscanf(reFp,"%s",rFilesystem) == 1) { // if we get a match, store filesystem type
-			LOGI("=> Filesystem is: %s\n",rFilesystem); // show it off to the world!
-		}
-		__pclose(reFp);
-
-		if ((DataManager_GetIntValue(VAR_RM_RF_VAR) == 1 && (strcmp(rMnt.mnt,"system") == 0 || strcmp(rMnt.mnt,"data") == 0 || strcmp(rMnt.mnt,"cache") == 0)) || strcmp(rMnt.mnt,".android_secure") == 0) { // we'll use rm -rf instead of formatting for system, data and cache if the option is set, always use rm -rf for android secure
-			char rCommand2[255];
-			ui_print("...using rm -rf to wipe %s\n", rMnt.mnt);
-			if (strcmp(rMnt.mnt,".android_secure") == 0) {
-				phx_mount(sdcext); // for android secure we must make sure that the sdcard is mounted
-				sprintf(rCommand, "rm -rf %s/*", rMnt.dev);
-				sprintf(rCommand2, "rm -rf %s/.*", rMnt.dev);
-			} else {
-				phx_mount(rMnt); // mount the partition first
-				sprintf(rCommand,"rm -rf %s%s/*", "/", rMnt.mnt);
-				sprintf(rCommand2,"rm -rf %s%s/.*", "/", rMnt.mnt);
-			}
-            SetDataState("Wiping", rMnt.mnt, 0, 0);
-			__system(rCommand);
-			__system(rCommand2);
-			ui_print("....done wiping.\n");
-		} else {
-			ui_print("...Formatting %s\n",rMnt.mnt);
-            SetDataState("Formatting", rMnt.mnt, 0, 0);
-			if (strcmp(rMnt.fst, "yaffs2") == 0) {
-				if (strcmp(rMnt.mnt, "data") == 0) {
-					phx_format(rFilesystem,"userdata"); // on MTD yaffs2, data is actually found under userdata
-				} else {
-					phx_format(rFilesystem,rMnt.mnt); // use mount location instead of block for formatting on mtd devices
-				}
-            } else {
-			    phx_format(rFilesystem,rMnt.blk); // let's format block, based on filesystem from filename above
-            }
-			ui_print("....done formatting.\n");
-		}
+    int spam = *((int*) cookie);
 
-        if (rMnt.backup == files)
+    if (spam == 2)          ui_print_overwrite("%s\n", name);
+    else if (spam == 1)     ui_print_overwrite("%s", name);
+}
+
+#define RESTORE_STAGING ".phx-restore"
+
+// An incremental archive only holds what changed since the backup it was
+// based on, so that one (and its own base, and so on) goes down first and
+// the entries deleted in between are removed before extracting this one.
+// Every archive is checked against its .md5 while it is extracted.
+// rFilename is <folder>/<timestamp>/<file>, the base is relative to <folder>
+static void phx_base_path(const char* rFilename, const char* rBase, char* path)
+{
+    char* ptr;
+
+    strcpy(path, rFilename);
+    if ((ptr = strrchr(path, '/')) != NULL)     *ptr = '\0';
+    if ((ptr = strrchr(path, '/')) != NULL)     *ptr = '\0';
+    strcat(path, "/");
+    strcat(path, rBase);
+}
+
+static int phx_extract_files(const char* rStaging, const char* rFilename, int rFlags)
+{
+    char path[PATH_MAX];
+    TarList* list;
+    WinReader* in;
+    struct stat st;
+    int spam = DataManager_GetIntValue(VAR_SHOW_SPAM_VAR);
+    int ret;
+
+    sprintf(path, "%s.files", rFilename);
+    list = tar_list_load(path);
+    if (list == NULL && stat(path, &st) == 0)
+        return 1;
+
+    if (list && tar_list_base(list))
+    {
+        phx_base_path(rFilename, tar_list_base(list), path);
+        if (stat(path, &st) != 0)
+        {
+            ui_print("E: Missing %s, which this backup builds on.\n", path);
+            tar_list_free(list);
+            return 1;
+        }
+        if ((rFlags & WIN_MD5) && !win_has_md5(path))
+        {
+            ui_print("E: Missing %s.md5, which this backup builds on.\n", path);
+            tar_list_free(list);
+            return 1;
+        }
+        ui_print("...Restoring base %s\n", tar_list_base(list));
+        if (phx_extract_files(rStaging, path, rFlags))
+        {
+            tar_list_free(list);
+            return 1;
+        }
+        tar_list_remove(list, rStaging);
+    }
+    tar_list_free(list);
+
+    in = win_open(rFilename, rFlags);
+    if (in == NULL)
+        return 1;
+    ret = tar_extract(in, rStaging, phx_restore_entry, &spam);
+    if (win_read_close(in))
+    {
+        ui_print("E: %s doesn't match its md5.\n", rFilename);
+        ret = 1;
+    }
+    return ret ? 1 : 0;
+}
+
+// Files are extracted into a staging folder on the partition and only moved
+// into place once every archive in the chain has checked out, so a corrupt
+// backup leaves an empty partition rather than a half restored one
+static int phx_restore_files(const char* rMount, const char* rFilename, int rFlags)
+{
+    char rStaging[PATH_MAX];
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    struct dirent* de;
+    DIR* d;
+    int ret = 0;
+
+    sprintf(rStaging, "%s/%s", rMount, RESTORE_STAGING);
+    phx_remove_tree(rStaging, 0);
+    if (mkdir(rStaging, 0700))
+    {
+        LOGE("Unable to create %s (%s)\n", rStaging, strerror(errno));
+        return 1;
+    }
+
+    if (phx_extract_files(rStaging, rFilename, rFlags))
+    {
+        ui_print("E: Restore of %s failed, nothing was committed.\n", rMount);
+        phx_remove_tree(rStaging, 0);
+        return 1;
+    }
+
+    d = opendir(rStaging);
+    if (d == NULL)
+    {
+        phx_remove_tree(rStaging, 0);
+        return 1;
+    }
+    while ((de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        sprintf(src, "%s/%s", rStaging, de->d_name);
+        sprintf(dst, "%s/%s", rMount, de->d_name);
+        if (rename(src, dst) == 0)
+            continue;
+
+        // Whatever the wipe left behind (lost+found) gives way to the backup
+        phx_remove_tree(dst, 0);
+        if (rename(src, dst))
+        {
+            LOGE("Unable to move %s into place (%s)\n", dst, strerror(errno));
+            ret = 1;
+        }
+    }
+    closedir(d);
+
+    phx_remove_tree(rStaging, 0);
+    return ret;
+}
+
+// Entries picked out of one archive's catalog for a selective restore
+struct restore_pick {
+    long long* offsets;         // in this archive
+    int noffsets;
+    char** names;               // left to the archive it builds on
+    int nnames;
+    int alloc;
+    int unknown;
+};
+
+static void phx_pick_entry(const char* name, long long offset, void* cookie)
+{
+    struct restore_pick* pick = (struct restore_pick*) cookie;
+
+    if (offset == TAR_OFFSET_UNKNOWN)
+    {
+        pick->unknown = 1;
+        return;
+    }
+    if (pick->noffsets >= pick->alloc || pick->nnames >= pick->alloc)
+    {
+        int alloc = pick->alloc ? pick->alloc * 2 : 64;
+        long long* offsets = (long long*) realloc(pick->offsets, alloc * sizeof(long long));
+        char** names = offsets ? (char**) realloc(pick->names, alloc * sizeof(char*)) : NULL;
+
+        if (offsets)        pick->offsets = offsets;
+        if (names)          pick->names = names;
+        if (names == NULL)
+        {
+            pick->unknown = 1;
+            return;
+        }
+        pick->alloc = alloc;
+    }
+    if (offset == TAR_OFFSET_BASE)
+        pick->names[pick->nnames++] = strdup(name);
+    else
+        pick->offsets[pick->noffsets++] = offset;
+}
+
+static void phx_pick_free(struct restore_pick* pick)
+{
+    int i;
+
+    for (i = 0; i < pick->nnames; i++)
+        free(pick->names[i]);
+    free(pick->names);
+    free(pick->offsets);
+    memset(pick, 0, sizeof(*pick));
+}
+
+static int compare_offset(const void* a, const void* b)
+{
+    long long x = *(const long long*) a, y = *(const long long*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Pulls 'rName' (and everything below it) out of a files backup without
+// touching the rest of the partition. The catalog says where each entry
+// starts, so only those records are read; unchanged entries of an
+// incremental backup are looked up in the backup it builds on.
+static int phx_restore_selected(const char* rMount, const char* rFilename, const char* rName)
+{
+    char path[PATH_MAX];
+    char archive[PATH_MAX];
+    struct restore_pick pick, next;
+    int spam = DataManager_GetIntValue(VAR_SHOW_SPAM_VAR);
+    int i, ret = 0;
+
+    memset(&pick, 0, sizeof(pick));
+    strcpy(archive, rFilename);
+    for (;;)
+    {
+        TarList* list;
+        WinReader* in;
+
+        sprintf(path, "%s.files", archive);
+        if ((list = tar_list_load(path)) == NULL)
         {
-            phx_mount(rMnt);
-            strcpy(rMount,"/");
-            if (strcmp(rMnt.mnt,".android_secure") == 0) { // if it's android_secure, we have add prefix
-                strcat(rMount,"sdcard/");
+            ui_print("E: %s has no catalog.\n", archive);
+            ret = 1;
+            break;
+        }
+
+        // The newest catalog lists everything there is, older ones are only
+        // asked about what the newer archive left to them
+        memset(&next, 0, sizeof(next));
+        if (strcmp(archive, rFilename) == 0)
+        {
+            if (tar_list_select(list, rName, phx_pick_entry, &next) == 0)
+            {
+                ui_print("E: %s isn't in %s.\n", rName, archive);
+                ret = 1;
             }
-            strcat(rMount,rMnt.mnt);
-            sprintf(rCommand,"cd %s && tar -xvf %s",rMount,rFilename); // formulate shell command to restore
-        } else if (rMnt.backup == image) {
-            if (strcmp(rFilesystem,"mtd") == 0) { // if filesystem is mtd, we use flash image
-    			sprintf(rCommand,"flash_image %s %s",rMnt.mnt,rFilename);
-    			strcpy(rMount,rMnt.mnt);
-    		} else { // if filesystem is emmc, we use dd
-    			sprintf(rCommand,"dd bs=%s if=%s of=%s",bs_size,rFilename,rMnt.dev);
-    			strcpy(rMount,rMnt.mnt);
-    		}
-        } else {
-            LOGE("Unknown backup method for mount %s\n", rMnt.mnt);
+        }
+        else
+        {
+            for (i = 0; i < pick.nnames; i++)
+            {
+                long long offset;
+
+                if (tar_list_offset(list, pick.names[i], &offset) == 0)
+                    phx_pick_entry(pick.names[i], offset, &next);
+                else
+                    LOGW("%s is missing from %s\n", pick.names[i], archive);
+            }
+        }
+        phx_pick_free(&pick);
+        pick = next;
+
+        if (pick.unknown)
+        {
+            ui_print("E: %s was made before catalogs, restore the whole partition instead.\n", archive);
+            tar_list_free(list);
+            ret = 1;
+            break;
+        }
+
+        // In archive order, so the reads only ever go forward
+        qsort(pick.offsets, pick.noffsets, sizeof(long long), compare_offset);
+        in = pick.noffsets ? win_open(archive, 0) : NULL;
+        if (pick.noffsets && in == NULL)
+            ret = 1;
+        for (i = 0; in && i < pick.noffsets; i++)
+        {
+            if (tar_extract_at(in, rMount, pick.offsets[i], phx_restore_entry, &spam))
+                ret = 1;
+        }
+        if (in && win_read_close(in))
+            ret = 1;
+
+        if (pick.nnames == 0 || tar_list_base(list) == NULL)
+        {
+            if (pick.nnames)
+                ui_print("E: %s leaves entries to a base it doesn't name.\n", archive);
+            tar_list_free(list);
+            break;
+        }
+        phx_base_path(rFilename, tar_list_base(list), archive);
+        tar_list_free(list);
+    }
+    phx_pick_free(&pick);
+    return ret;
+}
+
+// Partitions run past 2GB and off_t is only 32 bits here, so this seeks
+// with lseek64 rather than using pwrite
+static int phx_pwrite_all(int fd, const void* data, size_t len, unsigned long long offset)
+{
+    const char* ptr = (const char*) data;
+
+    if (lseek64(fd, offset, SEEK_SET) != (loff_t) offset)
+        return -1;
+    while (len > 0)
+    {
+        ssize_t wrote = write(fd, ptr, len);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+            return -1;
+        ptr += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+struct restore_sparse {
+    WinReader* in;
+    int fd;
+};
+
+static ssize_t phx_sparse_read(void* cookie, void* data, size_t len)
+{
+    return win_read(((struct restore_sparse*) cookie)->in, data, len);
+}
+
+static ssize_t phx_win_read(void* cookie, void* data, size_t len)
+{
+    return win_read((WinReader*) cookie, data, len);
+}
+
+static int phx_sparse_data(void* cookie, unsigned long long offset, const void* data, size_t len)
+{
+    return phx_pwrite_all(((struct restore_sparse*) cookie)->fd, data, len, offset);
+}
+
+static int phx_sparse_fill(void* cookie, unsigned long long offset, unsigned long long len, uint32_t value)
+{
+    return raw_fill(((struct restore_sparse*) cookie)->fd, offset, len, value);
+}
+
+static int phx_fd_out(void* cookie, const void* data, size_t len)
+{
+    int fd = *((int*) cookie);
+    const char* ptr = (const char*) data;
+
+    while (len > 0)
+    {
+        ssize_t wrote = write(fd, ptr, len);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+            return -1;
+        ptr += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+static int phx_mtd_out(void* cookie, const void* data, size_t len)
+{
+    return mtd_write_data((MtdWriteContext*) cookie, (const char*) data, len) == (ssize_t) len ? 0 : -1;
+}
+
+static MtdWriteContext* phx_mtd_open(struct dInfo* mnt)
+{
+    const MtdPartition* part;
+    MtdWriteContext* out;
+
+    if (mtd_scan_partitions() <= 0 || (part = mtd_find_partition_by_name(mnt->mnt)) == NULL)
+    {
+        LOGE("Unable to find mtd partition %s\n", mnt->mnt);
+        return NULL;
+    }
+    if ((out = mtd_write_partition(part)) == NULL)
+        LOGE("Unable to open mtd partition %s\n", mnt->mnt);
+    else if (DataManager_GetIntValue(VAR_RESTORE_MTD_DIFFERENTIAL) == 1)
+        mtd_write_set_differential(out, 1);
+    return out;
+}
+
+static int phx_mtd_close(MtdWriteContext* out, int ret)
+{
+    MtdWriteStats st;
+
+    if (ret == 0 && mtd_erase_blocks(out, -1) == -1)
+        ret = -1;
+    mtd_write_stats(out, &st);
+    LOGI("Wrote %u blocks, %u unchanged, in %llu ms (erase %llu ms, write %llu ms, verify %llu ms, %u bad)\n",
+         st.blocks, st.unchanged, st.elapsed_usec / 1000, st.erase_usec / 1000, st.write_usec / 1000,
+         st.verify_usec / 1000, st.bad_blocks);
+    if (mtd_write_close(out))
+        ret = -1;
+    return ret;
+}
+
+static int phx_discard_out(void* cookie, const void* data, size_t len)
+{
+    return 0;
+}
+
+// Reads an image (or a manifest and its chunks) through once to check it,
+// so a damaged backup is found before the partition has been touched
+static int phx_verify_image(const char* image, int flags)
+{
+    WinReader* in = win_open(image, flags | WIN_RAW);
+    char* buf = (char*) malloc(IMG_COPY_SIZE);
+    ssize_t len = -1;
+
+    if (in == NULL || buf == NULL)
+    {
+        free(buf);
+        if (in)     win_read_close(in);
+        return -1;
+    }
+    while ((len = win_read(in, buf, IMG_COPY_SIZE)) > 0)
+        ;
+    free(buf);
+    if (win_read_close(in) || len < 0)
+        return -1;
+    return 0;
+}
+
+static int phx_verify_chunks(const char* dir, const char* manifest, int flags)
+{
+    char store[PATH_MAX];
+    WinReader* in;
+
+    if ((in = win_open(manifest, flags)) == NULL || win_read_close(in))
+        return -1;
+    phx_chunk_store(dir, store);
+    return chunk_restore(store, manifest, phx_discard_out, NULL);
+}
+
+// Writes a plain .win image, or a sparse .sparse or .blocks image, onto the
+// partition, what flash_image (mtd) and dd (emmc) used to do, hashing it on
+// the way. phx_restore has checked the image beforehand; a mismatch here
+// means it changed since, and the caller has to say the partition can't
+// be trusted.
+static int phx_restore_image(struct dInfo* mnt, const char* fst, const char* image, int flags, int sparse)
+{
+    unsigned long long size = 0;
+    WinReader* in;
+    char* buf = NULL;
+    ssize_t len;
+    int ret = 0;
+
+    // Images are never compressed, so whatever the first bytes look like
+    // they are the partition's
+    in = win_open(image, flags | WIN_RAW);
+    if (in == NULL)
+        return -1;
+
+    if (strcmp(fst, "mtd") == 0)
+    {
+        MtdWriteContext* out = phx_mtd_open(mnt);
+
+        if (out == NULL)
+        {
+            win_read_close(in);
+            return -1;
+        }
+        if (sparse)
+        {
+            ret = mtd_write_sparse(out, phx_win_read, in);
+        }
+        else if ((buf = (char*) malloc(IMG_COPY_SIZE)) == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            while (ret == 0 && (len = win_read(in, buf, IMG_COPY_SIZE)) != 0)
+            {
+                if (len < 0 || phx_mtd_out(out, buf, len))
+                    ret = -1;
+            }
+        }
+        ret = phx_mtd_close(out, ret);
+    }
+    else
+    {
+        struct restore_sparse rs;
+
+        rs.in = in;
+        rs.fd = open(mnt->dev, O_WRONLY);
+        if (rs.fd < 0)
+        {
+            LOGE("Unable to open %s (%s)\n", mnt->dev, strerror(errno));
+            win_read_close(in);
+            return -1;
+        }
+
+        if (sparse)
+        {
+            ret = sparse_read(phx_sparse_read, phx_sparse_data, phx_sparse_fill, &rs, &size);
+        }
+        else if ((buf = (char*) malloc(IMG_COPY_SIZE)) == NULL)
+        {
+            ret = -1;
+        }
+        else
+        {
+            while (ret == 0 && (len = win_read(in, buf, IMG_COPY_SIZE)) != 0)
+            {
+                if (len < 0 || phx_pwrite_all(rs.fd, buf, len, size))
+                    ret = -1;
+                size += len;
+            }
+        }
+        if (ret == 0 && size > mnt->sze)
+        {
+            LOGE("Image of %llu bytes is larger than %s\n", size, mnt->dev);
+            ret = -1;
+        }
+        if (fsync(rs.fd) || close(rs.fd))
+            ret = -1;
+    }
+    free(buf);
+
+    if (win_read_close(in))
+    {
+        ui_print("E: %s doesn't match its md5.\n", image);
+        ret = -1;
+    }
+    return ret;
+}
+
+// Rebuilds a deduplicated image straight onto the partition. The chunks
+// and the image are checked by chunk_restore, the manifest by its .md5.
+static int phx_restore_chunks(struct dInfo* mnt, const char* fst, const char* dir, const char* manifest, int flags)
+{
+    char store[PATH_MAX];
+    WinReader* in;
+    int ret;
+
+    if ((in = win_open(manifest, flags)) == NULL)
+        return -1;
+    if (win_read_close(in))
+    {
+        ui_print("E: %s doesn't match its md5.\n", manifest);
+        return -1;
+    }
+
+    phx_chunk_store(dir, store);
+
+    if (strcmp(fst, "mtd") == 0)
+    {
+        MtdWriteContext* out = phx_mtd_open(mnt);
+
+        if (out == NULL)
+            return -1;
+        return phx_mtd_close(out, chunk_restore(store, manifest, phx_mtd_out, out));
+    }
+
+    int fd = open(mnt->dev, O_WRONLY);
+    if (fd < 0)
+    {
+        LOGE("Unable to open %s (%s)\n", mnt->dev, strerror(errno));
+        return -1;
+    }
+    ret = chunk_restore(store, manifest, phx_fd_out, &fd);
+    if (fsync(fd) || close(fd))
+        ret = -1;
+    return ret;
+}
+
+int phx_restore(struct dInfo rMnt, const char *rDir)
+{
+	int i;
+	FILE *reFp;
+	char rUppr[20];
+	char rMount[30];
+	char rFilesystem[10];
+	char rFilename[255];
+	char rCommand[255];
+	time_t rStart, rStop;
+	strcpy(rUppr,rMnt.mnt);
+	for (i = 0; i < (int) strlen(rUppr); i++) {
+		rUppr[i] = toupper(rUppr[i]);
+	}
+	ui_print("[%s]\n",rUppr);
+	time(&rStart);
+    invalidateUsedSizes();
+
+	strcpy(rFilename,rDir);
+    if (rFilename[strlen(rFilename)-1] != '/')
+    {
+        strcat(rFilename, "/");
+    }
+	strcat(rFilename,rMnt.fnm);
+
+    // The md5 is checked while restoring, not in a pass of its own, so make
+    // sure there is one to check against before anything gets wiped
+    int rFlags = 0;
+    if (DataManager_GetIntValue(VAR_SKIP_MD5_CHECK_VAR) == 1) {
+        ui_print("Skipping MD5 check based on user setting.\n");
+    } else if (!win_has_md5(rFilename)) {
+        ui_print("E: Missing %s.md5. Aborted.\n\n", rFilename);
+        return 1;
+    } else {
+        rFlags |= WIN_MD5;
+    }
+
+    // Restore the way this backup was made, which needn't be the way the
+    // partition is set to be backed up now
+    if (rMnt.backup == files || rMnt.backup == blocks)
+    {
+        size_t len = strlen(rMnt.fnm);
+        rMnt.backup = (len > 7 && strcmp(rMnt.fnm + len - 7, ".blocks") == 0) ? blocks : files;
+    }
+
+	sprintf(rCommand,"ls -l %s | awk -F'.' '{ print $2 }'",rFilename); // let's get the filesystem type from filename
+    reFp = __popen(rCommand, "r");
+	LOGI("=> Filename is: %s\n",rMnt.fnm);
+	while (fscanf(reFp,"%s",rFilesystem) == 1) { // if we get a match, store filesystem type
+		LOGI("=> Filesystem is: %s\n",rFilesystem); // show it off to the world!
+	}
+	__pclose(reFp);
+
+    int rChunks = (rMnt.backup == image && strcmp(rMnt.fnm + strlen(rMnt.fnm) - 7, ".chunks") == 0);
+    int rSparse = (rMnt.backup == blocks ||
+                   (rMnt.backup == image && strcmp(rMnt.fnm + strlen(rMnt.fnm) - 7, ".sparse") == 0));
+
+    // Images overwrite the whole partition, so check them before anything
+    // is written; a bad one leaves the partition as it was
+    if ((rMnt.backup == image || rMnt.backup == blocks) && (rFlags & WIN_MD5))
+    {
+        ui_print("...Verifying %s\n", rMnt.fnm);
+        SetDataState("Verifying", rMnt.mnt, 0, 0);
+        if (rChunks ? phx_verify_chunks(rDir, rFilename, rFlags) : phx_verify_image(rFilename, rFlags))
+        {
+            ui_print("E: %s doesn't match its md5, %s was left unchanged.\n", rMnt.fnm, rMnt.mnt);
             return 1;
         }
+    }
 
-		ui_print("...Restoring %s\n\n",rMount);
-        SetDataState("Restoring", rMnt.mnt, 0, 0);
-		reFp = __popen(rCommand, "r");
-		if(DataManager_GetIntValue(VAR_SHOW_SPAM_VAR) == 2) { // spam
-			while (fgets(rOutput,sizeof(rOutput),reFp) != NULL) {
-				ui_print_overwrite("%s",rOutput);
-			}
+	if (rMnt.backup == image || rMnt.backup == blocks) {
+        // The image carries the whole partition, all it needs is the
+        // partition to itself; there's nothing to format first. Blocks
+        // images go back to the device they were read from.
+        if (phx_unmount(rMnt)) {
+            ui_print("E: Unable to unmount %s.\n", rMnt.mnt);
+            return 1;
+        }
+        if (rMnt.backup == blocks)
+            strcpy(rMnt.dev, rMnt.blk);
+	} else if ((DataManager_GetIntValue(VAR_RM_RF_VAR) == 1 && (strcmp(rMnt.mnt,"system") == 0 || strcmp(rMnt.mnt,"data") == 0 || strcmp(rMnt.mnt,"cache") == 0)) || strcmp(rMnt.mnt,".android_secure") == 0) { // we'll use rm -rf instead of formatting for system, data and cache if the option is set, always use rm -rf for android secure
+		ui_print("...using rm -rf to wipe %s\n", rMnt.mnt);
+		if (strcmp(rMnt.mnt,".android_secure") == 0) {
+			phx_mount(sdcext); // for android secure we must make sure that the sdcard is mounted
+			strcpy(rCommand, rMnt.dev);
 		} else {
-			while (fscanf(reFp,"%s",rOutput) == 1) {
-				if(DataManager_GetIntValue(VAR_SHOW_SPAM_VAR) == 1) ui_print_overwrite("%s",rOutput);
-			}
-		}
-		__pclose(reFp);
-		ui_print_overwrite("....done restoring.\n");
-		if (strcmp(rMnt.mnt,".android_secure") != 0) { // any partition other than android secure,
-			phx_unmount(rMnt); // let's unmount (unmountable partitions won't matter)
+			phx_mount(rMnt); // mount the partition first
+			sprintf(rCommand,"/%s", rMnt.mnt);
 		}
+        SetDataState("Wiping", rMnt.mnt, 0, 0);
+		phx_remove_tree(rCommand, 1); // empties it, hidden entries included
+		ui_print("....done wiping.\n");
 	} else {
-		ui_print("...Failed md5 check. Aborted.\n\n");
-		return 1;
+		ui_print("...Formatting %s\n",rMnt.mnt);
+        SetDataState("Formatting", rMnt.mnt, 0, 0);
+		if (strcmp(rMnt.fst, "yaffs2") == 0) {
+			if (strcmp(rMnt.mnt, "data") == 0) {
+				phx_format(rFilesystem,"userdata"); // on MTD yaffs2, data is actually found under userdata
+			} else {
+				phx_format(rFilesystem,rMnt.mnt); // use mount location instead of block for formatting on mtd devices
+			}
+        } else {
+		    phx_format(rFilesystem,rMnt.blk); // let's format block, based on filesystem from filename above
+        }
+		ui_print("....done formatting.\n");
+	}
+
+    if (rMnt.backup == files)
+    {
+        phx_mount(rMnt);
+        strcpy(rMount,"/");
+        if (strcmp(rMnt.mnt,".android_secure") == 0) { // if it's android_secure, we have add prefix
+            strcat(rMount,"sdcard/");
+        }
+        strcat(rMount,rMnt.mnt);
+    } else if (rMnt.backup == image || rMnt.backup == blocks) {
+        strcpy(rMount,rMnt.mnt); // written straight to the partition below
+    } else {
+        LOGE("Unknown backup method for mount %s\n", rMnt.mnt);
+        return 1;
+    }
+
+	ui_print("...Restoring %s\n\n",rMount);
+    SetDataState("Restoring", rMnt.mnt, 0, 0);
+    if (rMnt.backup == files)
+    {
+        if (phx_restore_files(rMount, rFilename, rFlags))
+        {
+            ui_print("E: Unable to restore %s.\n", rMount);
+            return 1;
+        }
+    }
+    else if (rChunks ? phx_restore_chunks(&rMnt, rFilesystem, rDir, rFilename, rFlags)
+                     : phx_restore_image(&rMnt, rFilesystem, rFilename, rFlags, rSparse))
+    {
+        ui_print("E: Unable to restore %s. It was partly overwritten and can't be\n"
+                 "   trusted; restore it again or from another backup.\n", rMount);
+        return 1;
+    }
+	ui_print_overwrite("....done restoring.\n");
+	if (strcmp(rMnt.mnt,".android_secure") != 0) { // any partition other than android secure,
+		phx_unmount(rMnt); // let's unmount (unmountable partitions won't matter)
 	}
 	time(&rStop);
 	ui_print("[%s DONE (%d SECONDS)]\n\n",rUppr,(int)difftime(rStop,rStart));
@@ -978,68 +2096,95 @@ nandroid_rest_exe()
 	return 0;
 }
 
-static int compare_string(const void* a, const void* b) {
-    return strcmp(*(const char**)a, *(const char**)b);
-}
-
-int makeMD5(const char *imgDir, const char *imgFile)
+// Restores single files and folders (VAR_RESTORE_FILES_VAR, full paths
+// separated by ';') from the files backups in the selected folder, leaving
+// everything else on the partitions as it is
+int
+nandroid_rest_files_exe()
 {
-	int bool = 1;
-
-    if (DataManager_GetIntValue(VAR_SKIP_MD5_GENERATE_VAR) == 1) {
-        // When skipping the generate, we return success
-        return 0;
-    }
+    struct dInfo* mounts[] = { &sys, &dat, &cac, &sde, &ase, &sp1, &sp2, &sp3 };
+    const char* nan_dir = DataManager_GetStrValue("phx_restore");
+    char* paths = strdup(DataManager_GetStrValue(VAR_RESTORE_FILES_VAR));
+    char* path;
+    char* save = NULL;
+    time_t rStart, rStop;
+    int ret = 0;
 
-	if (ensure_path_mounted("/sdcard") != 0) {
-		LOGI("=> Can not mount sdcard.\n");
-		return bool;
-	} else {
-		FILE *fp;
-		char tmpString[255];
-		char tmpAnswer[15];
-		sprintf(tmpString,"cd %s && md5sum %s > %s.md5",imgDir,imgFile,imgFile);
-		fp = __popen(tmpString, "r");
-		fgets(tmpString, 255, fp);
-		getWordFromString(1, tmpString, tmpAnswer, sizeof(tmpAnswer));
-		if (strcmp(tmpAnswer,"md5sum:") == 0) {
-            ui_print("....MD5 Error: %s (%s)", tmpString, tmpAnswer);
-		} else {
-			ui_print("....MD5 Created.\n");
-			bool = 0;
-		}
-		__pclose(fp);
+    SetDataState("", "", 0, 0);
+	if (paths == NULL || ensure_path_mounted(SDCARD_ROOT) != 0) {
+		ui_print("-- Could not mount: %s.\n-- Aborting.\n",SDCARD_ROOT);
+        free(paths);
+		return 1;
 	}
-	return bool;
-}
 
-int checkMD5(const char *imgDir, const char *imgFile)
-{
-	int bool = 1;
+	time(&rStart);
+	ui_print("\n[RESTORE FILES STARTED]\n\n");
+    for (path = strtok_r(paths, ";", &save); path; path = strtok_r(NULL, ";", &save))
+    {
+        struct dInfo* rMnt = NULL;
+        char rMount[PATH_MAX];
+        char rFilename[PATH_MAX];
+        char rName[PATH_MAX];
+        size_t best = 0;
+        unsigned int i;
+
+        while (*path == ' ')    path++;
+        if (*path == '\0')      continue;
+
+        // The partition whose mount point holds the path
+        for (i = 0; i < sizeof(mounts) / sizeof(mounts[0]); i++)
+        {
+            char dir[PATH_MAX];
+            size_t len;
 
-    if (DataManager_GetIntValue(VAR_SKIP_MD5_CHECK_VAR) == 1) {
-        // When skipping the test, we return success
-        return 0;
+            if (mounts[i]->backup != files)     continue;
+            sprintf(dir, "/%s%s", strcmp(mounts[i]->mnt, ".android_secure") == 0 ? "sdcard/" : "", mounts[i]->mnt);
+            len = strlen(dir);
+            if (len > best && strncmp(path, dir, len) == 0 && (path[len] == '/' || path[len] == '\0'))
+            {
+                rMnt = mounts[i];
+                strcpy(rMount, dir);
+                best = len;
+            }
+        }
+        if (rMnt == NULL || rMnt->fnm[0] == '\0' || strstr(rMnt->fnm, ".win") == NULL)
+        {
+            ui_print("E: No files backup holds %s.\n", path);
+            ret = 1;
+            continue;
+        }
+
+        sprintf(rFilename, "%s%s%s", nan_dir, nan_dir[strlen(nan_dir) - 1] == '/' ? "" : "/", rMnt->fnm);
+        sprintf(rName, ".%s", path + best);
+        if (rName[1] == '\0')
+            strcpy(rName, ".");
+
+        ui_print("...Restoring %s\n", path);
+        SetDataState("Restoring", rMnt->mnt, 0, 0);
+        if (strcmp(rMnt->mnt, ".android_secure") == 0)
+            phx_mount(sdcext);
+        else
+            phx_mount(*rMnt);
+        if (phx_restore_selected(rMount, rFilename, rName))
+            ret = 1;
+        if (strcmp(rMnt->mnt, ".android_secure") != 0)
+            phx_unmount(*rMnt);
     }
+    free(paths);
 
-	if (ensure_path_mounted("/sdcard") != 0) {
-		LOGI("=> Can not mount sdcard.\n");
-		return bool;
-	} else {
-		FILE *fp;
-		char tmpString[255];
-		char tmpAnswer[15];
-		sprintf(tmpString,"cd %s && md5sum -c %s.md5",imgDir,imgFile);
-		fp = __popen(tmpString, "r");
-		fgets(tmpString, 255, fp);
-		getWordFromString(2, tmpString, tmpAnswer, sizeof(tmpAnswer));
-		if (strcmp(tmpAnswer,"OK") == 0) {
-			ui_print("....MD5 Check: %s\n", tmpAnswer);
-			bool = 0;
-		} else {
-			ui_print("....MD5 Error: %s (%s)", tmpString, tmpAnswer);
-		}
-		__pclose(fp);
-	}
-	return bool;
+	time(&rStop);
+    if (ret)
+    {
+        ui_print("-- Error occured, check recovery.log.\n");
+        SetDataState("Restore failed", "", 1, 1);
+        return 1;
+    }
+	ui_print("[RESTORE FILES COMPLETED IN %d SECONDS]\n\n",(int)difftime(rStop,rStart));
+	__system("sync");
+    SetDataState("Restore Succeeded", "", 0, 1);
+	return 0;
+}
+
+static int compare_string(const void* a, const void* b) {
+    return strcmp(*(const char**)a, *(const char**)b);
 }
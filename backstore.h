@@ -12,14 +12,13 @@ char* nan_img_set(int setting, int backstore);
 
 int nandroid_back_exe();
 int nandroid_rest_exe();
+int nandroid_rest_files_exe();
 
 void set_restore_files();
 char* nan_compress();
 
 int sdSpace;
 
-int makeMD5(const char *imgDir, const char *imgFile);
-int checkMD5(const char *imgDir, const char *imgFile);
 
 int phx_isMounted(struct dInfo mMnt);
 int phx_mount(struct dInfo mMnt);
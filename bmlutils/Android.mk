@@ -13,4 +13,6 @@ $(foreach board_define,$(BOARD_RECOVERY_DEFINES), \
 LOCAL_SRC_FILES := bmlutils.c
 LOCAL_MODULE := libbmlutils
 LOCAL_MODULE_TAGS := eng
+LOCAL_C_INCLUDES += bootable/recovery
+LOCAL_SHARED_LIBRARIES := libmtdutils
 include $(BUILD_SHARED_LIBRARY)
@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mincrypt/sha.h"
+
+#include "common.h"
+#include "md5.h"
+#include "chunkstore.h"
+#include "winfile.h"
+
+#define CHUNK_MASK          (~0U << (32 - CHUNK_AVG_BITS))
+
+struct ChunkEntry {
+    uint8_t sha[SHA_DIGEST_SIZE];
+    unsigned int len;
+};
+
+struct ChunkWriter {
+    char* store;
+    WinFile* manifest;
+
+    unsigned char* buf;         // the chunk being assembled
+    size_t fill;
+    uint32_t hash;
+
+    struct ChunkEntry* entries;
+    int count, alloc;
+
+    MD5_CTX md5;
+    unsigned long long bytes_in;
+    unsigned long long bytes_stored;
+    int error;
+};
+
+// Gear hash table: one random 32-bit value per byte. It has to be the same
+// on every run or chunk boundaries (and so deduplication) would drift.
+static uint32_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void)
+{
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for (i = 0; i < 256; i++)
+    {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = (uint32_t) ((z ^ (z >> 31)) >> 32);
+    }
+}
+
+static void sha_hex(const uint8_t* sha, char* out)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < SHA_DIGEST_SIZE; i++)
+    {
+        out[i * 2] = hex[sha[i] >> 4];
+        out[i * 2 + 1] = hex[sha[i] & 0xf];
+    }
+    out[SHA_DIGEST_SIZE * 2] = '\0';
+}
+
+// Chunks live in <store>/<first two hex digits>/<sha1>
+static void chunk_path(const char* store, const char* hex, char* path, int dir_only)
+{
+    if (dir_only)   snprintf(path, PATH_MAX, "%s/%.2s", store, hex);
+    else            snprintf(path, PATH_MAX, "%s/%.2s/%s", store, hex, hex);
+}
+
+static int write_all(int fd, const void* data, size_t len)
+{
+    const char* ptr = (const char*) data;
+
+    while (len > 0)
+    {
+        ssize_t wrote = write(fd, ptr, len);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+            return -1;
+        ptr += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+static int chunk_store(ChunkWriter* cw, const uint8_t* sha, const void* data, size_t len)
+{
+    char hex[SHA_DIGEST_SIZE * 2 + 1];
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    sha_hex(sha, hex);
+    chunk_path(cw->store, hex, path, 0);
+    if (stat(path, &st) == 0 && (size_t) st.st_size == len)
+        return 0;
+
+    chunk_path(cw->store, hex, tmp, 1);
+    if (mkdir(tmp, 0777) && errno != EEXIST)
+    {
+        LOGE("Unable to create %s (%s)\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    // Write under a temporary name so an interrupted backup never leaves a
+    // short chunk behind that a later backup would trust
+    strncat(tmp, "/.tmpXXXXXX", PATH_MAX - strlen(tmp) - 1);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        LOGE("Unable to create chunk in %s (%s)\n", cw->store, strerror(errno));
+        return -1;
+    }
+    int err = (write_all(fd, data, len) || fsync(fd));
+    if (close(fd))
+        err = 1;
+    if (err)
+    {
+        LOGE("Unable to write chunk %s (%s)\n", hex, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, path))
+    {
+        LOGE("Unable to store chunk %s (%s)\n", hex, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    cw->bytes_stored += len;
+    return 0;
+}
+
+static int chunk_flush(ChunkWriter* cw)
+{
+    SHA_CTX ctx;
+    struct ChunkEntry* entry;
+
+    if (cw->fill == 0)
+        return 0;
+
+    if (cw->count == cw->alloc)
+    {
+        int alloc = cw->alloc ? cw->alloc * 2 : 1024;
+        struct ChunkEntry* entries = (struct ChunkEntry*) realloc(cw->entries, alloc * sizeof(struct ChunkEntry));
+        if (entries == NULL)
+            return -1;
+        cw->entries = entries;
+        cw->alloc = alloc;
+    }
+    entry = &cw->entries[cw->count++];
+
+    SHA_init(&ctx);
+    SHA_update(&ctx, cw->buf, cw->fill);
+    memcpy(entry->sha, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    entry->len = cw->fill;
+
+    if (chunk_store(cw, entry->sha, cw->buf, cw->fill))
+        return -1;
+
+    cw->fill = 0;
+    cw->hash = 0;
+    return 0;
+}
+
+ChunkWriter* chunk_create(const char* store, const char* manifest, int flags)
+{
+    ChunkWriter* cw;
+
+    pthread_once(&gear_once, gear_init);
+
+    if (mkdir(store, 0777) && errno != EEXIST)
+    {
+        LOGE("Unable to create %s (%s)\n", store, strerror(errno));
+        return NULL;
+    }
+
+    cw = (ChunkWriter*) calloc(1, sizeof(ChunkWriter));
+    if (cw == NULL)
+        return NULL;
+
+    cw->store = strdup(store);
+    cw->buf = (unsigned char*) malloc(CHUNK_MAX_SIZE);
+    if (cw->store == NULL || cw->buf == NULL)
+    {
+        free(cw->store);
+        free(cw->buf);
+        free(cw);
+        return NULL;
+    }
+
+    // The manifest is tiny; only the hashing part of WinFile matters here
+    cw->manifest = win_create(manifest, flags & WIN_MD5);
+    if (cw->manifest == NULL)
+    {
+        free(cw->store);
+        free(cw->buf);
+        free(cw);
+        return NULL;
+    }
+
+    MD5_init(&cw->md5);
+    return cw;
+}
+
+int chunk_write(ChunkWriter* cw, const void* data, size_t len)
+{
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (cw->error)
+        return -1;
+
+    MD5_update(&cw->md5, data, len);
+    cw->bytes_in += len;
+
+    while (len > 0)
+    {
+        size_t n = 0;
+        int cut = 0;
+
+        // The hash only remembers the last 32 bytes, so there is nothing to
+        // roll until we get near the minimum chunk size
+        if (cw->fill + 32 < CHUNK_MIN_SIZE)
+        {
+            n = CHUNK_MIN_SIZE - 32 - cw->fill;
+            if (n > len)    n = len;
+        }
+        else
+        {
+            uint32_t hash = cw->hash;
+            size_t size = cw->fill;
+
+            while (n < len)
+            {
+                hash = (hash << 1) + gear[ptr[n++]];
+                if (++size >= CHUNK_MAX_SIZE || (size >= CHUNK_MIN_SIZE && (hash & CHUNK_MASK) == 0))
+                {
+                    cut = 1;
+                    break;
+                }
+            }
+            cw->hash = hash;
+        }
+
+        memcpy(cw->buf + cw->fill, ptr, n);
+        cw->fill += n;
+        ptr += n;
+        len -= n;
+
+        if (cut && chunk_flush(cw))
+        {
+            cw->error = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int chunk_close(ChunkWriter* cw)
+{
+    uint8_t digest[MD5_DIGEST_SIZE];
+    char hex[SHA_DIGEST_SIZE * 2 + 1];
+    char line[128];
+    int i;
+
+    if (!cw->error && chunk_flush(cw))
+        cw->error = 1;
+
+    if (!cw->error)
+    {
+        MD5_final(&cw->md5, digest);
+        MD5_hex(digest, hex);
+
+        snprintf(line, sizeof(line), "chunks 1\nsize %llu\nmd5 %s\n", cw->bytes_in, hex);
+        if (win_write(cw->manifest, line, strlen(line)))
+            cw->error = 1;
+
+        for (i = 0; i < cw->count && !cw->error; i++)
+        {
+            sha_hex(cw->entries[i].sha, hex);
+            snprintf(line, sizeof(line), "%s %u\n", hex, cw->entries[i].len);
+            if (win_write(cw->manifest, line, strlen(line)))
+                cw->error = 1;
+        }
+    }
+
+    if (win_close(cw->manifest))
+        cw->error = 1;
+
+    LOGI("%d chunks, %llu of %llu bytes new to the store\n", cw->count, cw->bytes_stored, cw->bytes_in);
+
+    int ret = cw->error ? -1 : 0;
+    free(cw->entries);
+    free(cw->buf);
+    free(cw->store);
+    free(cw);
+    return ret;
+}
+
+unsigned long long chunk_bytes_in(ChunkWriter* cw)
+{
+    return cw->bytes_in;
+}
+
+static int read_chunk(const char* store, const char* hex, unsigned char* buf, size_t len)
+{
+    char path[PATH_MAX];
+    char got[SHA_DIGEST_SIZE * 2 + 1];
+    SHA_CTX ctx;
+    size_t pos = 0;
+    int fd;
+
+    chunk_path(store, hex, path, 0);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        LOGE("Missing chunk %s (%s)\n", hex, strerror(errno));
+        return -1;
+    }
+    while (pos < len)
+    {
+        ssize_t n = read(fd, buf + pos, len - pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            LOGE("Short chunk %s\n", hex);
+            close(fd);
+            return -1;
+        }
+        pos += n;
+    }
+    close(fd);
+
+    SHA_init(&ctx);
+    SHA_update(&ctx, buf, len);
+    sha_hex(SHA_final(&ctx), got);
+    if (strcmp(got, hex) != 0)
+    {
+        LOGE("Corrupt chunk %s\n", hex);
+        return -1;
+    }
+    return 0;
+}
+
+int chunk_restore(const char* store, const char* manifest, chunk_out_fn out, void* cookie)
+{
+    char line[128];
+    char hex[SHA_DIGEST_SIZE * 2 + 1];
+    char want_md5[MD5_DIGEST_SIZE * 2 + 1];
+    uint8_t digest[MD5_DIGEST_SIZE];
+    unsigned long long size, total = 0;
+    unsigned int len;
+    unsigned char* buf;
+    MD5_CTX md5;
+    FILE* fp;
+    int ret = -1;
+
+    fp = fopen(manifest, "r");
+    if (fp == NULL)
+    {
+        LOGE("Unable to open %s (%s)\n", manifest, strerror(errno));
+        return -1;
+    }
+
+    if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, "chunks 1\n") != 0 ||
+        fgets(line, sizeof(line), fp) == NULL || sscanf(line, "size %llu", &size) != 1 ||
+        fgets(line, sizeof(line), fp) == NULL || sscanf(line, "md5 %32s", want_md5) != 1)
+    {
+        LOGE("%s is not a chunk manifest\n", manifest);
+        fclose(fp);
+        return -1;
+    }
+
+    buf = (unsigned char*) malloc(CHUNK_MAX_SIZE);
+    if (buf == NULL)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    MD5_init(&md5);
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "%40s %u", hex, &len) != 2 || strlen(hex) != SHA_DIGEST_SIZE * 2 ||
+            len == 0 || len > CHUNK_MAX_SIZE)
+        {
+            LOGE("Bad line in %s\n", manifest);
+            goto out;
+        }
+        if (read_chunk(store, hex, buf, len))
+            goto out;
+
+        MD5_update(&md5, buf, len);
+        if (out(cookie, buf, len))
+            goto out;
+        total += len;
+    }
+
+    MD5_final(&md5, digest);
+    MD5_hex(digest, hex);
+    if (total != size || strcmp(hex, want_md5) != 0)
+    {
+        LOGE("Image rebuilt from %s does not match its manifest\n", manifest);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(buf);
+    fclose(fp);
+    return ret;
+}
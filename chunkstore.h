@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CHUNKSTORE_HEADER
+#define _CHUNKSTORE_HEADER
+
+#include <sys/types.h>
+
+// Deduplicating store for raw partition images. An image is cut into
+// content-defined chunks (so an insertion only disturbs the chunks around
+// it), each chunk is stored once under its SHA-1 in a directory shared by
+// all backups of the device, and the backup itself only keeps a small
+// manifest listing the chunks in order:
+//
+//   chunks 1
+//   size <image bytes>
+//   md5 <md5 of the whole image>
+//   <sha1> <length>
+//   ...
+//
+// The manifest goes through WinFile, so WIN_MD5 gives it the usual .md5
+// sidecar.
+
+#define CHUNK_MIN_SIZE      (16 * 1024)
+#define CHUNK_AVG_BITS      16          // past the minimum, cut every 64KB on average
+#define CHUNK_MAX_SIZE      (256 * 1024)
+
+typedef int (*chunk_out_fn)(void* cookie, const void* data, size_t len);
+
+typedef struct ChunkWriter ChunkWriter;
+
+ChunkWriter* chunk_create(const char* store, const char* manifest, int flags);
+int chunk_write(ChunkWriter* cw, const void* data, size_t len);
+int chunk_close(ChunkWriter* cw);   // returns non-zero if anything failed
+
+// Image bytes handed to chunk_write
+unsigned long long chunk_bytes_in(ChunkWriter* cw);
+
+// Feeds the image described by a manifest to out, checking every chunk
+// against its name and the whole image against the recorded size and md5
+int chunk_restore(const char* store, const char* manifest, chunk_out_fn out, void* cookie);
+
+#endif  // _CHUNKSTORE_HEADER
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Round trips images through the chunk store and its manifest, checks
+// that an edited image mostly reuses chunks, and that missing or damaged
+// chunks and manifests are refused. Usage: chunkstore_test [scratch dir]
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunkstore.h"
+#include "minzip/DirUtil.h"
+#include "winfile.h"
+
+static const char* dir = "/tmp";
+static char store[PATH_MAX];
+static char manifest[PATH_MAX];
+static int failed = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+void ui_print(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+
+    fputs(buf, stderr);
+}
+
+static unsigned char* make_data(size_t len, unsigned int seed) {
+    unsigned char* data = malloc(len);
+    size_t i;
+
+    srand(seed);
+    for (i = 0; i < len; i++) data[i] = rand();
+    return data;
+}
+
+// Writes the image in uneven pieces, so chunks get cut across writes
+static int store_image(const unsigned char* data, size_t len) {
+    ChunkWriter* cw = chunk_create(store, manifest, WIN_MD5);
+    size_t pos = 0, piece = 1;
+
+    if (cw == NULL) return -1;
+    while (pos < len) {
+        size_t n = len - pos < piece ? len - pos : piece;
+        if (chunk_write(cw, data + pos, n)) break;
+        pos += n;
+        piece = piece * 3 + 7;
+        if (piece > 300000) piece = 1;
+    }
+    CHECK(chunk_bytes_in(cw) == pos);
+    return chunk_close(cw) == 0 && pos == len ? 0 : -1;
+}
+
+struct restored {
+    unsigned char* data;
+    size_t len, alloc;
+    int fail_after;             // the output fails once this many calls went through
+};
+
+static int collect(void* cookie, const void* data, size_t len) {
+    struct restored* r = (struct restored*) cookie;
+
+    if (r->fail_after >= 0 && r->fail_after-- == 0) return -1;
+    if (r->len + len > r->alloc) {
+        r->alloc = (r->len + len) * 2;
+        r->data = realloc(r->data, r->alloc);
+    }
+    memcpy(r->data + r->len, data, len);
+    r->len += len;
+    return 0;
+}
+
+static int restore(const unsigned char* data, size_t len) {
+    struct restored r;
+    int ret;
+
+    memset(&r, 0, sizeof(r));
+    r.fail_after = -1;
+    ret = chunk_restore(store, manifest, collect, &r);
+    if (ret == 0 && (r.len != len || (len && memcmp(r.data, data, len))))
+        ret = -1;
+    free(r.data);
+    return ret;
+}
+
+static int count_chunks(void) {
+    DIR* d = opendir(store);
+    struct dirent* de;
+    int count = 0;
+
+    while (d && (de = readdir(d)) != NULL) {
+        char sub[PATH_MAX];
+        DIR* s;
+        if (de->d_name[0] == '.') continue;
+        snprintf(sub, sizeof(sub), "%s/%s", store, de->d_name);
+        s = opendir(sub);
+        while (s && (de = readdir(s)) != NULL) {
+            if (de->d_name[0] != '.') count++;
+        }
+        if (s) closedir(s);
+    }
+    if (d) closedir(d);
+    return count;
+}
+
+// The chunk names and sizes listed in the manifest
+static int read_manifest(char names[][41], unsigned int* lens, int max) {
+    char line[128];
+    FILE* fp = fopen(manifest, "r");
+    int count = 0;
+
+    if (fp == NULL) return -1;
+    while (fgets(line, sizeof(line), fp) != NULL && count < max) {
+        if (sscanf(line, "%40[0-9a-f] %u", names[count], &lens[count]) == 2 && strlen(names[count]) == 40)
+            count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+static void chunk_file(const char* name, char* path) {
+    snprintf(path, PATH_MAX, "%s/%.2s/%s", store, name, name);
+}
+
+static void test_round_trip(const unsigned char* data, size_t len) {
+    char names[256][41];
+    unsigned int lens[256];
+    int count, i;
+    size_t total = 0;
+
+    CHECK(store_image(data, len) == 0);
+    CHECK(restore(data, len) == 0);
+    CHECK(win_has_md5(manifest));
+
+    count = read_manifest(names, lens, 256);
+    CHECK(count > 1);
+    for (i = 0; i < count; i++) {
+        CHECK(lens[i] <= CHUNK_MAX_SIZE);
+        CHECK(i == count - 1 || lens[i] >= CHUNK_MIN_SIZE);
+        total += lens[i];
+    }
+    CHECK(total == len);
+    CHECK(count_chunks() <= count);
+
+    // The same image again stores nothing new
+    i = count_chunks();
+    CHECK(store_image(data, len) == 0);
+    CHECK(count_chunks() == i);
+}
+
+// Bytes inserted in the middle only disturb the chunks around them
+static void test_dedup(const unsigned char* data, size_t len) {
+    size_t edited_len = len + 100;
+    unsigned char* edited = malloc(edited_len);
+    int before;
+
+    memcpy(edited, data, len / 2);
+    memset(edited + len / 2, 0xa5, 100);
+    memcpy(edited + len / 2 + 100, data + len / 2, len - len / 2);
+
+    CHECK(store_image(data, len) == 0);
+    before = count_chunks();
+    CHECK(store_image(edited, edited_len) == 0);
+    CHECK(count_chunks() - before <= 3);
+    CHECK(restore(edited, edited_len) == 0);
+    free(edited);
+}
+
+static void test_empty(void) {
+    CHECK(store_image(NULL, 0) == 0);
+    CHECK(restore(NULL, 0) == 0);
+}
+
+static int write_text(const char* path, const char* text) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) return -1;
+    fputs(text, fp);
+    return fclose(fp);
+}
+
+static void test_damaged(const unsigned char* data, size_t len) {
+    char names[256][41];
+    unsigned int lens[256];
+    char path[PATH_MAX];
+    unsigned char* buf;
+    struct restored r;
+    int count, fd;
+
+    CHECK(store_image(data, len) == 0);
+    count = read_manifest(names, lens, 256);
+    CHECK(count > 2);
+    if (count <= 2) return;
+    chunk_file(names[1], path);
+
+    // A flipped byte
+    buf = malloc(lens[1]);
+    fd = open(path, O_RDWR);
+    CHECK(fd >= 0 && read(fd, buf, lens[1]) == (ssize_t) lens[1]);
+    buf[lens[1] / 2] ^= 1;
+    CHECK(pwrite(fd, buf, lens[1], 0) == (ssize_t) lens[1]);
+    close(fd);
+    free(buf);
+    CHECK(restore(data, len) != 0);
+
+    // Cut short, then gone
+    CHECK(truncate(path, lens[1] - 1) == 0);
+    CHECK(restore(data, len) != 0);
+    unlink(path);
+    CHECK(restore(data, len) != 0);
+
+    // A backup storing the same image again puts the chunk back
+    CHECK(store_image(data, len) == 0);
+    CHECK(restore(data, len) == 0);
+
+    // The output failing stops the restore
+    memset(&r, 0, sizeof(r));
+    r.fail_after = 1;
+    CHECK(chunk_restore(store, manifest, collect, &r) != 0);
+    free(r.data);
+
+    // Manifests that are wrong or were cut short
+    CHECK(write_text(manifest, "chunks 2\nsize 0\nmd5 d41d8cd98f00b204e9800998ecf8427e\n") == 0);
+    CHECK(restore(NULL, 0) != 0);
+    CHECK(write_text(manifest, "chunks 1\nmd5 d41d8cd98f00b204e9800998ecf8427e\n") == 0);
+    CHECK(restore(NULL, 0) != 0);
+    CHECK(write_text(manifest, "chunks 1\nsize 0\nmd5 d41d8cd98f00b204e9800998ecf8427e\nzz 12\n") == 0);
+    CHECK(restore(NULL, 0) != 0);
+    snprintf(path, sizeof(path), "chunks 1\nsize %zu\nmd5 d41d8cd98f00b204e9800998ecf8427e\n%s %u\n",
+             len, names[0], lens[0]);
+    CHECK(write_text(manifest, path) == 0);
+    CHECK(restore(data, lens[0]) != 0);
+    snprintf(path, sizeof(path), "chunks 1\nsize %u\nmd5 d41d8cd98f00b204e9800998ecf8427e\n%s %u\n",
+             lens[0], names[0], CHUNK_MAX_SIZE + 1);
+    CHECK(write_text(manifest, path) == 0);
+    CHECK(restore(data, lens[0]) != 0);
+    unlink(manifest);
+    CHECK(restore(NULL, 0) != 0);
+}
+
+int main(int argc, char** argv) {
+    size_t len = 3 * 1024 * 1024 + 12345;
+    unsigned char* data = make_data(len, 1);
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [scratch dir]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2) dir = argv[1];
+    snprintf(store, sizeof(store), "%s/chunkstore_test_store", dir);
+    snprintf(manifest, sizeof(manifest), "%s/chunkstore_test.chunks", dir);
+    dirUnlinkHierarchy(store);
+
+    test_round_trip(data, len);
+    test_dedup(data, len);
+    test_empty();
+    test_damaged(data, len);
+
+    dirUnlinkHierarchy(store);
+    unlink(manifest);
+    strcat(manifest, ".md5");
+    unlink(manifest);
+    free(data);
+    printf("%s\n", failed ? "FAILURE" : "SUCCESS");
+    return failed;
+}
@@ -138,6 +138,25 @@ typedef struct {
 
 
 
+// files or blocks (ext2/3/4 used blocks only) for the mountable partitions
+#ifndef SYSTEM_BACKUP_METHOD
+#define SYSTEM_BACKUP_METHOD files
+#endif
+#ifndef DATA_BACKUP_METHOD
+#define DATA_BACKUP_METHOD files
+#endif
+#ifndef CACHE_BACKUP_METHOD
+#define CACHE_BACKUP_METHOD files
+#endif
+#ifndef SDEXT_BACKUP_METHOD
+#define SDEXT_BACKUP_METHOD files
+#endif
+
+// Changes with every build; anything cached by another build is dropped
+#ifndef RECOVERY_BUILD_ID
+#define RECOVERY_BUILD_ID "unknown"
+#endif
+
 // This handles the special partitions
 #ifndef SP1_NAME
 #define SP1_NAME
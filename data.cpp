@@ -379,6 +379,8 @@ void DataManager::SetDefaultValues()
     mValues.insert(make_pair(VAR_SORT_FILES_BY_DATE_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(VAR_GUI_SORT_ORDER, make_pair("1", 1)));
     mValues.insert(make_pair(VAR_RM_RF_VAR, make_pair("0", 1)));
+    mValues.insert(make_pair(VAR_WIPE_FILES_VAR, make_pair("0", 0)));
+    mValues.insert(make_pair(VAR_WIPE_MB_VAR, make_pair("0", 0)));
     mValues.insert(make_pair(VAR_SKIP_MD5_CHECK_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(VAR_SKIP_MD5_GENERATE_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(VAR_SDEXT_SIZE, make_pair("512", 1)));
@@ -391,6 +393,13 @@ void DataManager::SetDefaultValues()
     mValues.insert(make_pair(VAR_BACKUP_AVG_IMG_RATE, make_pair("15000000", 1)));
     mValues.insert(make_pair(VAR_BACKUP_AVG_FILE_RATE, make_pair("3000000", 1)));
     mValues.insert(make_pair(VAR_BACKUP_AVG_FILE_COMP_RATE, make_pair("2000000", 1)));
+    mValues.insert(make_pair(VAR_BACKUP_IO_JOBS, make_pair("2", 1)));
+    mValues.insert(make_pair(VAR_BACKUP_CPU_JOBS, make_pair("1", 1)));
+    mValues.insert(make_pair(VAR_BACKUP_DEDUP, make_pair("0", 1)));
+    mValues.insert(make_pair(VAR_BACKUP_INCREMENTAL, make_pair("0", 1)));
+    mValues.insert(make_pair(VAR_BACKUP_SPARSE, make_pair("1", 1)));
+    mValues.insert(make_pair(VAR_BACKUP_BLOCK_GZIP, make_pair("1", 1)));
+    mValues.insert(make_pair(VAR_RESTORE_MTD_DIFFERENTIAL, make_pair("0", 1)));
     mValues.insert(make_pair(VAR_RESTORE_AVG_IMG_RATE, make_pair("15000000", 1)));
     mValues.insert(make_pair(VAR_RESTORE_AVG_FILE_RATE, make_pair("3000000", 1)));
     mValues.insert(make_pair(VAR_RESTORE_AVG_FILE_COMP_RATE, make_pair("2000000", 1)));
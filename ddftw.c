@@ -16,6 +16,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <unistd.h>
@@ -26,6 +33,9 @@
 #include "bootloader.h"
 #include "backstore.h"
 #include "data.h"
+#include "minzip/DirUtil.h"
+#include "mtdutils/mounts.h"
+#include "roots.h"
 
 struct dInfo tmp, sys, dat, boo, rec, cac, sdcext, sdcint, ase, sde, sp1, sp2, sp3;
 char device_name[20];
@@ -292,95 +302,145 @@ int getLocationsViaProc(const char* fstype)
     return getLocationsViafstab();
 }
 
-unsigned long long getUsedSizeViaDu(const char* path)
-{
-    char cmd[512];
-    sprintf(cmd, "du %s | awk '{ print $1 }'", path);
-
-    FILE *fp;
-    fp = __popen(cmd, "r");
-    
-    char str[512];
-    fgets(str, sizeof(str), fp);
-    __pclose(fp);
-
-    unsigned long long size = atol(str);
-    size *= 1024;
-
-    return size;
-}
-
-void updateMntUsedSize(struct dInfo* mMnt)
+// Mounts what it has to, so it's run on the probe threads below; it
+// leaves reporting failures to the caller. Returns 0, or -1 with 'what'
+// set to what couldn't be mounted or stat'd.
+static int probeMntUsedSize(struct dInfo* mMnt, const char** what)
 {
 #ifdef RECOVERY_SDCARD_ON_DATA
     if (mMnt == &sdcext)
     {
         struct statfs st;
-        if (statfs("/mnt/data-sdc/.", &st) != 0)    return;
+        *what = "/mnt/data-sdc";
+        if (statfs("/mnt/data-sdc/.", &st) != 0)    return -1;
 
         mMnt->used = ((st.f_blocks - st.f_bfree) * st.f_bsize);
-        return;
+        return 0;
     }
 #endif
 
 	if (strcmp(mMnt->mnt, ".android_secure") == 0)
     {
-		// android_secure is a little different - we mount sdcard and use du to figure out how much space is being taken up by android_secure
-        
-        // We can ignore any error from this, it doesn't matter
-        phx_mount(sdcext);
+		// android_secure is a little different - we mount sdcard and walk android_secure to figure out how much space is being taken up
+        long long used;
+
+        // We can ignore a mount error, the walk will fail anyway
+        if (sdcext.mountable && !phx_isMounted(sdcext))
+        {
+            char target[255];
+            sprintf(target, "/%s", sdcext.mnt);
+            mount(sdcext.blk, target, sdcext.fst, 0, NULL);
+        }
 
-        mMnt->used = getUsedSizeViaDu("/sdcard/.android_secure");
+        *what = "/sdcard/.android_secure";
+        used = dirDiskUsage("/sdcard/.android_secure", 0);
+        mMnt->used = used < 0 ? 0 : used;
         mMnt->sze = mMnt->used;
-        return;
+        return (used < 0 && errno != ENOENT) ? -1 : 0;
 	}
 
     char path[512];
     struct statfs st;
-    int mounted;
+    int mounted, ret = 0;
 
     if (!mMnt->mountable)
     {
         // Since this partition isn't mountable, we're going to mark it's used size as it's standard size
         mMnt->used = mMnt->sze;
-        return;
+        return 0;
     }
 
+    sprintf(path, "/%s", mMnt->mnt);
     mounted = phx_isMounted(*mMnt);
-    if (!mounted)
+    if (!mounted && mount(mMnt->blk, path, mMnt->fst, 0, NULL) != 0)
     {
-        // If we fail, just move on
-        if (phx_mount(*mMnt))
-            return;
+        *what = mMnt->blk;
+        return -1;
     }
-    
-    sprintf(path, "/%s/.", mMnt->mnt);
+
+    strcat(path, "/.");
     if (statfs(path, &st) != 0)
     {
-        LOGE("Unable to stat '%s'\n", path);
-        return;
+        *what = mMnt->mnt;
+        ret = -1;
     }
+    else
+        mMnt->used = ((st.f_blocks - st.f_bfree) * st.f_bsize);
 
-    mMnt->used = ((st.f_blocks - st.f_bfree) * st.f_bsize);
+    if (!mounted)
+    {
+        path[strlen(path) - 2] = '\0';
+        umount(path);
+    }
+    return ret;
+}
 
-    if (!mounted)   phx_unmount(*mMnt);
-    return;
+// Each probe runs on its own thread. Partitions that can share a mount
+// point or a device (the sdcards and android_secure on them) go through
+// the same probe, in order.
+#define USED_PROBES     10
+
+struct used_probe {
+    struct dInfo* mnt[3];
+    const char* failed[3];
+    pthread_t thread;
+};
+
+static void* probeThread(void* cookie)
+{
+    struct used_probe* probe = (struct used_probe*) cookie;
+    int i;
+
+    for (i = 0; i < 3 && probe->mnt[i]; i++)
+    {
+        if (probeMntUsedSize(probe->mnt[i], &probe->failed[i]) != 0 && probe->failed[i] == NULL)
+            probe->failed[i] = probe->mnt[i]->mnt;
+    }
+    return NULL;
+}
+
+// The sizes stay good until the mount table changes or something writes
+// to a partition; see invalidateUsedSizes
+static int usedSizesValid = 0;
+static unsigned int usedSizesGeneration;
+
+void invalidateUsedSizes()
+{
+    usedSizesValid = 0;
 }
 
 void updateUsedSized()
 {
-    updateMntUsedSize(&boo);
-    updateMntUsedSize(&sys);
-    updateMntUsedSize(&dat);
-    updateMntUsedSize(&cac);
-    updateMntUsedSize(&rec);
-    updateMntUsedSize(&sdcext);
-    updateMntUsedSize(&sdcint);
-    updateMntUsedSize(&sde);
-	updateMntUsedSize(&ase);
-    updateMntUsedSize(&sp1);
-    updateMntUsedSize(&sp2);
-    updateMntUsedSize(&sp3);
+    struct used_probe probes[USED_PROBES] = {
+        { { &boo } }, { { &sys } }, { { &dat } }, { { &cac } }, { { &rec } },
+        { { &sdcext, &sdcint, &ase } },
+        { { &sde } }, { { &sp1 } }, { { &sp2 } }, { { &sp3 } },
+    };
+    int i, j, started[USED_PROBES];
+
+    if (usedSizesValid && mounted_volumes_generation() == usedSizesGeneration)
+        return;
+
+    for (i = 0; i < USED_PROBES; i++)
+    {
+        started[i] = (pthread_create(&probes[i].thread, NULL, probeThread, &probes[i]) == 0);
+        if (!started[i])
+            probeThread(&probes[i]);
+    }
+    for (i = 0; i < USED_PROBES; i++)
+    {
+        if (started[i])
+            pthread_join(probes[i].thread, NULL);
+        for (j = 0; j < 3 && probes[i].mnt[j]; j++)
+        {
+            if (probes[i].failed[j])
+                LOGE("Unable to get the used size of %s\n", probes[i].failed[j]);
+        }
+    }
+
+    // Our own mounts and unmounts above don't count as changes
+    usedSizesGeneration = mounted_volumes_generation();
+    usedSizesValid = 1;
 
     dumpPartitionTable();
     return;
@@ -392,7 +452,288 @@ void listMntInfo(struct dInfo* mMnt, char* variable_name)
 };
 	
 
-int getLocations()
+// The partition table only changes when the partition layout, the
+// recovery.fstab or recovery itself does, so what getLocations finds is
+// kept on /cache along with a fingerprint of all of those. The table is
+// saved as it was before blkid; the filesystem types blkid finds are kept
+// next to it, each with a stamp of its device, and blkid only runs again
+// for devices whose stamp changed.
+#define LOCATIONS_CACHE         "/cache/recovery/partitions.cache"
+#define LOCATIONS_CACHE_MAGIC   0x70746333      // "ptc3"
+#define LOCATIONS_CACHE_COUNT   13
+
+// What a device looked like when its filesystem type was last found
+struct fst_stamp {
+    uint64_t size;
+    uint64_t rdev;
+    uint32_t super;                 // ext superblock mount time, or a hash of the boot sector
+    char fst[sizeof(((struct dInfo*) 0)->fst)];
+};
+
+struct locations_cache {
+    uint32_t magic;
+    uint32_t size;                  // of this struct, catches dInfo changes
+    uint64_t fingerprint;
+    int isMTDdevice;
+    int isEMMCdevice;
+    struct dInfo info[LOCATIONS_CACHE_COUNT];
+    struct fst_stamp stamps[LOCATIONS_CACHE_COUNT];
+};
+
+static struct dInfo* const cachedLocations[LOCATIONS_CACHE_COUNT] = {
+    &tmp, &sys, &dat, &boo, &rec, &cac, &sdcext, &sdcint, &ase, &sde, &sp1, &sp2, &sp3,
+};
+
+// As loaded, or as discovered and waiting for its stamps to be saved
+static struct locations_cache* locationsCache;
+static pthread_t locationsWriter;
+static int locationsWriterStarted = 0;
+
+// FNV-1a, used for the fingerprint and the stamps
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) data;
+
+    while (len--)
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+    return hash;
+}
+
+// A missing file counts too
+static uint64_t hashFile(uint64_t hash, const char* path)
+{
+    char buf[1024];
+    ssize_t len;
+    int fd = open(path, O_RDONLY);
+
+    hash = (hash ^ (fd < 0)) * 0x100000001b3ULL;
+    if (fd < 0)
+        return hash;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        hash = hashBytes(hash, buf, len);
+    close(fd);
+    return hash;
+}
+
+static uint64_t locationsFingerprint()
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = hashBytes(hash, RECOVERY_BUILD_ID, strlen(RECOVERY_BUILD_ID));
+    hash = hashFile(hash, "/proc/mtd");
+    hash = hashFile(hash, "/proc/emmc");
+    hash = hashFile(hash, "/proc/partitions");
+    hash = hashFile(hash, "/etc/recovery.fstab");
+    return hash;
+}
+
+static int loadLocationsCache(uint64_t fingerprint)
+{
+    struct locations_cache* cache;
+    int fd, i, len;
+
+    if (ensure_path_mounted(LOCATIONS_CACHE) != 0)
+        return -1;
+
+    fd = open(LOCATIONS_CACHE, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    cache = malloc(sizeof(*cache));
+    len = cache ? read(fd, cache, sizeof(*cache)) : -1;
+    close(fd);
+
+    if (len != (int) sizeof(*cache) || cache->magic != LOCATIONS_CACHE_MAGIC ||
+        cache->size != sizeof(*cache) || cache->fingerprint != fingerprint)
+    {
+        free(cache);
+        return -1;
+    }
+
+    for (i = 0; i < LOCATIONS_CACHE_COUNT; i++)
+        *cachedLocations[i] = cache->info[i];
+    isMTDdevice = cache->isMTDdevice;
+    isEMMCdevice = cache->isEMMCdevice;
+    locationsCache = cache;
+    return 0;
+}
+
+// Snapshots the table as it is now, before blkid, for saveLocationsCache
+static void snapshotLocations(uint64_t fingerprint)
+{
+    struct locations_cache* cache;
+    int i;
+
+    free(locationsCache);
+    locationsCache = cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return;
+
+    cache->magic = LOCATIONS_CACHE_MAGIC;
+    cache->size = sizeof(*cache);
+    cache->fingerprint = fingerprint;
+    cache->isMTDdevice = isMTDdevice;
+    cache->isEMMCdevice = isEMMCdevice;
+    for (i = 0; i < LOCATIONS_CACHE_COUNT; i++)
+        cache->info[i] = *cachedLocations[i];
+}
+
+static void* writeLocationsCache(void* cookie)
+{
+    struct locations_cache* cache = (struct locations_cache*) cookie;
+    const char* tmpPath = LOCATIONS_CACHE ".tmp";
+    int fd, ok;
+
+    mkdir("/cache/recovery", 0770);
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ok = (fd >= 0 && write(fd, cache, sizeof(*cache)) == (ssize_t) sizeof(*cache) && fsync(fd) == 0);
+    if (fd >= 0 && close(fd) != 0)
+        ok = 0;
+    if (!ok || rename(tmpPath, LOCATIONS_CACHE) != 0)
+        unlink(tmpPath);
+
+    free(cache);
+    return NULL;
+}
+
+// Writes the cache out on a thread, which then owns it; publishLocations
+// waits for it so nothing unmounts /cache underneath it. The mount is done
+// here, the mount table code isn't thread safe.
+static void saveLocationsCache()
+{
+    struct locations_cache* cache = locationsCache;
+
+    locationsCache = NULL;
+    if (!cache || ensure_path_mounted(LOCATIONS_CACHE) != 0)
+    {
+        free(cache);
+        return;
+    }
+    locationsWriterStarted = (pthread_create(&locationsWriter, NULL, writeLocationsCache, cache) == 0);
+    if (!locationsWriterStarted)
+        writeLocationsCache(cache);
+}
+
+// Size, dev_t and the superblock's last mount time, which changes
+// whenever anything (a format, another recovery, Android) has mounted or
+// made a filesystem there. Without an ext superblock, the boot sector
+// stands in for it.
+static int stampDevice(const char* blk, struct fst_stamp* stamp)
+{
+    unsigned char sb[2048];
+    struct stat st;
+    int fd;
+
+    memset(stamp, 0, sizeof(*stamp));
+    if (stat(blk, &st) != 0 || !S_ISBLK(st.st_mode))
+        return -1;
+    fd = open(blk, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    stamp->size = lseek64(fd, 0, SEEK_END);
+    if (pread(fd, sb, sizeof(sb), 0) != (ssize_t) sizeof(sb))
+        memset(sb, 0, sizeof(sb));
+    close(fd);
+
+    stamp->rdev = st.st_rdev;
+    if (sb[1024 + 56] == 0x53 && sb[1024 + 57] == 0xef)
+        stamp->super = sb[1024 + 44] | (sb[1024 + 45] << 8) | (sb[1024 + 46] << 16) | ((uint32_t) sb[1024 + 47] << 24);
+    else
+        stamp->super = (uint32_t) hashBytes(0xcbf29ce484222325ULL, sb, 512);
+    return 0;
+}
+
+// The kernel already knows what a mounted filesystem is, and our own
+// mount of /cache moves its superblock time on every start
+static int mountedFst(dev_t rdev, char* fst, size_t len)
+{
+    char line[512], dev[256], type[64];
+    struct stat st;
+    int found = -1;
+    FILE* fp = fopen("/proc/mounts", "r");
+
+    if (!fp)
+        return -1;
+    while (found != 0 && fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, "%255s %*s %63s", dev, type) == 2 &&
+            stat(dev, &st) == 0 && S_ISBLK(st.st_mode) && st.st_rdev == rdev &&
+            strlen(type) < len)
+        {
+            strcpy(fst, type);
+            found = 0;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void runBlkid(const char* devices);
+
+// Fills in the filesystem types, from the cache where the device is
+// unchanged and from blkid for the rest. Returns 1 if the cache needs
+// saving.
+static int updateFst()
+{
+    char devices[LOCATIONS_CACHE_COUNT * (sizeof(sys.blk) + 1) + 1];
+    int stale[LOCATIONS_CACHE_COUNT];
+    struct locations_cache* cache = locationsCache;
+    int i, dirty = 0, blkid = 0;
+
+    // blkid has a tendency to hang on MTD devices, so they keep what
+    // the fstab says
+    if (isMTDdevice)
+        return 0;
+
+    devices[0] = '\0';
+    for (i = 0; i < LOCATIONS_CACHE_COUNT; i++)
+    {
+        struct dInfo* mnt = cachedLocations[i];
+        struct fst_stamp now;
+
+        stale[i] = 0;
+        if (!*mnt->blk || stampDevice(mnt->blk, &now) != 0)
+            continue;
+        if (mountedFst(now.rdev, now.fst, sizeof(now.fst)) == 0)
+        {
+            // Its stamp is only worth updating if the type moved on
+            strcpy(mnt->fst, now.fst);
+            if (!cache || strcmp(cache->stamps[i].fst, now.fst) == 0)
+                continue;
+        }
+        else if (cache && cache->stamps[i].fst[0] &&
+                 memcmp(&now, &cache->stamps[i], offsetof(struct fst_stamp, fst)) == 0)
+        {
+            strcpy(mnt->fst, cache->stamps[i].fst);
+            continue;
+        }
+        else
+        {
+            stale[i] = 1;
+            blkid = 1;
+            strcat(devices, " ");
+            strcat(devices, mnt->blk);
+        }
+        if (cache)
+            cache->stamps[i] = now;
+        dirty = 1;
+    }
+
+    if (blkid)
+    {
+        LOGI("=> Running blkid on%s\n", devices);
+        runBlkid(devices);
+        for (i = 0; i < LOCATIONS_CACHE_COUNT; i++)
+        {
+            if (stale[i] && cache)
+                strcpy(cache->stamps[i].fst, cachedLocations[i]->fst);
+        }
+    }
+    return dirty;
+}
+
+// The slow part of getLocations: /proc, fdisk and the recovery.fstab
+static int discoverLocations(uint64_t fingerprint)
 {
     // This decides if a partition can be mounted and appears in the fstab
     sys.mountable = 1;
@@ -409,10 +750,10 @@ int getLocations()
     sp3.mountable = SP3_MOUNTABLE;
 
     // This decides how we backup/restore a block
-    sys.backup = files;
-    dat.backup = files;
-    cac.backup = files;
-    sde.backup = files;
+    sys.backup = SYSTEM_BACKUP_METHOD;
+    dat.backup = DATA_BACKUP_METHOD;
+    cac.backup = CACHE_BACKUP_METHOD;
+    sde.backup = SDEXT_BACKUP_METHOD;
     boo.backup = image;
     rec.backup = image;
     sdcext.backup = none;
@@ -450,13 +791,48 @@ int getLocations()
     }
 
     get_device_id();
+    snapshotLocations(fingerprint);
+    return 0;
+}
+
+int getLocations()
+{
+    uint64_t fingerprint = locationsFingerprint();
+    int save = 0;
+
+    if (loadLocationsCache(fingerprint) == 0)
+    {
+        LOGI("=> Using the cached partition table.\n");
+        get_device_id();
+    }
+    else if (discoverLocations(fingerprint) != 0)
+        return -1;
+    else
+        save = 1;
 
 	LOGI("=> Let's update filesystem types.\n");
-	verifyFst(); // use blkid to REALLY REALLY determine partition filesystem type
+    if (updateFst())
+        save = 1;
+    if (save)
+        saveLocationsCache();
+    free(locationsCache);
+    locationsCache = NULL;
 	LOGI("=> And update our fstab also.\n");
 	createFstab(); // used for our busybox mount command
     LOGI("=> Update the usage statistics.\n\n");
     updateUsedSized();  // Retrieves the used space of all partitions
+    return 0;
+}
+
+// Kept out of getLocations so that can run while the gui is still loading
+// its theme; the data manager isn't thread safe.
+void publishLocations()
+{
+    if (locationsWriterStarted)
+    {
+        pthread_join(locationsWriter, NULL);
+        locationsWriterStarted = 0;
+    }
 
     // Now, let's update the data manager...
     DataManager_SetIntValue("_boot_is_mountable", boo.mountable ? 1 : 0);
@@ -482,7 +858,6 @@ int getLocations()
     listMntInfo(&sp1, "special 1");
     listMntInfo(&sp2, "special 2");
     listMntInfo(&sp3, "special 3");
-    return 0;
 }
 
 static void createFstabEntry(FILE* fp, struct dInfo* mnt)
@@ -534,9 +909,12 @@ void createFstab()
 	fclose(fp);
 }
 
-void verifyFst()
+// use blkid to REALLY REALLY determine partition filesystem type; devices
+// is a list to limit it to, or empty for all of them
+static void runBlkid(const char* devices)
 {
 	FILE *fp;
+	char cmd[sizeof("blkid") + LOCATIONS_CACHE_COUNT * (sizeof(sys.blk) + 1)];
 	char blkOutput[100];
 	char* blk;
     char* arg;
@@ -546,7 +924,9 @@ void verifyFst()
     // This has a tendency to hang on MTD devices.
     if (isMTDdevice)    return;
 
-	fp = __popen("blkid","r");
+	snprintf(cmd, sizeof(cmd), "blkid%s", devices);
+	fp = __popen(cmd,"r");
+    if (fp == NULL)     return;
 	while (fgets(blkOutput,sizeof(blkOutput),fp) != NULL)
     {
         blk = blkOutput;
@@ -593,12 +973,17 @@ void verifyFst()
             continue;
 
         dat = findDeviceByBlockDevice(blk);
-        if (dat)
-			strcpy(sys.fst,arg);
+        if (dat && strlen(arg) < sizeof(dat->fst))
+			strcpy(dat->fst,arg);
 	}
 	__pclose(fp);
 }
 
+void verifyFst()
+{
+    runBlkid("");
+}
+
 char backupToChar(enum backup_method method)
 {
     switch (method)
@@ -13,6 +13,7 @@ enum backup_method {
     none, 
     image, 
     files,
+    blocks,     // ext2/3/4 in use blocks only, as a sparse image
 };
 
 enum flash_memory_type {
@@ -42,7 +43,9 @@ void verifyFst();
 void createFstab();
 void listMntInfo(struct dInfo* mMnt, char* variable_name);
 int getLocations();
+void publishLocations();
 void updateUsedSized();
+void invalidateUsedSizes();
 
 extern struct dInfo tmp, sys, dat, datadata, boo, rec, cac, sdcext, sdcint, ase, sde, sp1, sp2, sp3;
 extern char device_name[20];
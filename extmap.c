@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "extmap.h"
+
+#define EXT_SUPERBLOCK_OFFSET   1024
+#define EXT_SUPERBLOCK_SIZE     1024
+#define EXT_SUPER_MAGIC         0xEF53
+
+#define EXT_COMPAT_SPARSE_SUPER2    0x0200
+#define EXT_INCOMPAT_JOURNAL_DEV    0x0008
+#define EXT_INCOMPAT_META_BG        0x0010
+#define EXT_INCOMPAT_64BIT          0x0080
+#define EXT_RO_COMPAT_SPARSE_SUPER  0x0001
+#define EXT_RO_COMPAT_BIGALLOC      0x0200
+
+#define EXT_BG_BLOCK_UNINIT     0x0002
+
+struct ext_fs {
+    unsigned block_size;
+    unsigned desc_size;
+    unsigned long long blocks;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    uint32_t inode_table_blocks;
+    uint32_t groups;
+    uint32_t gdt_blocks;
+    uint32_t reserved_gdt;
+    uint32_t first_meta_bg;
+    uint32_t backup_bgs[2];
+    uint32_t compat, incompat, ro_compat;
+};
+
+static uint32_t get_le16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// lseek64 rather than pread, off_t is only 32 bits on the device
+static int read_block(int fd, const struct ext_fs* fs, unsigned long long block, unsigned char* buf)
+{
+    loff_t offset = (loff_t) block * fs->block_size;
+
+    if (block >= fs->blocks || lseek64(fd, offset, SEEK_SET) != offset ||
+        read(fd, buf, fs->block_size) != (ssize_t) fs->block_size)
+    {
+        LOGE("Unable to read block %llu of the filesystem\n", block);
+        return -1;
+    }
+    return 0;
+}
+
+static int is_power_of(uint32_t n, uint32_t base)
+{
+    while (n > 1 && n % base == 0)
+        n /= base;
+    return n == 1;
+}
+
+// Whether group 'g' carries a superblock backup
+static int has_super(const struct ext_fs* fs, uint32_t g)
+{
+    if (g == 0)
+        return 1;
+    if (fs->compat & EXT_COMPAT_SPARSE_SUPER2)
+        return g == fs->backup_bgs[0] || g == fs->backup_bgs[1];
+    if (g == 1 || !(fs->ro_compat & EXT_RO_COMPAT_SPARSE_SUPER))
+        return 1;
+    return (g & 1) && (is_power_of(g, 3) || is_power_of(g, 5) || is_power_of(g, 7));
+}
+
+static unsigned long long group_start(const struct ext_fs* fs, uint32_t g)
+{
+    return fs->first_data_block + (unsigned long long) g * fs->blocks_per_group;
+}
+
+// Superblock and descriptor blocks at the start of group 'g', counted the
+// way the kernel does when it builds an uninitialized bitmap
+static uint32_t group_meta_blocks(const struct ext_fs* fs, uint32_t g)
+{
+    uint32_t per_block = fs->block_size / fs->desc_size;
+    uint32_t n = has_super(fs, g) ? 1 : 0;
+
+    if (!(fs->incompat & EXT_INCOMPAT_META_BG) || g / per_block < fs->first_meta_bg)
+    {
+        if (n)
+            n += fs->gdt_blocks + fs->reserved_gdt;
+    }
+    else
+    {
+        uint32_t index = g % per_block;
+        if (index == 0 || index == 1 || index == per_block - 1)
+            n++;
+    }
+    return n;
+}
+
+// Where descriptor block 'i' lives; meta_bg keeps the later ones at the
+// start of their own meta group
+static unsigned long long desc_block(const struct ext_fs* fs, uint32_t i)
+{
+    if (!(fs->incompat & EXT_INCOMPAT_META_BG) || i < fs->first_meta_bg)
+        return fs->first_data_block + 1 + i;
+
+    uint32_t g = i * (fs->block_size / fs->desc_size);
+    return group_start(fs, g) + has_super(fs, g);
+}
+
+static void mark_range(struct ext_map* map, unsigned long long block, unsigned long long count)
+{
+    while (count > 0 && block < map->blocks)
+    {
+        map->bitmap[block >> 3] |= 1 << (block & 7);
+        block++;
+        count--;
+    }
+}
+
+static int read_super(int fd, struct ext_fs* fs)
+{
+    unsigned char sb[EXT_SUPERBLOCK_SIZE];
+    uint32_t log_block_size, inodes_per_group, inode_size;
+
+    if (lseek64(fd, EXT_SUPERBLOCK_OFFSET, SEEK_SET) != EXT_SUPERBLOCK_OFFSET ||
+        read(fd, sb, sizeof(sb)) != sizeof(sb) || get_le16(sb + 56) != EXT_SUPER_MAGIC)
+    {
+        LOGE("No ext2/3/4 filesystem found\n");
+        return -1;
+    }
+
+    memset(fs, 0, sizeof(*fs));
+    log_block_size = get_le32(sb + 24);
+    fs->first_data_block = get_le32(sb + 20);
+    fs->blocks_per_group = get_le32(sb + 32);
+    inodes_per_group = get_le32(sb + 40);
+    fs->compat = get_le32(sb + 92);
+    fs->incompat = get_le32(sb + 96);
+    fs->ro_compat = get_le32(sb + 100);
+    inode_size = get_le32(sb + 76) == 0 ? 128 : get_le16(sb + 88);
+    fs->reserved_gdt = get_le16(sb + 206);
+    fs->first_meta_bg = get_le32(sb + 260);
+    fs->backup_bgs[0] = get_le32(sb + 588);
+    fs->backup_bgs[1] = get_le32(sb + 592);
+
+    fs->blocks = get_le32(sb + 4);
+    fs->desc_size = 32;
+    if (fs->incompat & EXT_INCOMPAT_64BIT)
+    {
+        fs->blocks |= (unsigned long long) get_le32(sb + 336) << 32;
+        fs->desc_size = get_le16(sb + 254);
+    }
+
+    if (fs->incompat & EXT_INCOMPAT_JOURNAL_DEV)
+    {
+        LOGE("External journal devices can't be mapped\n");
+        return -1;
+    }
+    if (fs->ro_compat & EXT_RO_COMPAT_BIGALLOC)
+    {
+        LOGE("Filesystems with bigalloc can't be mapped\n");
+        return -1;
+    }
+    if (log_block_size > 6 || fs->desc_size < 32 || fs->desc_size & (fs->desc_size - 1) || inode_size == 0)
+    {
+        LOGE("Bad ext2/3/4 superblock\n");
+        return -1;
+    }
+    fs->block_size = 1024 << log_block_size;
+    if (fs->desc_size > fs->block_size || fs->blocks_per_group == 0 || fs->blocks_per_group > fs->block_size * 8 ||
+        fs->blocks_per_group % 8 || fs->blocks <= fs->first_data_block)
+    {
+        LOGE("Bad ext2/3/4 superblock\n");
+        return -1;
+    }
+
+    fs->groups = (fs->blocks - fs->first_data_block + fs->blocks_per_group - 1) / fs->blocks_per_group;
+    fs->gdt_blocks = ((unsigned long long) fs->groups * fs->desc_size + fs->block_size - 1) / fs->block_size;
+    fs->inode_table_blocks = ((unsigned long long) inodes_per_group * inode_size + fs->block_size - 1) / fs->block_size;
+    return 0;
+}
+
+struct ext_map* ext_map_read(int fd)
+{
+    struct ext_fs fs;
+    struct ext_map* map;
+    unsigned char* desc = NULL;
+    unsigned char* bitmap = NULL;
+    unsigned long long i;
+    uint32_t g;
+
+    if (read_super(fd, &fs))
+        return NULL;
+
+    map = (struct ext_map*) calloc(1, sizeof(struct ext_map));
+    if (map == NULL)
+        return NULL;
+    map->block_size = fs.block_size;
+    map->blocks = fs.blocks;
+    map->bitmap = (unsigned char*) calloc((fs.blocks + 7) / 8, 1);
+    desc = (unsigned char*) malloc(fs.block_size);
+    bitmap = (unsigned char*) malloc(fs.block_size);
+    if (map->bitmap == NULL || desc == NULL || bitmap == NULL)
+        goto fail;
+
+    // The boot block in front of the first group
+    mark_range(map, 0, fs.first_data_block);
+
+    for (g = 0; g < fs.groups; g++)
+    {
+        uint32_t per_block = fs.block_size / fs.desc_size;
+        unsigned long long start = group_start(&fs, g);
+        unsigned long long count = fs.blocks - start;
+        unsigned long long block_bitmap, inode_bitmap, inode_table;
+        const unsigned char* d;
+
+        if (count > fs.blocks_per_group)
+            count = fs.blocks_per_group;
+
+        if (g % per_block == 0 && read_block(fd, &fs, desc_block(&fs, g / per_block), desc))
+            goto fail;
+        d = desc + (g % per_block) * fs.desc_size;
+
+        block_bitmap = get_le32(d);
+        inode_bitmap = get_le32(d + 4);
+        inode_table = get_le32(d + 8);
+        if (fs.desc_size >= 64)
+        {
+            block_bitmap |= (unsigned long long) get_le32(d + 32) << 32;
+            inode_bitmap |= (unsigned long long) get_le32(d + 36) << 32;
+            inode_table |= (unsigned long long) get_le32(d + 40) << 32;
+        }
+
+        if (get_le16(d + 18) & EXT_BG_BLOCK_UNINIT)
+        {
+            mark_range(map, start, group_meta_blocks(&fs, g));
+        }
+        else
+        {
+            if (read_block(fd, &fs, block_bitmap, bitmap))
+                goto fail;
+            if (start % 8 == 0)
+            {
+                for (i = 0; i < (count + 7) / 8; i++)
+                    map->bitmap[start / 8 + i] |= bitmap[i];
+            }
+            else
+            {
+                for (i = 0; i < count; i++)
+                {
+                    if (bitmap[i >> 3] & (1 << (i & 7)))
+                        mark_range(map, start + i, 1);
+                }
+            }
+        }
+
+        // Wherever flex_bg placed them, these are always in use
+        mark_range(map, block_bitmap, 1);
+        mark_range(map, inode_bitmap, 1);
+        mark_range(map, inode_table, fs.inode_table_blocks);
+    }
+
+    // The last group's bitmap pads the blocks past the end as used
+    if (fs.blocks % 8)
+        map->bitmap[fs.blocks / 8] &= (1 << (fs.blocks % 8)) - 1;
+
+    for (i = 0; i < (fs.blocks + 7) / 8; i++)
+        map->used += __builtin_popcount(map->bitmap[i]);
+
+    free(desc);
+    free(bitmap);
+    return map;
+
+fail:
+    free(desc);
+    free(bitmap);
+    ext_map_free(map);
+    return NULL;
+}
+
+void ext_map_free(struct ext_map* map)
+{
+    if (map == NULL)
+        return;
+    free(map->bitmap);
+    free(map);
+}
+
+unsigned long long ext_map_run(const struct ext_map* map, unsigned long long block, unsigned long long max)
+{
+    unsigned long long end = block + max;
+    unsigned long long pos = block;
+    unsigned char whole;
+    int used;
+
+    if (end > map->blocks)
+        end = map->blocks;
+    if (block >= end)
+        return 0;
+
+    used = ext_map_used(map, block);
+    whole = used ? 0xff : 0x00;
+    while (pos < end)
+    {
+        // Skip whole bytes while they match
+        if (pos % 8 == 0 && pos + 8 <= end && map->bitmap[pos / 8] == whole)
+        {
+            pos += 8;
+            continue;
+        }
+        if (ext_map_used(map, pos) != used)
+            break;
+        pos++;
+    }
+    return pos - block;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _EXTMAP_HEADER
+#define _EXTMAP_HEADER
+
+// Allocation map of an ext2/3/4 filesystem, read from its block bitmaps.
+// Groups whose bitmap was never initialized (BLOCK_UNINIT) get their
+// metadata marked the way the kernel would; every group's bitmaps and
+// inode table are marked regardless of where flex_bg put them. Whatever
+// isn't marked holds no data and can be left out of an image.
+
+struct ext_map {
+    unsigned block_size;
+    unsigned long long blocks;      // in the filesystem
+    unsigned long long used;        // blocks marked in 'bitmap'
+    unsigned char* bitmap;          // one bit per block, set if in use
+};
+
+// Returns NULL if fd doesn't hold a filesystem we can map
+struct ext_map* ext_map_read(int fd);
+void ext_map_free(struct ext_map* map);
+
+static inline int ext_map_used(const struct ext_map* map, unsigned long long block)
+{
+    return (map->bitmap[block >> 3] >> (block & 7)) & 1;
+}
+
+// Length of the run of blocks starting at 'block' that are all in use, or
+// all free, as 'block' is; stops at 'max' blocks
+unsigned long long ext_map_run(const struct ext_map* map, unsigned long long block, unsigned long long max);
+
+#endif  // _EXTMAP_HEADER
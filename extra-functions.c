@@ -378,16 +378,46 @@ int usb_storage_disable(void)
     return 0;
 }
 
+struct remove_progress {
+    unsigned long long reported;
+};
+
+static void phx_remove_progress(unsigned long long files, unsigned long long bytes, void* cookie)
+{
+    struct remove_progress* rp = (struct remove_progress*) cookie;
+
+    // Called a few times a second on our own thread, so only when it moved
+    if (files == rp->reported)
+        return;
+    rp->reported = files;
+    DataManager_SetIntValue(VAR_WIPE_FILES_VAR, (int) files);
+    DataManager_SetIntValue(VAR_WIPE_MB_VAR, (int) (bytes >> 20));
+}
+
+int phx_remove_tree(const char* path, int keep_root)
+{
+    struct remove_progress rp = { 0 };
+    int ret;
+
+    DataManager_SetIntValue(VAR_WIPE_FILES_VAR, 0);
+    DataManager_SetIntValue(VAR_WIPE_MB_VAR, 0);
+    invalidateUsedSizes();
+    ret = dirUnlinkHierarchyEx(path, 0, keep_root, phx_remove_progress, &rp);
+    if (ret != 0 && errno != ENOENT)
+        LOGW("Unable to remove all of %s (%s)\n", path, strerror(errno));
+    return (ret == 0 || errno == ENOENT) ? 0 : -1;
+}
+
 void wipe_dalvik_cache()
 {
         ensure_path_mounted("/data");
         ensure_path_mounted("/cache");
         ui_print("\n-- Wiping Dalvik Cache Directories...\n");
-        __system("rm -rf /data/dalvik-cache");
+        phx_remove_tree("/data/dalvik-cache", 0);
         ui_print("Cleaned: /data/dalvik-cache...\n");
-        __system("rm -rf /cache/dalvik-cache");
+        phx_remove_tree("/cache/dalvik-cache", 0);
         ui_print("Cleaned: /cache/dalvik-cache...\n");
-        __system("rm -rf /cache/dc");
+        phx_remove_tree("/cache/dc", 0);
         ui_print("Cleaned: /cache/dc\n");
 
         struct stat st;
@@ -399,7 +429,7 @@ void wipe_dalvik_cache()
     	    LOGI("Mounting /sd-ext\n");
     	    if (stat("/sd-ext/dalvik-cache",&st) == 0)
     	    {
-                __system("rm -rf /sd-ext/dalvik-cache");
+                phx_remove_tree("/sd-ext/dalvik-cache", 0);
         	    ui_print("Cleaned: /sd-ext/dalvik-cache...\n");
     	    }
         }
@@ -426,8 +456,21 @@ void wipe_battery_stats()
 void wipe_rotate_data()
 {
     ensure_path_mounted("/data");
-    __system("rm -r /data/misc/akmd*");
-    __system("rm -r /data/misc/rild*");
+
+    // rm -r /data/misc/akmd* /data/misc/rild*
+    DIR* d = opendir("/data/misc");
+    struct dirent* de;
+    while (d && (de = readdir(d)) != NULL)
+    {
+        char path[PATH_MAX];
+
+        if (strncmp(de->d_name, "akmd", 4) != 0 && strncmp(de->d_name, "rild", 4) != 0)
+            continue;
+        snprintf(path, sizeof(path), "/data/misc/%s", de->d_name);
+        phx_remove_tree(path, 0);
+    }
+    if (d)
+        closedir(d);
     ui_print("Cleared: Rotatation Data...\n");
     ensure_path_unmounted("/data");
 }   
@@ -2,6 +2,10 @@ int __system(const char *command);
 FILE * __popen(const char *program, const char *type);
 int __pclose(FILE *iop);
 
+// rm -rf on the minzip removal workers, with progress in VAR_WIPE_FILES_VAR
+// and VAR_WIPE_MB_VAR. keep_root only empties 'path'. A missing path is fine.
+int phx_remove_tree(const char* path, int keep_root);
+
 // Device ID variable / function
 char device_id[64];
 void get_device_id();
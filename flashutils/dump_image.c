@@ -140,8 +140,11 @@ return dump_image(argv[1], argv[2], NULL);
 
 int main(int argc, char **argv)
 {
+    if (argc == 4 && !strcmp(argv[1], "-s")) {
+        return backup_raw_partition_sparse(NULL, argv[2], argv[3]);
+    }
     if (argc != 3) {
-        fprintf(stderr, "usage: %s partition file.img\n", argv[0]);
+        fprintf(stderr, "usage: %s [-s] partition file.img\n", argv[0]);
         return 2;
     }
 
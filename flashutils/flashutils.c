@@ -95,6 +95,23 @@ int backup_raw_partition(const char* partitionType, const char *partition, const
     }
 }
 
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename)
+{
+    int type = detect_partition(partitionType, partition);
+    switch (type) {
+        case MTD:
+            return cmd_mtd_backup_raw_partition_sparse(partition, filename);
+        case MMC:
+            return cmd_mmc_backup_raw_partition_sparse(partition, filename);
+        case BML:
+            printf("sparse images aren't supported on bml");
+            return -1;
+        default:
+            printf("unable to detect device type");
+            return -1;
+    }
+}
+
 int erase_raw_partition(const char* partitionType, const char *partition)
 {
     int type = detect_partition(partitionType, partition);
@@ -3,6 +3,7 @@
 
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename);
 int backup_raw_partition(const char* partitionType, const char *partition, const char *filename);
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename);
 int erase_raw_partition(const char* partitionType, const char *partition);
 int erase_partition(const char *partition, const char *filesystem);
 int mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
@@ -17,6 +18,7 @@ char* get_default_filesystem();
 
 extern int cmd_mtd_restore_raw_partition(const char *partition, const char *filename);
 extern int cmd_mtd_backup_raw_partition(const char *partition, const char *filename);
+extern int cmd_mtd_backup_raw_partition_sparse(const char *partition, const char *filename);
 extern int cmd_mtd_erase_raw_partition(const char *partition);
 extern int cmd_mtd_erase_partition(const char *partition, const char *filesystem);
 extern int cmd_mtd_mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
@@ -24,6 +26,7 @@ extern int cmd_mtd_get_partition_device(const char *partition, char *device);
 
 extern int cmd_mmc_restore_raw_partition(const char *partition, const char *filename);
 extern int cmd_mmc_backup_raw_partition(const char *partition, const char *filename);
+extern int cmd_mmc_backup_raw_partition_sparse(const char *partition, const char *filename);
 extern int cmd_mmc_erase_raw_partition(const char *partition);
 extern int cmd_mmc_erase_partition(const char *partition, const char *filesystem);
 extern int cmd_mmc_mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
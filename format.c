@@ -17,7 +17,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/fs.h>
 
 #include "format.h"
 #include "extra-functions.h"
@@ -33,6 +40,52 @@ static int file_exists(const char* file)
     return 0;
 }
 
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12,114,size_t)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
+
+// How the last format went, for the line phx_format prints
+static const char* format_strategy;
+
+// Tells the device the whole partition is free, so the filesystem tools
+// don't have to overwrite anything and the controller can drop its
+// mappings.  Only eMMC and other block devices support this; 0 if done.
+// If zeroes isn't NULL it's set when discarded blocks read back as zero.
+static int phx_discard(const char* device, int* zeroes)
+{
+    struct stat st;
+    uint64_t range[2];
+    unsigned int discard_zeroes = 0;
+    int fd, ret;
+
+    if (zeroes)
+        *zeroes = 0;
+
+    if (stat(device, &st) != 0 || !S_ISBLK(st.st_mode))
+        return -1;
+
+    fd = open(device, O_RDWR);
+    if (fd < 0)
+        return -1;
+
+    range[0] = 0;
+    ret = ioctl(fd, BLKGETSIZE64, &range[1]);
+    if (ret == 0)
+        ret = ioctl(fd, BLKDISCARD, range);
+    if (ret != 0)
+        LOGI("%s: can't discard \"%s\" (%s)\n", __FUNCTION__, device, strerror(errno));
+    else if (zeroes && ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) == 0)
+        *zeroes = (discard_zeroes == 1);
+    close(fd);
+    return ret;
+}
+
 static int phx_format_mtd(const char* device)
 {
     char* location = (char*) device;
@@ -45,6 +98,7 @@ static int phx_format_mtd(const char* device)
     }
 
     LOGI("%s: Formatting \"%s\"\n", __FUNCTION__, location);
+    format_strategy = "mtd erase";
 
     mtd_scan_partitions();
     const MtdPartition* mtd = mtd_find_partition_by_name(location);
@@ -72,8 +126,6 @@ static int phx_format_mtd(const char* device)
 
 static int phx_format_rmfr(const char* device)
 {
-    char cmd[256];
-
     Volume* v = volume_for_device(device);
     if (!v)
     {
@@ -87,8 +139,8 @@ static int phx_format_rmfr(const char* device)
         return -1;
     }
     
-    sprintf(cmd, "rm -rf %s/* && rm -rf %s/.*", v->mount_point, v->mount_point);
-    __system(cmd);
+    format_strategy = "rm -rf";
+    phx_remove_tree(v->mount_point, 1);
 
     if (ensure_path_unmounted(v->mount_point) != 0)
     {
@@ -113,6 +165,7 @@ static int phx_format_vfat(const char* device)
 
     if (file_exists("/sbin/mkdosfs"))
     {
+        format_strategy = phx_discard(device, NULL) == 0 ? "discard" : "no discard";
         sprintf(exe,"mkdosfs %s", device); // use mkdosfs to format it
         __system(exe);
     }
@@ -127,7 +180,27 @@ static int phx_format_ext23(const char* fstype, const char* device)
     if (file_exists("/sbin/mke2fs"))
     {
         char exe[512];
+        int zeroes;
+
+        // With the partition discarded, the kernel zeroes the inode tables
+        // lazily after mounting. Nothing does that for the journal, so it's
+        // only left alone when the device guarantees discarded blocks read
+        // back as zero. Older mke2fs builds don't know these options, so
+        // fall back.
+        if (phx_discard(device, &zeroes) == 0)
+        {
+            sprintf(exe, "mke2fs -t %s -m 0 -E lazy_itable_init=1,%snodiscard %s", fstype,
+                    zeroes ? "lazy_journal_init=1," : "", device);
+            LOGI("mke2fs command: %s\n", exe);
+            if (__system(exe) == 0)
+            {
+                format_strategy = zeroes ? "discard, discarded blocks read as zeroes"
+                                         : "discard, journal zeroed";
+                return 0;
+            }
+        }
 
+        format_strategy = "zero-fill, no discard";
         sprintf(exe, "mke2fs -t %s -m 0 %s", fstype, device);
         LOGI("mke2fs command: %s\n", exe);
         __system(exe);
@@ -146,6 +219,7 @@ static int phx_format_ext4(const char* device)
 int phx_format(const char *fstype, const char *fsblock)
 {
     int result = -1;
+    struct timeval start, end;
 
     LOGI("%s: Formatting \"%s\" as \"%s\"\n", __FUNCTION__, fsblock, fstype);
     Volume* v = volume_for_device(fsblock);
@@ -171,6 +245,9 @@ int phx_format(const char *fstype, const char *fsblock)
     }
 
     // Let's handle the different types
+    invalidateUsedSizes();
+    format_strategy = NULL;
+    gettimeofday(&start, NULL);
     if (strcmp(fstype, "yaffs2") == 0 && v && strcmp(v->mount_point, "/efs") == 0)
         result = phx_format_rmfr(fsblock);
 
@@ -186,6 +263,14 @@ int phx_format(const char *fstype, const char *fsblock)
     else if (memcmp(fstype, "ext", 3) == 0)
         result = phx_format_ext23(fstype, fsblock);
 
+    gettimeofday(&end, NULL);
+    if (format_strategy)
+    {
+        ui_print("%s %s (%s) in %ld ms.\n", result == 0 ? "Formatted" : "Failed to format",
+                 fsblock, format_strategy,
+                 (long) ((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000));
+    }
+
     // Now, let's make sure we've set the +x for the mount point
     if (result == 0 && v)
     {
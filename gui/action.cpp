@@ -33,6 +33,7 @@ void wipe_dalvik_cache(void);
 int nandroid_back_exe(void);
 void set_restore_files(void);
 int nandroid_rest_exe(void);
+int nandroid_rest_files_exe(void);
 void wipe_data(int confirm);
 void wipe_battery_stats(void);
 void wipe_rotate_data(void);
@@ -558,6 +559,8 @@ int GUIAction::doAction(Action action, int isThreaded /* = 0 */)
                 nandroid_back_exe();
             else if (arg == "restore")
                 nandroid_rest_exe();
+            else if (arg == "restorefiles")
+                nandroid_rest_files_exe();
             else
                 return -1;
 #endif
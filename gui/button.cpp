@@ -185,6 +185,16 @@ int GUIButton::SetRenderPos(int x, int y, int w, int h)
     return 0;
 }
 
+int GUIButton::GetDamage(int& x, int& y, int& w, int& h)
+{
+    int tx, ty, tw, th;
+
+    GetRenderPos(x, y, w, h);
+    if (mButtonLabel && mButtonLabel->GetDamage(tx, ty, tw, th) == 0)
+        UnionRect(x, y, w, h, tx, ty, tw, th);
+    return ((w > 0 && h > 0) ? 0 : -1);
+}
+
 int GUIButton::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
     if (!isConditionTrue())     return -1;
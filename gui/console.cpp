@@ -14,6 +14,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <string>
 
@@ -27,16 +28,17 @@ extern "C" {
 #include "objects.hpp"
 
 
+// Backups and restores print from their worker threads while the gui
+// thread renders, so every access to gConsole holds gConsoleLock
 static std::vector<std::string> gConsole;
+static pthread_mutex_t gConsoleLock = PTHREAD_MUTEX_INITIALIZER;
 
-extern "C" void gui_print(const char *fmt, ...)
+static void gui_push(char* buf, int overwrite)
 {
-    char buf[512];          // We're going to limit a single request to 512 bytes
+    pthread_mutex_lock(&gConsoleLock);
 
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(buf, 512, fmt, ap);
-    va_end(ap);
+    // Pop the last line, and we can continue
+    if (overwrite && !gConsole.empty())   gConsole.pop_back();
 
     char *start, *next;
     for (start = next = buf; *next != '\0'; next++)
@@ -52,15 +54,19 @@ extern "C" void gui_print(const char *fmt, ...)
 
             // Handle the normal \n\0 case
             if (*next == '\0')
-                return;
+                break;
         }
     }
-    std::string line = start;
-    gConsole.push_back(line);
-    return;
+    if (*start != '\0' || start == buf)
+    {
+        std::string line = start;
+        gConsole.push_back(line);
+    }
+    pthread_mutex_unlock(&gConsoleLock);
+    gui_wakeup();
 }
 
-extern "C" void gui_print_overwrite(const char *fmt, ...)
+extern "C" void gui_print(const char *fmt, ...)
 {
     char buf[512];          // We're going to limit a single request to 512 bytes
 
@@ -69,29 +75,19 @@ extern "C" void gui_print_overwrite(const char *fmt, ...)
     vsnprintf(buf, 512, fmt, ap);
     va_end(ap);
 
-    // Pop the last line, and we can continue
-    if (!gConsole.empty())   gConsole.pop_back();
+    gui_push(buf, 0);
+}
 
-    char *start, *next;
-    for (start = next = buf; *next != '\0'; next++)
-    {
-        if (*next == '\n')
-        {
-            *next = '\0';
-            next++;
-            
-            std::string line = start;
-            gConsole.push_back(line);
-            start = next;
+extern "C" void gui_print_overwrite(const char *fmt, ...)
+{
+    char buf[512];          // We're going to limit a single request to 512 bytes
 
-            // Handle the normal \n\0 case
-            if (*next == '\0')
-                return;
-        }
-    }
-    std::string line = start;
-    gConsole.push_back(line);
-    return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 512, fmt, ap);
+    va_end(ap);
+
+    gui_push(buf, 1);
 }
 
 GUIConsole::GUIConsole(xml_node<>* node)
@@ -200,8 +196,13 @@ int GUIConsole::RenderConsole(void)
     gr_color(mForegroundColor.red, mForegroundColor.green, mForegroundColor.blue, mForegroundColor.alpha);
 
     // Don't try to continue to render without data
+    pthread_mutex_lock(&gConsoleLock);
     mLastCount = gConsole.size();
-    if (mLastCount == 0)        return (mSlideout ? RenderSlideout() : 0);
+    if (mLastCount == 0)
+    {
+        pthread_mutex_unlock(&gConsoleLock);
+        return (mSlideout ? RenderSlideout() : 0);
+    }
 
     // Find the start point
     int start;
@@ -225,6 +226,7 @@ int GUIConsole::RenderConsole(void)
             gr_textEx(mConsoleX, mStartY + (line * mFontHeight), gConsole[start + line].c_str(), fontResource);
         }
     }
+    pthread_mutex_unlock(&gConsoleLock);
     return (mSlideout ? RenderSlideout() : 0);
 }
 
@@ -255,7 +257,11 @@ int GUIConsole::Update(void)
         return 2;
     }
 
-    if (mCurrentLine == -1 && mLastCount != gConsole.size())
+    pthread_mutex_lock(&gConsoleLock);
+    size_t count = gConsole.size();
+    pthread_mutex_unlock(&gConsoleLock);
+
+    if (mCurrentLine == -1 && mLastCount != count)
     {
         // We can use Render, and return for just a flip
         Render();
@@ -292,6 +298,14 @@ int GUIConsole::SetRenderPos(int x, int y, int w, int h)
     return 0;
 }
 
+int GUIConsole::GetDamage(int& x, int& y, int& w, int& h)
+{
+    x = mConsoleX;  y = mConsoleY;  w = mConsoleW;  h = mConsoleH;
+    if (mSlideout)
+        UnionRect(x, y, w, h, mSlideoutX, mSlideoutY, mSlideoutW, mSlideoutH);
+    return ((w > 0 && h > 0) ? 0 : -1);
+}
+
 // IsInRegion - Checks if the request is handled by this object
 //  Return 0 if this object handles the request, 1 if not
 int GUIConsole::IsInRegion(int x, int y)
@@ -468,7 +468,9 @@ int GUIFileSelector::GetFileList(const std::string folder)
 
         if (data.fileType == DT_DIR)
         {
-            if (mShowNavFolders || (data.fileName != "." && data.fileName != ".."))
+            // Without navigation, hidden folders (like the backups' .chunks
+            // store) aren't anything to pick either
+            if (mShowNavFolders || data.fileName[0] != '.')
                 mFolderList.push_back(data);
         }
         else if (data.fileType == DT_REG)
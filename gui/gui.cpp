@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -63,12 +64,21 @@ static int gGuiConsoleRunning = 0;
 static int gGuiConsoleTerminate = 0;
 static int gForceRender = 0;
 static int gNoAnimation = 1;
+static int gScriptLoaded = 0;
 
 // Needed by pages.cpp too
 int gGuiRunning = 0;
 
 static int gRecorder = -1;
 
+// Anything that can change the screen (input, variable changes, page
+// changes, console output) writes a byte here; the render loop sleeps on
+// the other end between frames.
+static int gWakePipe[2] = { -1, -1 };
+
+#define FRAME_MS    33      // at most 30 frames a second
+#define IDLE_MS     1000    // clock, battery and the like still tick
+
 extern "C" void gr_write_frame_to_file(int fd);
 
 void flip(void)
@@ -227,6 +237,7 @@ static void *input_thread(void *cookie)
 #endif
             PageManager::NotifyKey(ev.code);
         }
+        gui_wakeup();
     }
     return NULL;
 }
@@ -280,6 +291,57 @@ static void loopTimer(void)
     return;
 }
 
+void gui_wakeup(void)
+{
+    char c = 0;
+
+    // A full pipe already has a wakeup pending
+    if (gWakePipe[1] >= 0)
+        write(gWakePipe[1], &c, 1);
+}
+
+// Returns when there's something to draw: after a wakeup, or the next
+// frame when something is animating, or the idle tick. However often
+// it's woken, frames are kept at least FRAME_MS apart.
+static void waitForWork(bool animating)
+{
+    static timespec lastFrame;
+    static int initialized = 0;
+    timespec curTime;
+    long elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &curTime);
+    if (initialized)
+    {
+        timespec diff = timespec_diff(lastFrame, curTime);
+        elapsed = diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+        if (!diff.tv_sec && elapsed < FRAME_MS)
+        {
+            usleep((FRAME_MS - elapsed) * 1000);
+            elapsed = FRAME_MS;
+        }
+    }
+    else
+        elapsed = FRAME_MS;
+
+    // Without the pipe, this is back to polling every frame
+    if (gWakePipe[0] >= 0)
+    {
+        struct pollfd fds = { gWakePipe[0], POLLIN, 0 };
+        char buf[64];
+        int timeout = (animating ? 0 : IDLE_MS - (elapsed < IDLE_MS ? elapsed : IDLE_MS));
+
+        if (poll(&fds, 1, timeout) > 0)
+        {
+            while (read(gWakePipe[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+    initialized = 1;
+}
+
 static int runPages(void)
 {
     // Raise the curtain
@@ -299,7 +361,7 @@ static int runPages(void)
 
     for (;;)
     {
-        loopTimer();
+        waitForWork(PageManager::IsAnimating());
 
         if (!gForceRender)
         {
@@ -327,6 +389,7 @@ static int runPages(void)
 int gui_forceRender(void)
 {
     gForceRender = 1;
+    gui_wakeup();
     return 0;
 }
 
@@ -335,6 +398,7 @@ int gui_changePage(std::string newPage)
     LOGI("Set page: '%s'\n", newPage.c_str());
     PageManager::ChangePage(newPage);
     gForceRender = 1;
+    gui_wakeup();
     return 0;
 }
 
@@ -342,6 +406,7 @@ int gui_changeOverlay(std::string overlay)
 {
     PageManager::ChangeOverlay(overlay);
     gForceRender = 1;
+    gui_wakeup();
     return 0;
 }
 
@@ -349,6 +414,7 @@ int gui_changePackage(std::string newPackage)
 {
     PageManager::SelectPackage(newPackage);
     gForceRender = 1;
+    gui_wakeup();
     return 0;
 }
 
@@ -359,6 +425,14 @@ extern "C" int gui_init()
     gr_init();
     ev_init();
 
+    if (pipe(gWakePipe) == 0)
+    {
+        fcntl(gWakePipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(gWakePipe[1], F_SETFL, O_NONBLOCK);
+    }
+    else
+        gWakePipe[0] = gWakePipe[1] = -1;
+
     // We need to write out the curtain blob
     if (sizeof(gCurtainBlob) > 32)
     {
@@ -387,9 +461,11 @@ extern "C" int gui_init()
     return 0;
 }
 
-extern "C" int gui_loadResources()
+// Makes sure the sdcard the theme lives on is mounted. Kept apart from
+// gui_loadResources, which only reads, so that startup can mount on its
+// main thread and load the theme on another.
+extern "C" int gui_mountResources()
 {
-    // Make sure the sdcard is mounted before we continue
 #ifdef RECOVERY_SDCARD_ON_DATA
     mkdir("/mnt/data-sdc", 0777);
     mount(dat.blk, "/mnt/data-sdc", dat.fst, 0, NULL);
@@ -398,17 +474,34 @@ extern "C" int gui_loadResources()
         LOGE("Unable to symlink (errno %d)\n", errno);
     }
 #else
-    if (ensure_path_mounted("/sdcard") < 0)
+    // A card that's slow to come up gets a second for its node to show
+    // up, and then a few tries at the mount, as the node can be there
+    // before the card answers
+    wait_for_volume("/sdcard", 1000);
+    for (int delay = 50; ensure_path_mounted("/sdcard") < 0; delay *= 2)
     {
-        usleep(500000);
-        if (ensure_path_mounted("/sdcard") < 0)
-        {
-            usleep(500000);
-            ensure_path_mounted("/sdcard");
-        }
+        if (delay > 800)
+            return -1;
+        usleep(delay * 1000);
     }
 #endif
+    return 0;
+}
+
+// A script left in /cache replaces the theme for one start. It's loaded
+// on the main thread, which is the one mounting and unmounting /cache.
+extern "C" int gui_loadScript()
+{
+    if (PageManager::LoadPackage("PHX", "/cache/phx_script.xml"))
+        return -1;
 
+    unlink("/cache/phx_script.xml");
+    gScriptLoaded = 1;
+    return 0;
+}
+
+extern "C" int gui_loadResources()
+{
 //    unlink("/sdcard/video.last");
 //    rename("/sdcard/video.bin", "/sdcard/video.last");
 //    gRecorder = open("/sdcard/video.bin", O_CREAT | O_WRONLY);
@@ -416,22 +509,15 @@ extern "C" int gui_loadResources()
     std::string theme = "/sdcard/phoenix/themes/default.zip";
     DataManager::GetValue(VAR_CURRENT_THEME, theme);
 
-    // This is used for scripting
-    if (PageManager::LoadPackage("PHX", "/cache/phx_script.xml"))
+    // The script from gui_loadScript, if there was one, takes the theme's place
+    if (!gScriptLoaded && PageManager::LoadPackage("PHX", theme))
     {
-        if (PageManager::LoadPackage("PHX", theme))
+        if (PageManager::LoadPackage("PHX", "/res/ui.xml"))
         {
-            if (PageManager::LoadPackage("PHX", "/res/ui.xml"))
-            {
-                LOGE("Failed to load base packages.\n");
-                goto error;
-            }
+            LOGE("Failed to load base packages.\n");
+            goto error;
         }
     }
-    else
-    {
-        unlink("/cache/phx_script.xml");
-    }
 
     // Set the default package
     PageManager::SelectPackage("PHX");
@@ -450,6 +536,7 @@ extern "C" int gui_start()
     if (!gGuiInitialized)   return -1;
 
     gGuiConsoleTerminate = 1;
+    gui_wakeup();
     while (gGuiConsoleRunning)  loopTimer();
 
     // Set the default package
@@ -468,7 +555,7 @@ static void *console_thread(void *cookie)
 
     while (!gGuiConsoleTerminate)
     {
-        loopTimer();
+        waitForWork(PageManager::IsAnimating());
 
         if (!gForceRender)
         {
@@ -45,6 +45,10 @@ public:
     // GetRenderPos - Returns the current position of the object
     virtual int GetRenderPos(int& x, int& y, int& w, int& h)        { x = mRenderX; y = mRenderY; w = mRenderW; h = mRenderH; return 0; }
 
+    // GetDamage - Returns the area the last Update changed, for a partial redraw
+    //  Return 0 on success, <0 if unknown (the whole page is redrawn)
+    virtual int GetDamage(int& x, int& y, int& w, int& h)           { GetRenderPos(x, y, w, h); return ((w > 0 && h > 0) ? 0 : -1); }
+
     // SetRenderPos - Update the position of the object
     //  Return 0 on success, <0 on error
     virtual int SetRenderPos(int x, int y, int w = 0, int h = 0)    { mRenderX = x; mRenderY = y; if (w || h) { mRenderW = w; mRenderH = h; } return 0; }
@@ -58,6 +62,9 @@ public:
     // SetPageFocus - Notify when a page gains or loses focus
     virtual void SetPageFocus(int inFocus)                          { return; }
 
+    // IsAnimating - Whether Update has to keep being called when nothing else changes
+    virtual bool IsAnimating(void)                                  { return false; }
+
 protected:
     int mRenderX, mRenderY, mRenderW, mRenderH;
     Placement mPlacement;
@@ -147,6 +154,9 @@ public:
     // Retrieve the size of the current string (dynamic strings may change per call)
     virtual int GetCurrentBounds(int& w, int& h);
 
+    // GetDamage - Covers both the text last drawn and the text to come
+    virtual int GetDamage(int& x, int& y, int& w, int& h);
+
     // Notify of a variable change
     virtual int NotifyVarChange(std::string varName, std::string value);
 
@@ -158,9 +168,12 @@ protected:
     int mIsStatic;
     int mVarChanged;
     int mFontHeight;
+    int mDrawnX, mDrawnY, mDrawnW;      // mDrawnW is 0 if nothing is drawn
+    time_t mLastRefresh;
 
 protected:
     std::string parseText(void);
+    void GetTextPos(const std::string& value, int& x, int& y, int& w);
 };
 
 // GUIImage - Used for static image
@@ -254,6 +267,9 @@ public:
     //  Return 0 on success, >0 to ignore remainder of touch, and <0 on error (Return error to allow other handlers)
     virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
 
+    // GetDamage - The console and its slideout tab
+    virtual int GetDamage(int& x, int& y, int& w, int& h);
+
 protected:
     enum SlideoutState
     {
@@ -309,6 +325,9 @@ public:
     //  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
     virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
 
+    // GetDamage - The button, and its label where that spills over
+    virtual int GetDamage(int& x, int& y, int& w, int& h);
+
 protected:
     GUIImage* mButtonImg;
     Resource* mButtonIcon;
@@ -439,6 +458,9 @@ public:
     //  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
     virtual int Update(void);
 
+    // IsAnimating - Until the last frame of a non-looping animation
+    virtual bool IsAnimating(void)      { return (mAnimation && mLoop != -2); }
+
 protected:
     AnimationResource* mAnimation;
     int mFrame;
@@ -466,6 +488,9 @@ public:
     //  Returns 0 on success, <0 on error
     virtual int NotifyVarChange(std::string varName, std::string value);
 
+    // IsAnimating - While sliding towards the next portion
+    virtual bool IsAnimating(void)      { return (mSlideFrames > 0); }
+
 protected:
     Resource* mEmptyBar;
     Resource* mFullBar;
@@ -534,6 +559,9 @@ public:
     //  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
     virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
 
+    // GetDamage - The slider, and the touch icon where it's taller
+    virtual int GetDamage(int& x, int& y, int& w, int& h);
+
 protected:
     GUIAction* mAction;
     Resource* mSlider;
@@ -547,6 +575,7 @@ protected:
 
 // Helper APIs
 bool LoadPlacement(xml_node<>* node, int* x, int* y, int* w = NULL, int* h = NULL, RenderObject::Placement* placement = NULL);
+void UnionRect(int& x, int& y, int& w, int& h, int x2, int y2, int w2, int h2);
 
 #endif  // _OBJECTS_HEADER
 
@@ -111,6 +111,17 @@ bool LoadPlacement(xml_node<>* node, int* x, int* y, int* w /* = NULL */, int* h
     return true;
 }
 
+void UnionRect(int& x, int& y, int& w, int& h, int x2, int y2, int w2, int h2)
+{
+    int right = (x + w > x2 + w2) ? x + w : x2 + w2;
+    int bottom = (y + h > y2 + h2) ? y + h : y2 + h2;
+
+    if (x2 < x)     x = x2;
+    if (y2 < y)     y = y2;
+    w = right - x;
+    h = bottom - y;
+}
+
 int ActionObject::SetActionPos(int x, int y, int w, int h)
 {
     if (x < 0 || y < 0)                                     return -1;
@@ -291,9 +302,12 @@ bool Page::ProcessNode(xml_node<>* page, xml_node<>* templates /* = NULL */, int
 
 int Page::Render(void)
 {
+    mDirty.clear();
+
     // Render background
     gr_color(mBackground.red, mBackground.green, mBackground.blue, mBackground.alpha);
     gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    gr_damage(0, 0, gr_fb_width(), gr_fb_height());
 
     // Render remaining objects
     std::vector<RenderObject*>::iterator iter;
@@ -305,20 +319,109 @@ int Page::Render(void)
     return 0;
 }
 
+// Redraws the areas Update found changed: the background, and every
+// object over them, clipped to them
+int Page::RenderDirty(void)
+{
+    std::vector<RECT>::iterator dirty;
+    for (dirty = mDirty.begin(); dirty != mDirty.end(); dirty++)
+    {
+        gr_clip(dirty->x, dirty->y, dirty->w, dirty->h);
+        gr_color(mBackground.red, mBackground.green, mBackground.blue, mBackground.alpha);
+        gr_fill(dirty->x, dirty->y, dirty->w, dirty->h);
+
+        std::vector<RenderObject*>::iterator iter;
+        for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
+        {
+            int x, y, w, h;
+
+            // Objects without a known size are drawn anyway; the clip keeps them in
+            if ((*iter)->GetDamage(x, y, w, h) == 0 &&
+                (x >= dirty->x + dirty->w || dirty->x >= x + w || y >= dirty->y + dirty->h || dirty->y >= y + h))
+                continue;
+            if ((*iter)->Render())
+                LOGE("A render request has failed.\n");
+        }
+        gr_noclip();
+        gr_damage(dirty->x, dirty->y, dirty->w, dirty->h);
+    }
+    mDirty.clear();
+    return 0;
+}
+
+bool Page::IsAnimating(void)
+{
+    std::vector<RenderObject*>::iterator iter;
+    for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
+    {
+        if ((*iter)->IsAnimating())
+            return true;
+    }
+    return false;
+}
+
 int Page::Update(void)
 {
     int retCode = 0;
+    bool full = false;
+
+    mDirty.clear();
 
     std::vector<RenderObject*>::iterator iter;
     for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
     {
         int ret = (*iter)->Update();
+        int x, y, w, h;
+
         if (ret < 0)
+        {
             LOGE("An update request has failed.\n");
-        else if (ret > retCode)
-            retCode = ret;
+            continue;
+        }
+        if (ret == 0)
+            continue;
+
+        if ((*iter)->GetDamage(x, y, w, h) != 0)
+        {
+            // Nothing to go on, so all of it
+            x = 0;  y = 0;  w = gr_fb_width();  h = gr_fb_height();
+            if (ret > 1)    full = true;
+        }
+
+        if (ret == 1)
+        {
+            // The object drew itself, it only has to reach the screen
+            gr_damage(x, y, w, h);
+            if (retCode < 1)    retCode = 1;
+        }
+        else if (!full)
+        {
+            RECT rect = { x, y, w, h };
+
+            // Overlapping areas are drawn once
+            std::vector<RECT>::iterator dirty = mDirty.begin();
+            while (dirty != mDirty.end())
+            {
+                if (rect.x < dirty->x + dirty->w && dirty->x < rect.x + rect.w &&
+                    rect.y < dirty->y + dirty->h && dirty->y < rect.y + rect.h)
+                {
+                    UnionRect(rect.x, rect.y, rect.w, rect.h, dirty->x, dirty->y, dirty->w, dirty->h);
+                    mDirty.erase(dirty);
+                    dirty = mDirty.begin();
+                }
+                else
+                    dirty++;
+            }
+            mDirty.push_back(rect);
+            retCode = 1;
+        }
     }
 
+    if (full)
+    {
+        mDirty.clear();
+        return 2;
+    }
     return retCode;
 }
 
@@ -563,12 +666,25 @@ int PageSet::Render(void)
 
 int PageSet::Update(void)
 {
-    int ret;
+    int ret, ret2;
 
     ret = (mCurrentPage ? mCurrentPage->Update() : -1);
     if (ret < 0 || ret > 1)     return ret;
-    ret = (mOverlayPage ? mOverlayPage->Update() : -1);
-    return ret;
+    if (!mOverlayPage)          return mCurrentPage->RenderDirty() == 0 ? ret : -1;
+
+    // The overlay covers the page, so redrawing part of the page below it
+    // means redrawing the lot
+    if (mCurrentPage->IsDirty())    return 2;
+    ret2 = mOverlayPage->Update();
+    if (ret2 < 0 || ret2 > 1)   return ret2;
+    if (mOverlayPage->IsDirty())    return 2;
+    return (ret2 > ret ? ret2 : ret);
+}
+
+bool PageSet::IsAnimating(void)
+{
+    if (mOverlayPage && mOverlayPage->IsAnimating())    return true;
+    return (mCurrentPage ? mCurrentPage->IsAnimating() : false);
 }
 
 int PageSet::NotifyTouch(TOUCH_STATE state, int x, int y)
@@ -814,10 +930,16 @@ int PageManager::NotifyVarChange(std::string varName, std::string value)
     return (mCurrentSet ? mCurrentSet->NotifyVarChange(varName, value) : -1);
 }
 
+bool PageManager::IsAnimating(void)
+{
+    return (mCurrentSet ? mCurrentSet->IsAnimating() : false);
+}
+
 extern "C" void gui_notifyVarChange(const char *name, const char* value)
 {
     if (!gGuiRunning)   return;
 
     PageManager::NotifyVarChange(name, value);
+    gui_wakeup();
 }
 
@@ -10,9 +10,14 @@ typedef struct {
     unsigned char alpha;
 } COLOR;
 
+typedef struct {
+    int x, y, w, h;
+} RECT;
+
 // Utility Functions
 int ConvertStrToColor(std::string str, COLOR* color);
 int gui_forceRender(void);
+void gui_wakeup(void);
 int gui_changePage(std::string newPage);
 int gui_changeOverlay(std::string newPage);
 
@@ -32,16 +37,22 @@ public:
 
 public:
     virtual int Render(void);
+    virtual int RenderDirty(void);
     virtual int Update(void);
     virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
     virtual int NotifyKey(int key);
     virtual int NotifyVarChange(std::string varName, std::string value);
     virtual void SetPageFocus(int inFocus);
+    virtual bool IsAnimating(void);
+
+    // Whether the last Update left areas for RenderDirty
+    bool IsDirty(void)          { return !mDirty.empty(); }
 
 protected:
     std::string mName;
     std::vector<RenderObject*> mRenders;
     std::vector<ActionObject*> mActions;
+    std::vector<RECT> mDirty;
 
     ActionObject* mTouchStart;
     COLOR mBackground;
@@ -73,6 +84,7 @@ public:
     int NotifyTouch(TOUCH_STATE state, int x, int y);
     int NotifyKey(int key);
     int NotifyVarChange(std::string varName, std::string value);
+    bool IsAnimating(void);
 
 protected:
     int LoadPages(xml_node<>* pages, xml_node<>* templates = NULL);
@@ -116,6 +128,9 @@ public:
     static int NotifyKey(int key);
     static int NotifyVarChange(std::string varName, std::string value);
 
+    // Whether something on screen needs frames without any events
+    static bool IsAnimating(void);
+
 protected:
     static PageSet* FindPackage(std::string name);
 
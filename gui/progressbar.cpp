@@ -36,6 +36,7 @@ GUIProgressBar::GUIProgressBar(xml_node<>* node)
     mLastPos = 0;
     mSlide = 0.0;
     mSlideInc = 0.0;
+    mSlideFrames = 0;
 
     if (!node)
     {
@@ -150,7 +151,8 @@ int GUIProgressBar::Update(void)
 
     if (pos == mLastPos)            return 0;
     mLastPos = pos;
-    if (RenderInternal() != 0)      return -1;
+
+    // The page redraws just the bar, with whatever is behind it
     return 2;
 }
 
@@ -120,6 +120,14 @@ int GUISlider::Update(void)
     return 0;
 }
 
+int GUISlider::GetDamage(int& x, int& y, int& w, int& h)
+{
+    GetRenderPos(x, y, w, h);
+    if (mTouch && mTouch->GetResource())
+        UnionRect(x, y, w, h, mRenderX, mRenderY + ((mRenderH - mTouchH) / 2), mRenderW, mTouchH);
+    return ((w > 0 && h > 0) ? 0 : -1);
+}
+
 int GUISlider::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
     static bool dragging = false;
@@ -36,6 +36,8 @@ GUIText::GUIText(xml_node<>* node)
     mIsStatic = 1;
     mVarChanged = 0;
     mFontHeight = 0;
+    mDrawnX = mDrawnY = mDrawnW = 0;
+    mLastRefresh = 0;
 
     if (!node)      return;
 
@@ -80,19 +82,15 @@ GUIText::GUIText(xml_node<>* node)
     return;
 }
 
-int GUIText::Render(void)
+void GUIText::GetTextPos(const std::string& value, int& x, int& y, int& width)
 {
-    if (!isConditionTrue())     return 0;
-
     void* fontResource = NULL;
 
     if (mFont)  fontResource = mFont->GetResource();
 
-    mLastValue = DataManager::ParseText(mText);
-    mVarChanged = 0;
-
-    int x = mRenderX, y = mRenderY;
-    int width = gr_measureEx(mLastValue.c_str(), fontResource);
+    x = mRenderX;
+    y = mRenderY;
+    width = gr_measureEx(value.c_str(), fontResource);
 
     if (mPlacement != TOP_LEFT && mPlacement != BOTTOM_LEFT)
     {
@@ -108,24 +106,56 @@ int GUIText::Render(void)
         else
             y -= mFontHeight;
     }
+}
+
+int GUIText::Render(void)
+{
+    if (!isConditionTrue())
+    {
+        mDrawnW = 0;
+        return 0;
+    }
+
+    void* fontResource = NULL;
+
+    if (mFont)  fontResource = mFont->GetResource();
+
+    mLastValue = DataManager::ParseText(mText);
+    mVarChanged = 0;
+
+    int x, y, width;
+    GetTextPos(mLastValue, x, y, width);
 
     gr_color(mColor.red, mColor.green, mColor.blue, mColor.alpha);
     gr_textEx(x, y, mLastValue.c_str(), fontResource);
+
+    mDrawnX = x;
+    mDrawnY = y;
+    mDrawnW = width;
     return 0;
 }
 
+int GUIText::GetDamage(int& x, int& y, int& w, int& h)
+{
+    int newX, newY, newW;
+
+    GetTextPos(DataManager::ParseText(mText), newX, newY, newW);
+    x = newX;   y = newY;   w = newW;   h = mFontHeight;
+    if (mDrawnW > 0)
+        UnionRect(x, y, w, h, mDrawnX, mDrawnY, mDrawnW, mFontHeight);
+    return ((w > 0 && h > 0) ? 0 : -1);
+}
+
 int GUIText::Update(void)
 {
     if (!isConditionTrue())     return 0;
 
-    static int updateCounter = 3;
-
-    // This hack just makes sure we update at least once a minute for things like clock and battery
-    if (updateCounter)  updateCounter--;
-    else
+    // This hack just makes sure we update at least once a second for things like clock and battery
+    time_t now = time(NULL);
+    if (now != mLastRefresh)
     {
         mVarChanged = 1;
-        updateCounter = 3;
+        mLastRefresh = now;
     }
 
     if (mIsStatic || !mVarChanged)      return 0;
@@ -29,6 +29,16 @@ int gui_init()
     return -1;
 }
 
+int gui_mountResources()
+{
+    return -1;
+}
+
+int gui_loadScript()
+{
+    return -1;
+}
+
 int gui_loadResources()
 {
     return -1;
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "md5.h"
+
+#define F(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)  ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z)  ((x) ^ (y) ^ (z))
+#define I(x, y, z)  ((y) ^ ((x) | ~(z)))
+
+#define ROL(x, n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = ROL((a), (s)); \
+    (a) += (b);
+
+static void MD5_transform(MD5_CTX* ctx, const uint8_t* p)
+{
+    uint32_t a = ctx->state[0];
+    uint32_t b = ctx->state[1];
+    uint32_t c = ctx->state[2];
+    uint32_t d = ctx->state[3];
+    uint32_t x[16];
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        x[i] = (uint32_t) p[i * 4] | ((uint32_t) p[i * 4 + 1] << 8) |
+               ((uint32_t) p[i * 4 + 2] << 16) | ((uint32_t) p[i * 4 + 3] << 24);
+    }
+
+    STEP(F, a, b, c, d, x[ 0], 0xd76aa478,  7)
+    STEP(F, d, a, b, c, x[ 1], 0xe8c7b756, 12)
+    STEP(F, c, d, a, b, x[ 2], 0x242070db, 17)
+    STEP(F, b, c, d, a, x[ 3], 0xc1bdceee, 22)
+    STEP(F, a, b, c, d, x[ 4], 0xf57c0faf,  7)
+    STEP(F, d, a, b, c, x[ 5], 0x4787c62a, 12)
+    STEP(F, c, d, a, b, x[ 6], 0xa8304613, 17)
+    STEP(F, b, c, d, a, x[ 7], 0xfd469501, 22)
+    STEP(F, a, b, c, d, x[ 8], 0x698098d8,  7)
+    STEP(F, d, a, b, c, x[ 9], 0x8b44f7af, 12)
+    STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17)
+    STEP(F, b, c, d, a, x[11], 0x895cd7be, 22)
+    STEP(F, a, b, c, d, x[12], 0x6b901122,  7)
+    STEP(F, d, a, b, c, x[13], 0xfd987193, 12)
+    STEP(F, c, d, a, b, x[14], 0xa679438e, 17)
+    STEP(F, b, c, d, a, x[15], 0x49b40821, 22)
+
+    STEP(G, a, b, c, d, x[ 1], 0xf61e2562,  5)
+    STEP(G, d, a, b, c, x[ 6], 0xc040b340,  9)
+    STEP(G, c, d, a, b, x[11], 0x265e5a51, 14)
+    STEP(G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20)
+    STEP(G, a, b, c, d, x[ 5], 0xd62f105d,  5)
+    STEP(G, d, a, b, c, x[10], 0x02441453,  9)
+    STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14)
+    STEP(G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20)
+    STEP(G, a, b, c, d, x[ 9], 0x21e1cde6,  5)
+    STEP(G, d, a, b, c, x[14], 0xc33707d6,  9)
+    STEP(G, c, d, a, b, x[ 3], 0xf4d50d87, 14)
+    STEP(G, b, c, d, a, x[ 8], 0x455a14ed, 20)
+    STEP(G, a, b, c, d, x[13], 0xa9e3e905,  5)
+    STEP(G, d, a, b, c, x[ 2], 0xfcefa3f8,  9)
+    STEP(G, c, d, a, b, x[ 7], 0x676f02d9, 14)
+    STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+
+    STEP(H, a, b, c, d, x[ 5], 0xfffa3942,  4)
+    STEP(H, d, a, b, c, x[ 8], 0x8771f681, 11)
+    STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16)
+    STEP(H, b, c, d, a, x[14], 0xfde5380c, 23)
+    STEP(H, a, b, c, d, x[ 1], 0xa4beea44,  4)
+    STEP(H, d, a, b, c, x[ 4], 0x4bdecfa9, 11)
+    STEP(H, c, d, a, b, x[ 7], 0xf6bb4b60, 16)
+    STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23)
+    STEP(H, a, b, c, d, x[13], 0x289b7ec6,  4)
+    STEP(H, d, a, b, c, x[ 0], 0xeaa127fa, 11)
+    STEP(H, c, d, a, b, x[ 3], 0xd4ef3085, 16)
+    STEP(H, b, c, d, a, x[ 6], 0x04881d05, 23)
+    STEP(H, a, b, c, d, x[ 9], 0xd9d4d039,  4)
+    STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11)
+    STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+    STEP(H, b, c, d, a, x[ 2], 0xc4ac5665, 23)
+
+    STEP(I, a, b, c, d, x[ 0], 0xf4292244,  6)
+    STEP(I, d, a, b, c, x[ 7], 0x432aff97, 10)
+    STEP(I, c, d, a, b, x[14], 0xab9423a7, 15)
+    STEP(I, b, c, d, a, x[ 5], 0xfc93a039, 21)
+    STEP(I, a, b, c, d, x[12], 0x655b59c3,  6)
+    STEP(I, d, a, b, c, x[ 3], 0x8f0ccc92, 10)
+    STEP(I, c, d, a, b, x[10], 0xffeff47d, 15)
+    STEP(I, b, c, d, a, x[ 1], 0x85845dd1, 21)
+    STEP(I, a, b, c, d, x[ 8], 0x6fa87e4f,  6)
+    STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+    STEP(I, c, d, a, b, x[ 6], 0xa3014314, 15)
+    STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21)
+    STEP(I, a, b, c, d, x[ 4], 0xf7537e82,  6)
+    STEP(I, d, a, b, c, x[11], 0xbd3af235, 10)
+    STEP(I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15)
+    STEP(I, b, c, d, a, x[ 9], 0xeb86d391, 21)
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+}
+
+void MD5_init(MD5_CTX* ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+void MD5_update(MD5_CTX* ctx, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    size_t used = (size_t) (ctx->count & 63);
+
+    ctx->count += len;
+
+    if (used)
+    {
+        size_t avail = 64 - used;
+        if (len < avail)
+        {
+            memcpy(ctx->buf + used, p, len);
+            return;
+        }
+        memcpy(ctx->buf + used, p, avail);
+        MD5_transform(ctx, ctx->buf);
+        p += avail;
+        len -= avail;
+    }
+
+    while (len >= 64)
+    {
+        MD5_transform(ctx, p);
+        p += 64;
+        len -= 64;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+void MD5_final(MD5_CTX* ctx, uint8_t digest[MD5_DIGEST_SIZE])
+{
+    uint64_t bits = ctx->count << 3;
+    size_t used = (size_t) (ctx->count & 63);
+    int i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56)
+    {
+        memset(ctx->buf + used, 0, 64 - used);
+        MD5_transform(ctx, ctx->buf);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; i++)
+        ctx->buf[56 + i] = (uint8_t) (bits >> (8 * i));
+    MD5_transform(ctx, ctx->buf);
+
+    for (i = 0; i < 16; i++)
+        digest[i] = (uint8_t) (ctx->state[i / 4] >> (8 * (i % 4)));
+}
+
+void MD5_hex(const uint8_t digest[MD5_DIGEST_SIZE], char out[MD5_DIGEST_SIZE * 2 + 1])
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < MD5_DIGEST_SIZE; i++)
+    {
+        out[i * 2] = hex[digest[i] >> 4];
+        out[i * 2 + 1] = hex[digest[i] & 0xf];
+    }
+    out[MD5_DIGEST_SIZE * 2] = '\0';
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MD5_HEADER
+#define _MD5_HEADER
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// RFC 1321 MD5, used for the .md5 sidecars next to each backup image
+
+#define MD5_DIGEST_SIZE     16
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t count;
+    uint8_t buf[64];
+} MD5_CTX;
+
+void MD5_init(MD5_CTX* ctx);
+void MD5_update(MD5_CTX* ctx, const void* data, size_t len);
+void MD5_final(MD5_CTX* ctx, uint8_t digest[MD5_DIGEST_SIZE]);
+
+// Formats a digest as 32 lowercase hex characters plus a terminator
+void MD5_hex(const uint8_t digest[MD5_DIGEST_SIZE], char out[MD5_DIGEST_SIZE * 2 + 1]);
+
+#endif  // _MD5_HEADER
@@ -25,6 +25,10 @@ ifeq ($(RECOVERY_GRAPHICS_USE_LINELENGTH), true)
 LOCAL_CFLAGS += -DRECOVERY_GRAPHICS_USE_LINELENGTH
 endif
 
+ifeq ($(RECOVERY_GRAPHICS_FORCE_COPY), true)
+LOCAL_CFLAGS += -DRECOVERY_GRAPHICS_FORCE_COPY
+endif
+
 ifeq ($(TWRP_EVENT_LOGGING), true)
 LOCAL_CFLAGS += -D_EVENT_LOGGING
 endif
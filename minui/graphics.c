@@ -54,6 +54,43 @@ static GGLSurface gr_framebuffer[2];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
 
+/* With gr_direct set everything is drawn straight into the framebuffer
+ * page that isn't showing, and a flip only pans to it.  Otherwise drawing
+ * goes to gr_mem_surface, which flips copy out.  gr_draw is whichever is
+ * being drawn into.
+ */
+static int gr_direct = 0;
+static GGLSurface *gr_draw = &gr_mem_surface;
+
+/* Damage declared with gr_damage() since the last flip, and for the flip
+ * before that: the page being flipped to last had the frame before the
+ * one just shown, so it needs both. A count of -1 means the whole screen.
+ */
+#define GR_MAX_DAMAGE   8
+
+typedef struct {
+    int x, y, w, h;
+} GRRect;
+
+static GRRect gr_damage_rect[2][GR_MAX_DAMAGE];
+static int gr_damage_count[2] = { -1, -1 };
+static unsigned gr_damage_frame = 0;
+
+/* In direct mode, what the page being drawn into lacks of the frame on
+ * screen: that frame's damage, which went into the other page. It's
+ * copied across right before the page is first drawn into, less what that
+ * drawing paints over anyway, so a full redraw copies nothing. A count of
+ * -1 means the whole screen.
+ */
+static GRRect gr_missing_rect[GR_MAX_DAMAGE];
+static int gr_missing_count = 0;
+
+/* What gr_fill will paint over: it's opaque unless the color has alpha,
+ * and limited by the clip */
+static int gr_opaque = 1;
+static int gr_clipped = 0;
+static GRRect gr_clip_rect;
+
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
@@ -180,31 +217,224 @@ static void get_memory_surface(GGLSurface* ms) {
   ms->format = PIXEL_FORMAT;
 }
 
-static void set_active_framebuffer(unsigned n)
+static int set_active_framebuffer(unsigned n)
 {
-    if (n > 1) return;
-    vi.yres_virtual = vi.yres * PIXEL_SIZE;
+    if (n > 1) return -1;
     vi.yoffset = n * vi.yres;
+    if (ioctl(gr_fb_fd, FBIOPAN_DISPLAY, &vi) == 0) return 0;
+
+    /* Drivers that can't pan may still take the whole mode again */
 //    vi.bits_per_pixel = PIXEL_SIZE * 8;
     if (ioctl(gr_fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
         perror("active fb swap failed");
+        return -1;
+    }
+    return 0;
+}
+
+static void set_draw_surface(GGLSurface *surface)
+{
+    gr_draw = surface;
+    gr_context->colorBuffer(gr_context, surface);
+}
+
+void gr_damage(int x, int y, int w, int h)
+{
+    GRRect *rects = gr_damage_rect[gr_damage_frame];
+    int *count = &gr_damage_count[gr_damage_frame];
+    int i;
+
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > (int) vi.xres) w = vi.xres - x;
+    if (y + h > (int) vi.yres) h = vi.yres - y;
+    if (w <= 0 || h <= 0 || *count < 0) return;
+
+    if (x == 0 && y == 0 && w == (int) vi.xres && h == (int) vi.yres) {
+        *count = -1;
+        return;
+    }
+
+    /* Overlapping rectangles are merged; past GR_MAX_DAMAGE the new one
+     * goes into the last */
+    for (i = 0; i < *count; i++) {
+        GRRect *r = &rects[i];
+        if (x < r->x + r->w && r->x < x + w && y < r->y + r->h && r->y < y + h)
+            break;
+    }
+    if (i == *count && *count < GR_MAX_DAMAGE) {
+        rects[i].x = x;
+        rects[i].y = y;
+        rects[i].w = w;
+        rects[i].h = h;
+        (*count)++;
+        return;
+    }
+    if (i == *count) i = *count - 1;
+
+    GRRect *r = &rects[i];
+    int x2 = (x + w > r->x + r->w) ? x + w : r->x + r->w;
+    int y2 = (y + h > r->y + r->h) ? y + h : r->y + r->h;
+    if (x < r->x) r->x = x;
+    if (y < r->y) r->y = y;
+    r->w = x2 - r->x;
+    r->h = y2 - r->y;
+}
+
+static void copy_rects(char *dst, const char *src, const GRRect *rects, int count)
+{
+    unsigned stride = vi.xres_virtual * PIXEL_SIZE;
+    int i, row;
+
+    for (i = 0; i < count; i++) {
+        const GRRect *r = &rects[i];
+        unsigned offset = r->y * stride + r->x * PIXEL_SIZE;
+        for (row = 0; row < r->h; row++, offset += stride)
+            memcpy(dst + offset, src + offset, r->w * PIXEL_SIZE);
+    }
+}
+
+static int contains(const GRRect *outer, const GRRect *inner)
+{
+    return inner->x >= outer->x && inner->y >= outer->y &&
+           inner->x + inner->w <= outer->x + outer->w &&
+           inner->y + inner->h <= outer->y + outer->h;
+}
+
+/* Brings the page being drawn into up to date with the one showing,
+ * before anything is drawn into it. 'cover' is what the caller is about to
+ * paint over opaquely, or NULL; missing parts inside it aren't copied.
+ */
+static void sync_back(const GRRect *cover)
+{
+    GRRect screen = { 0, 0, vi.xres, vi.yres };
+    char *dst = gr_framebuffer[gr_active_fb ^ 1].data;
+    char *src = gr_framebuffer[gr_active_fb].data;
+    GRRect paint;
+    int i, n;
+
+    if (!gr_direct || gr_missing_count == 0) return;
+
+    if (cover) {
+        /* what actually gets painted is cut down by the clip */
+        paint = *cover;
+        if (gr_clipped) {
+            int x2 = paint.x + paint.w, y2 = paint.y + paint.h;
+            const GRRect *c = &gr_clip_rect;
+            if (paint.x < c->x) paint.x = c->x;
+            if (paint.y < c->y) paint.y = c->y;
+            if (x2 > c->x + c->w) x2 = c->x + c->w;
+            if (y2 > c->y + c->h) y2 = c->y + c->h;
+            paint.w = x2 - paint.x;
+            paint.h = y2 - paint.y;
+        }
+        if (!gr_opaque || paint.w <= 0 || paint.h <= 0) cover = NULL;
+    }
+
+    if (gr_missing_count < 0) {
+        if (!cover || !contains(&paint, &screen))
+            memcpy(dst, src, vi.xres_virtual * vi.yres * PIXEL_SIZE);
+    } else {
+        for (i = n = 0; i < gr_missing_count; i++) {
+            if (!cover || !contains(&paint, &gr_missing_rect[i]))
+                gr_missing_rect[n++] = gr_missing_rect[i];
+        }
+        copy_rects(dst, src, gr_missing_rect, n);
     }
+    gr_missing_count = 0;
+}
+
+/* Shows the page that was drawn into. The other one still has the frame
+ * before; it's brought up to date when it's next drawn into, see
+ * sync_back.
+ */
+static int flip_direct(void)
+{
+    unsigned cur = gr_damage_frame;
+    unsigned shown = gr_active_fb ^ 1;
+
+    /* a frame nothing was drawn into still has to show the one before */
+    sync_back(NULL);
+    if (set_active_framebuffer(shown) != 0) return -1;
+    gr_active_fb = shown;
+
+    gr_missing_count = gr_damage_count[cur] <= 0 ? -1 : gr_damage_count[cur];
+    if (gr_missing_count > 0)
+        memcpy(gr_missing_rect, gr_damage_rect[cur], gr_missing_count * sizeof(GRRect));
+    set_draw_surface(&gr_framebuffer[gr_active_fb ^ 1]);
+
+    gr_damage_frame = cur ^ 1;
+    gr_damage_count[gr_damage_frame] = 0;
+    return 0;
+}
+
+/* Panning stopped working; carry on drawing in memory, starting from
+ * what was drawn so far.
+ */
+static void stop_direct(void)
+{
+    GGLSurface *drawn = gr_draw;
+
+    fprintf(stderr, "framebuffer: can't pan any more, copying frames instead\n");
+    sync_back(NULL);
+    gr_direct = 0;
+    get_memory_surface(&gr_mem_surface);
+    memcpy(gr_mem_surface.data, drawn->data, vi.xres_virtual * vi.yres * PIXEL_SIZE);
+    set_draw_surface(&gr_mem_surface);
+    gr_damage_count[gr_damage_frame] = -1;
 }
 
 void gr_flip(void)
 {
     GGLContext *gl = gr_context;
+    unsigned cur, prev;
+
+    if (gr_direct) {
+        if (flip_direct() == 0) return;
+        stop_direct();
+    }
+    cur = gr_damage_frame;
+    prev = cur ^ 1;
 
     /* swap front and back buffers */
     gr_active_fb = (gr_active_fb + 1) & 1;
 
     /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres_virtual * vi.yres * PIXEL_SIZE);
+     * to make active; all of it, unless the frame said what changed */
+    if (gr_damage_count[cur] <= 0 || gr_damage_count[prev] < 0) {
+        memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
+               vi.xres_virtual * vi.yres * PIXEL_SIZE);
+        gr_damage_count[cur] = -1;
+    } else {
+        char *dst = gr_framebuffer[gr_active_fb].data;
+        copy_rects(dst, gr_mem_surface.data, gr_damage_rect[cur], gr_damage_count[cur]);
+        copy_rects(dst, gr_mem_surface.data, gr_damage_rect[prev], gr_damage_count[prev]);
+    }
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
+
+    gr_damage_frame = prev;
+    gr_damage_count[prev] = 0;
+}
+
+void gr_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
+    gr_clipped = 1;
+    gr_clip_rect.x = x;
+    gr_clip_rect.y = y;
+    gr_clip_rect.w = w;
+    gr_clip_rect.h = h;
+}
+
+void gr_noclip(void)
+{
+    GGLContext *gl = gr_context;
+    gl->disable(gl, GGL_SCISSOR_TEST);
+    gr_clipped = 0;
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -216,6 +446,7 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+    gr_opaque = (a == 255);
 }
 
 int gr_measureEx(const char *s, void* font)
@@ -246,6 +477,7 @@ int gr_textEx(int x, int y, const char *s, void* pFont)
     /* Handle default font */
     if (!font)  font = gr_font;
 
+    sync_back(NULL);
     gl->bindTexture(gl, &font->texture);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -269,6 +501,9 @@ int gr_textEx(int x, int y, const char *s, void* pFont)
 void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+    GRRect cover = { x, y, w, h };
+
+    sync_back(&cover);
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x, y, x + w, y + h);
 }
@@ -279,6 +514,7 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     }
 
     GGLContext *gl = gr_context;
+    sync_back(NULL);
     gl->bindTexture(gl, (GGLSurface*) source);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -448,15 +684,31 @@ int gr_init(void)
         return -1;
     }
 
-    get_memory_surface(&gr_mem_surface);
-
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
 
+    /* room for both pages; set once, flips only move yoffset */
+    vi.yres_virtual = vi.yres * PIXEL_SIZE;
+    if (ioctl(gr_fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
+        perror("failed to set fb0 virtual size");
+    }
+
     /* start with 0 as front (displayed) and 1 as back (drawing) */
     gr_active_fb = 0;
+#ifndef RECOVERY_GRAPHICS_FORCE_COPY
+    gr_direct = (fi.smem_len >= 2 * vi.yres * vi.xres_virtual * PIXEL_SIZE &&
+                 set_active_framebuffer(0) == 0);
+#else
     set_active_framebuffer(0);
-    gl->colorBuffer(gl, &gr_mem_surface);
+#endif
+    fprintf(stderr, "framebuffer: %s\n", gr_direct ? "drawing into the back page" : "copying frames");
+
+    if (gr_direct) {
+        set_draw_surface(&gr_framebuffer[1]);
+    } else {
+        get_memory_surface(&gr_mem_surface);
+        set_draw_surface(&gr_mem_surface);
+    }
 
     gl->activeTexture(gl, 0);
     gl->enable(gl, GGL_BLEND);
@@ -492,7 +744,8 @@ int gr_fb_height(void)
 
 gr_pixel *gr_fb_data(void)
 {
-    return (unsigned short *) gr_mem_surface.data;
+    sync_back(NULL);
+    return (unsigned short *) gr_draw->data;
 }
 
 void gr_fb_blank(int blank)
@@ -513,7 +766,8 @@ int gr_get_surface(gr_surface* surface)
     get_memory_surface(ms);
 
     // Now, copy the data
-    memcpy(ms->data, gr_mem_surface.data, vi.xres * vi.yres * vi.bits_per_pixel / 8);
+    sync_back(NULL);
+    memcpy(ms->data, gr_draw->data, vi.xres * vi.yres * vi.bits_per_pixel / 8);
 
     *surface = (gr_surface*) ms;
     return 0;
@@ -532,5 +786,6 @@ int gr_free_surface(gr_surface surface)
 
 void gr_write_frame_to_file(int fd)
 {
-    write(fd, gr_mem_surface.data, vi.xres * vi.yres * vi.bits_per_pixel / 8);
+    sync_back(NULL);
+    write(fd, gr_draw->data, vi.xres * vi.yres * vi.bits_per_pixel / 8);
 }
@@ -27,10 +27,16 @@ int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+// Marks a rectangle as changed since the last flip. A flip with nothing
+// marked takes the whole screen as changed.
+void gr_damage(int x, int y, int w, int h);
 void gr_fb_blank(int blank);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_fill(int x, int y, int w, int h);
+// Limits drawing to a rectangle until gr_noclip()
+void gr_clip(int x, int y, int w, int h);
+void gr_noclip(void);
 
 int gr_textEx(int x, int y, const char *s, void* font);
 static inline int gr_text(int x, int y, const char *s)     { return gr_textEx(x, y, s, NULL); }
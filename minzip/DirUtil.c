@@ -22,7 +22,10 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "DirUtil.h"
 
@@ -165,13 +168,318 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
+/* Parallel directory walk, shared by rm -rf and du below. Directories
+ * are queued as they are found and any worker may pick them up; the
+ * entries of a directory are handed to visit() by whoever is scanning
+ * it. A directory is finished once its scan is done and every
+ * subdirectory found in it is finished, which then counts towards its
+ * parent, so leave() sees children before their parents.
+ */
+typedef struct WalkDir {
+    char *path;
+    struct WalkDir *parent;
+    int pending;                /* own scan + subdirectories not yet finished */
+    struct WalkDir *next;       /* work queue */
+} WalkDir;
+
+typedef struct {
+    unsigned long long files;
+    unsigned long long bytes;
+} WalkCount;
+
+#define WALK_DESCEND        (-1)
+
+/* Returns WALK_DESCEND to walk into de, 0 to go on, or an errno. Runs
+ * on a worker, without the lock; count belongs to the calling scan.
+ */
+typedef int (*WalkVisit)(int dfd, const struct dirent *de,
+        WalkCount *count, void *cookie);
+
+/* Returns 0 or an errno. Runs with the lock held. */
+typedef int (*WalkLeave)(const char *path, bool isRoot, void *cookie);
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t finished;    /* the caller waits on this one */
+    WalkDir *queue;
+    WalkDir *root;
+    bool done;
+    int error;                  /* first errno seen */
+    WalkCount count;
+
+    WalkVisit visit;
+    WalkLeave leave;
+    void *cookie;
+} WalkState;
+
+#define WALK_MAX_THREADS    8
+#define WALK_PROGRESS_MS    250
+
+static void
+walkFail(WalkState *ws, int err)
+{
+    if (ws->error == 0) {
+        ws->error = err;
+    }
+}
+
+/* Called with the lock held once one more piece of dir is finished */
+static void
+walkDirDone(WalkState *ws, WalkDir *dir)
+{
+    while (dir != NULL && --dir->pending == 0) {
+        WalkDir *parent = dir->parent;
+
+        if (ws->leave != NULL) {
+            int err = ws->leave(dir->path, dir == ws->root, ws->cookie);
+            if (err != 0) {
+                walkFail(ws, err);
+            }
+        }
+        if (dir == ws->root) {
+            ws->done = true;
+            pthread_cond_broadcast(&ws->cond);
+            pthread_cond_broadcast(&ws->finished);
+        }
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+static void
+walkScan(WalkState *ws, WalkDir *dir)
+{
+    WalkCount count = { 0, 0 };
+    struct dirent *de;
+    DIR *d;
+
+    d = opendir(dir->path);
+    if (d == NULL) {
+        pthread_mutex_lock(&ws->lock);
+        walkFail(ws, errno);
+        walkDirDone(ws, dir);
+        pthread_mutex_unlock(&ws->lock);
+        return;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        int ret;
+
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+
+        ret = ws->visit(dirfd(d), de, &count, ws->cookie);
+        if (ret == 0) {
+            continue;
+        }
+        if (ret != WALK_DESCEND) {
+            pthread_mutex_lock(&ws->lock);
+            walkFail(ws, ret);
+            pthread_mutex_unlock(&ws->lock);
+            continue;
+        }
+
+        WalkDir *child = (WalkDir *) calloc(1, sizeof(WalkDir));
+        size_t len = strlen(dir->path) + strlen(de->d_name) + 2;
+
+        if (child == NULL || (child->path = (char *) malloc(len)) == NULL) {
+            free(child);
+            pthread_mutex_lock(&ws->lock);
+            walkFail(ws, ENOMEM);
+            pthread_mutex_unlock(&ws->lock);
+            continue;
+        }
+        snprintf(child->path, len, "%s/%s", dir->path, de->d_name);
+        child->parent = dir;
+        child->pending = 1;
+
+        pthread_mutex_lock(&ws->lock);
+        dir->pending++;
+        child->next = ws->queue;
+        ws->queue = child;
+        pthread_cond_signal(&ws->cond);
+        pthread_mutex_unlock(&ws->lock);
+    }
+    closedir(d);
+
+    pthread_mutex_lock(&ws->lock);
+    ws->count.files += count.files;
+    ws->count.bytes += count.bytes;
+    walkDirDone(ws, dir);
+    pthread_mutex_unlock(&ws->lock);
+}
+
+static void *
+walkWorker(void *cookie)
+{
+    WalkState *ws = (WalkState *) cookie;
+
+    pthread_mutex_lock(&ws->lock);
+    while (!ws->done) {
+        WalkDir *dir = ws->queue;
+
+        if (dir == NULL) {
+            pthread_cond_wait(&ws->cond, &ws->lock);
+            continue;
+        }
+        ws->queue = dir->next;
+        pthread_mutex_unlock(&ws->lock);
+
+        walkScan(ws, dir);
+
+        pthread_mutex_lock(&ws->lock);
+    }
+    pthread_mutex_unlock(&ws->lock);
+    return NULL;
+}
+
+/* Walks the directory path on <threads> workers (<= 0 picks a default)
+ * and leaves what visit() counted in count. progress, if any, is called
+ * on this thread. Returns -1 with errno set to the first error, after
+ * walking everything it could.
+ */
+static int
+dirWalk(const char *path, int threads, WalkVisit visit, WalkLeave leave,
+        void *cookie, DirUnlinkProgress progress, void *progressCookie,
+        WalkCount *count)
+{
+    pthread_t workers[WALK_MAX_THREADS];
+    WalkState ws;
+    int i, started;
+
+    if (threads <= 0 || threads > WALK_MAX_THREADS) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        /* walking waits on the filesystem more than the cpu */
+        threads = (cpus < 1) ? 2 : (int) cpus * 2;
+        if (threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+    }
+
+    memset(&ws, 0, sizeof(ws));
+    ws.visit = visit;
+    ws.leave = leave;
+    ws.cookie = cookie;
+    ws.root = (WalkDir *) calloc(1, sizeof(WalkDir));
+    if (ws.root == NULL || (ws.root->path = strdup(path)) == NULL) {
+        free(ws.root);
+        errno = ENOMEM;
+        return -1;
+    }
+    ws.root->pending = 1;
+    ws.queue = ws.root;
+    pthread_mutex_init(&ws.lock, NULL);
+    pthread_cond_init(&ws.cond, NULL);
+    pthread_cond_init(&ws.finished, NULL);
+
+    started = 0;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, walkWorker, &ws) != 0) {
+            break;
+        }
+        started++;
+    }
+    /* no threads to be had, do it here */
+    if (started == 0) {
+        walkWorker(&ws);
+    }
+
+    /* progress is reported from here so the callback never has to
+     * worry about which thread it's on
+     */
+    pthread_mutex_lock(&ws.lock);
+    while (!ws.done) {
+        WalkCount now = ws.count;
+        struct timespec ts;
+
+        if (progress != NULL && now.files > 0) {
+            pthread_mutex_unlock(&ws.lock);
+            progress(now.files, now.bytes, progressCookie);
+            pthread_mutex_lock(&ws.lock);
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += WALK_PROGRESS_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (!ws.done) {
+            pthread_cond_timedwait(&ws.finished, &ws.lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&ws.lock);
+    if (progress != NULL && ws.count.files > 0) {
+        progress(ws.count.files, ws.count.bytes, progressCookie);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&ws.finished);
+    pthread_cond_destroy(&ws.cond);
+    pthread_mutex_destroy(&ws.lock);
+    *count = ws.count;
+    if (ws.error != 0) {
+        errno = ws.error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Parallel rm -rf: files are unlinked as they are visited, directories
+ * once everything under them is gone.
+ */
+typedef struct {
+    bool keepRoot;
+    bool sized;                 /* someone wants to know the bytes */
+} UnlinkState;
+
+static int
+unlinkVisit(int dfd, const struct dirent *de, WalkCount *count, void *cookie)
+{
+    UnlinkState *us = (UnlinkState *) cookie;
+    struct stat st;
+
+    /* d_type saves a stat per entry, unless we're counting bytes */
+    if (de->d_type == DT_UNKNOWN || (us->sized && de->d_type == DT_REG)) {
+        if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            return errno;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            return WALK_DESCEND;
+        }
+        count->bytes += st.st_size;
+    } else if (de->d_type == DT_DIR) {
+        return WALK_DESCEND;
+    }
+
+    if (unlinkat(dfd, de->d_name, 0) < 0) {
+        return errno;
+    }
+    count->files++;
+    return 0;
+}
+
+static int
+unlinkLeave(const char *path, bool isRoot, void *cookie)
+{
+    UnlinkState *us = (UnlinkState *) cookie;
+
+    if (isRoot && us->keepRoot) {
+        return 0;
+    }
+    return rmdir(path) < 0 ? errno : 0;
+}
+
 int
-dirUnlinkHierarchy(const char *path)
+dirUnlinkHierarchyEx(const char *path, int threads, bool keepRoot,
+        DirUnlinkProgress progress, void *cookie)
 {
+    UnlinkState us;
+    WalkCount count;
     struct stat st;
-    DIR *dir;
-    struct dirent *de;
-    int fail = 0;
 
     /* is it a file or directory? */
     if (lstat(path, &st) < 0) {
@@ -180,45 +488,55 @@ dirUnlinkHierarchy(const char *path)
 
     /* a file, so unlink it */
     if (!S_ISDIR(st.st_mode)) {
+        if (keepRoot) {
+            errno = ENOTDIR;
+            return -1;
+        }
         return unlink(path);
     }
 
-    /* a directory, so open handle */
-    dir = opendir(path);
-    if (dir == NULL) {
-        return -1;
-    }
+    us.keepRoot = keepRoot;
+    us.sized = (progress != NULL);
+    return dirWalk(path, threads, unlinkVisit, unlinkLeave, &us,
+            progress, cookie, &count);
+}
 
-    /* recurse over components */
-    errno = 0;
-    while ((de = readdir(dir)) != NULL) {
-//TODO: don't blow the stack
-        char dn[PATH_MAX];
-        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-            continue;
-        }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
-            fail = 1;
-            break;
-        }
-        errno = 0;
+int
+dirUnlinkHierarchy(const char *path)
+{
+    return dirUnlinkHierarchyEx(path, 0, false, NULL, NULL);
+}
+
+/* Parallel du: every entry is stat'ed and its blocks counted. */
+static int
+usageVisit(int dfd, const struct dirent *de, WalkCount *count, void *cookie)
+{
+    struct stat st;
+
+    if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        return errno;
     }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
-        int save = errno;
-        closedir(dir);
-        errno = save;
+    count->bytes += (unsigned long long) st.st_blocks * 512;
+    return S_ISDIR(st.st_mode) ? WALK_DESCEND : 0;
+}
+
+long long
+dirDiskUsage(const char *path, int threads)
+{
+    WalkCount count;
+    struct stat st;
+
+    if (lstat(path, &st) < 0) {
         return -1;
     }
+    if (!S_ISDIR(st.st_mode)) {
+        return (long long) st.st_blocks * 512;
+    }
 
-    /* close directory handle */
-    if (closedir(dir) < 0) {
+    if (dirWalk(path, threads, usageVisit, NULL, NULL, NULL, NULL, &count) < 0) {
         return -1;
     }
-
-    /* delete target directory */
-    return rmdir(path);
+    return (long long) st.st_blocks * 512 + (long long) count.bytes;
 }
 
 int
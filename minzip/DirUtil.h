@@ -40,6 +40,26 @@ int dirCreateHierarchy(const char *path, int mode,
  */
 int dirUnlinkHierarchy(const char *path);
 
+/* Called now and then on the thread that called dirUnlinkHierarchyEx(),
+ * with the number of files removed so far and their size.
+ */
+typedef void (*DirUnlinkProgress)(unsigned long long files,
+        unsigned long long bytes, void *cookie);
+
+/* rm -rf <path> on <threads> workers (<= 0 picks a default). With
+ * keepRoot, only what's inside path goes, hidden entries included.
+ * Returns -1 with errno set to the first error, after removing
+ * everything it could.
+ */
+int dirUnlinkHierarchyEx(const char *path, int threads, bool keepRoot,
+        DirUnlinkProgress progress, void *cookie);
+
+/* du -s <path> in bytes, walked on <threads> workers (<= 0 picks a
+ * default). Files with several links are counted each time. Returns -1
+ * with errno set to the first error.
+ */
+long long dirDiskUsage(const char *path, int threads);
+
 /* chown -R <uid>:<gid> <path>
  * chmod -R <mode> <path>
  *
@@ -13,6 +13,8 @@ mmcutils.c
 
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
+LOCAL_C_INCLUDES += bootable/recovery
+LOCAL_SHARED_LIBRARIES := libmtdutils
 
 include $(BUILD_SHARED_LIBRARY)
 
@@ -40,6 +40,7 @@
 #include <sys/mount.h> // for _IOW, _IOR, mount()
 
 #include "mmcutils.h"
+#include "mtdutils/rawcopy.h"
 
 unsigned ext3_count = 0;
 char *ext3_partitions[] = {"system", "userdata", "cache", "NONE"};
@@ -419,107 +420,15 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
 
 int
 mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
-
-    in = fopen ( in_file, "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file, "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return raw_copy(in_file, partition->device_index, RAW_DIRECT | RAW_SPARSE);
 }
 
 
 int
 mmc_raw_dump_internal (const char* in_file, const char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-
-    in = fopen ( in_file, "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file, "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return raw_copy(in_file, out_file, RAW_DIRECT);
 }
 
-// TODO: refactor this to not be a giant copy paste mess
 int
 mmc_raw_dump (const MmcPartition *partition, char *out_file) {
     return mmc_raw_dump_internal(partition->device_index, out_file);
@@ -593,7 +502,7 @@ int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
         return mmc_raw_copy(p, filename);
     }
     else {
-        return mmc_raw_dump_internal(filename, partition);
+        return raw_copy(filename, partition, RAW_DIRECT | RAW_SPARSE);
     }
 }
 
@@ -612,6 +521,21 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
     }
 }
 
+int cmd_mmc_backup_raw_partition_sparse(const char *partition, const char *filename)
+{
+    if (partition[0] != '/') {
+        mmc_scan_partitions();
+        const MmcPartition *p;
+        p = mmc_find_partition_by_name(partition);
+        if (p == NULL)
+            return -1;
+        return raw_dump_sparse(p->device_index, filename, RAW_DIRECT);
+    }
+    else {
+        return raw_dump_sparse(partition, filename, RAW_DIRECT);
+    }
+}
+
 int cmd_mmc_erase_raw_partition(const char *partition)
 {
     return 0;
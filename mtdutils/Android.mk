@@ -6,7 +6,9 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
 	mtdutils.c \
-	mounts.c 
+	mounts.c \
+	rawcopy.c \
+	sparse.c
 
 LOCAL_MODULE := libmtdutils
 
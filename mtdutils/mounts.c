@@ -19,7 +19,10 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 
 #include "mounts.h"
 
@@ -34,12 +37,18 @@ typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+    int watch_fd;       // polls readable with POLLPRI when the table changes
+    int valid;          // the volumes match the table as of the last poll
+    unsigned int generation;    // bumped each time the table is re-read
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    -1,     // watch_fd
+    0,      // valid
+    0       // generation
 };
 
 static inline void
@@ -55,6 +64,25 @@ free_volume_internals(const MountedVolume *volume, int zero)
 }
 
 #define PROC_MOUNTS_FILENAME   "/proc/mounts"
+#define PROC_SELF_MOUNTS_FILENAME   "/proc/self/mounts"
+
+/* The kernel flags an open mounts file with POLLPRI|POLLERR whenever
+ * something is mounted or unmounted, our own calls included, and clears
+ * it again once poll() has seen it.
+ */
+static int
+mounts_unchanged()
+{
+    struct pollfd pfd;
+
+    if (!g_mounts_state.valid) {
+        return 0;
+    }
+    pfd.fd = g_mounts_state.watch_fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+    return pfd.fd >= 0 && poll(&pfd, 1, 0) == 0;
+}
 
 int
 scan_mounted_volumes()
@@ -64,6 +92,19 @@ scan_mounted_volumes()
     int fd;
     ssize_t nbytes;
 
+    if (mounts_unchanged()) {
+        return 0;
+    }
+    if (g_mounts_state.watch_fd < 0) {
+        g_mounts_state.watch_fd = open(PROC_SELF_MOUNTS_FILENAME, O_RDONLY);
+    } else {
+        /* Clears the flag; anything after this is caught by the next scan.
+         */
+        struct pollfd pfd = { g_mounts_state.watch_fd, POLLPRI, 0 };
+        poll(&pfd, 1, 0);
+    }
+    g_mounts_state.valid = 0;
+
     if (g_mounts_state.volumes == NULL) {
         const int numv = 32;
         MountedVolume *volumes = malloc(numv * sizeof(*volumes));
@@ -152,6 +193,8 @@ printf("matches was %d on <<%.40s>>\n", matches, bufp);
         }
     }
 
+    g_mounts_state.valid = 1;
+    g_mounts_state.generation++;
     return 0;
 
 bail:
@@ -160,6 +203,13 @@ bail:
     return -1;
 }
 
+unsigned int
+mounted_volumes_generation()
+{
+    scan_mounted_volumes();
+    return g_mounts_state.generation;
+}
+
 const MountedVolume *
 find_mounted_volume_by_device(const char *device)
 {
@@ -198,9 +248,30 @@ find_mounted_volume_by_mount_point(const char *mount_point)
     return NULL;
 }
 
+/* Flushes just the filesystem being unmounted, rather than everything
+ * with sync().
+ */
+static void
+sync_mounted_volume(const MountedVolume *volume)
+{
+#ifdef __NR_syncfs
+    int fd = open(volume->mount_point, O_RDONLY);
+    if (fd >= 0) {
+        int ret = syscall(__NR_syncfs, fd);
+        close(fd);
+        if (ret == 0) return;
+    }
+#endif
+    sync();
+}
+
 int
 unmount_mounted_volume(const MountedVolume *volume)
 {
+    if (volume->mount_point != NULL) {
+        sync_mounted_volume(volume);
+    }
+
     /* Intentionally pass NULL to umount if the caller tries
      * to unmount a volume they already unmounted using this
      * function.
@@ -21,6 +21,12 @@ typedef struct MountedVolume MountedVolume;
 
 int scan_mounted_volumes(void);
 
+/* Changes whenever something has been mounted or unmounted since the last
+ * call, by us or anyone else.  Without a way to watch the mount table it
+ * changes on every call.
+ */
+unsigned int mounted_volumes_generation(void);
+
 const MountedVolume *find_mounted_volume_by_device(const char *device);
 
 const MountedVolume *
@@ -22,17 +22,26 @@
 #include <errno.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include <mtd/mtd-user.h>
 #undef NDEBUG
 #include <assert.h>
 
 #include "mtdutils.h"
+#include "sparse.h"
 
 struct MtdPartition {
     int device_index;
     unsigned int size;
     unsigned int erase_size;
     char *name;
+
+    /* One byte per erase block, set if the block is bad.  Built when the
+     * partition is scanned and extended when a write gives up on a block;
+     * NULL if the scan failed, in which case every block is asked for.
+     */
+    unsigned char *bad_blocks;
 };
 
 struct MtdReadContext {
@@ -42,31 +51,102 @@ struct MtdReadContext {
     int fd;
 };
 
+/* Blocks handed to the writer thread.  The caller fills the slot after the
+ * queued ones while the thread erases, programs and verifies the oldest.
+ */
+#define MTD_WRITE_QUEUE 4
+
 struct MtdWriteContext {
     const MtdPartition *partition;
-    char *buffer;
-    size_t stored;
+    size_t stored;      // bytes in the slot being filled
     int fd;
 
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    char *queue[MTD_WRITE_QUEUE];
+    int head;           // oldest queued slot
+    int count;          // slots queued for the thread
+    int fill;           // slot being filled, only touched by the caller
+    int error;          // a queued block couldn't be written, errno in saved_errno
+    int saved_errno;
+    int stop;
+    int differential;   // leave blocks that already hold the data alone
+    char *verify;       // read-back buffer, only touched by the thread
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    MtdWriteStats stats;
+    struct timeval start;
 };
 
 typedef struct {
     MtdPartition *partitions;
     int partitions_allocd;
     int partition_count;
+    char *proc_mtd;         // what the table was parsed from
 } MtdState;
 
 static MtdState g_mtd_state = {
     NULL,   // partitions
     0,      // partitions_allocd
-    -1      // partition_count
+    -1,     // partition_count
+    NULL    // proc_mtd
 };
 
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
+/* Most partitions have no bad blocks at all, which the ECC stats tell us
+ * without asking about each block in turn.
+ */
+static void scan_bad_blocks(MtdPartition *p)
+{
+    char mtddevname[32];
+    sprintf(mtddevname, "/dev/mtd/mtd%d", p->device_index);
+    int fd = open(mtddevname, O_RDONLY);
+    if (fd < 0) return;
+
+    unsigned int blocks = p->size / p->erase_size;
+    unsigned char *map = calloc(blocks ? blocks : 1, 1);
+    struct mtd_ecc_stats stats;
+    if (map != NULL &&
+            (ioctl(fd, ECCGETSTATS, &stats) != 0 || stats.badblocks != 0)) {
+        unsigned int i;
+        for (i = 0; i < blocks; ++i) {
+            loff_t pos = (loff_t) i * p->erase_size;
+            int ret = ioctl(fd, MEMGETBADBLOCK, &pos);
+            if (ret == -1 && errno == EOPNOTSUPP) break;  // NOR, never bad
+            if (ret < 0) {
+                fprintf(stderr, "mtd: can't scan %s for bad blocks (%s)\n",
+                        p->name, strerror(errno));
+                free(map);
+                map = NULL;
+                break;
+            }
+            map[i] = (ret > 0);
+        }
+    }
+    close(fd);
+    p->bad_blocks = map;
+}
+
+static int block_is_bad(const MtdPartition *partition, int fd, loff_t pos)
+{
+    if (partition->bad_blocks != NULL) {
+        return partition->bad_blocks[pos / partition->erase_size];
+    }
+    return ioctl(fd, MEMGETBADBLOCK, &pos);
+}
+
+static void mark_block_bad(const MtdPartition *partition, loff_t pos)
+{
+    if (partition->bad_blocks != NULL) {
+        partition->bad_blocks[pos / partition->erase_size] = 1;
+    }
+}
+
 int
 mtd_scan_partitions()
 {
@@ -76,6 +156,29 @@ mtd_scan_partitions()
     int i;
     ssize_t nbytes;
 
+    /* Open and read the file contents.
+     */
+    fd = open(MTD_PROC_FILENAME, O_RDONLY);
+    if (fd < 0) {
+        goto bail;
+    }
+    nbytes = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nbytes < 0) {
+        goto bail;
+    }
+    buf[nbytes] = '\0';
+
+    /* The table hardly ever changes, and this is called before most
+     * operations; don't throw away names callers may still hold.
+     */
+    if (g_mtd_state.partition_count >= 0 && g_mtd_state.proc_mtd != NULL &&
+            strcmp(g_mtd_state.proc_mtd, buf) == 0) {
+        return g_mtd_state.partition_count;
+    }
+    free(g_mtd_state.proc_mtd);
+    g_mtd_state.proc_mtd = NULL;
+
     if (g_mtd_state.partitions == NULL) {
         const int nump = 32;
         MtdPartition *partitions = malloc(nump * sizeof(*partitions));
@@ -102,19 +205,6 @@ mtd_scan_partitions()
         p->device_index = -1;
     }
 
-    /* Open and read the file contents.
-     */
-    fd = open(MTD_PROC_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
-    }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
-        goto bail;
-    }
-    buf[nbytes] = '\0';
-
     /* Parse the contents of the file, which looks like:
      *
      *     # cat /proc/mtd
@@ -141,6 +231,15 @@ mtd_scan_partitions()
          */
         if (matches == 4) {
             MtdPartition *p = &g_mtd_state.partitions[mtdnum];
+            /* Keep the bad block map of a partition that hasn't changed;
+             * this is called before most operations.
+             */
+            if (p->bad_blocks != NULL &&
+                    (p->size != (unsigned int) mtdsize ||
+                     p->erase_size != (unsigned int) mtderasesize)) {
+                free(p->bad_blocks);
+                p->bad_blocks = NULL;
+            }
             p->device_index = mtdnum;
             p->size = mtdsize;
             p->erase_size = mtderasesize;
@@ -149,6 +248,9 @@ mtd_scan_partitions()
                 errno = ENOMEM;
                 goto bail;
             }
+            if (p->bad_blocks == NULL && p->erase_size > 0) {
+                scan_bad_blocks(p);
+            }
             g_mtd_state.partition_count++;
         }
 
@@ -164,6 +266,7 @@ mtd_scan_partitions()
         }
     }
 
+    g_mtd_state.proc_mtd = strdup(buf);
     return g_mtd_state.partition_count;
 
 bail:
@@ -299,7 +402,11 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
     int mgbb;
 
     while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
+        if ((mgbb = block_is_bad(partition, fd, pos))) {
+            fprintf(stderr,
+                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
+                    mgbb, pos, errno);
+        } else if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
             fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
                     pos, strerror(errno));
         } else if (ioctl(fd, ECCGETSTATS, &after)) {
@@ -311,10 +418,6 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
                     after.failed - before.failed, pos);
             // copy the comparison baseline for the next read.
             memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
         } else {
             return 0;  // Success!
         }
@@ -326,6 +429,40 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
     return -1;
 }
 
+/* Reads up to 'max' blocks with a single read() when the bad block map
+ * says the blocks ahead are good, and returns how many were read.  Falls
+ * back to read_block() for bad blocks, and to find the block behind an
+ * ECC error.
+ */
+static int read_blocks(const MtdPartition *partition, int fd, char *data, int max)
+{
+    ssize_t size = partition->erase_size;
+    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    int count = 0;
+
+    if (partition->bad_blocks != NULL && pos >= 0) {
+        loff_t end = pos;
+        while (count < max && end + size <= (int) partition->size &&
+               !partition->bad_blocks[end / size]) {
+            end += size;
+            count++;
+        }
+    }
+    if (count > 1) {
+        struct mtd_ecc_stats before, after;
+        if (ioctl(fd, ECCGETSTATS, &before) == 0 &&
+                read(fd, data, count * size) == count * size &&
+                ioctl(fd, ECCGETSTATS, &after) == 0 &&
+                after.failed == before.failed) {
+            return count;
+        }
+        lseek64(fd, pos, SEEK_SET);
+    }
+
+    if (read_block(partition, fd, data)) return -1;
+    return 1;
+}
+
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
     ssize_t read = 0;
@@ -341,8 +478,10 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
         // Read complete blocks directly into the user's buffer
         while (ctx->consumed == ctx->partition->erase_size &&
                len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+            int n = read_blocks(ctx->partition, ctx->fd, data + read,
+                                (len - read) / ctx->partition->erase_size);
+            if (n < 0) return -1;
+            read += n * ctx->partition->erase_size;
         }
 
         if (read >= len) {
@@ -366,18 +505,32 @@ void mtd_read_close(MtdReadContext *ctx)
     free(ctx);
 }
 
+static void *write_thread(void *cookie);
+
+static void free_write_context(MtdWriteContext *ctx) {
+    int i;
+    for (i = 0; i < MTD_WRITE_QUEUE; ++i) free(ctx->queue[i]);
+    free(ctx->verify);
+    free(ctx->bad_block_offsets);
+    free(ctx);
+}
+
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
-    MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
+    MtdWriteContext *ctx = (MtdWriteContext*) calloc(1, sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
-
-    ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
-        free(ctx);
+    int i;
+    for (i = 0; i < MTD_WRITE_QUEUE; ++i) {
+        ctx->queue[i] = malloc(partition->erase_size);
+        if (ctx->queue[i] == NULL) {
+            free_write_context(ctx);
+            return NULL;
+        }
+    }
+    ctx->verify = malloc(partition->erase_size);
+    if (ctx->verify == NULL) {
+        free_write_context(ctx);
         return NULL;
     }
 
@@ -385,17 +538,27 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
     ctx->fd = open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
-        free(ctx->buffer);
-        free(ctx);
+        free_write_context(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->stored = 0;
+    gettimeofday(&ctx->start, NULL);
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    if (pthread_create(&ctx->thread, NULL, write_thread, ctx) != 0) {
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->lock);
+        close(ctx->fd);
+        free_write_context(ctx);
+        return NULL;
+    }
     return ctx;
 }
 
 static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
+    mark_block_bad(ctx->partition, pos);
     if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
         ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
         ctx->bad_block_offsets = realloc(ctx->bad_block_offsets,
@@ -404,51 +567,114 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
-static int write_block(MtdWriteContext *ctx, const char *data)
+static long long usec_since(const struct timeval *then) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - then->tv_sec) * 1000000LL + (now.tv_usec - then->tv_usec);
+}
+
+/* Whether the block at 'pos' reads back cleanly and holds 'data'. */
+static int block_matches(MtdWriteContext *ctx, loff_t pos, const char *data)
+{
+    ssize_t size = ctx->partition->erase_size;
+    struct mtd_ecc_stats before, after;
+
+    return ioctl(ctx->fd, ECCGETSTATS, &before) == 0 &&
+           lseek64(ctx->fd, pos, SEEK_SET) == pos &&
+           read(ctx->fd, ctx->verify, size) == size &&
+           ioctl(ctx->fd, ECCGETSTATS, &after) == 0 &&
+           after.failed == before.failed &&
+           memcmp(data, ctx->verify, size) == 0;
+}
+
+/* Runs on the writer thread only; 'st' collects what it cost. */
+static int write_block(MtdWriteContext *ctx, const char *data, MtdWriteStats *st)
 {
     const MtdPartition *partition = ctx->partition;
     int fd = ctx->fd;
+    struct timeval t;
 
     off_t pos = lseek(fd, 0, SEEK_CUR);
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+        int ret = block_is_bad(partition, fd, pos);
         if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
             add_bad_block_offset(ctx, pos);
             fprintf(stderr,
                     "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
                     pos, ret, errno);
+            st->bad_blocks++;
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        if (ctx->differential) {
+            gettimeofday(&t, NULL);
+            int same = block_matches(ctx, pos, data);
+            st->verify_usec += usec_since(&t);
+            if (same && lseek(fd, pos + size, SEEK_SET) == pos + size) {
+                st->unchanged++;
+                st->blocks++;
+                st->bytes += size;
+                return 0;
+            }
+        }
+
+        // Erased flash already reads as all ones; there's nothing to program
+        int blank = ((unsigned char) data[0] == 0xff &&
+                     memcmp(data, data + 1, size - 1) == 0);
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
+            struct mtd_ecc_stats before, after;
+
+            if (retry > 0) st->retries++;
+            gettimeofday(&t, NULL);
             if (ioctl(fd, MEMERASE, &erase_info) < 0) {
                 fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
+            st->erase_usec += usec_since(&t);
+
+            if (blank && lseek(fd, pos + size, SEEK_SET) == pos + size) {
+                st->blocks++;
+                st->bytes += size;
+                return 0;
+            }
+
+            gettimeofday(&t, NULL);
             if (lseek(fd, pos, SEEK_SET) != pos ||
                 write(fd, data, size) != size) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
             }
+            st->write_usec += usec_since(&t);
 
-            char verify[size];
+            // Read it back; the ECC stats catch bits the chip had to
+            // correct beyond repair even when the data happens to match
+            gettimeofday(&t, NULL);
+            int have_ecc = (ioctl(fd, ECCGETSTATS, &before) == 0);
             if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
+                read(fd, ctx->verify, size) != size) {
                 fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
-            if (memcmp(data, verify, size) != 0) {
+            st->verify_usec += usec_since(&t);
+            if (have_ecc && ioctl(fd, ECCGETSTATS, &after) == 0 &&
+                after.failed != before.failed) {
+                fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08lx\n",
+                        after.corrected - before.corrected,
+                        after.failed - before.failed, pos);
+                continue;
+            }
+            if (memcmp(data, ctx->verify, size) != 0) {
                 fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
@@ -458,6 +684,8 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                 fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
             }
             fprintf(stderr, "mtd: successfully wrote block at %llx\n", pos);
+            st->blocks++;
+            st->bytes += size;
             return 0;  // Success!
         }
 
@@ -465,6 +693,7 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         add_bad_block_offset(ctx, pos);
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
         ioctl(fd, MEMERASE, &erase_info);
+        st->bad_blocks++;
         pos += partition->erase_size;
     }
 
@@ -473,44 +702,197 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     return -1;
 }
 
+/* Writes queued blocks in order.  After a failure the rest are dropped
+ * and the error is reported to the caller's next call.
+ */
+static void *write_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) cookie;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->count == 0 && !ctx->stop) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->count == 0) break;
+
+        const char *data = ctx->queue[ctx->head];
+        int failed = ctx->error;
+        MtdWriteStats st;
+        memset(&st, 0, sizeof(st));
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (!failed && write_block(ctx, data, &st)) failed = errno ? errno : EIO;
+
+        pthread_mutex_lock(&ctx->lock);
+        if (failed && !ctx->error) {
+            ctx->error = 1;
+            ctx->saved_errno = failed;
+        }
+        ctx->stats.bytes += st.bytes;
+        ctx->stats.blocks += st.blocks;
+        ctx->stats.unchanged += st.unchanged;
+        ctx->stats.bad_blocks += st.bad_blocks;
+        ctx->stats.retries += st.retries;
+        ctx->stats.erase_usec += st.erase_usec;
+        ctx->stats.write_usec += st.write_usec;
+        ctx->stats.verify_usec += st.verify_usec;
+        ctx->head = (ctx->head + 1) % MTD_WRITE_QUEUE;
+        ctx->count--;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* Hands the filled slot to the thread, waiting for room if need be. */
+static int queue_block(MtdWriteContext *ctx)
+{
+    int ret = 0;
+    pthread_mutex_lock(&ctx->lock);
+    ctx->count++;
+    pthread_cond_broadcast(&ctx->cond);
+    while (ctx->count == MTD_WRITE_QUEUE && !ctx->error) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    if (ctx->error) {
+        errno = ctx->saved_errno;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    ctx->fill = (ctx->fill + 1) % MTD_WRITE_QUEUE;
+    ctx->stored = 0;
+    return ret;
+}
+
+/* Waits for every queued block to be written. */
+static int flush_blocks(MtdWriteContext *ctx)
+{
+    int ret = 0;
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->count > 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    if (ctx->error) {
+        errno = ctx->saved_errno;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return ret;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
     size_t wrote = 0;
     while (wrote < len) {
-        // Coalesce partial writes into complete blocks
-        if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->stored;
-            size_t copy = len - wrote < avail ? len - wrote : avail;
-            memcpy(ctx->buffer + ctx->stored, data + wrote, copy);
-            ctx->stored += copy;
-            wrote += copy;
-        }
-
-        // If a complete block was accumulated, write it
+        // Coalesce writes into complete blocks in the slot after the
+        // queued ones, which the thread never touches
+        char *slot = ctx->queue[ctx->fill];
+        size_t avail = ctx->partition->erase_size - ctx->stored;
+        size_t copy = len - wrote < avail ? len - wrote : avail;
+        memcpy(slot + ctx->stored, data + wrote, copy);
+        ctx->stored += copy;
+        wrote += copy;
+
+        // If a complete block was accumulated, queue it
         if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
-            ctx->stored = 0;
+            if (queue_block(ctx)) return -1;
         }
+    }
+
+    return wrote;
+}
 
-        // Write complete blocks directly from the user's buffer
-        while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
-            wrote += ctx->partition->erase_size;
+struct SparseMtd {
+    ssize_t (*read_fn)(void *cookie, void *data, size_t len);
+    void *cookie;
+    MtdWriteContext *ctx;
+    unsigned long long offset;  // of the next byte to write
+    char *pattern;              // one erase block of 'value'
+    uint32_t value;
+    int have_pattern;
+};
+
+/* Writes 'value' up to 'end', a block of pattern at a time. */
+static int sparse_mtd_fill_to(struct SparseMtd *sm, unsigned long long end, uint32_t value)
+{
+    size_t size = sm->ctx->partition->erase_size;
+
+    if (end <= sm->offset) return 0;
+    if (!sm->have_pattern || sm->value != value) {
+        size_t i;
+        for (i = 0; i + sizeof(value) <= size; i += sizeof(value)) {
+            memcpy(sm->pattern + i, &value, sizeof(value));
         }
+        sm->value = value;
+        sm->have_pattern = 1;
     }
+    while (sm->offset < end) {
+        // Stay in step with the pattern, which starts on a block boundary
+        size_t skip = sm->offset % size;
+        size_t len = size - skip;
+        if (len > end - sm->offset) len = end - sm->offset;
+        if (mtd_write_data(sm->ctx, sm->pattern + skip, len) != (ssize_t) len) return -1;
+        sm->offset += len;
+    }
+    return 0;
+}
 
-    return wrote;
+static ssize_t sparse_mtd_read(void *cookie, void *data, size_t len)
+{
+    struct SparseMtd *sm = (struct SparseMtd *) cookie;
+    return sm->read_fn(sm->cookie, data, len);
+}
+
+static int sparse_mtd_data(void *cookie, unsigned long long offset, const void *data, size_t len)
+{
+    struct SparseMtd *sm = (struct SparseMtd *) cookie;
+
+    // Skipped (don't care) ranges are left erased
+    if (sparse_mtd_fill_to(sm, offset, 0xffffffff)) return -1;
+    if (mtd_write_data(sm->ctx, data, len) != (ssize_t) len) return -1;
+    sm->offset += len;
+    return 0;
+}
+
+static int sparse_mtd_fill(void *cookie, unsigned long long offset, unsigned long long len, uint32_t value)
+{
+    struct SparseMtd *sm = (struct SparseMtd *) cookie;
+
+    if (sparse_mtd_fill_to(sm, offset, 0xffffffff)) return -1;
+    return sparse_mtd_fill_to(sm, offset + len, value);
+}
+
+int mtd_write_sparse(MtdWriteContext *ctx,
+        ssize_t (*read_fn)(void *cookie, void *data, size_t len), void *cookie)
+{
+    struct SparseMtd sm;
+    unsigned long long size;
+    int ret;
+
+    memset(&sm, 0, sizeof(sm));
+    sm.read_fn = read_fn;
+    sm.cookie = cookie;
+    sm.ctx = ctx;
+    sm.pattern = malloc(ctx->partition->erase_size);
+    if (sm.pattern == NULL) return -1;
+
+    ret = sparse_read(sparse_mtd_read, sparse_mtd_data, sparse_mtd_fill, &sm, &size);
+    if (ret == 0) ret = sparse_mtd_fill_to(&sm, size, 0xffffffff);
+    free(sm.pattern);
+    return ret;
 }
 
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
+        char *slot = ctx->queue[ctx->fill];
         size_t zero = ctx->partition->erase_size - ctx->stored;
-        memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
-        ctx->stored = 0;
+        memset(slot + ctx->stored, 0, zero);
+        if (queue_block(ctx)) return -1;
     }
+    if (flush_blocks(ctx)) return -1;
 
     off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
@@ -524,8 +906,7 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (block_is_bad(ctx->partition, ctx->fd, pos) > 0) {
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
@@ -543,15 +924,46 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
     return pos;
 }
 
+void mtd_write_set_differential(MtdWriteContext *ctx, int enable)
+{
+    ctx->differential = enable;
+}
+
+void mtd_write_stats(MtdWriteContext *ctx, MtdWriteStats *stats)
+{
+    pthread_mutex_lock(&ctx->lock);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->lock);
+    stats->elapsed_usec = usec_since(&ctx->start);
+}
+
 int mtd_write_close(MtdWriteContext *ctx)
 {
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stop = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_join(ctx->thread, NULL);
+
+    MtdWriteStats st;
+    mtd_write_stats(ctx, &st);
+    if (st.blocks > 0) {
+        fprintf(stderr, "mtd: wrote %u blocks, %u unchanged (%llu KB/s; "
+                "erase %llu ms, write %llu ms, verify %llu ms; %u retries, %u bad)\n",
+                st.blocks, st.unchanged,
+                st.bytes * 1000 / (st.elapsed_usec / 1000 + 1) / 1024,
+                st.erase_usec / 1000, st.write_usec / 1000, st.verify_usec / 1000,
+                st.retries, st.bad_blocks);
+    }
+
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
     if (close(ctx->fd)) r = -1;
-    free(ctx->bad_block_offsets);
-    free(ctx->buffer);
-    free(ctx);
+    free_write_context(ctx);
     return r;
 }
 
@@ -560,6 +972,7 @@ int mtd_write_close(MtdWriteContext *ctx)
  */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
     int i;
+    flush_blocks(ctx);
     for (i = 0; i < ctx->bad_block_count; ++i) {
         if (ctx->bad_block_offsets[i] == pos) {
             pos += ctx->partition->erase_size;
@@ -574,6 +987,36 @@ off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
 #define SPARE_SIZE (BLOCK_SIZE >> 5)
 #define HEADER_SIZE 2048
 
+static ssize_t fd_read(void *cookie, void *data, size_t len)
+{
+    return read(*(int *) cookie, data, len);
+}
+
+// Sparse images hold filesystems, not boot images, so there's no header to
+// hold back; they go out in one pass
+static int restore_sparse(const MtdPartition *partition, const char *partition_name, int fd)
+{
+    MtdWriteContext *out = mtd_write_partition(partition);
+    if (out == NULL)
+    {
+       printf("error writing %s", partition_name);
+       return -1;
+    }
+
+    if (mtd_write_sparse(out, fd_read, &fd))
+    {
+        mtd_write_close(out);
+        printf("error writing %s", partition_name);
+        return -1;
+    }
+    if (mtd_write_close(out))
+    {
+        printf("error closing %s", partition_name);
+        return -1;
+    }
+    return 0;
+}
+
 int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filename)
 {
     const MtdPartition *ptn;
@@ -602,6 +1045,14 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
         return -1;
     }
 
+    if (sparse_is_image(fd))
+    {
+        printf("flashing %s from sparse image %s\n", partition_name, filename);
+        int ret = restore_sparse(partition, partition_name, fd);
+        close(fd);
+        return ret;
+    }
+
     char header[HEADER_SIZE];
     int headerlen = read(fd, header, sizeof(header));
     if (headerlen <= 0)
@@ -723,9 +1174,10 @@ int cmd_mtd_restore_raw_partition(const char *partition_name, const char *filena
 }
 
 
-int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filename)
+static int backup_raw_partition(const char *partition_name, const char *filename, int sparse)
 {
     MtdReadContext *in;
+    SparseWriter *sw = NULL;
     const MtdPartition *partition;
     char buf[BLOCK_SIZE + SPARE_SIZE];
     size_t partition_size;
@@ -766,6 +1218,13 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
        return -1;
     }
 
+    if (sparse && (sw = sparse_create_fd(fd)) == NULL) {
+        close(fd);
+        unlink(filename);
+        printf("error starting sparse image %s", filename);
+        return -1;
+    }
+
     in = mtd_read_partition(partition);
     if (in == NULL) {
         close(fd);
@@ -776,7 +1235,11 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
 
     total = 0;
     while ((len = mtd_read_data(in, buf, BLOCK_SIZE)) > 0) {
-        wrote = write(fd, buf, len);
+        if (sw != NULL) {
+            wrote = sparse_write(sw, buf, len) ? -1 : len;
+        } else {
+            wrote = write(fd, buf, len);
+        }
         if (wrote != len) {
             close(fd);
             unlink(filename);
@@ -788,6 +1251,13 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
 
     mtd_read_close(in);
 
+    if (sw != NULL && sparse_close(sw)) {
+        close(fd);
+        unlink(filename);
+        printf("error finishing sparse image %s", filename);
+        return -1;
+    }
+
     if (close(fd)) {
         unlink(filename);
         printf("error closing %s", filename);
@@ -796,6 +1266,16 @@ int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filenam
     return 0;
 }
 
+int cmd_mtd_backup_raw_partition(const char *partition_name, const char *filename)
+{
+    return backup_raw_partition(partition_name, filename, 0);
+}
+
+int cmd_mtd_backup_raw_partition_sparse(const char *partition_name, const char *filename)
+{
+    return backup_raw_partition(partition_name, filename, 1);
+}
+
 int cmd_mtd_erase_raw_partition(const char *partition_name)
 {
     MtdWriteContext *out;
@@ -53,4 +53,35 @@ off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
 
+/* Blocks are erased, written and read back on a thread of their own while
+ * the caller produces the next ones.  A failure shows up as an error from
+ * a later mtd_write_data(), mtd_erase_blocks() or mtd_write_close().
+ * These counters say where the time went.
+ */
+typedef struct {
+    unsigned long long bytes;           /* written and verified */
+    unsigned int blocks;
+    unsigned int unchanged;             /* of those, left alone as they were */
+    unsigned int bad_blocks;            /* skipped, bad already or failed now */
+    unsigned int retries;
+    unsigned long long erase_usec;
+    unsigned long long write_usec;
+    unsigned long long verify_usec;
+    unsigned long long elapsed_usec;    /* since mtd_write_partition() */
+} MtdWriteStats;
+
+void mtd_write_stats(MtdWriteContext *, MtdWriteStats *);
+
+/* Differential mode reads each block before erasing it and leaves it alone
+ * if it already holds the data, which saves time and wear when reflashing
+ * an image that barely changed.  Set it before writing any data.
+ */
+void mtd_write_set_differential(MtdWriteContext *, int enable);
+
+/* Writes an Android sparse image, read through read_fn, expanded.  Don't
+ * care ranges and the space after the image are left erased.
+ */
+int mtd_write_sparse(MtdWriteContext *,
+        ssize_t (*read_fn)(void *cookie, void *data, size_t len), void *cookie);
+
 #endif  // MTDUTILS_H_
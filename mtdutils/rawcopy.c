@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "rawcopy.h"
+#include "sparse.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+#define RAW_ALIGN   4096
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT  _IO(0x12,127)
+#endif
+
+/* One buffer is filled by the reader thread while the other is drained by
+ * the caller.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf[2];
+    ssize_t len[2];     /* valid once full[] is set; -1 for a read error */
+    int full[2];
+    int read_errno;
+    int stop;           /* the caller gave up, the reader should too */
+    int in_fd;
+    int flags;
+} RawPipe;
+
+/* O_DIRECT needs aligned offsets and lengths, which the odd sized tail of
+ * an image or a pipe doesn't give us; carry on through the page cache.
+ */
+static int drop_direct(int fd) {
+    int mode = fcntl(fd, F_GETFL);
+    if (mode < 0 || !(mode & O_DIRECT)) return -1;
+    return fcntl(fd, F_SETFL, mode & ~O_DIRECT);
+}
+
+static ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, buf + got, len - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EINVAL && drop_direct(fd) == 0) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return got;
+}
+
+static int write_full(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EINVAL && drop_direct(fd) == 0) continue;
+        if (w <= 0) return -1;
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+int raw_open(const char *path, int mode, int flags) {
+    struct stat st;
+    int blk = (stat(path, &st) == 0 && S_ISBLK(st.st_mode));
+
+    mode |= O_LARGEFILE;
+    if (blk && (flags & RAW_DIRECT)) mode |= O_DIRECT;
+    if (!blk && (mode & O_ACCMODE) != O_RDONLY) mode |= O_CREAT | O_TRUNC;
+    return open(path, mode, 0666);
+}
+
+static void *reader_thread(void *cookie) {
+    RawPipe *p = (RawPipe *) cookie;
+    int i = 0;
+
+    for (;;) {
+        ssize_t len;
+        int stop;
+
+        pthread_mutex_lock(&p->lock);
+        while (p->full[i] && !p->stop) pthread_cond_wait(&p->cond, &p->lock);
+        stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) break;
+
+        len = read_full(p->in_fd, p->buf[i], RAW_COPY_SIZE);
+        if (len > 0 && len < RAW_COPY_SIZE && (p->flags & RAW_PAD) && len % RAW_PAD_SIZE) {
+            size_t pad = RAW_PAD_SIZE - len % RAW_PAD_SIZE;
+            memset(p->buf[i] + len, 0, pad);
+            len += pad;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (len < 0) p->read_errno = errno;
+        p->len[i] = len;
+        p->full[i] = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        if (len < RAW_COPY_SIZE) break;     /* end of input, or an error */
+        i ^= 1;
+    }
+    return NULL;
+}
+
+int raw_read_fd(int in_fd, raw_out_fn out, void *cookie, int flags) {
+    RawPipe p;
+    pthread_t thread;
+    int i = 0, ret = 0;
+
+    memset(&p, 0, sizeof(p));
+    p.in_fd = in_fd;
+    p.flags = flags;
+    p.buf[0] = memalign(RAW_ALIGN, RAW_COPY_SIZE);
+    p.buf[1] = memalign(RAW_ALIGN, RAW_COPY_SIZE);
+    if (p.buf[0] == NULL || p.buf[1] == NULL) {
+        free(p.buf[0]);
+        free(p.buf[1]);
+        return -1;
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    if (pthread_create(&thread, NULL, reader_thread, &p) != 0) {
+        ret = -1;
+        goto done;
+    }
+
+    for (;;) {
+        ssize_t len;
+
+        pthread_mutex_lock(&p.lock);
+        while (!p.full[i]) pthread_cond_wait(&p.cond, &p.lock);
+        len = p.len[i];
+        pthread_mutex_unlock(&p.lock);
+
+        if (len < 0) {
+            printf("error reading raw data: %s\n", strerror(p.read_errno));
+            ret = -1;
+            break;
+        }
+        if (len > 0 && out(cookie, p.buf[i], len) != 0) {
+            ret = -1;
+            break;
+        }
+        if (len < RAW_COPY_SIZE) break;
+
+        pthread_mutex_lock(&p.lock);
+        p.full[i] = 0;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+        i ^= 1;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    pthread_join(thread, NULL);
+
+done:
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    free(p.buf[0]);
+    free(p.buf[1]);
+    return ret;
+}
+
+static int fd_out(void *cookie, const void *data, size_t len) {
+    if (write_full(*(int *) cookie, (const char *) data, len) == 0) return 0;
+    printf("error writing raw data: %s\n", strerror(errno));
+    return -1;
+}
+
+/* off_t is 32 bits on the device, hence lseek64 rather than pwrite */
+static int write_at(int fd, const void *data, size_t len, loff_t offset) {
+    if (lseek64(fd, offset, SEEK_SET) != offset) return -1;
+    return write_full(fd, (const char *) data, len);
+}
+
+int raw_fill(int fd, loff_t offset, unsigned long long len, uint32_t value) {
+    uint64_t range[2] = { offset, len };
+    uint32_t *buf;
+    size_t i;
+    int ret = 0;
+
+    if (value == 0 && ioctl(fd, BLKZEROOUT, range) == 0) return 0;
+
+    buf = malloc(RAW_COPY_SIZE);
+    if (buf == NULL) return -1;
+    for (i = 0; i < RAW_COPY_SIZE / sizeof(uint32_t); ++i) buf[i] = value;
+
+    while (len > 0 && ret == 0) {
+        size_t chunk = len < RAW_COPY_SIZE ? (size_t) len : RAW_COPY_SIZE;
+        ret = write_at(fd, buf, chunk, offset);
+        offset += chunk;
+        len -= chunk;
+    }
+    free(buf);
+    return ret;
+}
+
+static ssize_t sparse_in(void *cookie, void *data, size_t len) {
+    return read_full(((int *) cookie)[0], data, len);
+}
+
+static int sparse_data(void *cookie, unsigned long long offset, const void *data, size_t len) {
+    if (write_at(((int *) cookie)[1], data, len, offset) == 0) return 0;
+    printf("error writing raw data: %s\n", strerror(errno));
+    return -1;
+}
+
+static int sparse_fill(void *cookie, unsigned long long offset, unsigned long long len, uint32_t value) {
+    if (raw_fill(((int *) cookie)[1], offset, len, value) == 0) return 0;
+    printf("error filling raw data: %s\n", strerror(errno));
+    return -1;
+}
+
+int raw_copy_fd(int in_fd, int out_fd, int flags) {
+    if ((flags & RAW_SPARSE) && sparse_is_image(in_fd)) {
+        int fds[2] = { in_fd, out_fd };
+        unsigned long long size;
+        struct stat st;
+
+        if (sparse_read(sparse_in, sparse_data, sparse_fill, fds, &size) != 0) return -1;
+        /* An image ending in a don't care chunk never writes its last
+         * bytes, so a file has to be grown to the full size here */
+        if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            ftruncate64(out_fd, size) != 0) {
+            printf("error sizing raw data: %s\n", strerror(errno));
+            return -1;
+        }
+    } else if (raw_read_fd(in_fd, fd_out, &out_fd, flags) != 0) {
+        return -1;
+    }
+
+    /* Pipes and the like can't be synced, and don't need to be */
+    if (fsync(out_fd) != 0 && errno != EINVAL && errno != EROFS) {
+        printf("error syncing raw data: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int raw_copy(const char *in_path, const char *out_path, int flags) {
+    int in_fd, out_fd, ret;
+
+    in_fd = raw_open(in_path, O_RDONLY, flags);
+    if (in_fd < 0) {
+        printf("error opening %s: %s\n", in_path, strerror(errno));
+        return -1;
+    }
+    out_fd = raw_open(out_path, O_WRONLY, flags);
+    if (out_fd < 0) {
+        printf("error opening %s: %s\n", out_path, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+
+    ret = raw_copy_fd(in_fd, out_fd, flags);
+    close(in_fd);
+    if (close(out_fd) != 0) ret = -1;
+    return ret;
+}
+
+static int sparse_out(void *cookie, const void *data, size_t len) {
+    if (sparse_write((SparseWriter *) cookie, data, len) == 0) return 0;
+    printf("error writing sparse data: %s\n", strerror(errno));
+    return -1;
+}
+
+int raw_dump_sparse(const char *in_path, const char *out_path, int flags) {
+    SparseWriter *sw;
+    int in_fd, out_fd, ret;
+
+    in_fd = raw_open(in_path, O_RDONLY, flags);
+    if (in_fd < 0) {
+        printf("error opening %s: %s\n", in_path, strerror(errno));
+        return -1;
+    }
+    out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0666);
+    if (out_fd < 0) {
+        printf("error opening %s: %s\n", out_path, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+
+    sw = sparse_create_fd(out_fd);
+    ret = sw ? raw_read_fd(in_fd, sparse_out, sw, flags) : -1;
+    if (sw && sparse_close(sw) != 0) ret = -1;
+    close(in_fd);
+    if (close(out_fd) != 0) ret = -1;
+    return ret;
+}
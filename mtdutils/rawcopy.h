@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RAWCOPY_H_
+#define RAWCOPY_H_
+
+#include <stdint.h>
+#include <sys/types.h>  // for size_t, etc.
+
+/* Raw copies between block devices and image files. Data moves in large
+ * page aligned buffers; the next buffer is read on a second thread while
+ * the last one is written, and the destination is only synced once, at
+ * the end.
+ */
+
+#define RAW_COPY_SIZE   (1024 * 1024)   /* bytes per buffer */
+
+#define RAW_DIRECT      0x01    /* O_DIRECT on block devices, where it works */
+#define RAW_PAD         0x02    /* zero pad the last write to RAW_PAD_SIZE */
+#define RAW_SPARSE      0x04    /* expand input that is an Android sparse image */
+
+#define RAW_PAD_SIZE    4096
+
+typedef int (*raw_out_fn)(void *cookie, const void *data, size_t len);
+
+/* open(2) for copies: adds O_LARGEFILE, and O_DIRECT for block devices
+ * when RAW_DIRECT is set.  Regular files opened for writing are created
+ * and truncated.
+ */
+int raw_open(const char *path, int mode, int flags);
+
+/* Hands everything up to the end of in_fd to 'out', RAW_COPY_SIZE bytes at
+ * a time (less only for the last piece).  0 ok, -1 on a read error or if
+ * 'out' fails.
+ */
+int raw_read_fd(int in_fd, raw_out_fn out, void *cookie, int flags);
+
+/* Copies in_fd to out_fd and syncs out_fd.  0 ok, -1 on error.  With
+ * RAW_SPARSE a sparse image is written out expanded: raw chunks where
+ * they go, fills with raw_fill(), and don't care ranges not at all.  A
+ * regular file is then sized to the expanded image.
+ */
+int raw_copy_fd(int in_fd, int out_fd, int flags);
+
+/* raw_copy_fd() between two paths. */
+int raw_copy(const char *in_path, const char *out_path, int flags);
+
+/* Fills 'len' bytes at 'offset' with the 32 bit 'value'.  Zeros are left
+ * to the device (BLKZEROOUT) when it can do that.
+ */
+int raw_fill(int fd, loff_t offset, unsigned long long len, uint32_t value);
+
+/* Dumps in_path to out_path as a sparse image, so runs of zeros take no
+ * room.  The input has to be a multiple of 4096 bytes.
+ */
+int raw_dump_sparse(const char *in_path, const char *out_path, int flags);
+
+#endif  // RAWCOPY_H_
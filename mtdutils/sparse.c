@@ -0,0 +1,485 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparse.h"
+
+#define SPARSE_READ_SIZE    (1024 * 1024)
+
+struct SparseWriter {
+    sparse_out_fn out;
+    void* cookie;
+    unsigned long long size;
+    unsigned long long bytes_in;
+    unsigned char* region;
+    size_t fill;
+    int error;
+
+    // Only used by mapped images
+    unsigned block_size;
+    uint32_t chunks;
+    unsigned long long raw_left;
+
+    // Only used by images whose size isn't known up front
+    int fd;
+    loff_t start;
+    uint32_t chunks_out;
+};
+
+static const unsigned char zero_region[SPARSE_REGION_SIZE];
+
+static int sparse_header(sparse_out_fn out, void* cookie, unsigned block_size, uint32_t blocks, uint32_t chunks)
+{
+    sparse_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPARSE_HEADER_MAGIC;
+    hdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    hdr.file_hdr_sz = sizeof(sparse_header_t);
+    hdr.chunk_hdr_sz = sizeof(chunk_header_t);
+    hdr.blk_sz = block_size;
+    hdr.total_blks = blocks;
+    hdr.total_chunks = chunks;
+    return out(cookie, &hdr, sizeof(hdr));
+}
+
+static int sparse_flush(SparseWriter* sw)
+{
+    chunk_header_t chunk;
+
+    if (sw->fill == 0)
+        return 0;
+
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.chunk_sz = sw->fill / SPARSE_BLOCK_SIZE;
+
+    if (memcmp(sw->region, zero_region, sw->fill) == 0)
+    {
+        uint32_t value = 0;
+
+        chunk.chunk_type = CHUNK_TYPE_FILL;
+        chunk.total_sz = sizeof(chunk) + sizeof(value);
+        if (sw->out(sw->cookie, &chunk, sizeof(chunk)) || sw->out(sw->cookie, &value, sizeof(value)))
+            sw->error = 1;
+    }
+    else
+    {
+        chunk.chunk_type = CHUNK_TYPE_RAW;
+        chunk.total_sz = sizeof(chunk) + sw->fill;
+        if (sw->out(sw->cookie, &chunk, sizeof(chunk)) || sw->out(sw->cookie, sw->region, sw->fill))
+            sw->error = 1;
+    }
+    sw->fill = 0;
+    sw->chunks_out++;
+    return sw->error ? -1 : 0;
+}
+
+SparseWriter* sparse_create(sparse_out_fn out, void* cookie, unsigned long long size)
+{
+    SparseWriter* sw;
+
+    if (size % SPARSE_BLOCK_SIZE || size / SPARSE_BLOCK_SIZE > 0xffffffffULL)
+    {
+        printf("Can't make a sparse image of %llu bytes\n", size);
+        return NULL;
+    }
+
+    sw = (SparseWriter*) calloc(1, sizeof(SparseWriter));
+    if (sw == NULL)
+        return NULL;
+    sw->region = (unsigned char*) malloc(SPARSE_REGION_SIZE);
+    if (sw->region == NULL)
+    {
+        free(sw);
+        return NULL;
+    }
+    sw->out = out;
+    sw->cookie = cookie;
+    sw->size = size;
+    sw->fd = -1;
+
+    if (sparse_header(out, cookie, SPARSE_BLOCK_SIZE, size / SPARSE_BLOCK_SIZE,
+                      (size + SPARSE_REGION_SIZE - 1) / SPARSE_REGION_SIZE))
+    {
+        free(sw->region);
+        free(sw);
+        return NULL;
+    }
+    return sw;
+}
+
+int sparse_write(SparseWriter* sw, const void* data, size_t len)
+{
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (sw->error)
+        return -1;
+    if (sw->region == NULL)
+    {
+        // Mapped images pass the data of the open raw chunk straight through
+        if (len > sw->raw_left)
+        {
+            printf("Sparse image got more data than its raw chunk holds\n");
+            sw->error = 1;
+            return -1;
+        }
+        sw->raw_left -= len;
+        if (sw->out(sw->cookie, data, len))
+            sw->error = 1;
+        return sw->error ? -1 : 0;
+    }
+    if (sw->bytes_in + len > sw->size)
+    {
+        printf("Sparse image is larger than the %llu bytes promised\n", sw->size);
+        sw->error = 1;
+        return -1;
+    }
+    sw->bytes_in += len;
+
+    while (len > 0)
+    {
+        size_t copy = SPARSE_REGION_SIZE - sw->fill;
+        if (copy > len)     copy = len;
+
+        memcpy(sw->region + sw->fill, ptr, copy);
+        sw->fill += copy;
+        ptr += copy;
+        len -= copy;
+
+        if (sw->fill == SPARSE_REGION_SIZE && sparse_flush(sw))
+            return -1;
+    }
+    return 0;
+}
+
+SparseWriter* sparse_create_mapped(sparse_out_fn out, void* cookie, unsigned block_size, uint32_t blocks, uint32_t chunks)
+{
+    SparseWriter* sw;
+
+    if (block_size == 0 || block_size % 4)
+    {
+        printf("Can't make a sparse image of %u byte blocks\n", block_size);
+        return NULL;
+    }
+
+    sw = (SparseWriter*) calloc(1, sizeof(SparseWriter));
+    if (sw == NULL)
+        return NULL;
+    sw->out = out;
+    sw->cookie = cookie;
+    sw->fd = -1;
+    sw->size = (unsigned long long) blocks * block_size;
+    sw->block_size = block_size;
+    sw->chunks = chunks;
+
+    if (sparse_header(out, cookie, block_size, blocks, chunks))
+    {
+        free(sw);
+        return NULL;
+    }
+    return sw;
+}
+
+static int fd_out(void* cookie, const void* data, size_t len)
+{
+    int fd = *(int*) cookie;
+    const char* ptr = (const char*) data;
+
+    while (len > 0)
+    {
+        ssize_t wrote = write(fd, ptr, len);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+            return -1;
+        ptr += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+SparseWriter* sparse_create_fd(int fd)
+{
+    SparseWriter* sw;
+
+    sw = (SparseWriter*) calloc(1, sizeof(SparseWriter));
+    if (sw == NULL)
+        return NULL;
+    sw->region = (unsigned char*) malloc(SPARSE_REGION_SIZE);
+    sw->start = lseek64(fd, 0, SEEK_CUR);
+    if (sw->region == NULL || sw->start < 0)
+    {
+        printf("Can't make a sparse image here (%s)\n", strerror(errno));
+        free(sw->region);
+        free(sw);
+        return NULL;
+    }
+    sw->fd = fd;
+    sw->out = fd_out;
+    sw->cookie = &sw->fd;
+    sw->size = SPARSE_BLOCK_SIZE * 0xffffffffULL;
+
+    // Counted for real and written again by sparse_close()
+    if (sparse_header(fd_out, &sw->fd, SPARSE_BLOCK_SIZE, 0, 0))
+    {
+        free(sw->region);
+        free(sw);
+        return NULL;
+    }
+    return sw;
+}
+
+// Writes the header of the next chunk of a mapped image
+static int sparse_chunk(SparseWriter* sw, uint16_t type, uint32_t blocks, uint32_t data)
+{
+    unsigned long long len = (unsigned long long) blocks * sw->block_size;
+    chunk_header_t chunk;
+
+    if (sw->error)
+        return -1;
+    if (sw->raw_left || sw->chunks == 0 || sw->bytes_in + len > sw->size)
+    {
+        printf("Sparse image doesn't match the layout promised\n");
+        sw->error = 1;
+        return -1;
+    }
+    sw->chunks--;
+    sw->bytes_in += len;
+
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.chunk_type = type;
+    chunk.chunk_sz = blocks;
+    chunk.total_sz = sizeof(chunk) + data;
+    if (sw->out(sw->cookie, &chunk, sizeof(chunk)))
+        sw->error = 1;
+    return sw->error ? -1 : 0;
+}
+
+int sparse_raw(SparseWriter* sw, uint32_t blocks)
+{
+    unsigned long long len = (unsigned long long) blocks * sw->block_size;
+
+    if (len > SPARSE_RAW_MAX)
+    {
+        printf("Raw chunk of %llu bytes is too large\n", len);
+        sw->error = 1;
+        return -1;
+    }
+    if (sparse_chunk(sw, CHUNK_TYPE_RAW, blocks, len))
+        return -1;
+    sw->raw_left = len;
+    return 0;
+}
+
+int sparse_skip(SparseWriter* sw, uint32_t blocks)
+{
+    return sparse_chunk(sw, CHUNK_TYPE_DONT_CARE, blocks, 0);
+}
+
+int sparse_close(SparseWriter* sw)
+{
+    int ret;
+
+    if (!sw->error && (sw->raw_left || sw->chunks) && sw->region == NULL)
+    {
+        printf("Sparse image ended before its last chunk\n");
+        sw->error = 1;
+    }
+    if (!sw->error && sw->fd >= 0)
+    {
+        if (sw->bytes_in % SPARSE_BLOCK_SIZE)
+        {
+            printf("Sparse image of %llu bytes doesn't end on a block\n", sw->bytes_in);
+            sw->error = 1;
+        }
+        sw->size = sw->bytes_in;
+    }
+    if (!sw->error && sw->bytes_in != sw->size)
+    {
+        printf("Sparse image ended after %llu of %llu bytes\n", sw->bytes_in, sw->size);
+        sw->error = 1;
+    }
+    if (!sw->error)
+        sparse_flush(sw);
+
+    if (!sw->error && sw->fd >= 0)
+    {
+        loff_t end = lseek64(sw->fd, 0, SEEK_CUR);
+
+        if (end < 0 || lseek64(sw->fd, sw->start, SEEK_SET) != sw->start ||
+            sparse_header(fd_out, &sw->fd, SPARSE_BLOCK_SIZE, sw->size / SPARSE_BLOCK_SIZE, sw->chunks_out) ||
+            lseek64(sw->fd, end, SEEK_SET) != end)
+        {
+            printf("Unable to finish the sparse image header (%s)\n", strerror(errno));
+            sw->error = 1;
+        }
+    }
+
+    ret = sw->error ? -1 : 0;
+    free(sw->region);
+    free(sw);
+    return ret;
+}
+
+static int read_all(sparse_read_fn read_fn, void* cookie, void* data, size_t len)
+{
+    char* ptr = (char*) data;
+
+    while (len > 0)
+    {
+        ssize_t got = read_fn(cookie, ptr, len);
+        if (got <= 0)
+            return -1;
+        ptr += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int skip_bytes(sparse_read_fn read_fn, void* cookie, size_t len)
+{
+    char buf[256];
+
+    while (len > 0)
+    {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        if (read_all(read_fn, cookie, buf, want))
+            return -1;
+        len -= want;
+    }
+    return 0;
+}
+
+int sparse_is_image(int fd)
+{
+    uint32_t magic;
+
+    if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+        return 0;
+    return magic == SPARSE_HEADER_MAGIC;
+}
+
+int sparse_read(sparse_read_fn read_fn, sparse_data_fn data_fn, sparse_fill_fn fill_fn, void* cookie, unsigned long long* size)
+{
+    sparse_header_t hdr;
+    chunk_header_t chunk;
+    unsigned long long offset = 0;
+    char* buf = NULL;
+    uint32_t i;
+    int ret = -1;
+
+    if (read_all(read_fn, cookie, &hdr, sizeof(hdr)) || hdr.magic != SPARSE_HEADER_MAGIC ||
+        hdr.major_version != SPARSE_HEADER_MAJOR_VER || hdr.file_hdr_sz < sizeof(hdr) ||
+        hdr.chunk_hdr_sz < sizeof(chunk) || hdr.blk_sz == 0 || hdr.blk_sz % 4)
+    {
+        printf("Not a usable sparse image\n");
+        return -1;
+    }
+    if (skip_bytes(read_fn, cookie, hdr.file_hdr_sz - sizeof(hdr)))
+        return -1;
+
+    buf = (char*) malloc(SPARSE_READ_SIZE);
+    if (buf == NULL)
+        return -1;
+
+    for (i = 0; i < hdr.total_chunks; i++)
+    {
+        unsigned long long len;
+        uint32_t value;
+
+        if (read_all(read_fn, cookie, &chunk, sizeof(chunk)) || skip_bytes(read_fn, cookie, hdr.chunk_hdr_sz - sizeof(chunk)))
+        {
+            printf("Sparse image is truncated\n");
+            goto out;
+        }
+        len = (unsigned long long) chunk.chunk_sz * hdr.blk_sz;
+
+        switch (chunk.chunk_type)
+        {
+        case CHUNK_TYPE_RAW:
+            if (chunk.total_sz != hdr.chunk_hdr_sz + len)
+            {
+                printf("Bad raw chunk %u in sparse image\n", i);
+                goto out;
+            }
+            while (len > 0)
+            {
+                size_t want = len < SPARSE_READ_SIZE ? (size_t) len : SPARSE_READ_SIZE;
+                if (read_all(read_fn, cookie, buf, want))
+                {
+                    printf("Sparse image is truncated\n");
+                    goto out;
+                }
+                if (data_fn(cookie, offset, buf, want))
+                    goto out;
+                offset += want;
+                len -= want;
+            }
+            break;
+
+        case CHUNK_TYPE_FILL:
+            if (chunk.total_sz != hdr.chunk_hdr_sz + sizeof(value) || read_all(read_fn, cookie, &value, sizeof(value)))
+            {
+                printf("Bad fill chunk %u in sparse image\n", i);
+                goto out;
+            }
+            if (fill_fn(cookie, offset, len, value))
+                goto out;
+            offset += len;
+            break;
+
+        case CHUNK_TYPE_DONT_CARE:
+            if (chunk.total_sz != hdr.chunk_hdr_sz)
+            {
+                printf("Bad don't care chunk %u in sparse image\n", i);
+                goto out;
+            }
+            offset += len;
+            break;
+
+        case CHUNK_TYPE_CRC32:
+            if (chunk.total_sz != hdr.chunk_hdr_sz + sizeof(uint32_t) ||
+                skip_bytes(read_fn, cookie, sizeof(uint32_t)))
+            {
+                printf("Bad crc32 chunk %u in sparse image\n", i);
+                goto out;
+            }
+            break;
+
+        default:
+            printf("Unknown chunk type 0x%04x in sparse image\n", chunk.chunk_type);
+            goto out;
+        }
+    }
+
+    if (offset != (unsigned long long) hdr.total_blks * hdr.blk_sz)
+    {
+        printf("Sparse image covers %llu bytes instead of %llu\n", offset, (unsigned long long) hdr.total_blks * hdr.blk_sz);
+        goto out;
+    }
+    if (size)
+        *size = offset;
+    ret = 0;
+
+out:
+    free(buf);
+    return ret;
+}
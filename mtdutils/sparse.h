@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPARSE_H_
+#define SPARSE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Android sparse images, the format fastboot and simg2img understand
+
+typedef struct sparse_header {
+    uint32_t magic;             // SPARSE_HEADER_MAGIC
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;       // 28 bytes for the first revision
+    uint16_t chunk_hdr_sz;      // 12 bytes for the first revision
+    uint32_t blk_sz;            // multiple of 4
+    uint32_t total_blks;        // blocks in the expanded image
+    uint32_t total_chunks;
+    uint32_t image_checksum;    // crc32 of the expanded image, 0 if unused
+} sparse_header_t;
+
+typedef struct chunk_header {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;          // in blocks of the expanded image
+    uint32_t total_sz;          // chunk header plus data, in bytes
+} chunk_header_t;
+
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_HEADER_MAJOR_VER 1
+
+#define CHUNK_TYPE_RAW          0xCAC1
+#define CHUNK_TYPE_FILL         0xCAC2
+#define CHUNK_TYPE_DONT_CARE    0xCAC3
+#define CHUNK_TYPE_CRC32        0xCAC4
+
+#define SPARSE_BLOCK_SIZE       4096
+#define SPARSE_REGION_SIZE      (64 * 1024)
+#define SPARSE_RAW_MAX          (256 * 1024 * 1024)     // keeps total_sz in 32 bits
+
+typedef int (*sparse_out_fn)(void* cookie, const void* data, size_t len);
+
+// Encoder for backups. The image is cut into fixed SPARSE_REGION_SIZE
+// regions, each stored as a raw chunk or, if it's all zeros, a zero fill
+// chunk. That keeps the chunk count known up front so the image can be
+// streamed. 'size' has to be a multiple of SPARSE_BLOCK_SIZE.
+typedef struct SparseWriter SparseWriter;
+
+SparseWriter* sparse_create(sparse_out_fn out, void* cookie, unsigned long long size);
+int sparse_write(SparseWriter* sw, const void* data, size_t len);
+int sparse_close(SparseWriter* sw);     // fails unless exactly 'size' bytes came in
+
+// Same, for dumps whose size isn't known until they end. The header is
+// written again with the real counts by sparse_close(), so 'fd' has to be
+// seekable, and the data has to end on a SPARSE_BLOCK_SIZE boundary.
+SparseWriter* sparse_create_fd(int fd);
+
+// Encoder for images whose layout is known before any data is read, such
+// as a filesystem's allocation map. The caller promises 'chunks' chunks and
+// starts each one with sparse_raw(), followed by exactly that much data
+// through sparse_write(), or sparse_skip() for blocks that can be left out.
+// Raw chunks are limited to SPARSE_RAW_MAX bytes.
+SparseWriter* sparse_create_mapped(sparse_out_fn out, void* cookie, unsigned block_size, uint32_t blocks, uint32_t chunks);
+int sparse_raw(SparseWriter* sw, uint32_t blocks);
+int sparse_skip(SparseWriter* sw, uint32_t blocks);
+
+// Decoder. The image comes in through read_fn (which returns 0 at the
+// end); data_fn gets the raw chunks and fill_fn the filled ones, both with
+// their offset in the expanded image. Don't care ranges are skipped.
+typedef ssize_t (*sparse_read_fn)(void* cookie, void* data, size_t len);
+typedef int (*sparse_data_fn)(void* cookie, unsigned long long offset, const void* data, size_t len);
+typedef int (*sparse_fill_fn)(void* cookie, unsigned long long offset, unsigned long long len, uint32_t value);
+
+int sparse_is_image(int fd);    // checks the magic without moving the file offset
+int sparse_read(sparse_read_fn read_fn, sparse_data_fn data_fn, sparse_fill_fn fill_fn, void* cookie, unsigned long long* size);
+
+#endif  // SPARSE_H_
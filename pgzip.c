@@ -0,0 +1,850 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "common.h"
+#include "pgzip.h"
+
+#define PGZIP_MAX_THREADS   8
+
+enum job_state {
+    JOB_FREE = 0,
+    JOB_PENDING,
+    JOB_DONE,
+};
+
+struct pgzip_job {
+    unsigned char* in;
+    size_t in_len;
+    unsigned char* out;
+    size_t out_len;
+    size_t out_alloc;
+    enum job_state state;
+    int error;
+};
+
+struct PGzip {
+    pgzip_write_fn write_fn;
+    void* cookie;
+    int level;
+    int flags;
+
+    int nthreads;
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;       // workers wait here for pending jobs
+    pthread_cond_t done_cond;       // producer waits here for finished jobs
+
+    // Jobs form a ring indexed by sequence number. Everything in
+    // [head, tail) has been submitted, [head, next_work) is owned by
+    // workers and the slot at tail is being filled by the producer.
+    struct pgzip_job* jobs;
+    int njobs;
+    unsigned long head;
+    unsigned long next_work;
+    unsigned long tail;
+    size_t fill;
+
+    int shutdown;
+    int error;
+    int submitted;
+
+    // PGZIP_INDEX: sizes of every member written so far, for the trailer
+    uint32_t* index;
+    unsigned long nindex;
+    unsigned long index_alloc;
+    unsigned long long bytes_out;
+};
+
+int pgzip_cpu_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)                   return 1;
+    if (cpus > PGZIP_MAX_THREADS)   return PGZIP_MAX_THREADS;
+    return (int) cpus;
+}
+
+static void put_le16(unsigned char* ptr, uint32_t val)
+{
+    ptr[0] = val & 0xff;
+    ptr[1] = (val >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char* ptr, uint32_t val)
+{
+    put_le16(ptr, val & 0xffff);
+    put_le16(ptr + 2, val >> 16);
+}
+
+static uint32_t get_le16(const unsigned char* ptr)
+{
+    return ptr[0] | (ptr[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char* ptr)
+{
+    return get_le16(ptr) | (get_le16(ptr + 2) << 16);
+}
+
+// gzip header carrying the 'PZ' size field, followed by 'extra_len' bytes
+// of further extra subfields the caller fills in
+static void put_member_header(unsigned char* hdr, uint32_t csize, uint32_t usize, size_t extra_len)
+{
+    static const unsigned char magic[10] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 255 };
+
+    memcpy(hdr, magic, sizeof(magic));
+    put_le16(hdr + 10, PGZIP_SIZE_FIELD + extra_len);
+    hdr[12] = 'P';
+    hdr[13] = 'Z';
+    put_le16(hdr + 14, PGZIP_SIZE_FIELD - 4);
+    put_le32(hdr + 16, csize);
+    put_le32(hdr + 20, usize);
+}
+
+static int compress_job(z_stream* strm, struct pgzip_job* job, int indexed)
+{
+    size_t header = indexed ? PGZIP_HEADER_SIZE : 0;
+
+    if (deflateReset(strm) != Z_OK)
+        return -1;
+
+    strm->next_in = job->in;
+    strm->avail_in = job->in_len;
+    strm->next_out = job->out + header;
+    strm->avail_out = job->out_alloc - header - 8;
+
+    if (deflate(strm, Z_FINISH) != Z_STREAM_END)
+        return -1;
+
+    job->out_len = job->out_alloc - 8 - strm->avail_out;
+    if (indexed)
+    {
+        // Raw deflate wrapped by hand, so the header can say how long the
+        // member is and a reader can split the stream without inflating it
+        unsigned char* trailer = job->out + job->out_len;
+
+        put_le32(trailer, crc32(crc32(0, Z_NULL, 0), job->in, job->in_len));
+        put_le32(trailer + 4, job->in_len);
+        job->out_len += 8;
+        put_member_header(job->out, job->out_len, job->in_len, 0);
+    }
+    return 0;
+}
+
+static void* pgzip_worker(void* cookie)
+{
+    PGzip* gz = (PGzip*) cookie;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    // windowBits + 16 makes zlib emit a gzip header and trailer per member,
+    // indexed members get raw deflate and a header of our own
+    int bits = (gz->flags & PGZIP_INDEX) ? -15 : 15 + 16;
+    int zret = deflateInit2(&strm, gz->level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY);
+
+    pthread_mutex_lock(&gz->lock);
+    while (1)
+    {
+        while (!gz->shutdown && gz->next_work == gz->tail)
+            pthread_cond_wait(&gz->work_cond, &gz->lock);
+        if (gz->next_work == gz->tail)
+            break;
+
+        struct pgzip_job* job = &gz->jobs[gz->next_work % gz->njobs];
+        gz->next_work++;
+        pthread_mutex_unlock(&gz->lock);
+
+        int err = (zret != Z_OK) ? -1 : compress_job(&strm, job, gz->flags & PGZIP_INDEX);
+
+        pthread_mutex_lock(&gz->lock);
+        job->error = err;
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&gz->done_cond);
+    }
+    pthread_mutex_unlock(&gz->lock);
+
+    if (zret == Z_OK)
+        deflateEnd(&strm);
+    return NULL;
+}
+
+static int pgzip_add_index(PGzip* gz, struct pgzip_job* job)
+{
+    if (gz->nindex + 2 > gz->index_alloc)
+    {
+        unsigned long alloc = gz->index_alloc ? gz->index_alloc * 2 : 1024;
+        uint32_t* index = (uint32_t*) realloc(gz->index, alloc * sizeof(uint32_t));
+        if (index == NULL)
+        {
+            LOGE("pgzip: out of memory\n");
+            return -1;
+        }
+        gz->index = index;
+        gz->index_alloc = alloc;
+    }
+    gz->index[gz->nindex++] = job->out_len;
+    gz->index[gz->nindex++] = job->in_len;
+    return 0;
+}
+
+// Empty member (it inflates to nothing) whose extra field holds 'data'
+static int pgzip_write_empty(PGzip* gz, char id, const unsigned char* data, size_t len)
+{
+    static const unsigned char empty[10] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };   // deflate + crc32 + isize
+    unsigned char* member;
+    size_t size = PGZIP_HEADER_SIZE + 4 + len + sizeof(empty);
+    int ret;
+
+    member = (unsigned char*) malloc(size);
+    if (member == NULL)
+        return -1;
+    put_member_header(member, size, 0, 4 + len);
+    member[PGZIP_HEADER_SIZE] = 'P';
+    member[PGZIP_HEADER_SIZE + 1] = id;
+    put_le16(member + PGZIP_HEADER_SIZE + 2, len);
+    memcpy(member + PGZIP_HEADER_SIZE + 4, data, len);
+    memcpy(member + PGZIP_HEADER_SIZE + 4 + len, empty, sizeof(empty));
+
+    ret = gz->write_fn(gz->cookie, member, size);
+    gz->bytes_out += size;
+    free(member);
+    return ret;
+}
+
+// The index goes out as 'PX' members of up to PGZIP_INDEX_ENTRIES blocks
+// each, then a fixed size 'PT' member (always the last PGZIP_TAIL_SIZE
+// bytes of the file) saying where the index starts
+static int pgzip_write_index(PGzip* gz)
+{
+    unsigned long long start = gz->bytes_out;
+    unsigned long blocks = gz->nindex / 2;
+    unsigned long i, members = 0;
+    unsigned char tail[16];
+
+    for (i = 0; i < blocks; i += PGZIP_INDEX_ENTRIES)
+    {
+        unsigned long count = blocks - i < PGZIP_INDEX_ENTRIES ? blocks - i : PGZIP_INDEX_ENTRIES;
+        unsigned char* data = (unsigned char*) malloc(count * 8);
+        unsigned long j;
+        int ret;
+
+        if (data == NULL)
+            return -1;
+        for (j = 0; j < count * 2; j++)
+            put_le32(data + j * 4, gz->index[i * 2 + j]);
+        ret = pgzip_write_empty(gz, 'X', data, count * 8);
+        free(data);
+        if (ret)
+            return -1;
+        members++;
+    }
+
+    put_le32(tail, start & 0xffffffff);
+    put_le32(tail + 4, start >> 32);
+    put_le32(tail + 8, blocks);
+    put_le32(tail + 12, members);
+    return pgzip_write_empty(gz, 'T', tail, sizeof(tail));
+}
+
+// Writes out every finished job at the head of the ring. When 'wait' is set,
+// blocks until at least the head job is finished.
+static int pgzip_drain(PGzip* gz, int wait)
+{
+    pthread_mutex_lock(&gz->lock);
+    while (gz->head != gz->tail)
+    {
+        struct pgzip_job* job = &gz->jobs[gz->head % gz->njobs];
+        if (job->state != JOB_DONE)
+        {
+            if (!wait)      break;
+            pthread_cond_wait(&gz->done_cond, &gz->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&gz->lock);
+
+        if (job->error)
+        {
+            LOGE("pgzip: deflate failed\n");
+            gz->error = 1;
+        }
+        else if (!gz->error && gz->write_fn(gz->cookie, job->out, job->out_len) != 0)
+            gz->error = 1;
+        else if (!gz->error && (gz->flags & PGZIP_INDEX) && pgzip_add_index(gz, job))
+            gz->error = 1;
+        gz->bytes_out += job->out_len;
+
+        pthread_mutex_lock(&gz->lock);
+        job->state = JOB_FREE;
+        gz->head++;
+        wait = 0;
+    }
+    pthread_mutex_unlock(&gz->lock);
+    return gz->error ? -1 : 0;
+}
+
+static int pgzip_submit(PGzip* gz)
+{
+    struct pgzip_job* job = &gz->jobs[gz->tail % gz->njobs];
+
+    job->in_len = gz->fill;
+    job->state = JOB_PENDING;
+    gz->fill = 0;
+    gz->submitted = 1;
+
+    pthread_mutex_lock(&gz->lock);
+    gz->tail++;
+    pthread_cond_signal(&gz->work_cond);
+    pthread_mutex_unlock(&gz->lock);
+
+    // Opportunistically flush whatever is already done, and block only when
+    // the ring is full and the slot we're about to fill is still in flight.
+    if (pgzip_drain(gz, 0))
+        return -1;
+    while (gz->tail - gz->head >= (unsigned long) gz->njobs)
+    {
+        if (pgzip_drain(gz, 1))
+            return -1;
+    }
+    return 0;
+}
+
+PGzip* pgzip_open(pgzip_write_fn write_fn, void* cookie, int level, int threads, int flags)
+{
+    int i;
+    PGzip* gz = (PGzip*) calloc(1, sizeof(PGzip));
+    if (gz == NULL)
+        return NULL;
+
+    if (threads <= 0)       threads = pgzip_cpu_count();
+
+    gz->write_fn = write_fn;
+    gz->cookie = cookie;
+    gz->level = level;
+    gz->flags = flags;
+    gz->nthreads = threads;
+    gz->njobs = threads * 2;
+
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->work_cond, NULL);
+    pthread_cond_init(&gz->done_cond, NULL);
+
+    gz->jobs = (struct pgzip_job*) calloc(gz->njobs, sizeof(struct pgzip_job));
+    gz->threads = (pthread_t*) calloc(gz->nthreads, sizeof(pthread_t));
+    if (gz->jobs == NULL || gz->threads == NULL)
+        goto error;
+
+    for (i = 0; i < gz->njobs; i++)
+    {
+        struct pgzip_job* job = &gz->jobs[i];
+        job->out_alloc = PGZIP_MEMBER_MAX;
+        job->in = (unsigned char*) malloc(PGZIP_BLOCK_SIZE);
+        job->out = (unsigned char*) malloc(job->out_alloc);
+        if (job->in == NULL || job->out == NULL)
+            goto error;
+    }
+
+    for (i = 0; i < gz->nthreads; i++)
+    {
+        if (pthread_create(&gz->threads[i], NULL, pgzip_worker, gz) != 0)
+        {
+            LOGE("pgzip: unable to start worker %d\n", i);
+            gz->nthreads = i;
+            pgzip_close(gz);
+            return NULL;
+        }
+    }
+    return gz;
+
+error:
+    LOGE("pgzip: out of memory\n");
+    gz->nthreads = 0;
+    pgzip_close(gz);
+    return NULL;
+}
+
+int pgzip_write(PGzip* gz, const void* data, size_t len)
+{
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    while (len > 0)
+    {
+        struct pgzip_job* job = &gz->jobs[gz->tail % gz->njobs];
+        size_t copy = PGZIP_BLOCK_SIZE - gz->fill;
+        if (copy > len)     copy = len;
+
+        memcpy(job->in + gz->fill, ptr, copy);
+        gz->fill += copy;
+        ptr += copy;
+        len -= copy;
+
+        if (gz->fill == PGZIP_BLOCK_SIZE && pgzip_submit(gz))
+            return -1;
+    }
+    return gz->error ? -1 : 0;
+}
+
+int pgzip_close(PGzip* gz)
+{
+    int i, ret = 0;
+
+    if (gz->jobs && gz->nthreads > 0)
+    {
+        // Always emit at least one member so an empty input is still valid gzip
+        if (gz->fill > 0 || !gz->submitted)
+            pgzip_submit(gz);
+        while (gz->head != gz->tail)
+        {
+            if (pgzip_drain(gz, 1))
+                break;
+        }
+        if (!gz->error && (gz->flags & PGZIP_INDEX) && pgzip_write_index(gz))
+            gz->error = 1;
+    }
+
+    pthread_mutex_lock(&gz->lock);
+    gz->shutdown = 1;
+    pthread_cond_broadcast(&gz->work_cond);
+    pthread_mutex_unlock(&gz->lock);
+
+    for (i = 0; i < gz->nthreads; i++)
+        pthread_join(gz->threads[i], NULL);
+
+    // Anything still queued after an error belongs to nobody now
+    gz->head = gz->tail;
+
+    if (gz->jobs)
+    {
+        for (i = 0; i < gz->njobs; i++)
+        {
+            free(gz->jobs[i].in);
+            free(gz->jobs[i].out);
+        }
+    }
+    ret = gz->error ? -1 : 0;
+
+    pthread_cond_destroy(&gz->done_cond);
+    pthread_cond_destroy(&gz->work_cond);
+    pthread_mutex_destroy(&gz->lock);
+    free(gz->index);
+    free(gz->jobs);
+    free(gz->threads);
+    free(gz);
+    return ret;
+}
+
+struct PGunzip {
+    pgunzip_read_fn read_fn;
+    void* cookie;
+
+    int nthreads;
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+
+    // Same ring as the compressor, except that the consumer copies out of
+    // the head job, 'pos' bytes in
+    struct pgzip_job* jobs;
+    int njobs;
+    unsigned long head;
+    unsigned long next_work;
+    unsigned long tail;
+    size_t pos;
+
+    int eof;
+    int shutdown;
+    int error;
+};
+
+int pgzip_is_indexed(const void* head, size_t len)
+{
+    const unsigned char* hdr = (const unsigned char*) head;
+
+    return len >= PGZIP_HEADER_SIZE && hdr[0] == 0x1f && hdr[1] == 0x8b && hdr[2] == 8 &&
+           hdr[3] == 4 && get_le16(hdr + 10) >= PGZIP_SIZE_FIELD && hdr[12] == 'P' && hdr[13] == 'Z' &&
+           get_le16(hdr + 14) == PGZIP_SIZE_FIELD - 4;
+}
+
+static int decompress_job(z_stream* strm, struct pgzip_job* job)
+{
+    const unsigned char* trailer = job->in + job->in_len - 8;
+
+    if (inflateReset(strm) != Z_OK)
+        return -1;
+
+    strm->next_in = job->in;
+    strm->avail_in = job->in_len - 8;
+    strm->next_out = job->out;
+    strm->avail_out = job->out_len;
+
+    if (inflate(strm, Z_FINISH) != Z_STREAM_END || strm->avail_out != 0)
+        return -1;
+    if (get_le32(trailer) != crc32(crc32(0, Z_NULL, 0), job->out, job->out_len) ||
+        get_le32(trailer + 4) != job->out_len)
+        return -1;
+    return 0;
+}
+
+static void* pgunzip_worker(void* cookie)
+{
+    PGunzip* gz = (PGunzip*) cookie;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    int zret = inflateInit2(&strm, -15);
+
+    pthread_mutex_lock(&gz->lock);
+    while (1)
+    {
+        while (!gz->shutdown && gz->next_work == gz->tail)
+            pthread_cond_wait(&gz->work_cond, &gz->lock);
+        if (gz->shutdown)
+            break;
+
+        struct pgzip_job* job = &gz->jobs[gz->next_work % gz->njobs];
+        gz->next_work++;
+        pthread_mutex_unlock(&gz->lock);
+
+        int err = (zret != Z_OK) ? -1 : decompress_job(&strm, job);
+
+        pthread_mutex_lock(&gz->lock);
+        job->error = err;
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&gz->done_cond);
+    }
+    pthread_mutex_unlock(&gz->lock);
+
+    if (zret == Z_OK)
+        inflateEnd(&strm);
+    return NULL;
+}
+
+// Returns 1 if all of 'len' came in, 0 at a clean end of the stream
+static int pgunzip_read_full(PGunzip* gz, void* data, size_t len, int eof_ok)
+{
+    unsigned char* ptr = (unsigned char*) data;
+    size_t left = len;
+
+    while (left > 0)
+    {
+        ssize_t got = gz->read_fn(gz->cookie, ptr, left);
+        if (got < 0)
+            return -1;
+        if (got == 0)
+        {
+            if (eof_ok && left == len)
+                return 0;
+            LOGE("pgunzip: stream is truncated\n");
+            return -1;
+        }
+        ptr += got;
+        left -= got;
+    }
+    return 1;
+}
+
+// Reads the next member into the job at the tail. Index members inflate
+// to nothing and are skipped here.
+static int pgunzip_fill(PGunzip* gz)
+{
+    struct pgzip_job* job = &gz->jobs[gz->tail % gz->njobs];
+    unsigned char hdr[PGZIP_HEADER_SIZE];
+    uint32_t csize, usize, skip;
+    int ret;
+
+    for (;;)
+    {
+        ret = pgunzip_read_full(gz, hdr, sizeof(hdr), 1);
+        if (ret <= 0)
+            return ret;
+
+        csize = get_le32(hdr + 16);
+        usize = get_le32(hdr + 20);
+        skip = get_le16(hdr + 10) - PGZIP_SIZE_FIELD;
+        if (!pgzip_is_indexed(hdr, sizeof(hdr)) || usize > PGZIP_BLOCK_SIZE ||
+            csize > PGZIP_MEMBER_MAX || csize < sizeof(hdr) + skip + 8 + 2)
+        {
+            LOGE("pgunzip: bad member header\n");
+            return -1;
+        }
+
+        // The rest of the extra field, then deflate data and trailer
+        job->in_len = csize - sizeof(hdr) - skip;
+        if (pgunzip_read_full(gz, job->in, skip, 0) <= 0 || pgunzip_read_full(gz, job->in, job->in_len, 0) <= 0)
+            return -1;
+        if (usize > 0)
+            break;
+    }
+
+    job->out_len = usize;
+    job->state = JOB_PENDING;
+
+    pthread_mutex_lock(&gz->lock);
+    gz->tail++;
+    pthread_cond_signal(&gz->work_cond);
+    pthread_mutex_unlock(&gz->lock);
+    return 1;
+}
+
+PGunzip* pgunzip_open(pgunzip_read_fn read_fn, void* cookie, int threads)
+{
+    int i;
+    PGunzip* gz = (PGunzip*) calloc(1, sizeof(PGunzip));
+    if (gz == NULL)
+        return NULL;
+
+    if (threads <= 0)       threads = pgzip_cpu_count();
+
+    gz->read_fn = read_fn;
+    gz->cookie = cookie;
+    gz->nthreads = threads;
+    gz->njobs = threads * 2;
+
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->work_cond, NULL);
+    pthread_cond_init(&gz->done_cond, NULL);
+
+    gz->jobs = (struct pgzip_job*) calloc(gz->njobs, sizeof(struct pgzip_job));
+    gz->threads = (pthread_t*) calloc(gz->nthreads, sizeof(pthread_t));
+    if (gz->jobs == NULL || gz->threads == NULL)
+        goto error;
+
+    for (i = 0; i < gz->njobs; i++)
+    {
+        struct pgzip_job* job = &gz->jobs[i];
+        job->in = (unsigned char*) malloc(PGZIP_MEMBER_MAX);
+        job->out = (unsigned char*) malloc(PGZIP_BLOCK_SIZE);
+        if (job->in == NULL || job->out == NULL)
+            goto error;
+    }
+
+    for (i = 0; i < gz->nthreads; i++)
+    {
+        if (pthread_create(&gz->threads[i], NULL, pgunzip_worker, gz) != 0)
+        {
+            LOGE("pgunzip: unable to start worker %d\n", i);
+            gz->nthreads = i;
+            pgunzip_close(gz);
+            return NULL;
+        }
+    }
+    return gz;
+
+error:
+    LOGE("pgunzip: out of memory\n");
+    gz->nthreads = 0;
+    pgunzip_close(gz);
+    return NULL;
+}
+
+ssize_t pgunzip_read(PGunzip* gz, void* data, size_t len)
+{
+    struct pgzip_job* job;
+    size_t copy;
+
+    if (gz->error)
+        return -1;
+    if (len == 0)
+        return 0;
+
+    // Keep every worker busy before waiting on the oldest block
+    while (!gz->eof && gz->tail - gz->head < (unsigned long) gz->njobs)
+    {
+        int ret = pgunzip_fill(gz);
+        if (ret < 0)
+        {
+            gz->error = 1;
+            return -1;
+        }
+        if (ret == 0)
+            gz->eof = 1;
+    }
+    if (gz->head == gz->tail)
+        return 0;
+
+    job = &gz->jobs[gz->head % gz->njobs];
+    pthread_mutex_lock(&gz->lock);
+    while (job->state != JOB_DONE)
+        pthread_cond_wait(&gz->done_cond, &gz->lock);
+    pthread_mutex_unlock(&gz->lock);
+    if (job->error)
+    {
+        LOGE("pgunzip: block %lu is corrupt\n", gz->head);
+        gz->error = 1;
+        return -1;
+    }
+
+    copy = job->out_len - gz->pos;
+    if (copy > len)     copy = len;
+    memcpy(data, job->out + gz->pos, copy);
+    gz->pos += copy;
+    if (gz->pos == job->out_len)
+    {
+        job->state = JOB_FREE;
+        gz->head++;
+        gz->pos = 0;
+    }
+    return copy;
+}
+
+int pgunzip_close(PGunzip* gz)
+{
+    int i, ret;
+
+    pthread_mutex_lock(&gz->lock);
+    gz->shutdown = 1;
+    pthread_cond_broadcast(&gz->work_cond);
+    pthread_mutex_unlock(&gz->lock);
+
+    for (i = 0; i < gz->nthreads; i++)
+        pthread_join(gz->threads[i], NULL);
+
+    if (gz->jobs)
+    {
+        for (i = 0; i < gz->njobs; i++)
+        {
+            free(gz->jobs[i].in);
+            free(gz->jobs[i].out);
+        }
+    }
+    ret = gz->error ? -1 : 0;
+
+    pthread_cond_destroy(&gz->done_cond);
+    pthread_cond_destroy(&gz->work_cond);
+    pthread_mutex_destroy(&gz->lock);
+    free(gz->jobs);
+    free(gz->threads);
+    free(gz);
+    return ret;
+}
+
+// off_t is 32 bits on the device, hence lseek64 and read rather than pread
+static int read_at(int fd, void* data, size_t len, loff_t offset)
+{
+    unsigned char* ptr = (unsigned char*) data;
+
+    if (lseek64(fd, offset, SEEK_SET) != offset)
+        return -1;
+    while (len > 0)
+    {
+        ssize_t got = read(fd, ptr, len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        ptr += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int pgzip_read_index_at(int fd, loff_t size, struct pgzip_block** blocks, unsigned long* count)
+{
+    unsigned char tail[PGZIP_TAIL_SIZE];
+    unsigned char* member = NULL;
+    struct pgzip_block* index;
+    unsigned long long pos, data = 0;
+    unsigned long nblocks, nmembers, i, n = 0;
+
+    if (size < PGZIP_TAIL_SIZE || read_at(fd, tail, sizeof(tail), size - PGZIP_TAIL_SIZE) != 0 ||
+        !pgzip_is_indexed(tail, sizeof(tail)) || get_le16(tail + 10) != PGZIP_SIZE_FIELD + 4 + 16 ||
+        tail[PGZIP_HEADER_SIZE] != 'P' || tail[PGZIP_HEADER_SIZE + 1] != 'T')
+        return -1;
+
+    pos = get_le32(tail + PGZIP_HEADER_SIZE + 4) | ((unsigned long long) get_le32(tail + PGZIP_HEADER_SIZE + 8) << 32);
+    nblocks = get_le32(tail + PGZIP_HEADER_SIZE + 12);
+    nmembers = get_le32(tail + PGZIP_HEADER_SIZE + 16);
+    if (nblocks > (unsigned long long) size / 10 || nmembers != (nblocks + PGZIP_INDEX_ENTRIES - 1) / PGZIP_INDEX_ENTRIES)
+        return -1;
+
+    index = (struct pgzip_block*) malloc((nblocks + 1) * sizeof(struct pgzip_block));
+    member = (unsigned char*) malloc(PGZIP_MEMBER_MAX);
+    if (index == NULL || member == NULL)
+        goto fail;
+
+    // The index members sit between the last block and the tail
+    unsigned long long start = pos, block = 0;
+    for (i = 0; i < nmembers; i++)
+    {
+        uint32_t csize, entries, j;
+
+        if (read_at(fd, member, PGZIP_HEADER_SIZE + 4, pos) != 0 || !pgzip_is_indexed(member, PGZIP_HEADER_SIZE) ||
+            member[PGZIP_HEADER_SIZE] != 'P' || member[PGZIP_HEADER_SIZE + 1] != 'X')
+            goto fail;
+        csize = get_le32(member + 16);
+        entries = get_le16(member + PGZIP_HEADER_SIZE + 2) / 8;
+        if (csize > PGZIP_MEMBER_MAX || entries > nblocks - n ||
+            read_at(fd, member, csize, pos) != 0)
+            goto fail;
+
+        for (j = 0; j < entries; j++)
+        {
+            const unsigned char* entry = member + PGZIP_HEADER_SIZE + 4 + j * 8;
+
+            index[n].offset = block;
+            index[n].data = data;
+            block += get_le32(entry);
+            data += get_le32(entry + 4);
+            n++;
+        }
+        pos += csize;
+    }
+    if (n != nblocks || block != start || pos != (unsigned long long) size - PGZIP_TAIL_SIZE)
+        goto fail;
+
+    // One past the last block, so every block has an end
+    index[n].offset = block;
+    index[n].data = data;
+
+    free(member);
+    *blocks = index;
+    *count = n;
+    return 0;
+
+fail:
+    LOGE("pgzip: bad block index\n");
+    free(member);
+    free(index);
+    return -1;
+}
+
+int pgzip_read_index(int fd, struct pgzip_block** blocks, unsigned long* count)
+{
+    // The caller may be in the middle of the file, put it back when done
+    loff_t here = lseek64(fd, 0, SEEK_CUR);
+
+    if (here < 0 || pgzip_read_index_at(fd, lseek64(fd, 0, SEEK_END), blocks, count) != 0)
+    {
+        lseek64(fd, here, SEEK_SET);
+        return -1;
+    }
+    if (lseek64(fd, here, SEEK_SET) != here)
+    {
+        free(*blocks);
+        *blocks = NULL;
+        return -1;
+    }
+    return 0;
+}
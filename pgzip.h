@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PGZIP_HEADER
+#define _PGZIP_HEADER
+
+#include <sys/types.h>
+
+// Parallel gzip compressor. Input is cut into fixed size blocks, each block
+// is deflated on a worker thread as a complete gzip member, and the members
+// are handed back in order. Concatenated members are a valid gzip stream, so
+// the output can be read by any gzip/tar -z.
+//
+// With PGZIP_INDEX every member also records its own compressed and
+// uncompressed size in a 'PZ' extra field (the way BGZF does), and the
+// stream ends with a block index stored in empty members, so plain gzip
+// still reads it while pgunzip can split it up and inflate the blocks in
+// parallel.
+
+#define PGZIP_BLOCK_SIZE    (256 * 1024)
+#define PGZIP_INDEX         0x01
+
+#define PGZIP_SIZE_FIELD    12          // 'PZ', length, compressed and uncompressed size
+#define PGZIP_HEADER_SIZE   (12 + PGZIP_SIZE_FIELD)
+#define PGZIP_MEMBER_MAX    (PGZIP_BLOCK_SIZE + PGZIP_BLOCK_SIZE / 16 + 1024)
+#define PGZIP_INDEX_ENTRIES 8000        // blocks per 'PX' index member
+#define PGZIP_TAIL_SIZE     (PGZIP_HEADER_SIZE + 4 + 16 + 10)
+
+// Called in stream order with each finished member. Return 0 on success.
+typedef int (*pgzip_write_fn)(void* cookie, const void* data, size_t len);
+
+typedef struct PGzip PGzip;
+
+// threads <= 0 selects one worker per online CPU
+PGzip* pgzip_open(pgzip_write_fn write_fn, void* cookie, int level, int threads, int flags);
+int pgzip_write(PGzip* gz, const void* data, size_t len);
+int pgzip_close(PGzip* gz);     // flushes, joins the workers and frees gz
+
+int pgzip_cpu_count(void);
+
+// Parallel decompressor for PGZIP_INDEX streams. Members are read in order
+// through read_fn (which returns 0 at the end), inflated on the workers and
+// handed back in order by pgunzip_read.
+typedef ssize_t (*pgunzip_read_fn)(void* cookie, void* data, size_t len);
+
+typedef struct PGunzip PGunzip;
+
+int pgzip_is_indexed(const void* head, size_t len);    // looks at the first member header
+PGunzip* pgunzip_open(pgunzip_read_fn read_fn, void* cookie, int threads);
+ssize_t pgunzip_read(PGunzip* gz, void* data, size_t len);     // 0 at the end
+int pgunzip_close(PGunzip* gz);
+
+// Block index of a PGZIP_INDEX file, for jumping into the middle of it
+struct pgzip_block {
+    unsigned long long offset;      // of the member in the file
+    unsigned long long data;        // of its first byte in the inflated stream
+};
+
+// Reads the index from the end of the file, returns -1 if there isn't one
+int pgzip_read_index(int fd, struct pgzip_block** blocks, unsigned long* count);
+
+#endif  // _PGZIP_HEADER
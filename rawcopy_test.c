@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Copies files of awkward sizes through the raw copy engine, from files
+// and pipes, and round trips images through raw_dump_sparse and sparse
+// expansion. Usage: rawcopy_test [scratch dir]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mtdutils/rawcopy.h"
+#include "mtdutils/sparse.h"
+
+static const char* dir = "/tmp";
+static char in_path[256], out_path[256], img_path[256];
+static int failed = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+void ui_print(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+
+    fputs(buf, stderr);
+}
+
+// Noise, with every third SPARSE_REGION_SIZE region left zero
+static unsigned char* make_data(size_t len) {
+    unsigned char* data = malloc(len ? len : 1);
+    size_t i;
+
+    srand(len);
+    for (i = 0; i < len; i++) {
+        data[i] = (i / SPARSE_REGION_SIZE) % 3 == 1 ? 0 : rand();
+    }
+    return data;
+}
+
+static int write_file(const char* path, const unsigned char* data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (len && write(fd, data, len) != (ssize_t) len) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+// 0 if 'path' holds data followed by exactly 'zeros' zero bytes
+static int check_file(const char* path, const unsigned char* data, size_t len, size_t zeros) {
+    unsigned char* buf = malloc(len + zeros + 1);
+    int fd = open(path, O_RDONLY);
+    size_t got = 0;
+    ssize_t n = 0;
+    int ret = -1;
+
+    while (fd >= 0 && (n = read(fd, buf + got, len + zeros + 1 - got)) > 0) got += n;
+    if (fd >= 0 && n == 0 && got == len + zeros && (len == 0 || memcmp(buf, data, len) == 0)) {
+        ret = 0;
+        for (; zeros > 0; zeros--) {
+            if (buf[len + zeros - 1] != 0) ret = -1;
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(buf);
+    return ret;
+}
+
+static void test_copy(size_t len, int flags) {
+    unsigned char* data = make_data(len);
+    size_t pad = 0;
+
+    if ((flags & RAW_PAD) && len % RAW_PAD_SIZE) pad = RAW_PAD_SIZE - len % RAW_PAD_SIZE;
+    CHECK(write_file(in_path, data, len) == 0);
+    CHECK(raw_copy(in_path, out_path, flags) == 0);
+    if (check_file(out_path, data, len, pad) != 0) {
+        fprintf(stderr, "  copying %zu bytes with flags %d\n", len, flags);
+        failed = 1;
+    }
+    free(data);
+}
+
+// Reads from a pipe come back short, and the end isn't known up front
+static void test_pipe(void) {
+    size_t len = RAW_COPY_SIZE + 12345;
+    unsigned char* data = make_data(len);
+    int fds[2], out_fd, status = 0;
+    pid_t pid;
+
+    CHECK(pipe(fds) == 0);
+    pid = fork();
+    if (pid == 0) {
+        size_t pos = 0, piece = 1;
+        close(fds[0]);
+        while (pos < len) {
+            size_t n = len - pos < piece ? len - pos : piece;
+            if (write(fds[1], data + pos, n) != (ssize_t) n) _exit(1);
+            pos += n;
+            piece = piece * 7 % 9973 + 1;
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(out_fd >= 0 && raw_copy_fd(fds[0], out_fd, RAW_SPARSE) == 0);
+    close(out_fd);
+    close(fds[0]);
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(check_file(out_path, data, len, 0) == 0);
+    free(data);
+}
+
+struct counter {
+    int calls;
+    int fail_at;
+    size_t bytes;
+};
+
+static int count_out(void* cookie, const void* data, size_t len) {
+    struct counter* c = (struct counter*) cookie;
+
+    if (++c->calls == c->fail_at) return -1;
+    if (len != RAW_COPY_SIZE && c->bytes % RAW_COPY_SIZE) return -1;
+    c->bytes += len;
+    return 0;
+}
+
+// Every piece is a full buffer but the last, and a failing output stops
+// the copy (and the reader thread) early
+static void test_read_fd(void) {
+    size_t len = 3 * RAW_COPY_SIZE + 100;
+    unsigned char* data = make_data(len);
+    struct counter c;
+    int fd;
+
+    CHECK(write_file(in_path, data, len) == 0);
+    memset(&c, 0, sizeof(c));
+    fd = open(in_path, O_RDONLY);
+    CHECK(fd >= 0 && raw_read_fd(fd, count_out, &c, 0) == 0);
+    CHECK(c.calls == 4 && c.bytes == len);
+    close(fd);
+
+    memset(&c, 0, sizeof(c));
+    c.fail_at = 2;
+    fd = open(in_path, O_RDONLY);
+    CHECK(fd >= 0 && raw_read_fd(fd, count_out, &c, 0) != 0);
+    CHECK(c.calls == 2);
+    close(fd);
+
+    // A directory can be opened but not read
+    memset(&c, 0, sizeof(c));
+    fd = open(dir, O_RDONLY);
+    CHECK(fd >= 0 && raw_read_fd(fd, count_out, &c, 0) != 0);
+    close(fd);
+    free(data);
+}
+
+static void test_fill(void) {
+    size_t len = RAW_COPY_SIZE * 2 + 40;
+    unsigned char* data = make_data(len);
+    unsigned char* want = malloc(len);
+    uint32_t value = 0xa1b2c3d4;
+    size_t i;
+    int fd;
+
+    CHECK(write_file(out_path, data, len) == 0);
+    memcpy(want, data, len);
+    for (i = 8; i < 8 + RAW_COPY_SIZE + 16; i += 4) memcpy(want + i, &value, 4);
+    memset(want + len - 20, 0, 16);
+
+    fd = open(out_path, O_WRONLY);
+    CHECK(fd >= 0);
+    CHECK(raw_fill(fd, 8, RAW_COPY_SIZE + 16, value) == 0);
+    CHECK(raw_fill(fd, len - 20, 16, 0) == 0);
+    close(fd);
+    CHECK(check_file(out_path, want, len, 0) == 0);
+    free(want);
+    free(data);
+}
+
+// Dumped sparse and expanded again, the image comes back as it was
+static void test_sparse(void) {
+    size_t len = 5 * SPARSE_REGION_SIZE + SPARSE_BLOCK_SIZE;
+    unsigned char* data = make_data(len);
+    struct stat st;
+
+    CHECK(write_file(in_path, data, len) == 0);
+    CHECK(raw_dump_sparse(in_path, img_path, 0) == 0);
+    CHECK(stat(img_path, &st) == 0 && st.st_size < (off_t) (len - SPARSE_REGION_SIZE));
+    CHECK(raw_copy(img_path, out_path, RAW_SPARSE) == 0);
+    CHECK(check_file(out_path, data, len, 0) == 0);
+
+    // Without RAW_SPARSE it's just a file
+    CHECK(raw_copy(img_path, out_path, 0) == 0);
+    CHECK(stat(out_path, &st) == 0 && st.st_size < (off_t) len);
+
+    // Cut short
+    CHECK(truncate(img_path, st.st_size - 100) == 0);
+    CHECK(raw_copy(img_path, out_path, RAW_SPARSE) != 0);
+
+    // Dumps have to be whole blocks
+    CHECK(write_file(in_path, data, SPARSE_BLOCK_SIZE + 1) == 0);
+    CHECK(raw_dump_sparse(in_path, img_path, 0) != 0);
+    free(data);
+}
+
+// An image ending in a don't care chunk still expands to its full size
+static void test_sparse_tail(void) {
+    unsigned char block[SPARSE_BLOCK_SIZE];
+    unsigned char want[3 * SPARSE_BLOCK_SIZE];
+    sparse_header_t hdr;
+    chunk_header_t chunk;
+    int fd;
+
+    memset(block, 0x33, sizeof(block));
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPARSE_HEADER_MAGIC;
+    hdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    hdr.file_hdr_sz = sizeof(hdr);
+    hdr.chunk_hdr_sz = sizeof(chunk);
+    hdr.blk_sz = SPARSE_BLOCK_SIZE;
+    hdr.total_blks = 3;
+    hdr.total_chunks = 2;
+
+    fd = open(img_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    CHECK(write(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.chunk_type = CHUNK_TYPE_RAW;
+    chunk.chunk_sz = 1;
+    chunk.total_sz = sizeof(chunk) + sizeof(block);
+    CHECK(write(fd, &chunk, sizeof(chunk)) == sizeof(chunk));
+    CHECK(write(fd, block, sizeof(block)) == sizeof(block));
+    chunk.chunk_type = CHUNK_TYPE_DONT_CARE;
+    chunk.chunk_sz = 2;
+    chunk.total_sz = sizeof(chunk);
+    CHECK(write(fd, &chunk, sizeof(chunk)) == sizeof(chunk));
+    close(fd);
+
+    memset(want, 0, sizeof(want));
+    memcpy(want, block, sizeof(block));
+    CHECK(raw_copy(img_path, out_path, RAW_SPARSE) == 0);
+    CHECK(check_file(out_path, want, sizeof(want), 0) == 0);
+}
+
+int main(int argc, char** argv) {
+    static const size_t sizes[] = {
+        0, 1, 511, 4096, RAW_COPY_SIZE - 1, RAW_COPY_SIZE, 2 * RAW_COPY_SIZE + 513
+    };
+    unsigned int i;
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [scratch dir]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2) dir = argv[1];
+    snprintf(in_path, sizeof(in_path), "%s/rawcopy_test.in", dir);
+    snprintf(out_path, sizeof(out_path), "%s/rawcopy_test.out", dir);
+    snprintf(img_path, sizeof(img_path), "%s/rawcopy_test.img", dir);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        test_copy(sizes[i], 0);
+        test_copy(sizes[i], RAW_DIRECT);
+        test_copy(sizes[i], RAW_PAD);
+        test_copy(sizes[i], RAW_SPARSE);
+    }
+    CHECK(raw_copy("/nonexistent/rawcopy_test", out_path, 0) != 0);
+    test_pipe();
+    test_read_fd();
+    test_fill();
+    test_sparse();
+    test_sparse_tail();
+
+    unlink(in_path);
+    unlink(out_path);
+    unlink(img_path);
+    printf("%s\n", failed ? "FAILURE" : "SUCCESS");
+    return failed;
+}
@@ -25,10 +25,12 @@
 #include <string.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "bootloader.h"
 #include "common.h"
@@ -50,6 +52,8 @@
 int notError;
 
 int gui_init(void);
+int gui_mountResources(void);
+int gui_loadScript(void);
 int gui_loadResources(void);
 int gui_start(void);
 int gui_console_only(void);
@@ -501,7 +505,7 @@ wipe_data(int confirm) {
     }
     if (stat("/sdcard/.android_secure", &st) == 0) {
         ui_print("Formatting /sdcard/.android_secure...\n");
-        __system("rm -rf /sdcard/.android_secure/* && rm -rf /sdcard/.android_secure/.*");
+        phx_remove_tree("/sdcard/.android_secure", 1);
     }
 	ui_reset_progress();
     ui_print("-- Factory reset complete.\n");
@@ -513,6 +517,96 @@ print_property(const char *key, const char *name, void *cookie) {
     printf("%s=%s\n", key, name);
 }
 
+// Startup is timed stage by stage, into the log
+static struct timeval startup_start;
+
+static long
+ms_since(const struct timeval *since) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+           (now.tv_usec - since->tv_usec) / 1000;
+}
+
+static void
+startup_stage(const char *name, struct timeval *stage) {
+    LOGI("startup: %-12s %5ld ms\n", name, ms_since(stage));
+    gettimeofday(stage, NULL);
+}
+
+// The theme is parsed and its images decoded on a thread of its own while
+// the partitions are found. It only reads from the sdcard, which is
+// mounted beforehand, and /res, and it has the data manager to itself until
+// joined. /cache is left to the main thread.
+struct theme_load {
+    pthread_t thread;
+    int started;
+    int ret;
+    long ms;
+};
+
+static void*
+theme_thread(void *cookie) {
+    struct theme_load *tl = (struct theme_load *) cookie;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+    tl->ret = gui_loadResources();
+    tl->ms = ms_since(&start);
+    return NULL;
+}
+
+// busybox --install -s /sbin without the shell, leaving alone the links a
+// previous run of recovery already made
+static void
+install_busybox_links() {
+    char name[64], path[PATH_MAX];
+    int made = 0, had = 0;
+    struct stat st;
+
+    FILE *fp = __popen("/sbin/busybox --list", "r");
+    if (fp != NULL) {
+        while (fgets(name, sizeof(name), fp) != NULL) {
+            name[strcspn(name, "\r\n")] = '\0';
+            if (name[0] == '\0' || strchr(name, '/') != NULL) continue;
+
+            snprintf(path, sizeof(path), "/sbin/%s", name);
+            if (lstat(path, &st) == 0)
+                had++;
+            else if (symlink("/sbin/busybox", path) == 0)
+                made++;
+        }
+        __pclose(fp);
+    }
+
+    // Builds without --list still know --install
+    if (made + had == 0) {
+        __system("/sbin/busybox --install -s /sbin");
+        return;
+    }
+    LOGI("=> busybox links: %d made, %d already there\n", made, had);
+}
+
+// The links are made while the sdcard comes up. Mounting is done with
+// mount(2) and nothing runs an applet before getLocations, which waits
+// for them; this is also the only __popen until then.
+struct busybox_install {
+    pthread_t thread;
+    int started;
+    long ms;
+};
+
+static void*
+busybox_thread(void *cookie) {
+    struct busybox_install *bi = (struct busybox_install *) cookie;
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+    install_busybox_links();
+    bi->ms = ms_since(&start);
+    return NULL;
+}
+
 int
 main(int argc, char **argv) {
     time_t start = time(NULL);
@@ -522,28 +616,63 @@ main(int argc, char **argv) {
     freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
     printf("Starting recovery on %s", ctime(&start));
 
+    struct timeval stage;
+    gettimeofday(&startup_start, NULL);
+    stage = startup_start;
+
     // Fire up the UI engine
     gui_init();
+    startup_stage("gui", &stage);
 
     printf("Loading volume table...\n");
     load_volume_table();
+    startup_stage("volumes", &stage);
 
-    // Load up all the resources
-    gui_loadResources();
+    LOGI("=> Installing busybox into /sbin\n");
+    struct busybox_install busybox;
+    memset(&busybox, 0, sizeof(busybox));
+    busybox.started = (pthread_create(&busybox.thread, NULL, busybox_thread, &busybox) == 0);
+    if (!busybox.started)
+        busybox_thread(&busybox);
+
+    // Load up all the resources, while we get on with the rest
+    struct theme_load theme;
+    memset(&theme, 0, sizeof(theme));
+    gui_mountResources();
+    gui_loadScript();
+    startup_stage("sdcard", &stage);
+    theme.started = (pthread_create(&theme.thread, NULL, theme_thread, &theme) == 0);
+    if (!theme.started)
+        theme_thread(&theme);
 
     printf("Processing arguments (%d)...\n", argc);
     get_args(&argc, &argv);
+    startup_stage("arguments", &stage);
 
-    LOGI("=> Installing busybox into /sbin\n");
-	__system("/sbin/busybox --install -s /sbin"); // Let's install busybox
+    if (busybox.started)
+        pthread_join(busybox.thread, NULL);
+    LOGI("startup: %-12s %5ld ms, %ld ms of it overlapped\n", "busybox",
+         busybox.ms, busybox.started ? busybox.ms - ms_since(&stage) : 0);
 	LOGI("=> Linking mtab\n");
-	__system("ln -s /proc/mounts /etc/mtab"); // And link mtab for mke2fs
+    symlink("/proc/mounts", "/etc/mtab"); // for mke2fs
+    startup_stage("busybox", &stage);
+
 	LOGI("=> Getting locations\n");
-    if (getLocations())
+    int located = getLocations();
+    startup_stage("partitions", &stage);
+
+    if (theme.started)
+        pthread_join(theme.thread, NULL);
+    LOGI("startup: %-12s %5ld ms, %ld ms of it overlapped\n", "theme",
+         theme.ms, theme.started ? theme.ms - ms_since(&stage) : 0);
+    gettimeofday(&stage, NULL);
+
+    if (located)
     {
         LOGE("Failing out of recovery.\n");
         return -1;
     }
+    publishLocations();
 
     int previous_runs = 0;
     const char *send_intent = NULL;
@@ -654,13 +783,11 @@ main(int argc, char **argv) {
 
     if (status != INSTALL_SUCCESS) { // We only want to show menu if error && visible
 
-        // Load up the values - Sleep to let the card be ready
-        usleep(500000);
-        if (ensure_path_mounted("/sdcard") < 0)
+        // Load up the values, once the card is ready
+        if (ensure_path_mounted("/sdcard") < 0 &&
+            (wait_for_volume("/sdcard", 1000) < 0 || ensure_path_mounted("/sdcard") < 0))
         {
-            usleep(500000);
-            if (ensure_path_mounted("/sdcard") < 0)
-                LOGE("Unable to mount sdcard\n");
+            LOGE("Unable to mount sdcard\n");
         }
         mkdir("/sdcard/phoenix", 0777);
         DataManager_LoadValues("/sdcard/phoenix/.settings");
@@ -671,6 +798,8 @@ main(int argc, char **argv) {
         // This clears up a bug about reboot coming back to recovery with the GUI
         finish_recovery(NULL);
 
+        startup_stage("settings", &stage);
+        LOGI("startup: ready for input after %ld ms\n", ms_since(&startup_start));
         gui_start();
     }
 
@@ -17,11 +17,15 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <linux/netlink.h>
 
 #include "mtdutils/mtdutils.h"
 #include "mtdutils/mounts.h"
@@ -125,6 +129,56 @@ Volume* volume_for_device(const char* device)
     return NULL;
 }
 
+static int volume_device_ready(const Volume* v) {
+    struct stat st;
+    return stat(v->device, &st) == 0 ||
+           (v->device2 && stat(v->device2, &st) == 0);
+}
+
+int wait_for_volume(const char* path, int timeout_ms) {
+    Volume* v = volume_for_path(path);
+    if (v == NULL || v->device == NULL) return -1;
+    if (v->device[0] != '/') return 0;  // mtd partitions are named, not nodes
+
+    // Listen before looking, so an add between the two isn't missed
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = 0;    // let the kernel pick, init holds getpid()
+    addr.nl_groups = 0xffffffff;
+    int fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (fd >= 0 && bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    int slice = 100;
+    int ready;
+    while (!(ready = volume_device_ready(v))) {
+        gettimeofday(&now, NULL);
+        int left = timeout_ms - (int) ((now.tv_sec - start.tv_sec) * 1000 +
+                                       (now.tv_usec - start.tv_usec) / 1000);
+        if (left <= 0) break;
+
+        // ueventd makes the node some time after the event reaches us, so
+        // look again soon after one, and now and then regardless
+        if (fd >= 0) {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, left < slice ? left : slice) > 0) {
+                char buf[1024];
+                recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+                slice = 10;
+            }
+        } else {
+            usleep(left < 50000 ? left * 1000 : 50000);
+        }
+    }
+    if (fd >= 0) close(fd);
+    return ready ? 0 : -1;
+}
+
 int ensure_path_mounted(const char* path) {
 #ifdef RECOVERY_SDCARD_ON_DATA
     if (strcmp(path, "/sdcard") == 0)   return 0;
@@ -192,10 +246,6 @@ int ensure_path_mounted(const char* path) {
 }
 
 int ensure_path_unmounted(const char* path) {
-    // This is an old, common method for ensuring a flush
-    sync();
-    sync();
-
     Volume* v = volume_for_path(path);
     if (v == NULL) {
         LOGE("unknown volume for path [%s]\n", path);
@@ -220,6 +270,7 @@ int ensure_path_unmounted(const char* path) {
         return 0;
     }
 
+    // flushes the volume itself before unmounting it
     return unmount_mounted_volume(mv);
 }
 
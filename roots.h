@@ -32,6 +32,11 @@ Volume* volume_for_device(const char* device);
 // success (volume is mounted).
 int ensure_path_mounted(const char* path);
 
+// Wait up to timeout_ms for the device of the volume 'path' is on to
+// show up, waking on kernel uevents rather than polling.  Returns 0 once
+// it's there, -1 on timeout or if there's no such volume.
+int wait_for_volume(const char* path, int timeout_ms);
+
 // Make sure that the volume 'path' is on is mounted.  Returns 0 on
 // success (volume is unmounted);
 int ensure_path_unmounted(const char* path);
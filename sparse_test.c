@@ -0,0 +1,391 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Round trips images through the sparse encoders and decoder, and checks
+// that truncated and malformed sparse images are refused.
+// Usage: sparse_test [scratch dir]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mtdutils/sparse.h"
+
+static const char* dir = "/tmp";
+static int failed = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+void ui_print(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+
+    fputs(buf, stderr);
+}
+
+// A sparse image in memory, written by the encoders and read back by the
+// decoder, which expands it into 'image'
+struct buffer {
+    unsigned char* data;
+    size_t len, alloc, pos;
+    unsigned char* image;
+    size_t image_len;
+    int fills;
+};
+
+static int buf_out(void* cookie, const void* data, size_t len) {
+    struct buffer* b = (struct buffer*) cookie;
+
+    if (b->len + len > b->alloc) {
+        b->alloc = (b->len + len) * 2;
+        b->data = realloc(b->data, b->alloc);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+// Hands out odd sized pieces, the way a pipe might
+static ssize_t buf_read(void* cookie, void* data, size_t len) {
+    struct buffer* b = (struct buffer*) cookie;
+    size_t n = b->len - b->pos;
+
+    if (n > len) n = len;
+    if (n > 5000) n = 5000 - (b->pos % 7);
+    memcpy(data, b->data + b->pos, n);
+    b->pos += n;
+    return n;
+}
+
+static int buf_data(void* cookie, unsigned long long offset, const void* data, size_t len) {
+    struct buffer* b = (struct buffer*) cookie;
+
+    if (offset + len > b->image_len) return -1;
+    memcpy(b->image + offset, data, len);
+    return 0;
+}
+
+static int buf_fill(void* cookie, unsigned long long offset, unsigned long long len, uint32_t value) {
+    struct buffer* b = (struct buffer*) cookie;
+    unsigned long long i;
+
+    if (offset + len > b->image_len || len % 4) return -1;
+    for (i = 0; i < len; i += 4) memcpy(b->image + offset + i, &value, 4);
+    b->fills++;
+    return 0;
+}
+
+// Expands b->data into a fresh image of image_len bytes, all 0xee first so
+// don't care ranges stand out
+static int decode(struct buffer* b, size_t image_len, unsigned long long* size) {
+    free(b->image);
+    b->image = malloc(image_len ? image_len : 1);
+    memset(b->image, 0xee, image_len);
+    b->image_len = image_len;
+    b->pos = 0;
+    b->fills = 0;
+    return sparse_read(buf_read, buf_data, buf_fill, b, size);
+}
+
+static void buf_free(struct buffer* b) {
+    free(b->data);
+    free(b->image);
+    memset(b, 0, sizeof(*b));
+}
+
+// Regions of noise, zeros, and noise with a single zero block in it
+static unsigned char* make_image(size_t len) {
+    unsigned char* data = calloc(1, len);
+    size_t i;
+
+    srand(len);
+    for (i = 0; i < len; i++) {
+        size_t region = i / SPARSE_REGION_SIZE;
+        if (region % 3 == 1) continue;
+        if (region % 3 == 2 && (i / SPARSE_BLOCK_SIZE) % 16 == 5) continue;
+        data[i] = rand();
+    }
+    return data;
+}
+
+static void test_round_trip(void) {
+    size_t len = 7 * SPARSE_REGION_SIZE + 3 * SPARSE_BLOCK_SIZE;
+    unsigned char* data = make_image(len);
+    unsigned long long size = 0;
+    struct buffer b;
+    SparseWriter* sw;
+    size_t pos, piece = 1;
+
+    memset(&b, 0, sizeof(b));
+    sw = sparse_create(buf_out, &b, len);
+    CHECK(sw != NULL);
+    if (sw == NULL) return;
+    for (pos = 0; pos < len; pos += piece, piece = piece * 5 % 70001 + 1) {
+        if (piece > len - pos) piece = len - pos;
+        CHECK(sparse_write(sw, data + pos, piece) == 0);
+    }
+    CHECK(sparse_close(sw) == 0);
+
+    // The zero regions, the short one at the end too, take a fill chunk
+    // each instead of their data
+    CHECK(b.len < len - 2 * SPARSE_REGION_SIZE - 3 * SPARSE_BLOCK_SIZE + 1024);
+    CHECK(decode(&b, len, &size) == 0);
+    CHECK(size == len);
+    CHECK(b.fills == 3);
+    CHECK(memcmp(b.image, data, len) == 0);
+
+    // Cut anywhere, the image is refused
+    for (pos = 1; pos < b.len; pos += b.len / 37) {
+        size_t full = b.len;
+        b.len = pos;
+        CHECK(decode(&b, len, &size) != 0);
+        b.len = full;
+    }
+
+    buf_free(&b);
+    free(data);
+}
+
+static void test_writer_limits(void) {
+    struct buffer b;
+    SparseWriter* sw;
+    char block[SPARSE_BLOCK_SIZE];
+
+    memset(&b, 0, sizeof(b));
+    memset(block, 1, sizeof(block));
+    CHECK(sparse_create(buf_out, &b, SPARSE_BLOCK_SIZE + 1) == NULL);
+
+    // Short and long
+    sw = sparse_create(buf_out, &b, 2 * SPARSE_BLOCK_SIZE);
+    CHECK(sw != NULL && sparse_write(sw, block, sizeof(block)) == 0);
+    CHECK(sw != NULL && sparse_close(sw) != 0);
+    sw = sparse_create(buf_out, &b, SPARSE_BLOCK_SIZE);
+    CHECK(sw != NULL && sparse_write(sw, block, sizeof(block)) == 0);
+    CHECK(sw != NULL && sparse_write(sw, block, 1) != 0);
+    CHECK(sw != NULL && sparse_close(sw) != 0);
+    buf_free(&b);
+}
+
+// Dumps of unknown size get their header fixed up at the end, wherever in
+// the file the image starts
+static void test_fd(void) {
+    size_t len = 3 * SPARSE_REGION_SIZE + SPARSE_BLOCK_SIZE;
+    unsigned char* data = make_image(len);
+    unsigned long long size = 0;
+    char path[256];
+    struct buffer b;
+    SparseWriter* sw;
+    sparse_header_t hdr;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/sparse_test.img", dir);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    if (fd < 0) return;
+    CHECK(write(fd, "prefix", 6) == 6);
+    sw = sparse_create_fd(fd);
+    CHECK(sw != NULL);
+    if (sw != NULL) {
+        CHECK(sparse_write(sw, data, len) == 0);
+        CHECK(sparse_close(sw) == 0);
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.len = lseek(fd, 0, SEEK_END) - 6;
+    b.data = malloc(b.len);
+    CHECK(pread(fd, b.data, b.len, 6) == (ssize_t) b.len);
+    memcpy(&hdr, b.data, sizeof(hdr));
+    CHECK(hdr.total_blks == len / SPARSE_BLOCK_SIZE);
+    CHECK(hdr.total_chunks == 4);
+    CHECK(decode(&b, len, &size) == 0 && size == len);
+    CHECK(memcmp(b.image, data, len) == 0);
+    buf_free(&b);
+
+    // Has to end on a block
+    CHECK(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    sw = sparse_create_fd(fd);
+    CHECK(sw != NULL);
+    if (sw != NULL) {
+        CHECK(sparse_write(sw, data, SPARSE_BLOCK_SIZE + 10) == 0);
+        CHECK(sparse_close(sw) != 0);
+    }
+    CHECK(sparse_is_image(fd));
+    close(fd);
+    unlink(path);
+    free(data);
+}
+
+// Raw, don't care, raw, in 1024 byte blocks
+static void test_mapped(void) {
+    unsigned char data[5 * 1024];
+    unsigned long long size = 0;
+    struct buffer b;
+    SparseWriter* sw;
+    size_t i;
+
+    for (i = 0; i < sizeof(data); i++) data[i] = i * 13;
+    memset(&b, 0, sizeof(b));
+    sw = sparse_create_mapped(buf_out, &b, 1024, 9, 3);
+    CHECK(sw != NULL);
+    if (sw == NULL) return;
+    CHECK(sparse_raw(sw, 2) == 0);
+    CHECK(sparse_write(sw, data, 1000) == 0);
+    CHECK(sparse_write(sw, data + 1000, 1048) == 0);
+    CHECK(sparse_skip(sw, 4) == 0);
+    CHECK(sparse_raw(sw, 3) == 0);
+    CHECK(sparse_write(sw, data + 2048, 3072) == 0);
+    CHECK(sparse_close(sw) == 0);
+
+    CHECK(decode(&b, 9 * 1024, &size) == 0 && size == 9 * 1024);
+    CHECK(memcmp(b.image, data, 2048) == 0);
+    CHECK(b.image[2048] == 0xee && b.image[6 * 1024 - 1] == 0xee);
+    CHECK(memcmp(b.image + 6 * 1024, data + 2048, 3072) == 0);
+    buf_free(&b);
+
+    // More data than the chunk, a chunk too many, one too few
+    sw = sparse_create_mapped(buf_out, &b, 1024, 2, 1);
+    CHECK(sw != NULL && sparse_raw(sw, 1) == 0);
+    CHECK(sw != NULL && sparse_write(sw, data, 1025) != 0);
+    if (sw) sparse_close(sw);
+    sw = sparse_create_mapped(buf_out, &b, 1024, 2, 1);
+    CHECK(sw != NULL && sparse_skip(sw, 1) == 0 && sparse_skip(sw, 1) != 0);
+    if (sw) sparse_close(sw);
+    sw = sparse_create_mapped(buf_out, &b, 1024, 2, 2);
+    CHECK(sw != NULL && sparse_skip(sw, 2) == 0);
+    CHECK(sw != NULL && sparse_close(sw) != 0);
+    CHECK(sparse_create_mapped(buf_out, &b, 1022, 2, 2) == NULL);
+    buf_free(&b);
+}
+
+static void add_chunk(struct buffer* b, uint16_t type, uint32_t blocks, uint32_t total_sz, const void* data, size_t len) {
+    chunk_header_t chunk;
+
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.chunk_type = type;
+    chunk.chunk_sz = blocks;
+    chunk.total_sz = total_sz;
+    buf_out(b, &chunk, sizeof(chunk));
+    if (len) buf_out(b, data, len);
+}
+
+static void add_header(struct buffer* b, uint32_t blocks, uint32_t chunks) {
+    sparse_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPARSE_HEADER_MAGIC;
+    hdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    hdr.file_hdr_sz = sizeof(hdr);
+    hdr.chunk_hdr_sz = sizeof(chunk_header_t);
+    hdr.blk_sz = SPARSE_BLOCK_SIZE;
+    hdr.total_blks = blocks;
+    hdr.total_chunks = chunks;
+    b->len = 0;
+    buf_out(b, &hdr, sizeof(hdr));
+}
+
+// Hand made images, good and bad, as other tools might write them
+static void test_malformed(void) {
+    static unsigned char block[SPARSE_BLOCK_SIZE];
+    uint32_t value = 0x12345678;
+    uint32_t crc = 0;
+    unsigned long long size = 0;
+    size_t len = 4 * SPARSE_BLOCK_SIZE;
+    struct buffer b;
+    sparse_header_t* hdr;
+
+    memset(block, 0x42, sizeof(block));
+    memset(&b, 0, sizeof(b));
+    const uint32_t chdr = sizeof(chunk_header_t);
+
+    // Every chunk type, ending on a don't care chunk
+    add_header(&b, 4, 4);
+    add_chunk(&b, CHUNK_TYPE_RAW, 1, chdr + SPARSE_BLOCK_SIZE, block, sizeof(block));
+    add_chunk(&b, CHUNK_TYPE_CRC32, 0, chdr + 4, &crc, 4);
+    add_chunk(&b, CHUNK_TYPE_FILL, 2, chdr + 4, &value, 4);
+    add_chunk(&b, CHUNK_TYPE_DONT_CARE, 1, chdr, NULL, 0);
+    CHECK(decode(&b, len, &size) == 0 && size == len);
+    CHECK(memcmp(b.image, block, SPARSE_BLOCK_SIZE) == 0);
+    CHECK(memcmp(b.image + SPARSE_BLOCK_SIZE, &value, 4) == 0);
+    CHECK(b.image[3 * SPARSE_BLOCK_SIZE] == 0xee);
+
+    // A header that doesn't add up to the chunks
+    add_header(&b, 5, 1);
+    add_chunk(&b, CHUNK_TYPE_DONT_CARE, 4, chdr, NULL, 0);
+    CHECK(decode(&b, len + SPARSE_BLOCK_SIZE, &size) != 0);
+
+    // total_sz has to match what each chunk type carries
+    add_header(&b, 1, 1);
+    add_chunk(&b, CHUNK_TYPE_DONT_CARE, 1, chdr + 4, &value, 4);
+    CHECK(decode(&b, len, &size) != 0);
+    add_header(&b, 1, 1);
+    add_chunk(&b, CHUNK_TYPE_RAW, 1, chdr + SPARSE_BLOCK_SIZE - 4, block, sizeof(block));
+    CHECK(decode(&b, len, &size) != 0);
+    add_header(&b, 1, 1);
+    add_chunk(&b, CHUNK_TYPE_FILL, 1, chdr + 8, &value, 4);
+    CHECK(decode(&b, len, &size) != 0);
+    add_header(&b, 0, 1);
+    add_chunk(&b, CHUNK_TYPE_CRC32, 0, chdr, NULL, 0);
+    CHECK(decode(&b, len, &size) != 0);
+    add_header(&b, 1, 1);
+    add_chunk(&b, 0xCAC9, 1, chdr, NULL, 0);
+    CHECK(decode(&b, len, &size) != 0);
+
+    // Not sparse at all
+    add_header(&b, 0, 0);
+    hdr = (sparse_header_t*) b.data;
+    hdr->magic ^= 1;
+    CHECK(decode(&b, len, &size) != 0);
+    add_header(&b, 0, 0);
+    hdr = (sparse_header_t*) b.data;
+    hdr->major_version = 2;
+    CHECK(decode(&b, len, &size) != 0);
+    add_header(&b, 0, 0);
+    hdr = (sparse_header_t*) b.data;
+    hdr->blk_sz = 4094;
+    CHECK(decode(&b, len, &size) != 0);
+    add_header(&b, 0, 0);
+    CHECK(decode(&b, len, &size) == 0 && size == 0);
+    buf_free(&b);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [scratch dir]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2) dir = argv[1];
+
+    test_round_trip();
+    test_writer_limits();
+    test_fd();
+    test_mapped();
+    test_malformed();
+
+    printf("%s\n", failed ? "FAILURE" : "SUCCESS");
+    return failed;
+}
@@ -0,0 +1,1184 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "minzip/DirUtil.h"
+#include "tarball.h"
+#include "winfile.h"
+
+#define TAR_READ_SIZE       (64 * 1024)
+#define TAR_LINK_BUCKETS    1024
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[8];          // GNU: "ustar  \0"
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct tar_link {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+    struct tar_link* next;
+};
+
+struct tar_list_entry {
+    char* name;
+    char type;
+    unsigned long long ino;
+    unsigned long long size;
+    long long mtime;
+    unsigned int mode;
+    long long offset;               // TAR_OFFSET_BASE / TAR_OFFSET_UNKNOWN when not in this archive
+    int seen;
+    struct tar_list_entry* next;
+};
+
+struct TarList {
+    char* base;
+    struct tar_list_entry** buckets;
+    unsigned int nbuckets;          // power of two
+    char** removed;
+    int nremoved;
+};
+
+struct tar_state {
+    WinFile* out;
+    const char** excludes;
+    tar_entry_fn cb;
+    void* cookie;
+    FILE* list;
+    TarList* base;
+    unsigned long long offset;      // bytes of tar stream written so far
+    char* buffer;
+    struct tar_link* links[TAR_LINK_BUCKETS];
+    int error;
+};
+
+// Writes an octal field, or GNU base-256 when the value doesn't fit
+static void tar_number(char* field, int len, unsigned long long value)
+{
+    int i;
+
+    if (value < (1ULL << (3 * (len - 1))))
+    {
+        field[len - 1] = '\0';
+        for (i = len - 2; i >= 0; i--)
+        {
+            field[i] = '0' + (value & 7);
+            value >>= 3;
+        }
+        return;
+    }
+
+    for (i = len - 1; i > 0; i--)
+    {
+        field[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+    field[0] = (char) 0x80;
+}
+
+static int tar_write(struct tar_state* ts, const void* data, size_t len)
+{
+    if (ts->error)      return -1;
+    if (win_write(ts->out, data, len))
+        ts->error = 1;
+    ts->offset += len;
+    return ts->error ? -1 : 0;
+}
+
+static int tar_pad(struct tar_state* ts, unsigned long long len)
+{
+    static const char zeros[TAR_BLOCK_SIZE];
+    size_t rem = (size_t) (len % TAR_BLOCK_SIZE);
+
+    if (rem == 0)       return 0;
+    return tar_write(ts, zeros, TAR_BLOCK_SIZE - rem);
+}
+
+static int tar_write_header(struct tar_state* ts, struct tar_header* hdr)
+{
+    unsigned int sum = 0;
+    unsigned int i;
+    unsigned char* p = (unsigned char*) hdr;
+
+    memcpy(hdr->magic, "ustar  ", 8);
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    for (i = 0; i < sizeof(*hdr); i++)
+        sum += p[i];
+    tar_number(hdr->chksum, 7, sum);
+    hdr->chksum[7] = ' ';
+
+    return tar_write(ts, hdr, sizeof(*hdr));
+}
+
+// GNU long name/link records, for anything that doesn't fit in 100 bytes
+static int tar_write_longname(struct tar_state* ts, char type, const char* name)
+{
+    struct tar_header hdr;
+    size_t len = strlen(name) + 1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(hdr.name, "././@LongLink");
+    tar_number(hdr.mode, sizeof(hdr.mode), 0);
+    tar_number(hdr.uid, sizeof(hdr.uid), 0);
+    tar_number(hdr.gid, sizeof(hdr.gid), 0);
+    tar_number(hdr.size, sizeof(hdr.size), len);
+    tar_number(hdr.mtime, sizeof(hdr.mtime), 0);
+    hdr.typeflag = type;
+
+    if (tar_write_header(ts, &hdr))     return -1;
+    if (tar_write(ts, name, len))       return -1;
+    return tar_pad(ts, len);
+}
+
+static const char* tar_find_link(struct tar_state* ts, const struct stat* st, const char* name)
+{
+    unsigned int bucket = (unsigned int) (st->st_ino % TAR_LINK_BUCKETS);
+    struct tar_link* link;
+
+    for (link = ts->links[bucket]; link; link = link->next)
+    {
+        if (link->ino == st->st_ino && link->dev == st->st_dev)
+            return link->name;
+    }
+
+    // First time we see this inode, remember who owns the data
+    link = (struct tar_link*) malloc(sizeof(struct tar_link));
+    if (link)
+    {
+        link->dev = st->st_dev;
+        link->ino = st->st_ino;
+        link->name = strdup(name);
+        link->next = ts->links[bucket];
+        ts->links[bucket] = link;
+    }
+    return NULL;
+}
+
+static int tar_write_data(struct tar_state* ts, const char* path, unsigned long long size)
+{
+    unsigned long long left = size;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        LOGW("tar: unable to open %s (%s)\n", path, strerror(errno));
+
+    while (fd >= 0 && left > 0)
+    {
+        size_t want = left < TAR_READ_SIZE ? (size_t) left : TAR_READ_SIZE;
+        ssize_t len = read(fd, ts->buffer, want);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+        {
+            if (len < 0)
+                LOGW("tar: read error on %s (%s)\n", path, strerror(errno));
+            break;
+        }
+        if (tar_write(ts, ts->buffer, len))
+            break;
+        left -= len;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    // The header already promised 'size' bytes; if the file shrank (or
+    // couldn't be read) pad it out so the archive stays consistent.
+    if (left > 0 && !ts->error)
+    {
+        LOGW("tar: %s changed while reading, padding %llu bytes\n", path, left);
+        memset(ts->buffer, 0, TAR_READ_SIZE);
+        while (left > 0)
+        {
+            size_t len = left < TAR_READ_SIZE ? (size_t) left : TAR_READ_SIZE;
+            if (tar_write(ts, ts->buffer, len))
+                break;
+            left -= len;
+        }
+    }
+    return tar_pad(ts, size);
+}
+
+static unsigned int tar_list_hash(const char* name)
+{
+    unsigned int hash = 5381;
+
+    while (*name)
+        hash = hash * 33 + (unsigned char) *name++;
+    return hash;
+}
+
+static struct tar_list_entry* tar_list_find(TarList* list, const char* name)
+{
+    struct tar_list_entry* e = list->buckets[tar_list_hash(name) & (list->nbuckets - 1)];
+
+    while (e && strcmp(e->name, name) != 0)
+        e = e->next;
+    return e;
+}
+
+// Names go last on the line with '\\' and newlines escaped, so any name
+// survives the round trip
+static void tar_list_name(FILE* fp, const char* name)
+{
+    for (; *name; name++)
+    {
+        if (*name == '\\')         fputs("\\\\", fp);
+        else if (*name == '\n')    fputs("\\n", fp);
+        else                       fputc(*name, fp);
+    }
+    fputc('\n', fp);
+}
+
+static void tar_list_unescape(char* name)
+{
+    char* out = name;
+
+    for (; *name && *name != '\n'; name++)
+    {
+        if (*name == '\\' && name[1] == 'n')          { *out++ = '\n'; name++; }
+        else if (*name == '\\' && name[1] == '\\')   { *out++ = '\\'; name++; }
+        else                                        *out++ = *name;
+    }
+    *out = '\0';
+}
+
+// Records the entry in the new list and tells whether the previous backup
+// already holds an identical copy of it. Called before any of the entry's
+// records are written, so ts->offset is where they will start.
+static int tar_list_entry_unchanged(struct tar_state* ts, const char* name, char type, const struct stat* st)
+{
+    struct tar_list_entry* e = NULL;
+    int unchanged = 0;
+
+    if (ts->base && (e = tar_list_find(ts->base, name)) != NULL)
+    {
+        e->seen = 1;
+        if (e->type != type)
+        {
+            // Whatever was there has to go before the new entry is extracted
+            if (ts->list)
+            {
+                fputs("- 0 0 0 0 - ", ts->list);
+                tar_list_name(ts->list, name);
+            }
+        }
+        else if (type == '0' && e->ino == (unsigned long long) st->st_ino &&
+                 e->size == (unsigned long long) st->st_size && e->mtime == (long long) st->st_mtime)
+            unchanged = 1;
+    }
+
+    if (ts->list)
+    {
+        fprintf(ts->list, "%c %llu %llu %lld %o ", type, (unsigned long long) st->st_ino,
+                type == '0' ? (unsigned long long) st->st_size : 0ULL, (long long) st->st_mtime,
+                (unsigned int) (st->st_mode & 07777));
+        if (unchanged)      fputs("- ", ts->list);
+        else                fprintf(ts->list, "%llu ", ts->offset);
+        tar_list_name(ts->list, name);
+    }
+    return unchanged;
+}
+
+static int tar_add_entry(struct tar_state* ts, const char* path, const char* name, const struct stat* st)
+{
+    struct tar_header hdr;
+    char target[PATH_MAX];
+    char member[PATH_MAX + 1];
+    const char* link = NULL;
+    unsigned long long size = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(member, name);
+
+    if (S_ISREG(st->st_mode))
+    {
+        // Every name of an unchanged inode is unchanged too, so hard links
+        // among them are left to the base archive as well
+        if (tar_list_entry_unchanged(ts, name, '0', st))
+            return 0;
+
+        if (st->st_nlink > 1)
+            link = tar_find_link(ts, st, name);
+        if (link)
+            hdr.typeflag = '1';
+        else
+        {
+            hdr.typeflag = '0';
+            size = st->st_size;
+        }
+    }
+    else if (S_ISDIR(st->st_mode))
+    {
+        hdr.typeflag = '5';
+        strcat(member, "/");
+    }
+    else if (S_ISLNK(st->st_mode))
+    {
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        if (len < 0)
+        {
+            LOGW("tar: unable to read link %s (%s)\n", path, strerror(errno));
+            return 0;
+        }
+        target[len] = '\0';
+        link = target;
+        hdr.typeflag = '2';
+    }
+    else if (S_ISCHR(st->st_mode))      hdr.typeflag = '3';
+    else if (S_ISBLK(st->st_mode))      hdr.typeflag = '4';
+    else if (S_ISFIFO(st->st_mode))     hdr.typeflag = '6';
+    else
+    {
+        // Sockets can't be archived, tar skips them as well
+        return 0;
+    }
+
+    // Directories, links and nodes are always archived; they cost a header
+    if (hdr.typeflag != '0' && hdr.typeflag != '1')
+        tar_list_entry_unchanged(ts, name, hdr.typeflag, st);
+
+    if (strlen(member) >= sizeof(hdr.name) && tar_write_longname(ts, 'L', member))
+        return -1;
+    if (link && strlen(link) >= sizeof(hdr.linkname) && tar_write_longname(ts, 'K', link))
+        return -1;
+
+    strncpy(hdr.name, member, sizeof(hdr.name) - 1);
+    if (link)
+        strncpy(hdr.linkname, link, sizeof(hdr.linkname) - 1);
+
+    tar_number(hdr.mode, sizeof(hdr.mode), st->st_mode & 07777);
+    tar_number(hdr.uid, sizeof(hdr.uid), st->st_uid);
+    tar_number(hdr.gid, sizeof(hdr.gid), st->st_gid);
+    tar_number(hdr.size, sizeof(hdr.size), size);
+    tar_number(hdr.mtime, sizeof(hdr.mtime), st->st_mtime);
+    if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+    {
+        tar_number(hdr.devmajor, sizeof(hdr.devmajor), major(st->st_rdev));
+        tar_number(hdr.devminor, sizeof(hdr.devminor), minor(st->st_rdev));
+    }
+
+    if (tar_write_header(ts, &hdr))
+        return -1;
+
+    if (ts->cb)
+        ts->cb(member, ts->cookie);
+
+    if (hdr.typeflag == '0' && size > 0)
+        return tar_write_data(ts, path, size);
+    return 0;
+}
+
+static int tar_is_excluded(struct tar_state* ts, const char* name)
+{
+    const char** ex;
+
+    if (!ts->excludes)      return 0;
+    for (ex = ts->excludes; *ex; ex++)
+    {
+        if (strcmp(*ex, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int tar_add_dir(struct tar_state* ts, const char* path, const char* name)
+{
+    DIR* d = opendir(path);
+    struct dirent* de;
+
+    if (d == NULL)
+    {
+        LOGW("tar: unable to open directory %s (%s)\n", path, strerror(errno));
+        return 0;
+    }
+
+    while (!ts->error && (de = readdir(d)) != NULL)
+    {
+        char child_path[PATH_MAX];
+        char child_name[PATH_MAX];
+        struct stat st;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        if (snprintf(child_path, sizeof(child_path), "%s/%s", path, de->d_name) >= (int) sizeof(child_path) ||
+            snprintf(child_name, sizeof(child_name), "%s/%s", name, de->d_name) >= (int) sizeof(child_name))
+        {
+            LOGW("tar: path too long, skipping %s/%s\n", path, de->d_name);
+            continue;
+        }
+
+        if (tar_is_excluded(ts, child_name))
+            continue;
+
+        if (lstat(child_path, &st) != 0)
+        {
+            LOGW("tar: unable to stat %s (%s)\n", child_path, strerror(errno));
+            continue;
+        }
+
+        if (tar_add_entry(ts, child_path, child_name, &st))
+            break;
+
+        if (S_ISDIR(st.st_mode) && tar_add_dir(ts, child_path, child_name))
+            break;
+    }
+    closedir(d);
+    return ts->error ? -1 : 0;
+}
+
+int tar_create(WinFile* out, const char* root, const struct tar_options* opts)
+{
+    struct tar_state ts;
+    unsigned int i;
+
+    memset(&ts, 0, sizeof(ts));
+    ts.out = out;
+    ts.excludes = opts->excludes;
+    ts.cb = opts->cb;
+    ts.cookie = opts->cookie;
+    ts.list = opts->list;
+    ts.base = opts->base;
+    ts.buffer = (char*) malloc(TAR_READ_SIZE);
+    if (ts.buffer == NULL)
+        return -1;
+
+    tar_add_dir(&ts, root, ".");
+
+    // End of archive is two zero blocks
+    if (!ts.error)
+    {
+        char zeros[TAR_BLOCK_SIZE * 2];
+        memset(zeros, 0, sizeof(zeros));
+        tar_write(&ts, zeros, sizeof(zeros));
+    }
+
+    // Anything the base had that we didn't come across has been deleted
+    if (ts.base && ts.list && !ts.error)
+    {
+        for (i = 0; i < ts.base->nbuckets; i++)
+        {
+            struct tar_list_entry* e;
+            for (e = ts.base->buckets[i]; e; e = e->next)
+            {
+                if (e->seen)    continue;
+                fputs("- 0 0 0 0 - ", ts.list);
+                tar_list_name(ts.list, e->name);
+            }
+        }
+    }
+    if (ts.list && ferror(ts.list))
+    {
+        LOGE("tar: unable to write the file list\n");
+        ts.error = 1;
+    }
+
+    for (i = 0; i < TAR_LINK_BUCKETS; i++)
+    {
+        while (ts.links[i])
+        {
+            struct tar_link* next = ts.links[i]->next;
+            free(ts.links[i]->name);
+            free(ts.links[i]);
+            ts.links[i] = next;
+        }
+    }
+    free(ts.buffer);
+    return ts.error ? -1 : 0;
+}
+
+struct tar_dir_time {
+    char* path;
+    time_t mtime;
+};
+
+struct tar_reader {
+    WinReader* in;
+    const char* root;
+    char* buffer;
+    struct tar_dir_time* dirs;      // directory mtimes are set once their contents are in
+    int ndirs, adirs;
+    int broken;                     // the stream failed, nothing more can be read
+};
+
+static int tar_read_full(struct tar_reader* tr, void* data, size_t len)
+{
+    char* ptr = (char*) data;
+
+    while (len > 0)
+    {
+        ssize_t got = win_read(tr->in, ptr, len);
+        if (got <= 0)
+        {
+            tr->broken = 1;
+            return -1;
+        }
+        ptr += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static unsigned long long tar_parse_number(const char* field, int len)
+{
+    unsigned long long value = 0;
+    int i = 0;
+
+    // GNU base-256
+    if ((unsigned char) field[0] & 0x80)
+    {
+        value = (unsigned char) field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+
+    while (i < len && (field[i] == ' ' || field[i] == '\0'))
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+// Header fields aren't terminated when they're full
+static void tar_field_cat(char* dst, const char* field, size_t len)
+{
+    size_t n = 0;
+    size_t end = strlen(dst);
+
+    while (n < len && field[n])
+        n++;
+    memcpy(dst + end, field, n);
+    dst[end + n] = '\0';
+}
+
+static int tar_header_ok(const struct tar_header* hdr)
+{
+    const unsigned char* p = (const unsigned char*) hdr;
+    unsigned long long want = tar_parse_number(hdr->chksum, sizeof(hdr->chksum));
+    unsigned int sum = 0;
+    int ssum = 0;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(*hdr); i++)
+    {
+        unsigned char c = (i >= 148 && i < 156) ? ' ' : p[i];
+        sum += c;
+        ssum += (signed char) c;
+    }
+    // Some old tars summed signed chars
+    return want == sum || want == (unsigned long long) ssum;
+}
+
+// Reads (or throws away) a member's data, which is padded to whole blocks
+static int tar_read_data(struct tar_reader* tr, int fd, const char* path, unsigned long long size)
+{
+    unsigned long long left = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    int ret = 0;
+
+    while (left > 0)
+    {
+        size_t want = left < TAR_READ_SIZE ? (size_t) left : TAR_READ_SIZE;
+        if (tar_read_full(tr, tr->buffer, want))
+        {
+            LOGE("tar: archive is truncated\n");
+            return -1;
+        }
+
+        size_t keep = size < want ? (size_t) size : want;
+        size -= keep;
+        left -= want;
+
+        const char* ptr = tr->buffer;
+        while (fd >= 0 && keep > 0 && ret == 0)
+        {
+            ssize_t wrote = write(fd, ptr, keep);
+            if (wrote < 0 && errno == EINTR)
+                continue;
+            if (wrote <= 0)
+            {
+                LOGE("tar: unable to write %s (%s)\n", path, strerror(errno));
+                ret = -1;
+                break;
+            }
+            ptr += wrote;
+            keep -= wrote;
+        }
+    }
+    return ret;
+}
+
+static char* tar_read_longname(struct tar_reader* tr, unsigned long long size)
+{
+    char* name;
+    unsigned long long padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+    if (size == 0 || size > PATH_MAX * 4)
+        return NULL;
+    name = (char*) malloc(padded + 1);
+    if (name == NULL)
+        return NULL;
+    if (tar_read_full(tr, name, padded))
+    {
+        free(name);
+        return NULL;
+    }
+    name[size] = '\0';
+    return name;
+}
+
+// pax records are "<length> <key>=<value>\n"; only the long names matter
+static void tar_parse_pax(const char* data, unsigned long long size, char** longname, char** longlink)
+{
+    const char* end = data + size;
+
+    while (data < end)
+    {
+        char* ptr;
+        unsigned long len = strtoul(data, &ptr, 10);
+        const char* key = ptr + 1;
+        const char* eq;
+        char** dst = NULL;
+
+        if (len == 0 || *ptr != ' ' || len > (unsigned long) (end - data) || data[len - 1] != '\n')
+            return;
+        eq = memchr(key, '=', data + len - key);
+        if (eq != NULL)
+        {
+            if (eq - key == 4 && strncmp(key, "path", 4) == 0)              dst = longname;
+            else if (eq - key == 8 && strncmp(key, "linkpath", 8) == 0)     dst = longlink;
+        }
+        if (dst != NULL)
+        {
+            free(*dst);
+            *dst = strndup(eq + 1, data + len - 1 - (eq + 1));
+        }
+        data += len;
+    }
+}
+
+// Builds root/name, refusing names that would land outside of root
+static int tar_safe_path(const char* root, const char* name, char* path)
+{
+    const char* p;
+
+    while (*name == '/')                            name++;
+    while (name[0] == '.' && name[1] == '/')        name += 2;
+    if (*name == '\0' || strcmp(name, ".") == 0)    return -1;
+
+    for (p = name; p; p = strchr(p, '/'))
+    {
+        if (*p == '/')  p++;
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return -1;
+    }
+
+    if (snprintf(path, PATH_MAX, "%s/%s", root, name) >= PATH_MAX)
+        return -1;
+
+    // Directories come with a trailing slash
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    return 0;
+}
+
+static int tar_member_path(struct tar_reader* tr, const char* name, char* path)
+{
+    return tar_safe_path(tr->root, name, path);
+}
+
+static void tar_make_parents(struct tar_reader* tr, char* path)
+{
+    char* p = path + strlen(tr->root) + 1;
+
+    while ((p = strchr(p, '/')) != NULL)
+    {
+        *p = '\0';
+        mkdir(path, 0755);
+        *p++ = '/';
+    }
+}
+
+static void tar_set_owner(const char* path, const struct tar_header* hdr, int typeflag)
+{
+    uid_t uid = (uid_t) tar_parse_number(hdr->uid, sizeof(hdr->uid));
+    gid_t gid = (gid_t) tar_parse_number(hdr->gid, sizeof(hdr->gid));
+    mode_t mode = (mode_t) tar_parse_number(hdr->mode, sizeof(hdr->mode)) & 07777;
+
+    if (lchown(path, uid, gid))
+        LOGW("tar: unable to chown %s (%s)\n", path, strerror(errno));
+    // After the chown, which clears set-id bits
+    if (typeflag != '2' && chmod(path, mode))
+        LOGW("tar: unable to chmod %s (%s)\n", path, strerror(errno));
+}
+
+static void tar_set_mtime(const char* path, time_t mtime)
+{
+    struct timeval tv[2];
+
+    tv[0].tv_sec = tv[1].tv_sec = mtime;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    utimes(path, tv);
+}
+
+static int tar_extract_entry(struct tar_reader* tr, const struct tar_header* hdr, const char* name, const char* linkname)
+{
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    unsigned long long size = tar_parse_number(hdr->size, sizeof(hdr->size));
+    time_t mtime = (time_t) tar_parse_number(hdr->mtime, sizeof(hdr->mtime));
+    mode_t mode = (mode_t) tar_parse_number(hdr->mode, sizeof(hdr->mode)) & 07777;
+    char type = hdr->typeflag;
+    int fd;
+
+    if (tar_member_path(tr, name, path))
+    {
+        if (strcmp(name, "./") != 0 && strcmp(name, ".") != 0)
+            LOGW("tar: skipping %s\n", name);
+        return tar_read_data(tr, -1, NULL, type == '0' || type == '\0' || type == '7' ? size : 0);
+    }
+    tar_make_parents(tr, path);
+
+    // Replace whatever is in the way, the same as tar does, so hard linked
+    // files from an earlier archive aren't written through
+    if (type != '5')
+        unlink(path);
+
+    switch (type)
+    {
+    case '0':
+    case '\0':
+    case '7':
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+        {
+            LOGE("tar: unable to create %s (%s)\n", path, strerror(errno));
+            tar_read_data(tr, -1, NULL, size);
+            return -1;
+        }
+        if (tar_read_data(tr, fd, path, size))
+        {
+            close(fd);
+            return -1;
+        }
+        if (close(fd))
+        {
+            LOGE("tar: unable to write %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        tar_set_owner(path, hdr, type);
+        tar_set_mtime(path, mtime);
+        return 0;
+
+    case '1':
+        if (tar_member_path(tr, linkname, target) || link(target, path))
+        {
+            LOGE("tar: unable to link %s to %s (%s)\n", path, linkname, strerror(errno));
+            return -1;
+        }
+        return 0;
+
+    case '2':
+        if (symlink(linkname, path))
+        {
+            LOGE("tar: unable to create symlink %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        tar_set_owner(path, hdr, type);
+        return 0;
+
+    case '3':
+    case '4':
+    case '6':
+        {
+            mode_t fmt = type == '3' ? S_IFCHR : (type == '4' ? S_IFBLK : S_IFIFO);
+            dev_t dev = makedev(tar_parse_number(hdr->devmajor, sizeof(hdr->devmajor)),
+                                tar_parse_number(hdr->devminor, sizeof(hdr->devminor)));
+            if (mknod(path, fmt | mode, dev))
+            {
+                LOGE("tar: unable to create node %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            tar_set_owner(path, hdr, type);
+            tar_set_mtime(path, mtime);
+            return 0;
+        }
+
+    case '5':
+        if (mkdir(path, 0700) && errno != EEXIST)
+        {
+            LOGE("tar: unable to create directory %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        tar_set_owner(path, hdr, type);
+        if (tr->ndirs == tr->adirs)
+        {
+            int alloc = tr->adirs ? tr->adirs * 2 : 256;
+            struct tar_dir_time* dirs = (struct tar_dir_time*) realloc(tr->dirs, alloc * sizeof(*dirs));
+            if (dirs == NULL)
+                return 0;
+            tr->dirs = dirs;
+            tr->adirs = alloc;
+        }
+        tr->dirs[tr->ndirs].path = strdup(path);
+        tr->dirs[tr->ndirs].mtime = mtime;
+        tr->ndirs++;
+        return 0;
+
+    default:
+        LOGW("tar: skipping %s of unknown type '%c'\n", name, type);
+        return tar_read_data(tr, -1, NULL, size);
+    }
+}
+
+// Extracts 'count' members from the current position, or everything up to
+// the end of the archive when count is negative
+static int tar_extract_members(WinReader* in, const char* root, int count, tar_entry_fn cb, void* cookie)
+{
+    struct tar_reader tr;
+    struct tar_header hdr;
+    char* longname = NULL;
+    char* longlink = NULL;
+    int ret = 0;
+    int i;
+
+    memset(&tr, 0, sizeof(tr));
+    tr.in = in;
+    tr.root = root;
+    tr.buffer = (char*) malloc(TAR_READ_SIZE);
+    if (tr.buffer == NULL)
+        return -1;
+
+    for (;;)
+    {
+        char name[sizeof(hdr.prefix) + sizeof(hdr.name) + 2];
+        char linkname[sizeof(hdr.linkname) + 1];
+
+        if (tar_read_full(&tr, &hdr, sizeof(hdr)))
+        {
+            LOGE("tar: archive is truncated\n");
+            ret = -1;
+            break;
+        }
+        // End of archive
+        if (hdr.name[0] == '\0')
+            break;
+        if (!tar_header_ok(&hdr))
+        {
+            LOGE("tar: bad header checksum\n");
+            ret = -1;
+            break;
+        }
+
+        unsigned long long size = tar_parse_number(hdr.size, sizeof(hdr.size));
+        if (hdr.typeflag == 'L' || hdr.typeflag == 'K')
+        {
+            char* value = tar_read_longname(&tr, size);
+            if (value == NULL)
+            {
+                LOGE("tar: bad long name record\n");
+                ret = -1;
+                break;
+            }
+            if (hdr.typeflag == 'L')    { free(longname); longname = value; }
+            else                        { free(longlink); longlink = value; }
+            continue;
+        }
+        if (hdr.typeflag == 'x' && size <= PATH_MAX * 4)
+        {
+            char* value = tar_read_longname(&tr, size);
+            if (value == NULL)
+            {
+                LOGE("tar: bad pax header\n");
+                ret = -1;
+                break;
+            }
+            tar_parse_pax(value, size, &longname, &longlink);
+            free(value);
+            continue;
+        }
+        if (hdr.typeflag == 'x' || hdr.typeflag == 'g')
+        {
+            // Other pax attributes aren't needed for anything we back up
+            if (tar_read_data(&tr, -1, NULL, size))
+            {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        // POSIX ustar splits long names over prefix and name
+        name[0] = '\0';
+        if (memcmp(hdr.magic, "ustar\0", 6) == 0 && hdr.prefix[0])
+        {
+            tar_field_cat(name, hdr.prefix, sizeof(hdr.prefix));
+            strcat(name, "/");
+        }
+        tar_field_cat(name, hdr.name, sizeof(hdr.name));
+        linkname[0] = '\0';
+        tar_field_cat(linkname, hdr.linkname, sizeof(hdr.linkname));
+
+        const char* member = longname ? longname : name;
+        if (cb)
+            cb(member, cookie);
+        if (tar_extract_entry(&tr, &hdr, member, longlink ? longlink : linkname))
+            ret = -1;
+        if (tr.broken)
+            break;
+
+        free(longname);
+        free(longlink);
+        longname = longlink = NULL;
+        if (count > 0 && --count == 0)
+            break;
+    }
+
+    // Deepest first, so setting a parent's mtime sticks
+    for (i = tr.ndirs - 1; i >= 0; i--)
+    {
+        tar_set_mtime(tr.dirs[i].path, tr.dirs[i].mtime);
+        free(tr.dirs[i].path);
+    }
+    free(tr.dirs);
+    free(longname);
+    free(longlink);
+    free(tr.buffer);
+    return ret;
+}
+
+int tar_extract(WinReader* in, const char* root, tar_entry_fn cb, void* cookie)
+{
+    return tar_extract_members(in, root, -1, cb, cookie);
+}
+
+int tar_extract_at(WinReader* in, const char* root, unsigned long long offset, tar_entry_fn cb, void* cookie)
+{
+    if (win_seek(in, offset))
+        return -1;
+    return tar_extract_members(in, root, 1, cb, cookie);
+}
+
+int tar_list_begin(FILE* list, const char* base)
+{
+    fprintf(list, "files 2\nbase %s\n", base ? base : "-");
+    return ferror(list) ? -1 : 0;
+}
+
+TarList* tar_list_load(const char* path)
+{
+    char line[PATH_MAX * 2 + 64];
+    TarList* list;
+    FILE* fp;
+    int version;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return NULL;
+
+    list = (TarList*) calloc(1, sizeof(TarList));
+    if (list == NULL)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    list->nbuckets = 4096;
+    list->buckets = (struct tar_list_entry**) calloc(list->nbuckets, sizeof(struct tar_list_entry*));
+
+    // Version 1 lists lack the mode and offset columns
+    if (list->buckets == NULL || fgets(line, sizeof(line), fp) == NULL || sscanf(line, "files %d", &version) != 1 ||
+        version < 1 || version > 2 || fgets(line, sizeof(line), fp) == NULL || strncmp(line, "base ", 5) != 0)
+    {
+        LOGE("%s is not a file list\n", path);
+        goto fail;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    if (strcmp(line + 5, "-") != 0)
+        list->base = strdup(line + 5);
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        struct tar_list_entry* e;
+        unsigned long long ino, size;
+        long long mtime, offset = TAR_OFFSET_UNKNOWN;
+        unsigned int mode = 0;
+        char type;
+        char where[24];
+        int pos = 0, more = 0;
+
+        if (sscanf(line, "%c %llu %llu %lld %n", &type, &ino, &size, &mtime, &pos) != 4 || pos == 0 ||
+            (version > 1 && (sscanf(line + pos, "%o %23s %n", &mode, where, &more) != 2 || more == 0)))
+        {
+            LOGE("Bad line in %s\n", path);
+            goto fail;
+        }
+        if (version > 1)
+        {
+            offset = strcmp(where, "-") == 0 ? TAR_OFFSET_BASE : strtoll(where, NULL, 10);
+            pos += more;
+        }
+        tar_list_unescape(line + pos);
+
+        if (type == '-')
+        {
+            char** removed = (char**) realloc(list->removed, (list->nremoved + 1) * sizeof(char*));
+            if (removed == NULL)
+                goto fail;
+            list->removed = removed;
+            list->removed[list->nremoved++] = strdup(line + pos);
+            continue;
+        }
+
+        e = (struct tar_list_entry*) calloc(1, sizeof(struct tar_list_entry));
+        if (e == NULL)
+            goto fail;
+        e->name = strdup(line + pos);
+        e->type = type;
+        e->ino = ino;
+        e->size = size;
+        e->mtime = mtime;
+        e->mode = mode;
+        e->offset = offset;
+
+        unsigned int bucket = tar_list_hash(e->name) & (list->nbuckets - 1);
+        e->next = list->buckets[bucket];
+        list->buckets[bucket] = e;
+    }
+    fclose(fp);
+    return list;
+
+fail:
+    fclose(fp);
+    tar_list_free(list);
+    return NULL;
+}
+
+const char* tar_list_base(const TarList* list)
+{
+    return list->base;
+}
+
+int tar_list_offset(const TarList* list, const char* name, long long* offset)
+{
+    struct tar_list_entry* e = tar_list_find((TarList*) list, name);
+
+    if (e == NULL)
+        return -1;
+    *offset = e->offset;
+    return 0;
+}
+
+int tar_list_select(const TarList* list, const char* name, tar_select_fn fn, void* cookie)
+{
+    size_t len = strlen(name);
+    unsigned int i;
+    int matches = 0;
+
+    while (len > 1 && name[len - 1] == '/')
+        len--;
+    for (i = 0; i < list->nbuckets; i++)
+    {
+        struct tar_list_entry* e;
+        for (e = list->buckets[i]; e; e = e->next)
+        {
+            if (strncmp(e->name, name, len) != 0 || (e->name[len] != '\0' && e->name[len] != '/'))
+                continue;
+            fn(e->name, e->offset, cookie);
+            matches++;
+        }
+    }
+    return matches;
+}
+
+void tar_list_free(TarList* list)
+{
+    unsigned int i;
+    int j;
+
+    if (list == NULL)
+        return;
+    for (i = 0; list->buckets && i < list->nbuckets; i++)
+    {
+        while (list->buckets[i])
+        {
+            struct tar_list_entry* next = list->buckets[i]->next;
+            free(list->buckets[i]->name);
+            free(list->buckets[i]);
+            list->buckets[i] = next;
+        }
+    }
+    for (j = 0; j < list->nremoved; j++)
+        free(list->removed[j]);
+    free(list->removed);
+    free(list->buckets);
+    free(list->base);
+    free(list);
+}
+
+int tar_list_remove(const TarList* list, const char* root)
+{
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < list->nremoved; i++)
+    {
+        char path[PATH_MAX];
+
+        // The list is read from the sdcard; never let it reach outside root
+        if (list->removed[i][0] == '/' || tar_safe_path(root, list->removed[i], path))
+        {
+            LOGW("tar: not removing %s, it isn't under %s\n", list->removed[i], root);
+            ret = -1;
+            continue;
+        }
+        if (dirUnlinkHierarchyEx(path, 0, false, NULL, NULL) != 0 && errno != ENOENT)
+        {
+            LOGW("tar: unable to remove %s (%s)\n", path, strerror(errno));
+            ret = -1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TARBALL_HEADER
+#define _TARBALL_HEADER
+
+#include <stdio.h>
+
+#include "winfile.h"
+
+#define TAR_BLOCK_SIZE      512
+
+// Called once per archived entry, with the name as stored ("./app/foo.apk")
+typedef void (*tar_entry_fn)(const char* name, void* cookie);
+
+// File list kept next to an archive ("<archive>.files"), one line per entry
+// with its type, inode, size, mtime, mode and the offset of its records in
+// the (uncompressed) archive. It is what the next incremental backup
+// compares against and the catalog for pulling single entries back out. An
+// incremental archive's list also names the archive it builds on and the
+// entries removed since.
+typedef struct TarList TarList;
+
+#define TAR_OFFSET_BASE     -1      // left to the archive this one builds on
+#define TAR_OFFSET_UNKNOWN  -2      // list from before offsets were recorded
+
+typedef void (*tar_select_fn)(const char* name, long long offset, void* cookie);
+
+struct tar_options {
+    const char** excludes;      // NULL terminated member names to skip, such as "./media"
+    tar_entry_fn cb;
+    void* cookie;
+    FILE* list;                 // if set, the file list is written here
+    TarList* base;              // if set, regular files unchanged since this list are left out
+};
+
+// Archives everything below 'root' (but not root itself) into 'out' as a
+// GNU tar stream, with member names relative to root ("./...") just like
+// 'cd root && tar -c ./*' gives, except that hidden entries at the top are
+// included too.
+int tar_create(WinFile* out, const char* root, const struct tar_options* opts);
+
+// Extracts a tar stream (ours, or one made by busybox/GNU tar) below
+// 'root', restoring owners, modes and mtimes. cb gets each member name.
+int tar_extract(WinReader* in, const char* root, tar_entry_fn cb, void* cookie);
+
+// Extracts the one entry whose records start at 'offset', as found in the list
+int tar_extract_at(WinReader* in, const char* root, unsigned long long offset, tar_entry_fn cb, void* cookie);
+
+// 'base' is the path of the archive this one builds on, relative to the
+// folder above the backup (so "<timestamp>/<archive>"), or NULL for a full one
+int tar_list_begin(FILE* list, const char* base);
+
+TarList* tar_list_load(const char* path);
+const char* tar_list_base(const TarList* list);
+
+// Catalog lookups. tar_list_select calls fn for 'name' ("./app/foo") and
+// everything below it and returns how many entries matched.
+int tar_list_offset(const TarList* list, const char* name, long long* offset);
+int tar_list_select(const TarList* list, const char* name, tar_select_fn fn, void* cookie);
+void tar_list_free(TarList* list);
+
+// Deletes the entries an incremental list records as removed from 'root'
+int tar_list_remove(const TarList* list, const char* root);
+
+#endif  // _TARBALL_HEADER
@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Round trips a small tree through tar_create/tar_extract and the .files
+// list, and checks that truncated, corrupt and hostile archives and lists
+// are refused. Usage: tarball_test [scratch dir]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "minzip/DirUtil.h"
+#include "tarball.h"
+#include "winfile.h"
+
+static const char* dir = "/tmp";
+static int failed = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+void ui_print(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+
+    fputs(buf, stderr);
+}
+
+static const char* scratch(const char* name) {
+    static char paths[8][PATH_MAX];
+    static int next = 0;
+    char* path = paths[next++ % 8];
+    snprintf(path, PATH_MAX, "%s/tarball_test_%s", dir, name);
+    return path;
+}
+
+static int write_file(const char* path, const char* data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0) return -1;
+    if (write(fd, data, len) != (ssize_t) len) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+// 0 if the file at 'path' holds exactly len bytes of data
+static int same_file(const char* path, const char* data, size_t len) {
+    char* buf = malloc(len + 1);
+    int fd = open(path, O_RDONLY);
+    ssize_t got = fd < 0 ? -1 : read(fd, buf, len + 1);
+    int ret = (got == (ssize_t) len && memcmp(buf, data, len) == 0) ? 0 : -1;
+    if (fd >= 0) close(fd);
+    free(buf);
+    return ret;
+}
+
+static int exists(const char* root, const char* name) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    return lstat(path, &st) == 0;
+}
+
+static char* big;
+static size_t big_len = 200000;
+static char long_name[PATH_MAX];
+
+// A file spanning many blocks, an empty one, a hidden one at the top, a
+// hard link, a symlink and a name too long for the header
+static void make_tree(const char* root) {
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    size_t i;
+
+    big = malloc(big_len);
+    for (i = 0; i < big_len; i++) big[i] = (i * 7) ^ (i >> 9);
+    strcpy(long_name, "app");
+    while (strlen(long_name) < 150) strcat(long_name, "/deeper");
+
+    dirUnlinkHierarchy(root);
+    mkdir(root, 0755);
+    snprintf(path, sizeof(path), "%s/app", root);
+    CHECK(mkdir(path, 0751) == 0);
+    snprintf(path, sizeof(path), "%s/app/big.apk", root);
+    CHECK(write_file(path, big, big_len) == 0);
+    snprintf(path, sizeof(path), "%s/app/empty", root);
+    CHECK(write_file(path, "", 0) == 0);
+    snprintf(path, sizeof(path), "%s/.hidden", root);
+    CHECK(write_file(path, "secret\n", 7) == 0);
+    snprintf(path, sizeof(path), "%s/app/hard", root);
+    snprintf(target, sizeof(target), "%s/app/big.apk", root);
+    CHECK(link(target, path) == 0);
+    snprintf(path, sizeof(path), "%s/app/sym", root);
+    CHECK(symlink("big.apk", path) == 0);
+    for (i = 4; i <= strlen(long_name); i++) {
+        if (long_name[i] != '/' && long_name[i] != '\0') continue;
+        snprintf(path, sizeof(path), "%s/%.*s", root, (int) i, long_name);
+        mkdir(path, 0755);
+    }
+    snprintf(path, sizeof(path), "%s/%s/file", root, long_name);
+    CHECK(write_file(path, "deep\n", 5) == 0);
+}
+
+static void check_tree(const char* root) {
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    struct stat st, st2;
+    ssize_t len;
+
+    snprintf(path, sizeof(path), "%s/app/big.apk", root);
+    CHECK(same_file(path, big, big_len) == 0);
+    CHECK(stat(path, &st) == 0 && (st.st_mode & 07777) == 0640);
+    snprintf(path, sizeof(path), "%s/app/empty", root);
+    CHECK(same_file(path, "", 0) == 0);
+    snprintf(path, sizeof(path), "%s/.hidden", root);
+    CHECK(same_file(path, "secret\n", 7) == 0);
+    snprintf(path, sizeof(path), "%s/app/hard", root);
+    CHECK(stat(path, &st2) == 0 && st2.st_ino == st.st_ino);
+    snprintf(path, sizeof(path), "%s/app/sym", root);
+    len = readlink(path, target, sizeof(target) - 1);
+    CHECK(len == 7 && memcmp(target, "big.apk", 7) == 0);
+    snprintf(path, sizeof(path), "%s/app", root);
+    CHECK(stat(path, &st) == 0 && (st.st_mode & 07777) == 0751);
+    snprintf(path, sizeof(path), "%s/%s/file", root, long_name);
+    CHECK(same_file(path, "deep\n", 5) == 0);
+}
+
+static int archive(const char* root, const char* path, int flags, const char* list, TarList* base) {
+    struct tar_options opts;
+    WinFile* wf = win_create(path, flags);
+    FILE* fp = list ? fopen(list, "w") : NULL;
+    int ret;
+
+    if (wf == NULL || (list && fp == NULL)) return -1;
+    memset(&opts, 0, sizeof(opts));
+    opts.list = fp;
+    opts.base = base;
+    if (fp) tar_list_begin(fp, base ? "earlier/data.win" : NULL);
+    ret = tar_create(wf, root, &opts);
+    if (win_close(wf)) ret = -1;
+    if (fp && fclose(fp)) ret = -1;
+    return ret;
+}
+
+static int extract(const char* path, const char* root) {
+    WinReader* wr = win_open(path, 0);
+    int ret;
+
+    if (wr == NULL) return -1;
+    dirUnlinkHierarchy(root);
+    mkdir(root, 0755);
+    ret = tar_extract(wr, root, NULL, NULL);
+    if (win_read_close(wr)) ret = -1;
+    return ret;
+}
+
+static void count_selected(const char* name, long long offset, void* cookie) {
+    (*(int*) cookie)++;
+}
+
+static void test_round_trip(int flags) {
+    const char* src = scratch("src");
+    const char* dst = scratch("dst");
+    const char* win = scratch("data.win");
+
+    CHECK(archive(src, win, flags, NULL, NULL) == 0);
+    CHECK(extract(win, dst) == 0);
+    check_tree(dst);
+}
+
+// The list records where each entry's records start, so one can be pulled
+// out on its own, and the next backup leaves out what didn't change
+static void test_list(void) {
+    const char* src = scratch("src");
+    const char* dst = scratch("dst");
+    const char* win = scratch("data.win");
+    const char* files = scratch("data.win.files");
+    const char* win2 = scratch("incr.win");
+    const char* files2 = scratch("incr.win.files");
+    char path[PATH_MAX];
+    long long offset = 0;
+    int selected = 0;
+    TarList* list;
+    WinReader* wr;
+
+    CHECK(archive(src, win, WIN_COMPRESS | WIN_INDEX, files, NULL) == 0);
+    list = tar_list_load(files);
+    CHECK(list != NULL);
+    if (list == NULL) return;
+    CHECK(tar_list_base(list) == NULL);
+    // app, big.apk, empty, hard, sym and the chain of directories
+    CHECK(tar_list_select(list, "./app/", count_selected, &selected) >= 5);
+    CHECK(selected >= 5);
+    CHECK(tar_list_offset(list, "./nothing", &offset) != 0);
+    CHECK(tar_list_offset(list, "./app/big.apk", &offset) == 0 && offset >= 0);
+
+    dirUnlinkHierarchy(dst);
+    mkdir(dst, 0755);
+    wr = win_open(win, 0);
+    CHECK(wr != NULL);
+    if (wr != NULL) {
+        CHECK(tar_extract_at(wr, dst, offset, NULL, NULL) == 0);
+        win_read_close(wr);
+    }
+    snprintf(path, sizeof(path), "%s/app/big.apk", dst);
+    CHECK(same_file(path, big, big_len) == 0);
+    CHECK(!exists(dst, ".hidden"));
+
+    // Change one file, drop another
+    snprintf(path, sizeof(path), "%s/.hidden", src);
+    CHECK(write_file(path, "changed, and longer\n", 20) == 0);
+    snprintf(path, sizeof(path), "%s/app/empty", src);
+    CHECK(unlink(path) == 0);
+
+    CHECK(archive(src, win2, WIN_COMPRESS | WIN_INDEX, files2, list) == 0);
+    tar_list_free(list);
+    list = tar_list_load(files2);
+    CHECK(list != NULL);
+    if (list == NULL) return;
+    CHECK(tar_list_base(list) != NULL && strcmp(tar_list_base(list), "earlier/data.win") == 0);
+    CHECK(tar_list_offset(list, "./app/big.apk", &offset) == 0 && offset == TAR_OFFSET_BASE);
+    CHECK(tar_list_offset(list, "./.hidden", &offset) == 0 && offset >= 0);
+
+    // Restoring the full backup and then the incremental one gives the new tree
+    CHECK(extract(win, dst) == 0);
+    wr = win_open(win2, 0);
+    CHECK(wr != NULL);
+    if (wr != NULL) {
+        CHECK(tar_extract(wr, dst, NULL, NULL) == 0);
+        win_read_close(wr);
+    }
+    CHECK(tar_list_remove(list, dst) == 0);
+    CHECK(!exists(dst, "app/empty"));
+    snprintf(path, sizeof(path), "%s/.hidden", dst);
+    CHECK(same_file(path, "changed, and longer\n", 20) == 0);
+    snprintf(path, sizeof(path), "%s/app/big.apk", dst);
+    CHECK(same_file(path, big, big_len) == 0);
+    tar_list_free(list);
+
+    snprintf(path, sizeof(path), "%s/app/empty", src);
+    CHECK(write_file(path, "", 0) == 0);
+    unlink(win2);
+    unlink(files2);
+    unlink(files);
+}
+
+static void test_bad_list(void) {
+    const char* files = scratch("bad.files");
+    const char* dst = scratch("dst");
+    const char* victim = scratch("victim");
+    char path[PATH_MAX];
+    FILE* fp;
+    TarList* list;
+
+    CHECK(write_file(files, "not a list\n", 11) == 0);
+    CHECK(tar_list_load(files) == NULL);
+    CHECK(write_file(files, "files 2\nbase -\n0 12 zz\n", 23) == 0);
+    CHECK(tar_list_load(files) == NULL);
+    CHECK(write_file(files, "files 9\nbase -\n", 15) == 0);
+    CHECK(tar_list_load(files) == NULL);
+
+    // Names with a newline or backslash survive; removals never leave root
+    fp = fopen(files, "w");
+    CHECK(fp != NULL);
+    if (fp == NULL) return;
+    fprintf(fp, "files 2\nbase -\n");
+    fprintf(fp, "0 1 5 0 644 0 ./odd\\nname\\\\x\n");
+    fprintf(fp, "- 0 0 0 0 - ./gone\n");
+    fprintf(fp, "- 0 0 0 0 - ../tarball_test_victim\n");
+    fprintf(fp, "- 0 0 0 0 - ./app/../../tarball_test_victim\n");
+    fprintf(fp, "- 0 0 0 0 - %s\n", victim);
+    fclose(fp);
+
+    list = tar_list_load(files);
+    CHECK(list != NULL);
+    if (list == NULL) return;
+    long long offset = -5;
+    CHECK(tar_list_offset(list, "./odd\nname\\x", &offset) == 0 && offset == 0);
+
+    CHECK(write_file(victim, "keep\n", 5) == 0);
+    dirUnlinkHierarchy(dst);
+    mkdir(dst, 0755);
+    snprintf(path, sizeof(path), "%s/gone", dst);
+    CHECK(write_file(path, "x", 1) == 0);
+    CHECK(tar_list_remove(list, dst) != 0);
+    CHECK(!exists(dst, "gone"));
+    CHECK(same_file(victim, "keep\n", 5) == 0);
+    tar_list_free(list);
+    unlink(victim);
+    unlink(files);
+}
+
+// Copies the first len bytes of src to dst, flipping the byte at flip if
+// it's inside them
+static int copy_file(const char* src, const char* dst, off_t len, off_t flip) {
+    char buf[4096];
+    int in = open(src, O_RDONLY);
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    off_t pos = 0;
+    ssize_t got = 0;
+
+    while (in >= 0 && out >= 0 && pos < len && (got = read(in, buf, sizeof(buf))) > 0) {
+        if (got > len - pos) got = len - pos;
+        if (flip >= pos && flip < pos + got) buf[flip - pos] ^= 0x5a;
+        if (write(out, buf, got) != got) break;
+        pos += got;
+    }
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    return pos == len ? 0 : -1;
+}
+
+static void test_damaged(void) {
+    const char* src = scratch("src");
+    const char* dst = scratch("dst");
+    const char* win = scratch("data.win");
+    const char* bad = scratch("bad.win");
+    struct stat st;
+
+    CHECK(archive(src, win, 0, NULL, NULL) == 0);
+    CHECK(stat(win, &st) == 0 && st.st_size % TAR_BLOCK_SIZE == 0);
+
+    // Cut in the middle of the data, and right before the end blocks
+    CHECK(copy_file(win, bad, st.st_size / 2 + 100, -1) == 0);
+    CHECK(extract(bad, dst) != 0);
+    CHECK(copy_file(win, bad, st.st_size - 2 * TAR_BLOCK_SIZE - TAR_BLOCK_SIZE / 2, -1) == 0);
+    CHECK(extract(bad, dst) != 0);
+
+    // A flipped byte in the first header fails its checksum
+    CHECK(copy_file(win, bad, st.st_size, 20) == 0);
+    CHECK(extract(bad, dst) != 0);
+
+    // Compressed and cut short
+    CHECK(archive(src, win, WIN_COMPRESS, NULL, NULL) == 0);
+    CHECK(stat(win, &st) == 0);
+    CHECK(copy_file(win, bad, st.st_size * 2 / 3, -1) == 0);
+    CHECK(extract(bad, dst) != 0);
+    unlink(bad);
+}
+
+static void tar_octal(char* field, int len, unsigned long value) {
+    snprintf(field, len, "%0*lo", len - 1, value);
+}
+
+// A hand made member named 'name', followed by the end of the archive
+static int write_member(const char* path, const char* name) {
+    char block[TAR_BLOCK_SIZE * 4];
+    unsigned int sum = 0;
+    int i;
+
+    memset(block, 0, sizeof(block));
+    strncpy(block, name, 99);
+    tar_octal(block + 100, 8, 0644);
+    tar_octal(block + 108, 8, 0);
+    tar_octal(block + 116, 8, 0);
+    tar_octal(block + 124, 12, 4);
+    tar_octal(block + 136, 12, 0);
+    block[156] = '0';
+    memcpy(block + 257, "ustar  ", 8);
+    memset(block + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) sum += (unsigned char) block[i];
+    tar_octal(block + 148, 7, sum);
+    memcpy(block + TAR_BLOCK_SIZE, "evil", 4);
+    return write_file(path, block, sizeof(block));
+}
+
+// Members can't write outside the root they're extracted to
+static void test_hostile(void) {
+    const char* dst = scratch("dst");
+    const char* bad = scratch("bad.tar");
+    const char* victim = scratch("victim");
+    char name[PATH_MAX];
+
+    CHECK(write_file(victim, "keep\n", 5) == 0);
+    CHECK(write_member(bad, "./hello") == 0);
+    CHECK(extract(bad, dst) == 0);
+    CHECK(exists(dst, "hello"));
+
+    CHECK(write_member(bad, "../tarball_test_victim") == 0);
+    extract(bad, dst);
+    CHECK(same_file(victim, "keep\n", 5) == 0);
+    CHECK(write_member(bad, "./a/../../tarball_test_victim") == 0);
+    extract(bad, dst);
+    CHECK(same_file(victim, "keep\n", 5) == 0);
+    snprintf(name, sizeof(name), "%s", victim);
+    CHECK(write_member(bad, name) == 0);
+    extract(bad, dst);
+    CHECK(same_file(victim, "keep\n", 5) == 0);
+    unlink(victim);
+    unlink(bad);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [scratch dir]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2) dir = argv[1];
+
+    make_tree(scratch("src"));
+    test_round_trip(0);
+    test_round_trip(WIN_COMPRESS);
+    test_round_trip(WIN_COMPRESS | WIN_INDEX);
+    test_list();
+    test_bad_list();
+    test_damaged();
+    test_hostile();
+
+    dirUnlinkHierarchy(scratch("src"));
+    dirUnlinkHierarchy(scratch("dst"));
+    unlink(scratch("data.win"));
+    free(big);
+    printf("%s\n", failed ? "FAILURE" : "SUCCESS");
+    return failed;
+}
@@ -0,0 +1,36 @@
+# Copyright (C) 2011 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# flashsim replaces open(), read(), ioctl() and friends by name, which
+# takes glibc and the kernel's mtd headers.
+ifeq ($(HOST_OS),linux)
+
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := flashbench
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := \
+	flashbench.c \
+	flashsim.c \
+	../../mtdutils/mtdutils.c \
+	../../mtdutils/rawcopy.c \
+	../../mtdutils/sparse.c \
+	../../mmcutils/mmcutils.c
+LOCAL_C_INCLUDES += bootable/recovery
+LOCAL_CFLAGS += -D_GNU_SOURCE -U_FORTIFY_SOURCE
+LOCAL_LDLIBS += -lpthread -ldl
+include $(BUILD_HOST_EXECUTABLE)
+
+endif	# HOST_OS == linux
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Times the raw flash paths of mtdutils and mmcutils against flashsim, on
+ * the host.  Besides the usual build, it builds on its own with
+ *
+ *   gcc -D_GNU_SOURCE -U_FORTIFY_SOURCE -I. -o flashbench \
+ *       tools/flashbench/flashbench.c tools/flashbench/flashsim.c \
+ *       mtdutils/mtdutils.c mtdutils/rawcopy.c mtdutils/sparse.c \
+ *       mmcutils/mmcutils.c \
+ *       -lpthread -ldl
+ *
+ * from the top of the recovery tree.  It exits non-zero if any of the
+ * data read back doesn't match what was written.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "flashsim.h"
+#include "mtdutils/mtdutils.h"
+#include "mtdutils/sparse.h"
+#include "mmcutils/mmcutils.h"
+#include "flashutils/flashutils.h"
+
+#define CHUNK   (64 * 1024)
+
+static char g_image_path[PATH_MAX];
+static char *g_image;
+static unsigned int g_image_size;
+static int g_failed;
+
+static long long now_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void report(const char *name, unsigned long long bytes, long long usec, int ok) {
+    int op;
+
+    printf("%-32s %6.1f MB in %7.3f s  %7.2f MB/s%s\n", name,
+           bytes / 1048576.0, usec / 1e6,
+           usec > 0 ? bytes / 1048576.0 / (usec / 1e6) : 0.0,
+           ok ? "" : "  FAILED");
+    if (!ok) g_failed = 1;
+
+    for (op = 0; op < FLASHSIM_OPS; ++op) {
+        FlashSimOpStats st;
+        int i;
+
+        flashsim_stats(op, &st);
+        if (st.count == 0) continue;
+        printf("    %-10s %8llu ops  %8.1f us avg   ", flashsim_op_name(op),
+               st.count, (double) st.usec / st.count);
+        for (i = 0; i < FLASHSIM_BUCKETS; ++i) {
+            if (st.hist[i]) printf(" <%lluus:%llu", 2ULL << i, st.hist[i]);
+        }
+        printf("\n");
+    }
+    flashsim_reset_stats();
+}
+
+static int same_as_image(const char *path) {
+    char *buf = malloc(g_image_size);
+    int fd = open(path, O_RDONLY);
+    int ok = buf != NULL && fd >= 0 &&
+             read(fd, buf, g_image_size) == (ssize_t) g_image_size &&
+             memcmp(buf, g_image, g_image_size) == 0;
+    if (fd >= 0) close(fd);
+    free(buf);
+    return ok;
+}
+
+struct expand {
+    int fd;
+    char *buf;
+    unsigned long long filled;
+};
+
+static ssize_t expand_in(void *cookie, void *data, size_t len) {
+    struct expand *ex = (struct expand *) cookie;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t got = read(ex->fd, (char *) data + done, len - done);
+        if (got < 0) return -1;
+        if (got == 0) break;
+        done += got;
+    }
+    return done;
+}
+
+static int expand_data(void *cookie, unsigned long long offset, const void *data, size_t len) {
+    struct expand *ex = (struct expand *) cookie;
+
+    if (offset + len > g_image_size) return -1;
+    memcpy(ex->buf + offset, data, len);
+    return 0;
+}
+
+static int expand_fill(void *cookie, unsigned long long offset, unsigned long long len, uint32_t value) {
+    struct expand *ex = (struct expand *) cookie;
+    unsigned long long i;
+
+    if (offset + len > g_image_size) return -1;
+    for (i = 0; i < len; ++i) ex->buf[offset + i] = value >> (8 * (i % 4));
+    ex->filled += len;
+    return 0;
+}
+
+// A sparse dump has to expand back to the image, with the empty quarter
+// stored as fill chunks rather than raw data
+static int sparse_same_as_image(const char *path) {
+    struct expand ex;
+    unsigned long long size = 0;
+    int ok;
+
+    ex.fd = open(path, O_RDONLY);
+    ex.buf = malloc(g_image_size);
+    ex.filled = 0;
+    ok = ex.fd >= 0 && ex.buf != NULL && sparse_is_image(ex.fd);
+    if (ok) {
+        // Anything the image leaves out stays different from g_image
+        memset(ex.buf, 0xa5, g_image_size);
+        ok = sparse_read(expand_in, expand_data, expand_fill, &ex, &size) == 0 &&
+             size == g_image_size && memcmp(ex.buf, g_image, g_image_size) == 0 &&
+             ex.filled >= g_image_size / 4;
+    }
+    if (ex.fd >= 0) close(ex.fd);
+    free(ex.buf);
+    return ok;
+}
+
+// Leaves a file standing in for a partition the way an erase leaves flash
+static int erase_file(const char *path) {
+    char *buf = malloc(g_image_size);
+    int fd = open(path, O_WRONLY);
+    int ok = buf != NULL && fd >= 0;
+
+    if (ok) {
+        memset(buf, 0xff, g_image_size);
+        ok = write(fd, buf, g_image_size) == (ssize_t) g_image_size;
+    }
+    if (fd >= 0 && close(fd)) ok = 0;
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+static void bench_mtd_write(const char *name, int differential) {
+    const MtdPartition *part = mtd_find_partition_by_name("system");
+    long long start = now_usec();
+    MtdWriteContext *out = part ? mtd_write_partition(part) : NULL;
+    unsigned int done;
+    int ok = (out != NULL);
+
+    if (ok) {
+        mtd_write_set_differential(out, differential);
+        for (done = 0; ok && done < g_image_size; done += CHUNK) {
+            ssize_t len = g_image_size - done < CHUNK ? g_image_size - done : CHUNK;
+            ok = (mtd_write_data(out, g_image + done, len) == len);
+        }
+        if (mtd_write_close(out)) ok = 0;
+    }
+    report(name, g_image_size, now_usec() - start, ok);
+}
+
+static void bench_mtd_read(void) {
+    const MtdPartition *part = mtd_find_partition_by_name("system");
+    long long start = now_usec();
+    MtdReadContext *in = part ? mtd_read_partition(part) : NULL;
+    char *buf = malloc(CHUNK);
+    unsigned int done;
+    int ok = (in != NULL && buf != NULL);
+
+    for (done = 0; ok && done < g_image_size; done += CHUNK) {
+        ssize_t len = g_image_size - done < CHUNK ? g_image_size - done : CHUNK;
+        ok = (mtd_read_data(in, buf, len) == len && memcmp(buf, g_image + done, len) == 0);
+    }
+    if (in != NULL) mtd_read_close(in);
+    free(buf);
+    report("mtd_read_data", g_image_size, now_usec() - start, ok);
+}
+
+static void bench_cmd(const char *name, int (*cmd)(const char *, const char *),
+                      const char *partition, const char *file,
+                      int (*same)(const char *), const char *check) {
+    long long start = now_usec();
+    int ok = (cmd(partition, file) == 0);
+    long long usec = now_usec() - start;
+    report(name, g_image_size, usec, ok && same(check));
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -d DIR     where to keep the images (/tmp/flashbench)\n"
+            "  -s MB      size of the test image (16)\n"
+            "  -e KB      erase block size (128)\n"
+            "  -p BYTES   page size (2048)\n"
+            "  -b LIST    bad blocks, as mtd:block,... (mtd1 is system)\n"
+            "  -c LIST    blocks that fail ECC on every read, same format\n"
+            "  -E US      erase latency per block (2000)\n"
+            "  -P US      program latency per page (200)\n"
+            "  -R US      read latency per page (50)\n"
+            "  -M US      emmc latency per MB (50000)\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    FlashSimConfig config;
+    unsigned int size_mb = 16;
+    int opt;
+
+    memset(&config, 0, sizeof(config));
+    config.dir = "/tmp/flashbench";
+    config.erase_size = 128 * 1024;
+    config.page_size = 2048;
+    config.erase_usec = 2000;
+    config.program_usec = 200;
+    config.read_usec = 50;
+    config.mmc_usec_per_mb = 50000;
+
+    while ((opt = getopt(argc, argv, "d:s:e:p:b:c:E:P:R:M:")) != -1) {
+        switch (opt) {
+            case 'd': config.dir = optarg; break;
+            case 's': size_mb = atoi(optarg); break;
+            case 'e': config.erase_size = atoi(optarg) * 1024; break;
+            case 'p': config.page_size = atoi(optarg); break;
+            case 'b':
+                config.bad_count = flashsim_parse_faults(optarg, config.bad, FLASHSIM_MAX_FAULTS);
+                if (config.bad_count < 0) usage(argv[0]);
+                break;
+            case 'c':
+                config.ecc_count = flashsim_parse_faults(optarg, config.ecc, FLASHSIM_MAX_FAULTS);
+                if (config.ecc_count < 0) usage(argv[0]);
+                break;
+            case 'E': config.erase_usec = atoi(optarg); break;
+            case 'P': config.program_usec = atoi(optarg); break;
+            case 'R': config.read_usec = atoi(optarg); break;
+            case 'M': config.mmc_usec_per_mb = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (size_mb == 0 || config.erase_size == 0) usage(argv[0]);
+
+    // The image fills most of system; the spare blocks make room for bad ones
+    g_image_size = size_mb * 1024 * 1024;
+    unsigned int system_size = g_image_size + 8 * config.erase_size;
+    system_size -= system_size % config.erase_size;
+
+    config.mtd[0].name = "boot";
+    config.mtd[0].size = 8 * config.erase_size;
+    config.mtd[1].name = "system";
+    config.mtd[1].size = system_size;
+    config.mtd_count = 2;
+    config.mmc[0].name = "boot";
+    config.mmc[0].size = 8 * 1024 * 1024;
+    config.mmc[0].mbr_type = MMC_BOOT_TYPE;
+    config.mmc[1].name = "system";
+    config.mmc[1].size = g_image_size;
+    config.mmc[1].mbr_type = MMC_EXT3_TYPE;
+    config.mmc_count = 2;
+
+    if (flashsim_init(&config)) {
+        fprintf(stderr, "can't set up %s: %s\n", config.dir, strerror(errno));
+        return 1;
+    }
+
+    g_image = malloc(g_image_size);
+    if (g_image == NULL) return 1;
+    srand(1);
+    unsigned int i;
+    for (i = 0; i < g_image_size; ++i) g_image[i] = rand();
+    // Like a real filesystem image, leave some of it empty
+    memset(g_image + g_image_size / 2, 0, g_image_size / 4);
+    snprintf(g_image_path, sizeof(g_image_path), "%s/image.bin", config.dir);
+    int fd = open(g_image_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, g_image, g_image_size) != (ssize_t) g_image_size || close(fd)) {
+        fprintf(stderr, "can't write %s: %s\n", g_image_path, strerror(errno));
+        return 1;
+    }
+
+    char backup_path[PATH_MAX];
+    snprintf(backup_path, sizeof(backup_path), "%s/backup.img", config.dir);
+    char sparse_path[PATH_MAX];
+    snprintf(sparse_path, sizeof(sparse_path), "%s/backup.simg", config.dir);
+    char mmc_path[PATH_MAX];
+    snprintf(mmc_path, sizeof(mmc_path), "%s/mmcblk0p2.img", config.dir);
+
+    if (mtd_scan_partitions() <= 0) {
+        fprintf(stderr, "can't scan the simulated mtd partitions\n");
+        return 1;
+    }
+    flashsim_reset_stats();
+
+    bench_mtd_write("mtd_write_data", 0);
+    bench_mtd_write("mtd_write_data (differential)", 1);
+    bench_mtd_read();
+    bench_cmd("cmd_mtd_backup_raw_partition", cmd_mtd_backup_raw_partition,
+              "system", backup_path, same_as_image, backup_path);
+    bench_cmd("mmc restore (raw_copy)", cmd_mmc_restore_raw_partition,
+              "system", g_image_path, same_as_image, mmc_path);
+    bench_cmd("mmc backup (raw_copy)", cmd_mmc_backup_raw_partition,
+              "system", backup_path, same_as_image, backup_path);
+    bench_cmd("mmc backup (sparse)", cmd_mmc_backup_raw_partition_sparse,
+              "system", sparse_path, sparse_same_as_image, sparse_path);
+    // Only a restore onto a partition that no longer holds the image shows
+    // anything, the empty quarter included
+    if (erase_file(mmc_path)) {
+        fprintf(stderr, "can't erase %s: %s\n", mmc_path, strerror(errno));
+        return 1;
+    }
+    flashsim_reset_stats();
+    bench_cmd("mmc restore (sparse)", cmd_mmc_restore_raw_partition,
+              "system", sparse_path, same_as_image, mmc_path);
+    // The image file is only a stand-in here; the read back does the checking
+    cmd_mtd_erase_raw_partition("system");
+    flashsim_reset_stats();
+    bench_cmd("mtd restore (sparse)", cmd_mtd_restore_raw_partition,
+              "system", sparse_path, same_as_image, g_image_path);
+    bench_mtd_read();
+
+    free(g_image);
+    return g_failed;
+}
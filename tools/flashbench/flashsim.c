@@ -0,0 +1,506 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <mtd/mtd-user.h>
+
+#include "flashsim.h"
+
+/* The real calls, for everything that isn't ours and for the images
+ * themselves.
+ */
+static int (*real_open)(const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static int (*real_ioctl)(int, unsigned long, ...);
+
+enum { KIND_NONE, KIND_MTD, KIND_MMC };
+
+#define MAX_FDS 1024
+
+static struct {
+    int kind;
+    int index;          // mtd number
+} g_fds[MAX_FDS];
+
+static FlashSimConfig g_config;
+static int g_active;
+static struct mtd_ecc_stats g_ecc[FLASHSIM_MAX_PARTS];
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static FlashSimOpStats g_stats[FLASHSIM_OPS];
+
+static void resolve(void) {
+    if (real_open != NULL) return;
+    real_fopen = dlsym(RTLD_NEXT, "fopen");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_read = dlsym(RTLD_NEXT, "read");
+    real_write = dlsym(RTLD_NEXT, "write");
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    real_open = dlsym(RTLD_NEXT, "open");
+}
+
+/* Maps a device path onto its image; returns the kind, or -1 if the path
+ * isn't one of ours.
+ */
+static int map_path(const char *path, char *out, size_t len, int *index) {
+    int n;
+    char tail;
+
+    if (!g_active || path == NULL) return -1;
+    if (strcmp(path, "/proc/mtd") == 0) {
+        snprintf(out, len, "%s/proc_mtd", g_config.dir);
+        return KIND_NONE;
+    }
+    if (sscanf(path, "/dev/mtd/mtd%d%c", &n, &tail) == 1 &&
+            n >= 0 && n < g_config.mtd_count) {
+        snprintf(out, len, "%s/mtd%d.img", g_config.dir, n);
+        *index = n;
+        return KIND_MTD;
+    }
+    if (strcmp(path, "/dev/block/mmcblk0") == 0) {
+        snprintf(out, len, "%s/mmcblk0.img", g_config.dir);
+        return KIND_MMC;
+    }
+    if (sscanf(path, "/dev/block/mmcblk0p%d%c", &n, &tail) == 1 &&
+            n >= 1 && n <= g_config.mmc_count) {
+        snprintf(out, len, "%s/mmcblk0p%d.img", g_config.dir, n);
+        return KIND_MMC;
+    }
+    return -1;
+}
+
+static int fd_kind(int fd) {
+    return (fd >= 0 && fd < MAX_FDS) ? g_fds[fd].kind : KIND_NONE;
+}
+
+static long long now_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* Sleeps off the simulated cost of an operation that started at 'start'
+ * and books the time it took.
+ */
+static void charge(int op, long long start, size_t bytes, unsigned long long cost) {
+    if (cost > 0) usleep(cost);
+
+    long long usec = now_usec() - start;
+    int bucket = 0;
+    while (bucket < FLASHSIM_BUCKETS - 1 && (1LL << (bucket + 1)) <= usec) ++bucket;
+
+    pthread_mutex_lock(&g_lock);
+    g_stats[op].count++;
+    g_stats[op].bytes += bytes;
+    g_stats[op].usec += usec;
+    g_stats[op].hist[bucket]++;
+    pthread_mutex_unlock(&g_lock);
+}
+
+static int is_fault(const FlashSimFault *faults, int count, int part, unsigned int block) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (faults[i].part == part && faults[i].block == block) return 1;
+    }
+    return 0;
+}
+
+static int is_bad(int part, unsigned int block) {
+    return is_fault(g_config.bad, g_config.bad_count, part, block);
+}
+
+static int open_mapped(const char *path, int flags, mode_t mode) {
+    char mapped[PATH_MAX];
+    int index = 0;
+    int kind = map_path(path, mapped, sizeof(mapped), &index);
+    int fd;
+
+    resolve();
+    if (kind < 0) return real_open(path, flags, mode);
+
+    // Devices can't be created or truncated, and the images may well be
+    // on a filesystem without O_DIRECT
+    fd = real_open(mapped, flags & ~(O_CREAT | O_TRUNC | O_EXCL | O_DIRECT), 0);
+    if (fd >= 0 && fd < MAX_FDS) {
+        g_fds[fd].kind = kind;
+        g_fds[fd].index = index;
+    }
+    return fd;
+}
+
+int open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, int);
+        va_end(args);
+    }
+    return open_mapped(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, int);
+        va_end(args);
+    }
+    return open_mapped(path, flags | O_LARGEFILE, mode);
+}
+
+FILE *fopen(const char *path, const char *mode) {
+    char mapped[PATH_MAX];
+    int index;
+
+    resolve();
+    if (map_path(path, mapped, sizeof(mapped), &index) < 0) return real_fopen(path, mode);
+    // "w" would truncate the device
+    return real_fopen(mapped, mode[0] == 'r' ? mode : "r+");
+}
+
+FILE *fopen64(const char *path, const char *mode) {
+    return fopen(path, mode);
+}
+
+int close(int fd) {
+    resolve();
+    if (fd >= 0 && fd < MAX_FDS) g_fds[fd].kind = KIND_NONE;
+    return real_close(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    resolve();
+    int kind = fd_kind(fd);
+    if (kind == KIND_NONE) return real_read(fd, buf, count);
+
+    long long start = now_usec();
+    off64_t pos = lseek64(fd, 0, SEEK_CUR);
+    ssize_t r = real_read(fd, buf, count);
+    if (r <= 0) return r;
+
+    if (kind == KIND_MMC) {
+        charge(FLASHSIM_MMC_READ, start, r,
+               (unsigned long long) r * g_config.mmc_usec_per_mb >> 20);
+        return r;
+    }
+
+    int part = g_fds[fd].index;
+    unsigned int first = pos / g_config.erase_size;
+    unsigned int last = (pos + r - 1) / g_config.erase_size;
+    unsigned int block;
+    for (block = first; block <= last; ++block) {
+        if (is_fault(g_config.ecc, g_config.ecc_count, part, block)) {
+            pthread_mutex_lock(&g_lock);
+            g_ecc[part].failed++;
+            pthread_mutex_unlock(&g_lock);
+        }
+    }
+    charge(FLASHSIM_READ, start, r,
+           (unsigned long long) (r + g_config.page_size - 1) / g_config.page_size *
+           g_config.read_usec);
+    return r;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    resolve();
+    int kind = fd_kind(fd);
+    if (kind == KIND_NONE) return real_write(fd, buf, count);
+
+    long long start = now_usec();
+    if (kind == KIND_MMC) {
+        ssize_t w = real_write(fd, buf, count);
+        if (w > 0) {
+            charge(FLASHSIM_MMC_WRITE, start, w,
+                   (unsigned long long) w * g_config.mmc_usec_per_mb >> 20);
+        }
+        return w;
+    }
+
+    // NAND programs whole pages, and can only turn ones into zeros
+    int part = g_fds[fd].index;
+    off64_t pos = lseek64(fd, 0, SEEK_CUR);
+    if (pos < 0) return -1;
+    if (pos % g_config.page_size || count % g_config.page_size ||
+            pos + count > g_config.mtd[part].size) {
+        errno = EINVAL;
+        return -1;
+    }
+    unsigned int block;
+    for (block = pos / g_config.erase_size;
+         count > 0 && block <= (pos + count - 1) / g_config.erase_size; ++block) {
+        if (is_bad(part, block)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    unsigned char *old = malloc(count);
+    if (old == NULL) return -1;
+    ssize_t r = pread64(fd, old, count, pos);
+    size_t i;
+    for (i = 0; r == (ssize_t) count && i < count; ++i) {
+        old[i] &= ((const unsigned char *) buf)[i];
+    }
+    ssize_t w = (r == (ssize_t) count) ? pwrite64(fd, old, count, pos) : -1;
+    free(old);
+    if (w != (ssize_t) count) return -1;
+    lseek64(fd, pos + count, SEEK_SET);
+
+    charge(FLASHSIM_PROGRAM, start, count,
+           (unsigned long long) count / g_config.page_size * g_config.program_usec);
+    return count;
+}
+
+static int mtd_ioctl(int fd, unsigned long request, void *arg) {
+    int part = g_fds[fd].index;
+    const FlashSimPart *p = &g_config.mtd[part];
+
+    switch (request) {
+        case MEMGETINFO: {
+            struct mtd_info_user *info = arg;
+            memset(info, 0, sizeof(*info));
+            info->type = MTD_NANDFLASH;
+            info->flags = MTD_CAP_NANDFLASH;
+            info->size = p->size;
+            info->erasesize = g_config.erase_size;
+            info->writesize = g_config.page_size;
+            info->oobsize = g_config.page_size / 32;
+            return 0;
+        }
+
+        case MEMGETBADBLOCK: {
+            loff_t pos = *(loff_t *) arg;
+            if (pos < 0 || pos >= p->size) {
+                errno = EINVAL;
+                return -1;
+            }
+            return is_bad(part, pos / g_config.erase_size);
+        }
+
+        case ECCGETSTATS: {
+            pthread_mutex_lock(&g_lock);
+            memcpy(arg, &g_ecc[part], sizeof(struct mtd_ecc_stats));
+            pthread_mutex_unlock(&g_lock);
+            return 0;
+        }
+
+        case MEMERASE: {
+            struct erase_info_user *erase = arg;
+            long long start = now_usec();
+            if (erase->start % g_config.erase_size || erase->length % g_config.erase_size ||
+                    erase->start + erase->length > p->size) {
+                errno = EINVAL;
+                return -1;
+            }
+            unsigned char *ones = malloc(g_config.erase_size);
+            if (ones == NULL) return -1;
+            memset(ones, 0xff, g_config.erase_size);
+            unsigned int off;
+            int ret = 0;
+            for (off = 0; off < erase->length; off += g_config.erase_size) {
+                loff_t pos = (loff_t) erase->start + off;
+                if (is_bad(part, pos / g_config.erase_size) ||
+                        pwrite64(fd, ones, g_config.erase_size, pos) != (ssize_t) g_config.erase_size) {
+                    errno = EIO;
+                    ret = -1;
+                    break;
+                }
+            }
+            free(ones);
+            charge(FLASHSIM_ERASE, start, off,
+                   (unsigned long long) (off / g_config.erase_size) * g_config.erase_usec);
+            return ret;
+        }
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+
+    resolve();
+    switch (fd_kind(fd)) {
+        case KIND_MTD:
+            return mtd_ioctl(fd, request, arg);
+        case KIND_MMC:
+            errno = ENOTTY;
+            return -1;
+    }
+    return real_ioctl(fd, request, arg);
+}
+
+static int make_image(const char *path, unsigned int size, int fill) {
+    unsigned char buf[4096];
+    unsigned int done;
+    int fd = real_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    memset(buf, fill, sizeof(buf));
+    for (done = 0; fill != 0 && done < size; done += sizeof(buf)) {
+        size_t len = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        if (real_write(fd, buf, len) != (ssize_t) len) {
+            real_close(fd);
+            return -1;
+        }
+    }
+    if (ftruncate(fd, size) != 0) {
+        real_close(fd);
+        return -1;
+    }
+    return real_close(fd);
+}
+
+static void put_le32(unsigned char *p, unsigned int v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+int flashsim_init(const FlashSimConfig *config) {
+    char path[PATH_MAX];
+    int i;
+
+    resolve();
+    if (config->mtd_count > FLASHSIM_MAX_PARTS || config->mmc_count > 4 ||
+            config->erase_size == 0 || config->page_size == 0 ||
+            config->erase_size % config->page_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    g_config = *config;
+    memset(g_ecc, 0, sizeof(g_ecc));
+    memset(g_fds, 0, sizeof(g_fds));
+    flashsim_reset_stats();
+    mkdir(config->dir, 0755);
+
+    snprintf(path, sizeof(path), "%s/proc_mtd", config->dir);
+    FILE *f = real_fopen(path, "w");
+    if (f == NULL) return -1;
+    fprintf(f, "dev:    size   erasesize  name\n");
+    for (i = 0; i < config->mtd_count; ++i) {
+        const FlashSimPart *p = &config->mtd[i];
+        if (p->size % config->erase_size) {
+            fclose(f);
+            errno = EINVAL;
+            return -1;
+        }
+        fprintf(f, "mtd%d: %08x %08x \"%s\"\n", i, p->size, config->erase_size, p->name);
+
+        snprintf(path, sizeof(path), "%s/mtd%d.img", config->dir, i);
+        if (make_image(path, p->size, 0xff)) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    for (i = 0; i < config->bad_count; ++i) {
+        if (config->bad[i].part >= 0 && config->bad[i].part < FLASHSIM_MAX_PARTS) {
+            g_ecc[config->bad[i].part].badblocks++;
+        }
+    }
+
+    // Primary partitions only, packed one after the other
+    unsigned char mbr[512];
+    unsigned int sector = 1;
+    memset(mbr, 0, sizeof(mbr));
+    for (i = 0; i < config->mmc_count; ++i) {
+        unsigned char *entry = mbr + 0x1be + i * 16;
+        unsigned int sectors = config->mmc[i].size / 512;
+        entry[4] = config->mmc[i].mbr_type;
+        put_le32(entry + 8, sector);
+        put_le32(entry + 12, sectors);
+        sector += sectors;
+
+        snprintf(path, sizeof(path), "%s/mmcblk0p%d.img", config->dir, i + 1);
+        if (make_image(path, config->mmc[i].size, 0)) return -1;
+    }
+    mbr[0x1fe] = 0x55;
+    mbr[0x1ff] = 0xaa;
+    snprintf(path, sizeof(path), "%s/mmcblk0.img", config->dir);
+    int fd = real_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (real_write(fd, mbr, sizeof(mbr)) != sizeof(mbr)) {
+        real_close(fd);
+        return -1;
+    }
+    real_close(fd);
+
+    g_active = 1;
+    return 0;
+}
+
+int flashsim_parse_faults(const char *spec, FlashSimFault *faults, int max) {
+    int count = 0;
+    while (spec != NULL && *spec != '\0') {
+        int part, used;
+        unsigned int block;
+        if (count == max || sscanf(spec, "%d:%u%n", &part, &block, &used) != 2 ||
+                part < 0 || part >= FLASHSIM_MAX_PARTS) {
+            return -1;
+        }
+        faults[count].part = part;
+        faults[count].block = block;
+        count++;
+        spec += used;
+        if (*spec == ',') spec++;
+    }
+    return count;
+}
+
+void flashsim_stats(int op, FlashSimOpStats *stats) {
+    pthread_mutex_lock(&g_lock);
+    *stats = g_stats[op];
+    pthread_mutex_unlock(&g_lock);
+}
+
+void flashsim_reset_stats(void) {
+    pthread_mutex_lock(&g_lock);
+    memset(g_stats, 0, sizeof(g_stats));
+    pthread_mutex_unlock(&g_lock);
+}
+
+const char *flashsim_op_name(int op) {
+    static const char *names[FLASHSIM_OPS] = {
+        "erase", "program", "read", "mmc read", "mmc write"
+    };
+    return (op >= 0 && op < FLASHSIM_OPS) ? names[op] : "?";
+}
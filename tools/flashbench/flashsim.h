@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLASHSIM_H_
+#define FLASHSIM_H_
+
+/* A file backed stand-in for the flash devices of a phone, so mtdutils,
+ * mmcutils and rawcopy can be run and timed on a Linux host.
+ *
+ * Linked into a program, it takes over open(), read(), write(), ioctl()
+ * and friends for the device paths the flash code uses:
+ *
+ *     /proc/mtd               the partition table below
+ *     /dev/mtd/mtdN           <dir>/mtdN.img, with NAND rules: writes only
+ *                             clear bits, erases set them, bad blocks fail
+ *     /dev/block/mmcblk0      <dir>/mmcblk0.img, an MBR describing...
+ *     /dev/block/mmcblk0pN    <dir>/mmcblk0pN.img
+ *
+ * Everything else goes to the real calls.  Each flash operation sleeps
+ * for its configured latency, and its time is added to a histogram.
+ */
+
+#define FLASHSIM_MAX_PARTS  8
+#define FLASHSIM_MAX_FAULTS 32
+
+typedef struct {
+    const char *name;
+    unsigned int size;              /* bytes, a multiple of the erase size */
+    unsigned char mbr_type;         /* emmc only, see mmcutils.h */
+} FlashSimPart;
+
+typedef struct {
+    int part;                       /* mtd index */
+    unsigned int block;             /* erase block within it */
+} FlashSimFault;
+
+typedef struct {
+    const char *dir;                /* where the images live */
+
+    unsigned int erase_size;
+    unsigned int page_size;
+    FlashSimPart mtd[FLASHSIM_MAX_PARTS];
+    int mtd_count;
+    FlashSimPart mmc[FLASHSIM_MAX_PARTS];
+    int mmc_count;
+
+    FlashSimFault bad[FLASHSIM_MAX_FAULTS];     /* factory bad blocks */
+    int bad_count;
+    FlashSimFault ecc[FLASHSIM_MAX_FAULTS];     /* uncorrectable on read */
+    int ecc_count;
+
+    unsigned int erase_usec;        /* per erase block */
+    unsigned int program_usec;      /* per page */
+    unsigned int read_usec;         /* per page */
+    unsigned int mmc_usec_per_mb;   /* reads and writes alike */
+} FlashSimConfig;
+
+enum {
+    FLASHSIM_ERASE,
+    FLASHSIM_PROGRAM,
+    FLASHSIM_READ,
+    FLASHSIM_MMC_READ,
+    FLASHSIM_MMC_WRITE,
+    FLASHSIM_OPS
+};
+
+#define FLASHSIM_BUCKETS    24      /* powers of two, in usec */
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long bytes;
+    unsigned long long usec;
+    unsigned long long hist[FLASHSIM_BUCKETS];
+} FlashSimOpStats;
+
+/* Creates the images (all blank flash) and starts routing the device
+ * paths to them.  Returns 0, or -1 with errno set.
+ */
+int flashsim_init(const FlashSimConfig *config);
+
+/* Parses "mtd:block,mtd:block,..." into 'faults'; returns the count or -1. */
+int flashsim_parse_faults(const char *spec, FlashSimFault *faults, int max);
+
+void flashsim_stats(int op, FlashSimOpStats *stats);
+void flashsim_reset_stats(void);
+const char *flashsim_op_name(int op);
+
+#endif  // FLASHSIM_H_
@@ -36,6 +36,7 @@
 #include "minelf/Retouch.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "mtdutils/sparse.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
 
@@ -783,13 +784,50 @@ static bool write_raw_image_cb(const unsigned char* data,
     return false;
 }
 
-// write_raw_image(filename_or_blob, partition)
+typedef struct {
+    const char* data;
+    size_t size;
+    size_t pos;
+} BlobReader;
+
+static ssize_t read_blob(void* cookie, void* data, size_t len) {
+    BlobReader* r = (BlobReader*)cookie;
+    if (len > r->size - r->pos) len = r->size - r->pos;
+    memcpy(data, r->data + r->pos, len);
+    r->pos += len;
+    return len;
+}
+
+static ssize_t read_file(void* cookie, void* data, size_t len) {
+    FILE* f = (FILE*)cookie;
+    size_t got = fread(data, 1, len, f);
+    return (got == 0 && ferror(f)) ? -1 : (ssize_t)got;
+}
+
+static bool is_sparse(const char* data, size_t size) {
+    uint32_t magic;
+    if (size < sizeof(magic)) return false;
+    memcpy(&magic, data, sizeof(magic));
+    return magic == SPARSE_HEADER_MAGIC;
+}
+
+// write_raw_image(filename_or_blob, partition[, differential])
+//
+// With a true third argument, blocks that already hold the right data
+// are left alone instead of being erased and written again.
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
 
+    if (argc != 2 && argc != 3) {
+        return ErrorAbort(state, "%s() expects 2 or 3 args, got %d",
+                          name, argc);
+    }
+
     Value* partition_value;
     Value* contents;
-    if (ReadValueArgs(state, argv, 2, &contents, &partition_value) < 0) {
+    Value* differential = NULL;
+    if ((argc == 3 ? ReadValueArgs(state, argv, 3, &contents, &partition_value, &differential)
+                   : ReadValueArgs(state, argv, 2, &contents, &partition_value)) < 0) {
         return NULL;
     }
 
@@ -822,6 +860,10 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         result = strdup("");
         goto done;
     }
+    if (differential != NULL && differential->type == VAL_STRING &&
+        strlen(differential->data) > 0) {
+        mtd_write_set_differential(ctx, 1);
+    }
 
     bool success;
 
@@ -838,13 +880,23 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
 
         success = true;
         char* buffer = malloc(BUFSIZ);
-        int read;
-        while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-            int wrote = mtd_write_data(ctx, buffer, read);
-            success = success && (wrote == read);
+        int read = fread(buffer, 1, BUFSIZ, f);
+        if (is_sparse(buffer, read > 0 ? read : 0)) {
+            rewind(f);
+            success = (mtd_write_sparse(ctx, read_file, f) == 0);
+        } else {
+            while (success && read > 0) {
+                int wrote = mtd_write_data(ctx, buffer, read);
+                success = success && (wrote == read);
+                read = fread(buffer, 1, BUFSIZ, f);
+            }
         }
         free(buffer);
         fclose(f);
+    } else if (is_sparse(contents->data, contents->size)) {
+        // we're given a sparse image as a blob
+        BlobReader r = { contents->data, contents->size, 0 };
+        success = (mtd_write_sparse(ctx, read_blob, &r) == 0);
     } else {
         // we're given a blob as the contents
         ssize_t wrote = mtd_write_data(ctx, contents->data, contents->size);
@@ -870,6 +922,7 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
 done:
     if (result != partition) FreeValue(partition_value);
     FreeValue(contents);
+    FreeValue(differential);
     return StringValue(result);
 }
 
@@ -34,6 +34,13 @@
 #define VAR_BACKUP_AVG_IMG_RATE      "_backup_avg_img_rate"
 #define VAR_BACKUP_AVG_FILE_RATE     "_backup_avg_file_rate"
 #define VAR_BACKUP_AVG_FILE_COMP_RATE    "_backup_avg_file_comp_rate"
+#define VAR_BACKUP_IO_JOBS           "_backup_io_jobs"
+#define VAR_BACKUP_CPU_JOBS          "_backup_cpu_jobs"
+#define VAR_BACKUP_DEDUP             "_backup_dedup"
+#define VAR_BACKUP_INCREMENTAL       "_backup_incremental"
+#define VAR_BACKUP_SPARSE            "_backup_sparse"
+#define VAR_BACKUP_BLOCK_GZIP        "_backup_block_gzip"
+#define VAR_RESTORE_MTD_DIFFERENTIAL "_restore_mtd_differential"
 
 #define VAR_RESTORE_SYSTEM_VAR       "_restore_system"
 #define VAR_RESTORE_DATA_VAR         "_restore_data"
@@ -45,6 +52,7 @@
 #define VAR_RESTORE_SP1_VAR          "_restore_sp1"
 #define VAR_RESTORE_SP2_VAR          "_restore_sp2"
 #define VAR_RESTORE_SP3_VAR          "_restore_sp3"
+#define VAR_RESTORE_FILES_VAR        "_restore_files"
 #define VAR_RESTORE_AVG_IMG_RATE     "_restore_avg_img_rate"
 #define VAR_RESTORE_AVG_FILE_RATE    "_restore_avg_file_rate"
 #define VAR_RESTORE_AVG_FILE_COMP_RATE    "_restore_avg_file_comp_rate"
@@ -62,6 +70,8 @@
 #define VAR_REBOOT_AFTER_FLASH_VAR   "_reboot_after_flash_option"
 #define VAR_TIME_ZONE_VAR            "_time_zone"
 #define VAR_RM_RF_VAR                "_rm_rf"
+#define VAR_WIPE_FILES_VAR           "_wipe_files"
+#define VAR_WIPE_MB_VAR              "_wipe_mb"
 
 #define VAR_BACKUPS_FOLDER_VAR       "_backups_folder"
 
@@ -0,0 +1,556 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "common.h"
+#include "md5.h"
+#include "pgzip.h"
+#include "winfile.h"
+
+#define WIN_BUFFER_SIZE     (1024 * 1024)
+
+struct WinFile {
+    int fd;
+    char* path;
+    PGzip* gz;                  // NULL when the backup isn't compressed
+
+    unsigned char* buffer;      // coalesces small writes on the plain path
+    size_t fill;
+
+    int hash;
+    MD5_CTX md5;
+
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    int error;
+};
+
+static int win_write_out(void* cookie, const void* data, size_t len)
+{
+    WinFile* wf = (WinFile*) cookie;
+    const char* ptr = (const char*) data;
+
+    if (wf->hash)
+        MD5_update(&wf->md5, data, len);
+
+    while (len > 0)
+    {
+        ssize_t wrote = write(wf->fd, ptr, len);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+        {
+            LOGE("Unable to write to %s (%s)\n", wf->path, strerror(errno));
+            wf->error = 1;
+            return -1;
+        }
+        ptr += wrote;
+        len -= wrote;
+        wf->bytes_out += wrote;
+    }
+    return 0;
+}
+
+// Same layout md5sum produces, so 'md5sum -c' still verifies it
+static int win_write_md5(WinFile* wf)
+{
+    uint8_t digest[MD5_DIGEST_SIZE];
+    char hex[MD5_DIGEST_SIZE * 2 + 1];
+    char md5Path[PATH_MAX];
+    const char* name = strrchr(wf->path, '/');
+    FILE* fp;
+
+    name = name ? name + 1 : wf->path;
+    MD5_final(&wf->md5, digest);
+    MD5_hex(digest, hex);
+
+    snprintf(md5Path, sizeof(md5Path), "%s.md5", wf->path);
+    fp = fopen(md5Path, "w");
+    if (fp == NULL)
+    {
+        LOGE("Unable to create %s (%s)\n", md5Path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "%s  %s\n", hex, name);
+    if (fclose(fp) != 0)
+    {
+        LOGE("Unable to write %s (%s)\n", md5Path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+WinFile* win_create(const char* path, int flags)
+{
+    WinFile* wf = (WinFile*) calloc(1, sizeof(WinFile));
+    if (wf == NULL)
+        return NULL;
+
+    wf->path = strdup(path);
+    wf->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (wf->fd < 0)
+    {
+        LOGE("Unable to create %s (%s)\n", path, strerror(errno));
+        free(wf->path);
+        free(wf);
+        return NULL;
+    }
+
+    wf->hash = (flags & WIN_MD5) ? 1 : 0;
+    if (wf->hash)
+        MD5_init(&wf->md5);
+
+    if (flags & WIN_COMPRESS)
+    {
+        wf->gz = pgzip_open(win_write_out, wf, Z_DEFAULT_COMPRESSION, 0, (flags & WIN_INDEX) ? PGZIP_INDEX : 0);
+        if (wf->gz == NULL)
+        {
+            close(wf->fd);
+            unlink(path);
+            free(wf->path);
+            free(wf);
+            return NULL;
+        }
+    }
+    else
+    {
+        wf->buffer = (unsigned char*) malloc(WIN_BUFFER_SIZE);
+        if (wf->buffer == NULL)
+        {
+            close(wf->fd);
+            unlink(path);
+            free(wf->path);
+            free(wf);
+            return NULL;
+        }
+    }
+    return wf;
+}
+
+int win_write(WinFile* wf, const void* data, size_t len)
+{
+    if (wf->error)
+        return -1;
+
+    wf->bytes_in += len;
+
+    if (wf->gz)
+    {
+        if (pgzip_write(wf->gz, data, len))
+            wf->error = 1;
+        return wf->error ? -1 : 0;
+    }
+
+    // Large writes go straight through once the buffer is empty
+    if (wf->fill == 0 && len >= WIN_BUFFER_SIZE)
+        return win_write_out(wf, data, len);
+
+    const unsigned char* ptr = (const unsigned char*) data;
+    while (len > 0)
+    {
+        size_t copy = WIN_BUFFER_SIZE - wf->fill;
+        if (copy > len)     copy = len;
+
+        memcpy(wf->buffer + wf->fill, ptr, copy);
+        wf->fill += copy;
+        ptr += copy;
+        len -= copy;
+
+        if (wf->fill == WIN_BUFFER_SIZE)
+        {
+            if (win_write_out(wf, wf->buffer, wf->fill))
+                return -1;
+            wf->fill = 0;
+        }
+    }
+    return 0;
+}
+
+int win_close(WinFile* wf)
+{
+    if (wf->gz)
+    {
+        if (pgzip_close(wf->gz))
+            wf->error = 1;
+    }
+    else if (wf->fill > 0 && !wf->error)
+    {
+        win_write_out(wf, wf->buffer, wf->fill);
+    }
+
+    if (close(wf->fd) != 0)
+    {
+        LOGE("Unable to close %s (%s)\n", wf->path, strerror(errno));
+        wf->error = 1;
+    }
+
+    // Only vouch for the image if every byte made it out
+    if (wf->hash && !wf->error && win_write_md5(wf) != 0)
+        wf->error = 1;
+
+    int ret = wf->error ? -1 : 0;
+    free(wf->buffer);
+    free(wf->path);
+    free(wf);
+    return ret;
+}
+
+unsigned long long win_bytes_in(WinFile* wf)
+{
+    return wf->bytes_in;
+}
+
+unsigned long long win_bytes_out(WinFile* wf)
+{
+    return wf->bytes_out;
+}
+
+#define WIN_READ_SIZE       (256 * 1024)
+
+struct WinReader {
+    int fd;
+    char* path;
+
+    int gz;
+    PGunzip* pgz;               // indexed backups inflate on the pgzip workers
+    z_stream zs;
+    unsigned char* in;          // compressed input waiting for inflate
+    int in_member;              // inside a gzip member, so EOF would be a truncation
+
+    unsigned long long pos;     // in the inflated stream
+    struct pgzip_block* blocks; // pgzip index, loaded by the first seek
+    unsigned long nblocks;
+    int no_index;
+
+    int hash;
+    MD5_CTX md5;
+    char expected[MD5_DIGEST_SIZE * 2 + 1];
+    int error;
+};
+
+static int win_read_md5(const char* path, char* hex)
+{
+    char md5Path[PATH_MAX];
+    FILE* fp;
+    int ret;
+
+    snprintf(md5Path, sizeof(md5Path), "%s.md5", path);
+    fp = fopen(md5Path, "r");
+    if (fp == NULL)
+        return -1;
+    ret = (fscanf(fp, "%32s", hex) == 1 && strlen(hex) == MD5_DIGEST_SIZE * 2) ? 0 : -1;
+    fclose(fp);
+    return ret;
+}
+
+int win_has_md5(const char* path)
+{
+    char hex[MD5_DIGEST_SIZE * 2 + 1];
+
+    return win_read_md5(path, hex) == 0;
+}
+
+static ssize_t win_read_raw(WinReader* wr, void* data, size_t len)
+{
+    ssize_t got;
+
+    do {
+        got = read(wr->fd, data, len);
+    } while (got < 0 && errno == EINTR);
+
+    if (got < 0)
+    {
+        LOGE("Unable to read %s (%s)\n", wr->path, strerror(errno));
+        wr->error = 1;
+        return -1;
+    }
+    if (wr->hash)
+        MD5_update(&wr->md5, data, got);
+    return got;
+}
+
+static ssize_t win_read_block(void* cookie, void* data, size_t len)
+{
+    return win_read_raw((WinReader*) cookie, data, len);
+}
+
+WinReader* win_open(const char* path, int flags)
+{
+    WinReader* wr = (WinReader*) calloc(1, sizeof(WinReader));
+    unsigned char magic[PGZIP_HEADER_SIZE];
+
+    if (wr == NULL)
+        return NULL;
+
+    wr->path = strdup(path);
+    wr->hash = (flags & WIN_MD5) ? 1 : 0;
+    if (wr->hash && win_read_md5(path, wr->expected) != 0)
+    {
+        LOGE("Unable to read %s.md5\n", path);
+        free(wr->path);
+        free(wr);
+        return NULL;
+    }
+
+    wr->fd = open(path, O_RDONLY);
+    if (wr->fd < 0)
+    {
+        LOGE("Unable to open %s (%s)\n", path, strerror(errno));
+        free(wr->path);
+        free(wr);
+        return NULL;
+    }
+    if (wr->hash)
+        MD5_init(&wr->md5);
+
+    // Compressed backups used to be made with 'tar -z', so go by the
+    // contents rather than the settings. Images are never compressed and
+    // may well start with the gzip magic, so they are opened with WIN_RAW.
+    ssize_t got = (flags & WIN_RAW) ? 0 : pread(wr->fd, magic, sizeof(magic), 0);
+    if (pgzip_is_indexed(magic, got > 0 ? got : 0))
+    {
+        wr->pgz = pgunzip_open(win_read_block, wr, 0);
+        if (wr->pgz == NULL)
+        {
+            close(wr->fd);
+            free(wr->path);
+            free(wr);
+            return NULL;
+        }
+    }
+    else if (got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    {
+        wr->in = (unsigned char*) malloc(WIN_READ_SIZE);
+        if (wr->in == NULL || inflateInit2(&wr->zs, 15 + 16) != Z_OK)
+        {
+            free(wr->in);
+            close(wr->fd);
+            free(wr->path);
+            free(wr);
+            return NULL;
+        }
+        wr->gz = 1;
+    }
+    return wr;
+}
+
+static ssize_t win_read_stream(WinReader* wr, void* data, size_t len)
+{
+    if (wr->error)
+        return -1;
+    if (len == 0)
+        return 0;
+    if (wr->pgz)
+    {
+        ssize_t got = pgunzip_read(wr->pgz, data, len);
+        if (got < 0)
+        {
+            LOGE("%s is corrupt\n", wr->path);
+            wr->error = 1;
+        }
+        return got;
+    }
+    if (!wr->gz)
+        return win_read_raw(wr, data, len);
+
+    wr->zs.next_out = (Bytef*) data;
+    wr->zs.avail_out = len;
+    while (wr->zs.avail_out == len)
+    {
+        int ret;
+
+        if (wr->zs.avail_in == 0)
+        {
+            ssize_t got = win_read_raw(wr, wr->in, WIN_READ_SIZE);
+            if (got < 0)
+                return -1;
+            if (got == 0)
+            {
+                if (wr->in_member)
+                {
+                    LOGE("%s is truncated\n", wr->path);
+                    wr->error = 1;
+                    return -1;
+                }
+                return 0;
+            }
+            wr->zs.next_in = wr->in;
+            wr->zs.avail_in = got;
+        }
+
+        // A parallel gzip'd backup is a series of gzip members back to back
+        wr->in_member = 1;
+        ret = inflate(&wr->zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+        {
+            wr->in_member = 0;
+            inflateReset(&wr->zs);
+        }
+        else if (ret != Z_OK)
+        {
+            LOGE("%s is corrupt (zlib error %d)\n", wr->path, ret);
+            wr->error = 1;
+            return -1;
+        }
+    }
+    return len - wr->zs.avail_out;
+}
+
+ssize_t win_read(WinReader* wr, void* data, size_t len)
+{
+    ssize_t got = win_read_stream(wr, data, len);
+
+    if (got > 0)
+        wr->pos += got;
+    return got;
+}
+
+static int win_restart(WinReader* wr, unsigned long long offset, unsigned long long pos)
+{
+    if (lseek64(wr->fd, offset, SEEK_SET) != (loff_t) offset)
+    {
+        LOGE("Unable to seek in %s (%s)\n", wr->path, strerror(errno));
+        wr->error = 1;
+        return -1;
+    }
+    if (wr->pgz)
+    {
+        pgunzip_close(wr->pgz);
+        wr->pgz = pgunzip_open(win_read_block, wr, 0);
+        if (wr->pgz == NULL)
+        {
+            wr->error = 1;
+            return -1;
+        }
+    }
+    else if (wr->gz)
+    {
+        inflateReset(&wr->zs);
+        wr->zs.avail_in = 0;
+        wr->in_member = 0;
+    }
+    wr->pos = pos;
+    return 0;
+}
+
+int win_seek(WinReader* wr, unsigned long long offset)
+{
+    if (wr->error)
+        return -1;
+    if (wr->hash)
+    {
+        LOGE("Can't seek in %s while checking its md5\n", wr->path);
+        return -1;
+    }
+    if (!wr->gz && !wr->pgz)
+        return win_restart(wr, offset, offset);
+
+    if (wr->pgz && !wr->blocks && !wr->no_index && pgzip_read_index(wr->fd, &wr->blocks, &wr->nblocks) != 0)
+        wr->no_index = 1;
+
+    if (wr->blocks && (offset < wr->pos || offset - wr->pos > PGZIP_BLOCK_SIZE))
+    {
+        // Last block starting at or before offset
+        unsigned long lo = 0, hi = wr->nblocks;
+
+        while (lo < hi)
+        {
+            unsigned long mid = (lo + hi + 1) / 2;
+            if (wr->blocks[mid].data <= offset)     lo = mid;
+            else                                    hi = mid - 1;
+        }
+        if (win_restart(wr, wr->blocks[lo].offset, wr->blocks[lo].data))
+            return -1;
+    }
+    else if (offset < wr->pos && win_restart(wr, 0, 0))
+    {
+        return -1;
+    }
+
+    // Without an index, a compressed stream can only be read up to offset
+    while (wr->pos < offset)
+    {
+        char buf[4096];
+        size_t want = offset - wr->pos < sizeof(buf) ? (size_t) (offset - wr->pos) : sizeof(buf);
+        ssize_t got = win_read(wr, buf, want);
+
+        if (got <= 0)
+        {
+            LOGE("Unable to seek past the end of %s\n", wr->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int win_read_close(WinReader* wr)
+{
+    // Whatever the workers had in flight is dropped, the rest of the file
+    // still gets hashed below
+    if (wr->pgz && pgunzip_close(wr->pgz))
+        wr->error = 1;
+
+    // Whatever the consumer didn't need (tar padding, say) is still part
+    // of the file the md5 was taken over
+    if (wr->hash && !wr->error)
+    {
+        unsigned char* buf = (unsigned char*) malloc(WIN_READ_SIZE);
+        ssize_t got;
+
+        while (buf && (got = win_read_raw(wr, buf, WIN_READ_SIZE)) > 0)
+            ;
+        if (buf == NULL)
+            wr->error = 1;
+        free(buf);
+    }
+
+    if (wr->hash && !wr->error)
+    {
+        uint8_t digest[MD5_DIGEST_SIZE];
+        char hex[MD5_DIGEST_SIZE * 2 + 1];
+
+        MD5_final(&wr->md5, digest);
+        MD5_hex(digest, hex);
+        if (strcasecmp(hex, wr->expected) != 0)
+        {
+            LOGE("MD5 mismatch for %s\n", wr->path);
+            wr->error = 1;
+        }
+    }
+
+    if (wr->gz)
+    {
+        inflateEnd(&wr->zs);
+        free(wr->in);
+    }
+    close(wr->fd);
+
+    int ret = wr->error ? -1 : 0;
+    free(wr->blocks);
+    free(wr->path);
+    free(wr);
+    return ret;
+}
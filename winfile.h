@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WINFILE_HEADER
+#define _WINFILE_HEADER
+
+#include <sys/types.h>
+
+// Output stream for a backup (.win) file. Every byte of the backup goes
+// through here, optionally compressed on the parallel gzip workers, and the
+// bytes landing in the file are hashed on the way out so the .md5 sidecar
+// can be written at close without reading the image back.
+
+#define WIN_COMPRESS        0x01
+#define WIN_MD5             0x02    // write <path>.md5 in md5sum format on close
+#define WIN_INDEX           0x04    // with WIN_COMPRESS, size-tagged blocks plus an index (PGZIP_INDEX)
+#define WIN_RAW             0x08    // win_open: the file is the data as is, never inflated
+
+typedef struct WinFile WinFile;
+
+WinFile* win_create(const char* path, int flags);
+int win_write(WinFile* wf, const void* data, size_t len);
+int win_close(WinFile* wf);     // returns non-zero if anything failed
+
+// Bytes handed to win_write / bytes that actually hit the file
+unsigned long long win_bytes_in(WinFile* wf);
+unsigned long long win_bytes_out(WinFile* wf);
+
+// Input side, for restores. Gzip'd backups are inflated transparently and,
+// with WIN_MD5, the file is hashed as it is read so the restore doubles as
+// the md5 check instead of needing a pass of its own.
+typedef struct WinReader WinReader;
+
+int win_has_md5(const char* path);
+WinReader* win_open(const char* path, int flags);
+ssize_t win_read(WinReader* wr, void* data, size_t len);    // 0 at the end
+
+// Moves to 'offset' in the (inflated) stream. Indexed pgzip files jump to
+// the right block, other gzip files are read up to it; that includes every
+// compressed backup made without _backup_block_gzip, so single file
+// restores from those stay as slow as reading the archive. Not available
+// with WIN_MD5, the md5 needs every byte.
+int win_seek(WinReader* wr, unsigned long long offset);
+int win_read_close(WinReader* wr);  // returns non-zero on errors or an md5 mismatch
+
+#endif  // _WINFILE_HEADER
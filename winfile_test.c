@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Round trips .win files through winfile/pgzip and checks that damaged
+// ones, and ones that don't match their .md5, are caught.
+// Usage: winfile_test [scratch dir]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "md5.h"
+#include "pgzip.h"
+#include "winfile.h"
+
+static const char* dir = "/tmp";
+static int failed = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+void ui_print(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+
+    fputs(buf, stderr);
+}
+
+// Half compressible, half noise, so the blocks don't all come out alike
+static unsigned char* make_data(size_t len) {
+    unsigned char* data = malloc(len);
+    size_t i;
+
+    srand(len);
+    for (i = 0; i < len; i++) {
+        data[i] = ((i / 4096) & 1) ? rand() : (i & 0xff);
+    }
+    return data;
+}
+
+static int write_win(const char* path, int flags, const unsigned char* data, size_t len) {
+    WinFile* wf = win_create(path, flags);
+    if (wf == NULL) return -1;
+    if (win_write(wf, data, len)) {
+        win_close(wf);
+        return -1;
+    }
+    return win_close(wf);
+}
+
+// Copies the first len bytes of src to dst, flipping the byte at flip if
+// it's inside them
+static int copy_file(const char* src, const char* dst, off_t len, off_t flip) {
+    char buf[4096];
+    int in = open(src, O_RDONLY);
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    off_t pos = 0;
+    ssize_t got = 0;
+
+    while (in >= 0 && out >= 0 && pos < len && (got = read(in, buf, sizeof(buf))) > 0) {
+        if (got > len - pos) got = len - pos;
+        if (flip >= pos && flip < pos + got) buf[flip - pos] ^= 0x5a;
+        if (write(out, buf, got) != got) break;
+        pos += got;
+    }
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    return pos == len ? 0 : -1;
+}
+
+static off_t file_size(const char* path) {
+    int fd = open(path, O_RDONLY);
+    off_t size = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+    if (fd >= 0) close(fd);
+    return size;
+}
+
+static int read_index(const char* path, struct pgzip_block** blocks, unsigned long* count) {
+    int fd = open(path, O_RDONLY);
+    int ret = fd < 0 ? -1 : pgzip_read_index(fd, blocks, count);
+    if (fd >= 0) close(fd);
+    return ret;
+}
+
+static int read_at(WinReader* wr, unsigned long long offset, const unsigned char* data, size_t len) {
+    unsigned char buf[4096];
+    size_t done = 0;
+
+    if (win_seek(wr, offset)) return -1;
+    // Reads stop at the end of a block, like read() may
+    while (done < len) {
+        size_t want = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        ssize_t got = win_read(wr, buf, want);
+        if (got <= 0 || memcmp(buf, data + offset + done, got)) return -1;
+        done += got;
+    }
+    return 0;
+}
+
+// Three and a half blocks: the index should list four, in order
+static void test_index(const char* path, size_t len) {
+    struct pgzip_block* blocks = NULL;
+    unsigned long count = 0, i;
+
+    CHECK(read_index(path, &blocks, &count) == 0);
+    if (blocks == NULL) return;
+    CHECK(count == (len + PGZIP_BLOCK_SIZE - 1) / PGZIP_BLOCK_SIZE);
+    CHECK(blocks[0].offset == 0);
+    for (i = 0; i < count; i++) {
+        CHECK(blocks[i].data == (unsigned long long) i * PGZIP_BLOCK_SIZE);
+        CHECK(blocks[i + 1].offset > blocks[i].offset);
+    }
+    CHECK(blocks[count].data == len);
+    CHECK(blocks[count].offset < (unsigned long long) file_size(path));
+    free(blocks);
+}
+
+static void test_seek(const char* path, const unsigned char* data, size_t len) {
+    WinReader* wr = win_open(path, 0);
+    unsigned char c;
+
+    CHECK(wr != NULL);
+    if (wr == NULL) return;
+    // Into the middle of a block, then back, then across a block boundary
+    CHECK(read_at(wr, 2 * PGZIP_BLOCK_SIZE + PGZIP_BLOCK_SIZE / 2 + 3, data, 1000) == 0);
+    CHECK(read_at(wr, PGZIP_BLOCK_SIZE / 2, data, 1000) == 0);
+    CHECK(read_at(wr, PGZIP_BLOCK_SIZE - 500, data, 1000) == 0);
+    CHECK(read_at(wr, len - 10, data, 10) == 0);
+    CHECK(win_read(wr, &c, 1) == 0);
+    CHECK(win_seek(wr, len + 1) != 0);
+    win_read_close(wr);
+}
+
+// A file that lost its tail (or has a bad entry) has no index, but the
+// blocks in it still read, just without jumping
+static void test_damaged_index(const char* path, const unsigned char* data, size_t len) {
+    struct pgzip_block* blocks = NULL;
+    unsigned long count = 0;
+    off_t size = file_size(path);
+    char copy[256];
+    WinReader* wr;
+
+    snprintf(copy, sizeof(copy), "%s/winfile_test_cut.win", dir);
+
+    CHECK(copy_file(path, copy, size - PGZIP_TAIL_SIZE / 2, -1) == 0);
+    CHECK(read_index(copy, &blocks, &count) != 0);
+
+    CHECK(copy_file(path, copy, size - PGZIP_TAIL_SIZE - 8, -1) == 0);
+    CHECK(read_index(copy, &blocks, &count) != 0);
+    wr = win_open(copy, 0);
+    CHECK(wr != NULL);
+    if (wr != NULL) {
+        CHECK(read_at(wr, 2 * PGZIP_BLOCK_SIZE + 7, data, 1000) == 0);
+        CHECK(read_at(wr, 100, data, 1000) == 0);
+        win_read_close(wr);
+    }
+
+    // The first entry of the PX member, which starts right after the data
+    CHECK(read_index(path, &blocks, &count) == 0);
+    if (blocks != NULL) {
+        off_t entry = blocks[count].offset + PGZIP_HEADER_SIZE + 4;
+        free(blocks);
+        blocks = NULL;
+        CHECK(copy_file(path, copy, size, entry) == 0);
+        CHECK(read_index(copy, &blocks, &count) != 0);
+    }
+
+    // Past the data
+    CHECK(copy_file(path, copy, size - PGZIP_TAIL_SIZE / 2, -1) == 0);
+    wr = win_open(copy, 0);
+    if (wr != NULL) {
+        CHECK(win_seek(wr, len + PGZIP_BLOCK_SIZE) != 0);
+        win_read_close(wr);
+    }
+    unlink(copy);
+}
+
+static void md5_file(const char* path, char hex[MD5_DIGEST_SIZE * 2 + 1]) {
+    unsigned char buf[4096];
+    uint8_t digest[MD5_DIGEST_SIZE];
+    MD5_CTX md5;
+    ssize_t got;
+    int fd = open(path, O_RDONLY);
+
+    MD5_init(&md5);
+    while (fd >= 0 && (got = read(fd, buf, sizeof(buf))) > 0) MD5_update(&md5, buf, got);
+    if (fd >= 0) close(fd);
+    MD5_final(&md5, digest);
+    MD5_hex(digest, hex);
+}
+
+// Reads 'len' bytes (or everything, if len is 0) with the md5 check on and
+// returns what win_read_close says
+static int read_checked(const char* path, size_t len) {
+    unsigned char buf[4096];
+    WinReader* wr = win_open(path, WIN_MD5);
+    size_t done = 0;
+    ssize_t got;
+
+    if (wr == NULL) return -1;
+    while ((len == 0 || done < len) && (got = win_read(wr, buf, sizeof(buf))) > 0) done += got;
+    return win_read_close(wr);
+}
+
+// The sidecar is written at close from the bytes that went out, in md5sum
+// format, and reading the file back checks it
+static void test_md5(const unsigned char* data, size_t len, int flags) {
+    char path[256], md5Path[256], copy[256], copyMd5[256];
+    char hex[MD5_DIGEST_SIZE * 2 + 1], line[256], want[256];
+    struct stat st;
+    FILE* fp;
+
+    snprintf(path, sizeof(path), "%s/winfile_test_md5.win", dir);
+    snprintf(md5Path, sizeof(md5Path), "%s.md5", path);
+    snprintf(copy, sizeof(copy), "%s/winfile_test_md5_bad.win", dir);
+    snprintf(copyMd5, sizeof(copyMd5), "%s.md5", copy);
+    unlink(md5Path);
+
+    CHECK(write_win(path, flags | WIN_MD5, data, len) == 0);
+    CHECK(win_has_md5(path));
+    md5_file(path, hex);
+    snprintf(want, sizeof(want), "%s  winfile_test_md5.win\n", hex);
+    fp = fopen(md5Path, "r");
+    CHECK(fp != NULL && fgets(line, sizeof(line), fp) != NULL && strcmp(line, want) == 0);
+    if (fp != NULL) fclose(fp);
+
+    CHECK(read_checked(path, 0) == 0);
+    // What the reader leaves behind still gets hashed at close
+    CHECK(read_checked(path, 100) == 0);
+
+    // One flipped byte, in the middle and in the last block
+    CHECK(stat(path, &st) == 0);
+    CHECK(copy_file(md5Path, copyMd5, file_size(md5Path), -1) == 0);
+    CHECK(copy_file(path, copy, st.st_size, st.st_size / 2) == 0);
+    CHECK(read_checked(copy, 0) != 0);
+    CHECK(copy_file(path, copy, st.st_size, st.st_size - 3) == 0);
+    CHECK(read_checked(copy, 10) != 0);
+
+    // A sidecar that doesn't hold a digest, or none at all
+    CHECK(copy_file(path, copy, st.st_size, -1) == 0);
+    fp = fopen(copyMd5, "w");
+    if (fp != NULL) {
+        fputs("d41d8cd9  short\n", fp);
+        fclose(fp);
+    }
+    CHECK(!win_has_md5(copy));
+    CHECK(win_open(copy, WIN_MD5) == NULL);
+    unlink(copyMd5);
+    CHECK(!win_has_md5(copy));
+    CHECK(win_open(copy, WIN_MD5) == NULL);
+
+    unlink(copy);
+    unlink(path);
+    unlink(md5Path);
+}
+
+int main(int argc, char** argv) {
+    size_t len = 3 * PGZIP_BLOCK_SIZE + PGZIP_BLOCK_SIZE / 2;
+    unsigned char* data = make_data(len);
+    char path[256];
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [scratch dir]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2) dir = argv[1];
+    snprintf(path, sizeof(path), "%s/winfile_test.win", dir);
+
+    if (write_win(path, WIN_COMPRESS | WIN_INDEX, data, len)) {
+        fprintf(stderr, "can't write %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    test_index(path, len);
+    test_seek(path, data, len);
+    test_damaged_index(path, data, len);
+    test_md5(data, len, 0);
+    test_md5(data, len, WIN_COMPRESS);
+    test_md5(data, len, WIN_COMPRESS | WIN_INDEX);
+
+    unlink(path);
+    free(data);
+    printf("%s\n", failed ? "FAILURE" : "SUCCESS");
+    return failed;
+}